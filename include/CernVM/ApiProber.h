@@ -0,0 +1,274 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef APIPROBER_H
+#define APIPROBER_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#define API_PROBE_TIMEOUT       2000    // Default timeout of a probe (ms)
+#define API_PROBE_SIMPLE_GRACE  100     // How long a HSK_SIMPLE connection must survive (ms)
+#define API_PROBE_MIN_INTERVAL  500     // Re-probe interval of a watched session after a change (ms)
+#define API_PROBE_MAX_INTERVAL  30000   // Longest re-probe interval of a watched session (ms)
+
+/* Forward-declaration of the session class (Hypervisor.h) */
+class HVSession;
+
+/**
+ * A single API endpoint probe and it's result
+ */
+typedef struct {
+
+    std::string     host;       // Address to connect to
+    int             port;       // Port to connect to
+    unsigned char   handshake;  // One of the HSK_* protocols
+    std::string     uuid;       // The session this probe is about (if any)
+
+    bool            alive;      // [Result] The endpoint responded
+    int             latency;    // [Result] Time until the result (ms)
+
+} API_PROBE;
+
+/**
+ * Callback that receives the results of a batch of probes (fired from the prober thread)
+ */
+typedef boost::function< void ( const std::vector<API_PROBE>& ) >  callbackProbeBatch;
+
+/**
+ * A group of probes started together and completed when all of them have a result
+ */
+class ApiProbeBatch {
+public:
+
+    /**
+     * Constructor
+     */
+    ApiProbeBatch( const std::vector<API_PROBE>& probes, int timeoutMs, const callbackProbeBatch& onDone )
+        : probes(probes), timeoutMs(timeoutMs), onDone(onDone), pending(0), started(0), mutex(), cond(), done(false) { };
+
+    /**
+     * Wait for all the probes to complete
+     */
+    void                        wait            ( );
+
+    /**
+     * Check if all the probes have completed
+     */
+    bool                        isDone          ( );
+
+    // The probes, with their results after completion
+    std::vector<API_PROBE>      probes;
+
+private:
+    friend class ApiProber;
+
+    /**
+     * Mark the batch as completed and wake-up the waiters
+     */
+    void                        complete        ( );
+
+    int                         timeoutMs;
+    callbackProbeBatch          onDone;
+    size_t                      pending;
+    unsigned long long          started;
+
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+    bool                        done;
+
+};
+typedef boost::shared_ptr< ApiProbeBatch >  ApiProbeBatchPtr;
+
+/**
+ * Prober of the API ports of many sessions at once
+ *
+ * All the connections are non-blocking and driven by a single epoll thread with
+ * millisecond deadlines, so probing hundreds of endpoints takes as long as the
+ * slowest one. Watched sessions are re-probed with exponential backoff and receive
+ * an "apiAlive" or "apiDown" event (host, port) every time their status changes.
+ * On platforms without epoll, every batch is probed with isPortOpen() in it's own thread.
+ */
+class ApiProber {
+public:
+
+    /**
+     * Constructor & Destructor
+     */
+    ApiProber();
+    virtual ~ApiProber();
+
+    /**
+     * Global function to return the process-wide prober
+     */
+    static ApiProber&           Default         ( );
+
+    /**
+     * Probe the given endpoints in parallel and return immediately. The onDone
+     * callback receives all the results at once, so it must not block.
+     */
+    ApiProbeBatchPtr            probeAsync      ( const std::vector<API_PROBE>& probes, int timeoutMs = API_PROBE_TIMEOUT,
+                                                  const callbackProbeBatch& onDone = callbackProbeBatch() );
+
+    /**
+     * Probe the given endpoints in parallel and wait for the results. When called
+     * from a callback running on the prober thread, the endpoints are probed one
+     * after the other with blocking connections instead.
+     */
+    void                        probeAll        ( std::vector<API_PROBE>& probes, int timeoutMs = API_PROBE_TIMEOUT );
+
+    /**
+     * Probe a single endpoint and wait for the result
+     */
+    bool                        probe           ( const std::string& host, int port, unsigned char handshake = HSK_HTTP,
+                                                  int timeoutMs = API_PROBE_TIMEOUT );
+
+    /**
+     * Keep probing the API port of the given session, firing "apiAlive" and "apiDown"
+     * events on it when it's status changes.
+     */
+    void                        watch           ( const boost::shared_ptr<HVSession>& session, unsigned char handshake = HSK_HTTP );
+
+    /**
+     * Stop probing the session with the given UUID
+     */
+    void                        unwatch         ( const std::string& uuid );
+
+    /**
+     * Receive the results of every round of watched session probes as one batch
+     */
+    void                        setBatchListener( const callbackProbeBatch& cb );
+
+private:
+
+    /**
+     * Status of a watched session
+     */
+    typedef struct {
+        boost::weak_ptr<HVSession>  session;
+        unsigned char               handshake;
+        bool                        known;
+        bool                        alive;
+        int                         interval;
+        unsigned long long          nextAt;
+        bool                        probing;
+    } WATCH;
+
+    /**
+     * A probe in progress
+     */
+    typedef struct {
+        ApiProbeBatchPtr            batch;
+        size_t                      index;
+        int                         stage;
+        unsigned long long          deadline;
+        unsigned long long          graceAt;
+    } INFLIGHT;
+
+    /**
+     * Process the results of a round of watched session probes
+     */
+    void                        watchDone       ( const std::vector<API_PROBE>& results );
+
+    /**
+     * Collect the watched sessions that are due and start probing them
+     */
+    void                        startWatches    ( unsigned long long now );
+
+    /**
+     * Fire the completion of the given batch
+     */
+    void                        finishBatch     ( const ApiProbeBatchPtr& batch );
+
+    /**
+     * Wake-up the prober thread
+     */
+    void                        notify          ( );
+
+    /**
+     * Check if the caller is the prober thread
+     */
+    bool                        isProberThread  ( );
+
+    /**
+     * Probe the endpoints of the batch with blocking connections in the calling thread
+     */
+    void                        probeBlocking   ( const ApiProbeBatchPtr& batch );
+
+    /**
+     * The prober thread main loop
+     */
+    void                        proberLoop      ( );
+
+#ifdef __linux__
+
+    /**
+     * Start all the probes of the given batch
+     */
+    void                        startBatch      ( const ApiProbeBatchPtr& batch, unsigned long long now );
+
+    /**
+     * Complete the probe on the given descriptor
+     */
+    void                        finishProbe     ( int fd, bool alive, unsigned long long now );
+
+    /**
+     * Handle an epoll event on the given descriptor
+     */
+    void                        handleEvent     ( int fd, unsigned int events, unsigned long long now );
+
+    // Prober state
+    int                         epfd;
+    int                         wakeFd;
+    std::map< int, INFLIGHT >   inflight;
+
+#else
+
+    /**
+     * Thread body probing a batch on platforms without epoll
+     */
+    void                        fallbackRun     ( const ApiProbeBatchPtr& batch );
+
+#endif
+
+    // Shared between the prober and the callers
+    boost::mutex                queueMutex;
+    std::list< ApiProbeBatchPtr > pending;
+    std::map< std::string, WATCH > watches;
+    callbackProbeBatch          batchListener;
+    boost::thread *             proberThread;
+    bool                        stopRequested;
+
+};
+
+#endif /* end of include guard: APIPROBER_H */
@@ -0,0 +1,216 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef BOOTPROFILER_H
+#define BOOTPROFILER_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/LocalConfig.h>
+#include <CernVM/CrashReport.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+// How many samples of every step are kept for the percentiles
+#define BOOT_PROFILER_SAMPLES   64
+
+// The runtime config of the samples
+#define BOOT_PROFILER_TABLE     "profile"
+
+/**
+ * A timed interval of a trace
+ */
+typedef struct {
+
+    std::string         name;           // ex. "ConfigureVM" or "exec:modifyvm"
+    int                 parent;         // Index of the enclosing span, or -1
+    long                start;          // Milliseconds since the beginning of the trace
+    long                duration;       // Milliseconds, or -1 while open
+
+} PROFILE_SPAN;
+
+/**
+ * Latency percentiles of a single step, in milliseconds
+ */
+typedef struct {
+
+    int                 count;
+    long                p50;
+    long                p90;
+    long                p95;
+    long                p99;
+    long                max;
+
+} PROFILE_STATS;
+
+/**
+ * The timeline of a single operation (ex. a session start), split in spans.
+ *
+ * The spans opened by a thread are nested in the span that thread has open,
+ * so the commands executed by an FSM handler end up under that handler.
+ * When the trace is not active, spans are not recorded.
+ */
+class ProfileTrace {
+public:
+
+    /**
+     * Constructor
+     */
+    ProfileTrace() : label(), origin(0), total(0), active(false), spans(), current(), mutex() { };
+
+    /**
+     * Discard the previous spans and start recording
+     */
+    void                        begin           ( const std::string& label );
+
+    /**
+     * Open a new span, returning it's index or -1 if we are not recording. If
+     * nest is false, the span does not enclose the next spans of this thread.
+     */
+    int                         enter           ( const std::string& name, bool nest = true );
+
+    /**
+     * Close the given span
+     */
+    void                        leave           ( int span );
+
+    /**
+     * Close the open spans and stop recording, returning false if we were not recording
+     */
+    bool                        end             ( );
+
+    /**
+     * Stop recording and discard the spans
+     */
+    void                        cancel          ( );
+
+    /**
+     * Check if we are recording
+     */
+    bool                        isActive        ( );
+
+    /**
+     * Check if the calling thread has an open span
+     */
+    bool                        inSpan          ( );
+
+    /**
+     * Return a copy of the recorded spans
+     */
+    std::vector< PROFILE_SPAN > getSpans        ( );
+
+    /**
+     * Return the recorded spans as a JSON array of {name, parent, start, duration}
+     */
+    std::string                 toJSON          ( );
+
+    /**
+     * Return the total duration of the spans, summed by their path
+     * (ex. "ConfigureVM.exec:modifyvm"), together with the "total" duration.
+     */
+    std::map< std::string, long > getBreakdown  ( );
+
+    // The label passed to begin()
+    std::string                 label;
+
+private:
+
+    long                        origin;
+    long                        total;          // The duration of the completed trace
+    bool                        active;
+    std::vector< PROFILE_SPAN > spans;
+    std::map< boost::thread::id, int >
+                                current;        // The innermost open span of every thread
+    boost::mutex                mutex;
+
+};
+
+/**
+ * Scoped span of a trace. If nestedOnly is true, the span is recorded only
+ * if the calling thread has an open span (ex. it's running an FSM handler).
+ */
+class ProfileScope {
+public:
+    ProfileScope( ProfileTrace& trace, const std::string& name, bool nestedOnly = false )
+        : trace(trace), span( (nestedOnly && !trace.inSpan()) ? -1 : trace.enter(name) ) { };
+    ~ProfileScope() {
+        if (span >= 0) trace.leave( span );
+    };
+private:
+    ProfileTrace&               trace;
+    int                         span;
+};
+
+/**
+ * Aggregator of the completed session start traces, shared by all the
+ * sessions of all the processes.
+ *
+ * The last BOOT_PROFILER_SAMPLES durations of every step are kept in the
+ * BOOT_PROFILER_TABLE runtime config, so the percentiles survive restarts.
+ */
+class BootProfiler {
+public:
+
+    /**
+     * Constructor, keeping the samples in the given runtime config
+     */
+    BootProfiler( const std::string& name = BOOT_PROFILER_TABLE ) : name(name), table(), mutex() { };
+
+    /**
+     * Global function to return the process-wide profiler
+     */
+    static BootProfiler&        Default         ( );
+
+    /**
+     * Add the breakdown of the given completed trace to the samples
+     */
+    void                        record          ( ProfileTrace& trace );
+
+    /**
+     * Return the latency percentiles of every step
+     */
+    std::map< std::string, PROFILE_STATS >
+                                getStats        ( );
+
+    /**
+     * Discard all the samples
+     */
+    void                        reset           ( );
+
+private:
+
+    /**
+     * Load or synchronize the samples with the disk
+     */
+    void                        syncTable       ( );
+
+    // The persisted samples, step -> comma-separated durations
+    std::string                 name;
+    LocalConfigPtr              table;
+    boost::mutex                mutex;
+
+};
+
+#endif /* end of include guard: BOOTPROFILER_H */
@@ -141,4 +141,30 @@
 
 	#endif
 
-#endif
\ No newline at end of file
+/**
+ * The macros for writing spans to the Chrome trace file (see TraceEvent.h).
+ * The span lasts until the end of the scope and the arguments are evaluated
+ * only if the trace output is enabled.
+ *
+ * Usage:
+ *
+ *  function() {
+ *		TRACE_SPAN("exec", verb);
+ *			..
+ *		TRACE_SPAN_ARG("exit", code);
+ *  }
+ *
+ */
+#ifdef TRACING
+	#include "TraceEvent.h"
+	#define TRACE_SPAN(category,name) \
+		TraceSpan __traceSpan( category ); \
+		do { if (__traceSpan.active()) __traceSpan.begin( name ); } while(0)
+	#define TRACE_SPAN_ARG(key,value) \
+		do { if (__traceSpan.active()) __traceSpan.arg( key, value ); } while(0)
+#else
+	#define TRACE_SPAN(...)		;
+	#define TRACE_SPAN_ARG(...)	;
+#endif
+
+#endif
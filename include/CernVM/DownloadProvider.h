@@ -30,6 +30,7 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <vector>
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
@@ -42,18 +43,108 @@
 #include <curl/curl.h>
 #include <curl/easy.h>
 
+#include <openssl/evp.h>
+
 /**
  * Throttle timer delay which defines how frequetly the progress events will be fired
  */
 #define DP_THROTTLE_TIMER   250
 
+/**
+ * How many connections are used for downloading big files from servers that
+ * support range requests, and the smallest range downloaded by each of them
+ */
+#define DP_SEGMENTS         4
+#define DP_SEGMENT_MIN_SIZE 8388608
+
+/**
+ * How frequently (in ms) the state of a partial download is saved
+ */
+#define DP_CHECKPOINT_INTERVAL  5000
+
+/**
+ * How many bytes the digest of a segmented download reads back from
+ * the file between two polls of the transfers
+ */
+#define DP_DIGEST_READBACK  4194304
+
+/**
+ * A byte range of a file being downloaded
+ */
+typedef struct {
+
+    curl_off_t          begin;          // The first byte of the range
+    curl_off_t          pos;            // The next byte to be written
+    curl_off_t          end;            // The last byte of the range, or -1 if the size is unknown
+
+} DP_RANGE;
+
+/**
+ * The state of a partial download, kept in a sidecar file next to it
+ */
+typedef struct {
+
+    std::string         url;
+    std::string         validator;      // The ETag (or Last-Modified) of the file, used in If-Range
+    curl_off_t          size;           // The size of the file, or 0 if unknown
+    std::vector< DP_RANGE > ranges;
+
+} DP_PARTIAL;
+
 /**
  * Forward decleration of pointer types
  */
 class DownloadProvider; 
 class CURLProvider; 
+class DigestSink;
 typedef boost::shared_ptr< DownloadProvider >       DownloadProviderPtr;
 typedef boost::shared_ptr< CURLProvider >           CURLProviderPtr;
+typedef boost::shared_ptr< DigestSink >             DigestSinkPtr;
+
+/**
+ * A SHA256 checksum calculated while a file is downloaded, so it does not have to be read
+ * back from the disk afterwards.
+ *
+ * The data must be hashed in order. What arrives ahead of the digest (ex. in the later
+ * ranges of a segmented download) is read back from the file when the digest reaches it.
+ */
+class DigestSink {
+public:
+
+    // Constructor & Destructor
+    DigestSink();
+    ~DigestSink();
+
+    /**
+     * Start over from the beginning of the file
+     */
+    void                        reset       ( );
+
+    /**
+     * Hash the given data found at the given offset of the file, if it's where the digest is
+     */
+    void                        update      ( curl_off_t offset, const char * ptr, size_t len );
+
+    /**
+     * Hash up to the given number of bytes, reading them from the file
+     */
+    bool                        readBack    ( int fd, curl_off_t len );
+
+    /**
+     * Complete the checksum, if all the given bytes of the file were hashed
+     */
+    bool                        finish      ( curl_off_t size );
+
+    // The hex checksum, available after finish()
+    std::string                 hex;
+
+    // The offset up to which the file is hashed
+    curl_off_t                  position;
+
+private:
+    EVP_MD_CTX *                ctx;
+
+};
 
 /**
  * Base class of the download provider
@@ -70,6 +161,14 @@ public:
     virtual int                 downloadText( const std::string &URL, std::string *buffer, const VariableTaskPtr& pf = VariableTaskPtr() ) = 0;
     virtual DownloadProviderPtr clone() = 0;
 
+    // Download a file, hashing it while it's written if the provider can. By default the digest is left
+    // empty, so the caller has to checksum the file afterwards.
+    virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf, const DigestSinkPtr& digest );
+
+    // Download a file, continuing a previous failed download of it. By default it starts over.
+    // If a digest is given, it has the checksum of the file when the download completes.
+    virtual int                 resumeFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr(), const DigestSinkPtr& digest = DigestSinkPtr() );
+
     // Abort flag
     virtual int                 abort() = 0;
     virtual int                 abortAll() = 0;
@@ -111,6 +210,7 @@ public:
         this->abortPersistsFlag = false;
         this->operationInstances = 0;
         this->maxStreamSize = 0;
+        this->segments = DP_SEGMENTS;
 
         CRASH_REPORT_END;
 
@@ -122,19 +222,31 @@ public:
     };
 
     // Curl I/O
-    virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr()  ) ;
+    virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf, const DigestSinkPtr& digest );
     virtual int                 downloadText( const std::string &URL, std::string *buffer, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual int                 resumeFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr(), const DigestSinkPtr& digest = DigestSinkPtr() );
     virtual DownloadProviderPtr clone();
     virtual int                 abort();
     virtual int                 abortAll();
 
+    // Segmented and resumable downloads
+    void                        prepareFile( const std::string &URL, const VariableTaskPtr& pf, const DigestSinkPtr& digest );
+    int                         probeRanges( const std::string &URL, DP_PARTIAL * remote, std::string * rangeURL );
+    int                         segmentsFor( curl_off_t size );
+    int                         transferRanges( const std::string &URL, int fd, DP_PARTIAL * state, const std::string &sidecar );
+    static bool                 loadPartial( const std::string &file, DP_PARTIAL * state );
+    static bool                 savePartial( const std::string &file, const DP_PARTIAL& state );
+
     // Private variables
     CURL                        * curl;
     VariableTaskPtr             pf;
+    DigestSinkPtr               digest;
     long                        maxStreamSize;
     bool                        abortFlag;
     bool                        abortPersistsFlag;
     int                         operationInstances;
+    int                         segments;           // Connections per file (1 disables the segmented downloads)
     std::ofstream               fStream;
     std::ostringstream          sStream;
     
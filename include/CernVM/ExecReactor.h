@@ -0,0 +1,290 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef EXECREACTOR_H
+#define EXECREACTOR_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/* Forward-declaration of the exec classes */
+class ExecHandle;
+class ExecReactor;
+class ExecScheduler;
+typedef boost::shared_ptr< ExecHandle >             ExecHandlePtr;
+
+/**
+ * Completion callback of an asynchronous command (fired from the reactor thread)
+ */
+typedef boost::function< void ( const ExecHandlePtr& ) >  callbackExecDone;
+
+/**
+ * Handle to a command started through the ExecReactor
+ */
+class ExecHandle {
+public:
+
+    /**
+     * Constructor
+     */
+    ExecHandle( const std::string& app, const std::vector<std::string>& args, const SysExecConfig& config )
+        : exitCode(0), stdoutList(), stderrMsg(), app(app), args(args), config(config), onLine(), onDone(),
+          onRetry(), reactor(NULL), scheduler(NULL), ticket(0), granted(false), mutex(), cond(), done(false),
+          cancelRequested(false), tries(0), pid(0), pidfd(-1),
+          outfd(-1), errfd(-1), outOpen(false), errOpen(false), exited(false), status(0), deadline(0),
+          retryAt(0), outBuffer(), errBuffer(), started(0) { };
+
+    /**
+     * Return a handle that has already completed with the given exit code
+     */
+    static ExecHandlePtr        Completed       ( int exitCode );
+
+    /**
+     * Wait for the command to complete and return it's exit code.
+     * This is a boost::thread interruption point.
+     */
+    int                         wait            ( );
+
+    /**
+     * Wait up to the given time for the command to complete,
+     * returning true if it has completed.
+     */
+    bool                        waitFor         ( int timeoutMs );
+
+    /**
+     * Kill this command, without affecting any other. The handle
+     * completes with exit code 254 and it's not retried.
+     * A command still waiting for a scheduler slot gives up it's place.
+     */
+    void                        cancel          ( );
+
+    /**
+     * Check if the command has completed
+     */
+    bool                        isDone          ( );
+
+    // Results, valid after completion
+    int                         exitCode;
+    std::vector<std::string>    stdoutList;
+    std::string                 stderrMsg;
+
+private:
+    friend class ExecReactor;
+
+    /**
+     * Mark the handle as completed and wake-up the waiters
+     */
+    void                        complete        ( int code );
+
+    /**
+     * Line consumer used when no custom one is specified
+     */
+    void                        collectLine     ( const std::string& line );
+
+    /**
+     * Discard the output of a failed attempt before the command is retried
+     */
+    void                        discardOutput   ( );
+
+    // Command details
+    std::string                 app;
+    std::vector<std::string>    args;
+    SysExecConfig               config;
+    callbackLine                onLine;
+    callbackExecDone            onDone;
+    callbackVoid                onRetry;
+    ExecReactor *               reactor;
+
+    // Scheduler slot (see ExecScheduler::acquireAsync)
+    ExecScheduler *             scheduler;
+    unsigned long               ticket;
+    bool                        granted;
+
+    // Completion state
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+    bool                        done;
+    bool                        cancelRequested;
+
+    // State of the running attempt (accessed only by the reactor thread)
+    int                         tries;
+    int                         pid;
+    int                         pidfd;
+    int                         outfd;
+    int                         errfd;
+    bool                        outOpen;
+    bool                        errOpen;
+    bool                        exited;
+    int                         status;
+    long                        deadline;
+    long                        retryAt;
+    std::string                 outBuffer;
+    std::string                 errBuffer;
+
+    // When the command was queued (in microseconds, see traceNowUs)
+    unsigned long long          started;
+
+};
+
+/**
+ * A single thread that drives many concurrent commands, waking up only when one
+ * of them has output, exits, is cancelled or reaches it's deadline.
+ *
+ * The retry and error-string rules of the SysExecConfig are applied exactly like in sysExec().
+ * On platforms without epoll, every command is driven by a sysExec() in it's own thread
+ * and cancel() only stops it from being retried.
+ */
+class ExecReactor {
+public:
+
+    /**
+     * Constructor & Destructor
+     */
+    ExecReactor();
+    virtual ~ExecReactor();
+
+    /**
+     * Global function to return the process-wide reactor
+     */
+    static ExecReactor&         Default         ( );
+
+    /**
+     * Start the given command and return immediately a handle to it.
+     *
+     * If onLine is specified, the output lines are passed to it instead of being
+     * collected in the handle's stdoutList. Like in sysExec(), onRetry is called before
+     * every new attempt of a failed command, so the consumer can discard the lines it
+     * received from the previous one. All the callbacks are fired from the reactor
+     * thread, so they must not block.
+     *
+     * If a scheduler is specified, the command is started only when it's granted a slot
+     * for the priority and owner of it's configuration, and the slot is released when
+     * it completes. The handle is returned right away even while it's queued.
+     */
+    ExecHandlePtr               exec            ( const std::string& app,
+                                                  const std::vector<std::string>& args,
+                                                  const SysExecConfig& config,
+                                                  const callbackExecDone& onDone = callbackExecDone(),
+                                                  const callbackLine& onLine = callbackLine(),
+                                                  const callbackVoid& onRetry = callbackVoid(),
+                                                  ExecScheduler * scheduler = NULL );
+
+    /**
+     * Cancel all the active commands. Their handles complete with exit code 254
+     * and their completion callbacks are fired. (Also used when the reactor is destroyed)
+     */
+    void                        cancelAll       ( );
+
+    /**
+     * Wake-up the reactor thread (used by ExecHandle::cancel)
+     */
+    void                        notify          ( );
+
+    /**
+     * Take a cancelled handle out of the scheduler queue, if it's still
+     * waiting there, and wake-up the reactor thread (used by ExecHandle::cancel)
+     */
+    void                        withdraw        ( ExecHandle * handle );
+
+private:
+
+    /**
+     * Called by the scheduler when the given handle is granted a slot
+     */
+    void                        grant           ( const ExecHandlePtr& handle );
+
+    /**
+     * Pass the handle to the reactor thread (called with the queueMutex locked)
+     */
+    void                        start           ( const ExecHandlePtr& handle );
+
+    /**
+     * Fire the completion of the given handle
+     */
+    void                        finish          ( const ExecHandlePtr& handle, int code );
+
+#ifdef __linux__
+
+    /**
+     * The reactor thread main loop
+     */
+    void                        reactorLoop     ( );
+
+    /**
+     * Advance the state of the given handle, returning false when it's completed
+     */
+    bool                        step            ( const ExecHandlePtr& handle, long now, bool cancel );
+
+    /**
+     * Start a new attempt for the given handle
+     */
+    bool                        spawn           ( const ExecHandlePtr& handle, long now );
+
+    /**
+     * Close the descriptors of the running attempt
+     */
+    void                        release         ( const ExecHandlePtr& handle );
+
+    /**
+     * Start or stop watching the given descriptor
+     */
+    void                        watch           ( int fd, const ExecHandlePtr& handle );
+    void                        unwatch         ( int fd );
+
+    // Reactor state
+    int                         epfd;
+    int                         wakeFd;
+    std::list< ExecHandlePtr >  active;
+    std::map< int, ExecHandlePtr > fdHandles;
+
+#else
+
+    /**
+     * Thread body driving a single command on platforms without epoll
+     */
+    void                        fallbackRun     ( const ExecHandlePtr& handle );
+
+#endif
+
+    // Shared between the reactor and the callers
+    boost::mutex                queueMutex;
+    std::list< ExecHandlePtr >  pending;
+    std::list< ExecHandlePtr >  queued;             // Waiting for a scheduler slot
+    boost::thread *             reactorThread;
+    bool                        cancelAllRequested;
+    bool                        stopRequested;
+
+};
+
+#endif /* end of include guard: EXECREACTOR_H */
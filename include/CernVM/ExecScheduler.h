@@ -0,0 +1,182 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef EXECSCHEDULER_H
+#define EXECSCHEDULER_H
+
+#include <CernVM/Utilities.h>
+
+#include <string>
+#include <deque>
+#include <list>
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// Default number of hypervisor commands allowed to run in parallel
+#define EXEC_SCHEDULER_CONCURRENCY  4
+
+// Number of SYSEXEC_PRIORITY_* classes
+#define EXEC_SCHEDULER_PRIORITIES   3
+
+/**
+ * Queue metrics of a single priority class
+ */
+typedef struct {
+
+    int                 queued;         // Commands currently waiting
+    int                 maxQueued;      // The highest queue depth seen
+    unsigned long       scheduled;      // Commands granted a slot so far
+    unsigned long       totalWaitMs;    // Total time spent waiting for a slot
+    unsigned long       maxWaitMs;      // Longest time spent waiting for a slot
+
+} EXEC_QUEUE_STATS;
+
+/**
+ * Central scheduler that bounds the number of hypervisor commands running in parallel.
+ *
+ * Waiting commands are served strictly by priority class (SYSEXEC_PRIORITY_*) and,
+ * within the same class, round-robin between their owners (ex. sessions), so a single
+ * busy session cannot starve the others.
+ */
+class ExecScheduler {
+public:
+
+    /**
+     * Constructor
+     */
+    ExecScheduler( int maxConcurrency = EXEC_SCHEDULER_CONCURRENCY );
+
+    /**
+     * Block until the command of the given priority and owner can run.
+     * This is a boost::thread interruption point.
+     */
+    void                        acquire         ( int priority, const std::string& owner );
+
+    /**
+     * Queue the command of the given priority and owner without blocking.
+     *
+     * Returns true if a slot was granted right away. Otherwise the command waits in the
+     * same queues as acquire() under the returned ticket, and onGrant is called (outside
+     * of the scheduler lock, from the thread that freed the slot) when it's granted one.
+     */
+    bool                        acquireAsync    ( int priority, const std::string& owner, const callbackVoid& onGrant, unsigned long * ticket );
+
+    /**
+     * Give up the place of a command queued with acquireAsync(). Returns false if
+     * it was already granted a slot, in which case onGrant is (or will be) called.
+     */
+    bool                        cancelAsync     ( unsigned long ticket );
+
+    /**
+     * Release a slot previously obtained with acquire() or acquireAsync()
+     */
+    void                        release         ( );
+
+    /**
+     * Change the number of commands allowed to run in parallel
+     */
+    void                        setMaxConcurrency( int maxConcurrency );
+
+    /**
+     * Return the metrics of the given priority class
+     */
+    EXEC_QUEUE_STATS            getStats        ( int priority );
+
+    /**
+     * Return the number of the commands currently running
+     */
+    int                         getRunning      ( );
+
+private:
+
+    /**
+     * A command waiting for a slot
+     */
+    struct Waiter {
+        bool                    granted;
+        long                    since;
+        unsigned long           ticket;         // Set only for the acquireAsync() waiters
+        callbackVoid            onGrant;
+    };
+
+    /**
+     * Check if a command can run right away (called with the mutex locked)
+     */
+    bool                        tryFastPath     ( int priority );
+
+    /**
+     * Grant slots to the waiting commands (called with the mutex locked).
+     * The callbacks of the granted asynchronous waiters are appended to the given list.
+     */
+    void                        dispatch        ( std::list< callbackVoid > * granted );
+
+    /**
+     * Fire the callbacks collected by dispatch() (called with the mutex unlocked)
+     */
+    static void                 fire            ( const std::list< callbackVoid >& granted );
+
+    /**
+     * Remove the given waiter from it's queue (called with the mutex locked)
+     */
+    void                        dequeue         ( int priority, const std::string& owner, Waiter * waiter );
+
+    int                         maxConcurrency;
+    int                         running;
+
+    // Per priority: the waiting commands of every owner and the owners' serving order
+    std::map< std::string, std::deque< Waiter* > >
+                                queues[EXEC_SCHEDULER_PRIORITIES];
+    std::list< std::string >    rotation[EXEC_SCHEDULER_PRIORITIES];
+    EXEC_QUEUE_STATS            stats[EXEC_SCHEDULER_PRIORITIES];
+
+    // The waiters of acquireAsync(), by ticket
+    struct AsyncWaiter {
+        int                     priority;
+        std::string             owner;
+        Waiter                  waiter;
+    };
+    std::map< unsigned long, AsyncWaiter* >
+                                asyncWaiters;
+    unsigned long               lastTicket;
+
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+
+};
+
+/**
+ * Scoped ownership of an ExecScheduler slot
+ */
+class ExecSlot {
+public:
+    ExecSlot( ExecScheduler& scheduler, const SysExecConfig& config ) : scheduler(scheduler) {
+        scheduler.acquire( config.priority, config.owner );
+    };
+    ~ExecSlot() {
+        scheduler.release();
+    };
+private:
+    ExecScheduler&              scheduler;
+};
+
+#endif /* end of include guard: EXECSCHEDULER_H */
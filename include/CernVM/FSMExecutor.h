@@ -0,0 +1,100 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef FSMEXECUTOR_H
+#define FSMEXECUTOR_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <deque>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// Default number of worker threads
+#define FSM_EXECUTOR_THREADS    8
+
+/**
+ * A fixed-size pool of worker threads that drives the FSM of many sessions.
+ *
+ * Tasks are served in the order they were posted. A SimpleFSM posts one task per
+ * step and only one at a time, so the steps of a session never run in parallel and
+ * the sessions get the workers in turns.
+ */
+class FSMExecutor {
+public:
+
+    /**
+     * Start the given number of worker threads
+     */
+    FSMExecutor( int threads = FSM_EXECUTOR_THREADS );
+
+    /**
+     * Stop the worker threads, discarding the tasks that did not start
+     */
+    virtual ~FSMExecutor();
+
+    /**
+     * Queue a task to be run by the next free worker
+     */
+    void                        post            ( const callbackVoid& task );
+
+    /**
+     * Return the worker thread of the caller, or NULL if the caller is not a worker
+     */
+    boost::thread *             currentWorker   ( );
+
+    /**
+     * Return the number of the worker threads
+     */
+    int                         getThreads      ( );
+
+    /**
+     * Return the number of the tasks waiting for a worker
+     */
+    int                         getQueued       ( );
+
+private:
+
+    /**
+     * The worker thread main loop
+     */
+    void                        workerMain      ( );
+
+    std::vector< boost::thread* >
+                                workers;
+    std::deque< callbackVoid >  queue;
+    bool                        stopRequested;
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+
+};
+
+/**
+ * Shared pointer to the executor
+ */
+typedef boost::shared_ptr< FSMExecutor >    FSMExecutorPtr;
+
+#endif /* end of include guard: FSMEXECUTOR_H */
@@ -32,6 +32,10 @@
 #include <CernVM/ProgressFeedback.h>
 #include <CernVM/DownloadProvider.h>
 #include <CernVM/Utilities.h>
+#include <CernVM/ExecReactor.h>
+#include <CernVM/ExecScheduler.h>
+#include <CernVM/PortAllocator.h>
+#include <CernVM/FSMExecutor.h>
 #include <CernVM/CrashReport.h>
 #include <CernVM/ParameterMap.h>
 #include <CernVM/UserInteraction.h>
@@ -92,6 +96,9 @@ enum HVFailures {
 #define HVE_NOT_TRUSTED         -13 /* Same to HVE_NOT_TRUSTED */
 #define CVME_PASSWORD_DENIED    -20
 
+/* Interval (ms) between the full checks of the instance state monitor */
+#define HV_MONITOR_INTERVAL     2000
+
 /* Extra parameters supported by getExtraInfo() */
 #define EXIF_VIDEO_MODE         1
 
@@ -429,6 +436,23 @@ public:
 };
 
 
+/**
+ * A read-only command in progress, whose output is shared with all the identical
+ * commands issued while it's running (See HVInstance::exec)
+ */
+class HVSharedExec {
+public:
+    HVSharedExec() : mutex(), cond(), done(false), result(0), lines(), stderrMsg(), started(0) { };
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+    bool                        done;
+    int                         result;
+    std::vector<std::string>    lines;
+    std::string                 stderrMsg;
+    unsigned long               started;        // The execSequence when it was started
+};
+typedef boost::shared_ptr< HVSharedExec >   HVSharedExecPtr;
+
 /**
  * Overloadable base hypervisor class
  */
@@ -469,6 +493,22 @@ public:
      * The hypervisor version
      */
     HypervisorVersion       version;
+
+    /**
+     * The scheduler that bounds the hypervisor commands running in parallel
+     */
+    ExecScheduler           execScheduler;
+
+    /**
+     * The allocator of the local ports used by the sessions
+     */
+    PortAllocator           portAllocator;
+
+    /**
+     * The worker pool that drives the FSM of the sessions opened from now on.
+     * If it's not set (the default), every session runs it's own FSM thread.
+     */
+    FSMExecutorPtr          sessionExecutor;
     
     ////////////////////////////////////////
     // Session management
@@ -479,6 +519,16 @@ public:
      */
     std::list< HVSessionPtr > openSessions;
 
+    /**
+     * Protects the openSessions list, which is also read by the monitor thread
+     */
+    boost::mutex            openSessionsMutex;
+
+    /**
+     * Return a copy of the currently open sessions
+     */
+    std::list< HVSessionPtr > getOpenSessions   ( );
+
     /**
      * The map of session UUIDs and their object instance
      */
@@ -573,6 +623,39 @@ public:
      */
     int                     exec                ( std::string args, std::vector<std::string> * stdoutList, std::string * stderrMsg, const SysExecConfig& config );
 
+    /**
+     * Streaming version of exec(), passing every output line to the onLine consumer
+     * while the hypervisor binary is still running. (See sysExec() for the onRetry semantics)
+     */
+    int                     exec                ( std::string args, const callbackLine& onLine, std::string * stderrMsg, const SysExecConfig& config, const callbackVoid& onRetry = callbackVoid() );
+
+    /**
+     * Versions of exec() that pass the argument vector as-is to the hypervisor binary,
+     * without re-parsing a command-line string. (ex. a VBoxCommand)
+     */
+    int                     exec                ( const std::vector<std::string>& args, std::vector<std::string> * stdoutList, std::string * stderrMsg, const SysExecConfig& config );
+    int                     exec                ( const std::vector<std::string>& args, const callbackLine& onLine, std::string * stderrMsg, const SysExecConfig& config, const callbackVoid& onRetry = callbackVoid() );
+
+    /**
+     * Check if the given hypervisor command has no side-effects, in which case concurrent
+     * identical invocations of exec() (with equal configurations) are coalesced into a single process.
+     */
+    virtual bool            isReadOnlyCommand   ( const std::vector<std::string>& /* args */ ) { return false; };
+
+    /**
+     * Start the hypervisor binary through the ExecReactor and return immediately.
+     * The returned handle can be waited upon or cancelled without affecting other commands.
+     * The command waits for it's scheduler slot in the reactor, so the caller is never blocked
+     * and a handle that is still queued can be cancelled as well.
+     */
+    ExecHandlePtr           execAsync           ( const std::vector<std::string>& args, const SysExecConfig& config, const callbackExecDone& onDone = callbackExecDone() );
+
+    /**
+     * Note that a mutating command of the given owner has completed, so it's following
+     * read-only commands do not attach to shared ones started earlier
+     */
+    void                    execMutated         ( const std::string& owner );
+
     /**
      * Download an arbitrary file and validate it against a checksum
      * file, both provided as URLs
@@ -646,6 +729,22 @@ public:
      */
     void                    setUserInteraction( UserInteractionPtr p );
 
+    /**
+     * Start the thread that keeps the state of the open sessions up to date,
+     * calling monitorTick() on every interval or when monitorWait() is woken-up.
+     */
+    void                    monitorStart    ( int intervalMs = HV_MONITOR_INTERVAL );
+
+    /**
+     * Stop the monitor thread, waiting for the current tick to complete
+     */
+    void                    monitorStop     ( );
+
+    /**
+     * Check if the monitor thread is running
+     */
+    bool                    monitorRunning  ( );
+
     /* HACK: Only the JSAPI knows where it's located. Therefore it must provide it to
              the Hypervisor class in order to use the checkDaemonNeed() function. It's
              a hack because those two systems (JSAPI & HypervisorAPI) should be isolated. */
@@ -655,6 +754,47 @@ protected:
     int                     sessionID;
     DownloadProviderPtr     downloadProvider;
     UserInteractionPtr      userInteraction;
+
+    /**
+     * Execute a read-only command, sharing the output of an identical one if it's already running.
+     * A caller attaches only to a command started after it's own last mutating command completed,
+     * so it never gets output older than a change it has made.
+     */
+    int                     execShared          ( const std::vector<std::string>& args, const callbackLine& onLine, std::string * stderrMsg, const SysExecConfig& config, const callbackVoid& onRetry );
+
+    // The read-only commands currently in progress, indexed by their arguments
+    std::map< std::string, HVSharedExecPtr >
+                            sharedExecs;
+    boost::mutex            sharedExecsMutex;
+
+    // Sequence of the shared command starts and mutating command completions,
+    // and the sequence of the last completed mutating command of every owner
+    unsigned long           execSequence;
+    std::map< std::string, unsigned long >
+                            execMutations;
+
+    /**
+     * Block until something changes or the timeout expires, returning true
+     * if woken-up by a change. By default it just sleeps.
+     */
+    virtual bool            monitorWait     ( int timeoutMs );
+
+    /**
+     * Update the state of the open sessions. 'full' is true when the interval
+     * has elapsed, and false when monitorWait() reported a change.
+     */
+    virtual void            monitorTick     ( bool /* full */ ) { };
+
+private:
+
+    /**
+     * The monitor thread main loop
+     */
+    void                    monitorLoop     ( );
+
+    boost::thread *         monitorThread;
+    boost::mutex            monitorMutex;
+    int                     monitorInterval;
 };
 
 //////////////////////////////////////////////
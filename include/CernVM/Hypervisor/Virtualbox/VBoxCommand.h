@@ -0,0 +1,104 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef VBOXCOMMAND_H
+#define VBOXCOMMAND_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include <CernVM/Utilities.h>
+
+/**
+ * Builder for VBoxManage command lines.
+ *
+ * The arguments are kept as separate strings all the way down to execv(), so they
+ * are never re-parsed and values with spaces or quotes need no escaping.
+ */
+class VBoxCommand {
+public:
+
+    /**
+     * Start a new command with the given VBoxManage sub-command (ex. "modifyvm")
+     */
+    VBoxCommand( const std::string& command ) : args() {
+        args.push_back( command );
+    };
+
+    /**
+     * Wrap an already split argument vector
+     */
+    explicit VBoxCommand( const std::vector<std::string>& argv ) : args( argv ) { };
+
+    /**
+     * Append a single argument
+     */
+    VBoxCommand& arg( const std::string& value ) {
+        args.push_back( value );
+        return *this;
+    };
+
+    /**
+     * Append a single numeric (or otherwise streamable) argument
+     */
+    template <typename T> VBoxCommand& arg( const T& value ) {
+        std::ostringstream oss; oss << value;
+        args.push_back( oss.str() );
+        return *this;
+    };
+
+    /**
+     * Append an option followed by it's value (ex. "--memory", 1024)
+     */
+    template <typename T> VBoxCommand& opt( const std::string& name, const T& value ) {
+        args.push_back( name );
+        return arg( value );
+    };
+
+    /**
+     * Append all the arguments of another command
+     */
+    VBoxCommand& append( const VBoxCommand& cmd ) {
+        args.insert( args.end(), cmd.args.begin(), cmd.args.end() );
+        return *this;
+    };
+
+    /**
+     * Number of arguments, including the sub-command
+     */
+    size_t                      size() const        { return args.size(); };
+
+    /**
+     * Return a quoted string representation, used for logging
+     */
+    std::string                 str() const         { return joinArguments( args ); };
+
+    /**
+     * The argument vector, as passed to HVInstance::exec
+     */
+    operator const std::vector<std::string>& () const { return args; };
+
+    std::vector<std::string>    args;
+
+};
+
+#endif /* end of include guard: VBOXCOMMAND_H */
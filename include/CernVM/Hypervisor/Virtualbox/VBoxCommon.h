@@ -25,6 +25,11 @@
 #include <CernVM/ProgressFeedback.h>
 #include <CernVM/Hypervisor.h>
 #include <CernVM/DomainKeystore.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxCommand.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxQueryCache.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxMachineInfo.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxDiskRegistry.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxConfigPlan.h>
 
 // Where to mount the bootable CD-ROM
 #define BOOT_CONTROLLER     "IDE"
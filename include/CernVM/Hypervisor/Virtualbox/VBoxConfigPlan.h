@@ -0,0 +1,177 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef VBOXCONFIGPLAN_H
+#define VBOXCONFIGPLAN_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <CernVM/ParameterMap.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxCommand.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxMachineInfo.h>
+
+/**
+ * A storage controller to add on the VM
+ */
+typedef struct {
+
+    std::string     name;           // ex. "SATA"
+    std::string     type;           // The 'storagectl --add' bus type (ex. "sata")
+    int             portCount;      // Number of ports (0 for the default)
+
+} VBOX_CONTROLLER_SPEC;
+
+/**
+ * The desired configuration of a VM
+ */
+class VBoxMachineSpec {
+public:
+
+    /**
+     * Constructor
+     */
+    VBoxMachineSpec() : options(), natRules(), sharedFolders(), extraData(), controllers() { };
+
+    /**
+     * Set a 'modifyvm' option, given without the leading dashes (ex. "memory", 1024)
+     */
+    VBoxMachineSpec& set( const std::string& option, const std::string& value ) {
+        options.push_back( std::make_pair( option, value ) );
+        return *this;
+    };
+    template <typename T> VBoxMachineSpec& set( const std::string& option, const T& value ) {
+        std::ostringstream oss; oss << value;
+        return set( option, oss.str() );
+    };
+
+    /**
+     * Define a NAT port-forwarding rule on the first NIC, in the '--natpf1' format
+     */
+    VBoxMachineSpec& natRule( const std::string& name, const std::string& rule ) {
+        natRules.push_back( std::make_pair( name, rule ) );
+        return *this;
+    };
+
+    /**
+     * Share a host folder with the guest (auto-mounted)
+     */
+    VBoxMachineSpec& sharedFolder( const std::string& name, const std::string& hostPath ) {
+        VBOX_SHARED_FOLDER f = { name, hostPath };
+        sharedFolders.push_back( f );
+        return *this;
+    };
+
+    /**
+     * Define a value of the VM extra data
+     */
+    VBoxMachineSpec& extra( const std::string& key, const std::string& value ) {
+        extraData.push_back( std::make_pair( key, value ) );
+        return *this;
+    };
+
+    /**
+     * Add a storage controller (if missing)
+     */
+    VBoxMachineSpec& controller( const std::string& name, const std::string& type, int portCount = 0 ) {
+        VBOX_CONTROLLER_SPEC c = { name, type, portCount };
+        controllers.push_back( c );
+        return *this;
+    };
+
+    std::vector< std::pair<std::string, std::string> >  options;
+    std::vector< std::pair<std::string, std::string> >  natRules;
+    std::vector< VBOX_SHARED_FOLDER >                   sharedFolders;
+    std::vector< std::pair<std::string, std::string> >  extraData;
+    std::vector< VBOX_CONTROLLER_SPEC >                 controllers;
+
+};
+
+/**
+ * A single VBoxManage invocation of a plan
+ */
+class VBoxConfigStep {
+public:
+
+    /**
+     * Constructor
+     */
+    VBoxConfigStep( const VBoxCommand& command ) : command(command), applied() { };
+
+    // The command to execute
+    VBoxCommand                 command;
+
+    // Values to record as applied when the command succeeds, for the
+    // settings that cannot be read back from the machine information.
+    std::vector< std::pair<std::string, std::string> >  applied;
+
+};
+
+/**
+ * The minimum set of VBoxManage invocations that bring a VM from it's
+ * current state to the desired one.
+ *
+ * All the 'modifyvm' options and NAT rules are merged into a single
+ * invocation and everything that already has the desired value is
+ * skipped, so an up-to-date VM needs no commands at all. Shared folders,
+ * extra data and storage controllers need an invocation each, since
+ * VBoxManage accepts only one per call. (A shared folder whose host path
+ * has changed is removed and added again)
+ *
+ * The values that 'showvminfo' does not report (ex. extra data) are compared
+ * against the values recorded in the 'applied' map after a previous plan.
+ */
+class VBoxConfigPlan {
+public:
+
+    /**
+     * Plan the changes needed on the given VM. The current state may be
+     * an empty MachineInfo if it's unknown.
+     */
+    VBoxConfigPlan( const std::string& vboxid, const VBoxMachineSpec& spec,
+                    const MachineInfo& current, const ParameterMapPtr& applied );
+
+    /**
+     * Check if the VM is already in the desired state
+     */
+    bool                        empty           ( ) const   { return steps.empty(); };
+
+    /**
+     * Number of invocations avoided, compared to applying every
+     * item of the specifications in it's own command
+     */
+    int                         saved           ( ) const   { return naive - (int)steps.size(); };
+
+    /**
+     * The key under which the given item is recorded in the 'applied' map
+     */
+    static std::string          appliedKey      ( const std::string& kind, const std::string& name );
+
+    // The commands to execute, in order
+    std::vector<VBoxConfigStep> steps;
+
+    // Number of commands without planning
+    int                         naive;
+
+};
+
+#endif /* end of include guard: VBOXCONFIGPLAN_H */
@@ -0,0 +1,135 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef VBOXDISKREGISTRY_H
+#define VBOXDISKREGISTRY_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Minimum interval (in milliseconds) between two reloads triggered by a look-up miss
+#define VBOX_DISK_REGISTRY_RELOAD   2000
+
+/**
+ * A hard disk known to VirtualBox (as reported by 'list hdds')
+ */
+typedef struct {
+
+    std::string     uuid;
+    std::string     parentUUID;     // "base" for base disks
+    std::string     location;
+    std::string     type;           // ex. "normal", "multiattach"
+    std::string     state;
+
+} VBOX_DISK_RECORD;
+
+/**
+ * Registry of the hard disks known to VirtualBox, indexed by UUID, location and parent.
+ *
+ * It's populated from a 'list hdds' snapshot and then kept up to date by the operations
+ * performed through this library, so look-ups do not need to spawn any process.
+ */
+class VBoxDiskRegistry {
+public:
+
+    /**
+     * Constructor
+     */
+    VBoxDiskRegistry() : loaded(false), loadedTime(0), disks(), byLocation(), byParent(), mutex() { };
+
+    /**
+     * Normalize a location for indexing
+     */
+    static std::string          normalize       ( const std::string& location );
+
+    /**
+     * Replace the contents with the records of a 'list hdds' output
+     */
+    void                        load            ( const std::vector< std::map< const std::string, const std::string > >& list );
+
+    /**
+     * Check if the registry has been loaded, and when (monotonic milliseconds)
+     */
+    bool                        isLoaded        ( );
+    long                        getLoadedTime   ( );
+
+    /**
+     * Drop everything, forcing a reload on the next access
+     */
+    void                        invalidate      ( );
+
+    /**
+     * Add or replace the given disk record
+     */
+    void                        update          ( const VBOX_DISK_RECORD& disk );
+
+    /**
+     * Record the differencing disk that a multi-attach mount of the given base disk
+     * created with the given UUID, and mark the base as multi-attach. Returns false
+     * if the base disk is not known, in which case nothing is changed.
+     */
+    bool                        addDifferencing ( const std::string& baseLocation, const std::string& uuid );
+
+    /**
+     * Remove the disk with the given UUID or location
+     */
+    void                        remove          ( const std::string& uuidOrLocation );
+
+    /**
+     * Look-up a disk by UUID
+     */
+    bool                        findByUUID      ( const std::string& uuid, VBOX_DISK_RECORD * disk );
+
+    /**
+     * Look-up a disk by location
+     */
+    bool                        findByLocation  ( const std::string& location, VBOX_DISK_RECORD * disk );
+
+    /**
+     * Return the UUIDs of the direct children of the given disk
+     */
+    std::vector<std::string>    findChildren    ( const std::string& parentUUID );
+
+private:
+
+    /**
+     * Index management (called with the mutex locked)
+     */
+    void                        link            ( const VBOX_DISK_RECORD& disk );
+    void                        unlink          ( const std::string& uuid );
+
+    bool                        loaded;
+    long                        loadedTime;
+    boost::unordered_map< std::string, VBOX_DISK_RECORD >
+                                disks;
+    boost::unordered_map< std::string, std::string >
+                                byLocation;
+    boost::unordered_multimap< std::string, std::string >
+                                byParent;
+    boost::mutex                mutex;
+
+};
+
+#endif /* end of include guard: VBOXDISKREGISTRY_H */
@@ -26,6 +26,7 @@
 #include "VBoxSession.h"
 
 #include <map>
+#include <set>
 
 #include "CernVM/Utilities.h"
 #include "CernVM/Hypervisor.h"
@@ -42,7 +43,7 @@
 class VBoxInstance : public HVInstance {
 public:
 
-    VBoxInstance( std::string fBin ) : HVInstance(), execConfig(), reflectionValid(true) {
+    VBoxInstance( std::string fBin ) : HVInstance(), queryCache(), diskRegistry(), execConfig(), reflectionValid(true) {
         CRASH_REPORT_BEGIN;
 
         // Populate variables
@@ -52,13 +53,18 @@ public:
         // Load hypervisor-specific runtime configuration
         this->hvConfig = LocalConfig::forRuntime("virtualbox");
 
+        // Limit the VBoxManage instances running in parallel
+        this->execScheduler.setMaxConcurrency( this->hvConfig->getNum<int>("maxExecConcurrency", EXEC_SCHEDULER_CONCURRENCY) );
+
         // Detect and update VirtualBox Version & Reflection flag
         this->validateIntegrity();
 
         CRASH_REPORT_END;
     };
 
-    virtual ~VBoxInstance() { }
+    virtual ~VBoxInstance() {
+        monitorStop();
+    }
 
 
     /////////////////////////
@@ -78,6 +84,7 @@ public:
     virtual int             getCapabilities     ( HVINFO_CAPS * caps );
     virtual void            abort               ( );
     virtual bool            validateIntegrity   ( );
+    virtual bool            isReadOnlyCommand   ( const std::vector<std::string>& args );
 
     /////////////////////////
     // Friend functions
@@ -86,27 +93,59 @@ public:
     int                     prepareSession      ( VBoxSession * session );
     std::map<const std::string, const std::string>        
                             getMachineInfo      ( std::string uuid, int timeout = SYSEXEC_TIMEOUT );
+    int                     getMachineInfo      ( std::string uuid, MachineInfo * info, int timeout = SYSEXEC_TIMEOUT );
     std::string             getProperty         ( std::string uuid, std::string name );
     std::vector< std::map< const std::string, const std::string > > 
                             getDiskList         ( );
+    bool                    findDisk            ( const std::string& uuidOrLocation, VBOX_DISK_RECORD * disk );
     std::map<std::string, std::string> 
                             getAllProperties    ( std::string uuid );
     bool                    hasExtPack          ();
     int                     installExtPack      ( DomainKeystore & keystore, const DownloadProviderPtr & downloadProvider, const FiniteTaskPtr & pf = FiniteTaskPtr() );
     HVSessionPtr            sessionByVBID       ( const std::string& virtualBoxGUID );
 
+    /**
+     * Execute an idempotent VBoxManage query, re-using a recent result if possible
+     */
+    int                     query               ( const VBoxCommand& cmd, std::vector<std::string> * stdoutList, std::string * stderrMsg, const SysExecConfig& config );
+
     /////////////////////////
     // Global properties
     /////////////////////////
 
     std::string             hvGuestAdditions;
 
+    // Results of recent queries, shared by all the sessions
+    VBoxQueryCache          queryCache;
+
+    // The hard disks known to VirtualBox
+    VBoxDiskRegistry        diskRegistry;
+
+protected:
+
+    /////////////////////////
+    // State monitor
+    /////////////////////////
+
+    virtual bool            monitorWait         ( int timeoutMs );
+    virtual void            monitorTick         ( bool full );
+
 private:
 
     /////////////////////////
     // Local properties
     /////////////////////////
 
+    /**
+     * (Re-)load the disk registry from 'list hdds'
+     */
+    int                     loadDiskRegistry    ( );
+
+    /**
+     * Return the UUIDs of the running VMs
+     */
+    int                     getRunningUUIDs     ( std::set<std::string> * uuids );
+
     LocalConfigPtr          hvConfig;
     bool                    sessionLoaded;
 
@@ -0,0 +1,140 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef VBOXMACHINEINFO_H
+#define VBOXMACHINEINFO_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+// Number of network adapters and boot devices reported by VirtualBox
+#define VBOX_MAX_NICS       8
+#define VBOX_MAX_BOOT       4
+
+/**
+ * A medium attached on a storage controller slot
+ */
+typedef struct {
+
+    std::string     controller;     // The storage controller name (ex. "SATA")
+    int             port;
+    int             device;
+    std::string     medium;         // Path to the medium
+    std::string     uuid;           // UUID of the medium (if known)
+
+} VBOX_STORAGE_SLOT;
+
+/**
+ * A folder shared with the guest
+ */
+typedef struct {
+
+    std::string     name;           // The share name, as seen by the guest
+    std::string     hostPath;       // The folder on the host
+
+} VBOX_SHARED_FOLDER;
+
+/**
+ * Typed record of the output of 'showvminfo --machinereadable'
+ */
+class MachineInfo {
+public:
+
+    /**
+     * Constructor
+     */
+    MachineInfo() { clear(); };
+
+    /**
+     * Reset all the fields
+     */
+    void                        clear           ( );
+
+    /**
+     * Parse the output lines of 'showvminfo --machinereadable' in a single pass.
+     * Returns false if the output does not describe a machine.
+     */
+    bool                        parse           ( const std::vector<std::string>& lines );
+
+    /**
+     * Parse a single 'key=value' line
+     */
+    void                        parseLine       ( const char * line, size_t length );
+
+    /**
+     * Return the medium attached on the given slot, or NULL if it's empty
+     */
+    const VBOX_STORAGE_SLOT *   slot            ( const std::string& controller, int port, int device ) const;
+
+    /**
+     * Export the record using the keys of the human-readable 'showvminfo' output,
+     * as stored in the session's machine configuration.
+     */
+    void                        toMap           ( std::map<const std::string, const std::string> * map ) const;
+
+    // True if the record has been populated
+    bool                        valid;
+
+    // Identity
+    std::string                 uuid;
+    std::string                 name;
+    std::string                 configFile;
+    std::string                 logFolder;
+
+    // State (SS_* and the raw VirtualBox state name)
+    int                         state;
+    std::string                 stateName;
+
+    // Resources
+    int                         cpus;
+    int                         memory;         // MBytes
+    int                         vram;           // MBytes
+    int                         executionCap;   // Percent
+    bool                        acpi;
+    bool                        ioapic;
+    std::string                 boot[VBOX_MAX_BOOT];
+
+    // Current video mode of the first screen (0 when the VM is not running)
+    int                         videoWidth;
+    int                         videoHeight;
+    int                         videoBpp;
+
+    // Attachment type of each NIC ("none" when disabled)
+    std::string                 nics[VBOX_MAX_NICS];
+
+    // Storage controllers and attached media
+    std::vector<std::string>    controllers;
+    std::vector<VBOX_STORAGE_SLOT> slots;
+
+    // NAT port-forwarding rules of the first NIC, indexed by rule name
+    std::map<std::string, std::string> natRules;
+
+    // Shared folders of the machine
+    std::vector<VBOX_SHARED_FOLDER> sharedFolders;
+
+    // Raw value of every plain setting (ex. "graphicscontroller"), the
+    // keys are the same as the respective 'modifyvm' options.
+    std::map<std::string, std::string> settings;
+
+};
+
+#endif /* end of include guard: VBOXMACHINEINFO_H */
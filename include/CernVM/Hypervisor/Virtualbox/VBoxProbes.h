@@ -31,6 +31,42 @@
 
 using namespace std;
 
+/**
+ * Single-pass scanner for the log lines the probes are interested in
+ *
+ * All the patterns are searched at once. Where SSE2 is available, 16 positions are
+ * tested at a time against the first and the last byte of every pattern. Otherwise
+ * the Wu-Manber algorithm is used: a table indexed by two consecutive bytes tells
+ * how far the search window can be moved, so most of the log is skipped several
+ * bytes at a time.
+ */
+class VBoxLogScanner {
+public:
+
+	/**
+	 * Build the shift table for the known patterns
+	 */
+	VBoxLogScanner();
+
+	/**
+	 * Return the first occurence of any pattern in the given buffer, or NULL
+	 */
+	const char * 	find( const char * begin, const char * end ) const;
+
+	/**
+	 * Global function to return the shared scanner
+	 */
+	static const VBoxLogScanner& Default();
+
+private:
+
+	const char * 	patterns[3];
+	size_t 			lengths[3];
+	size_t 			minLength;
+	unsigned char 	shift[65536];
+
+};
+
 /**
  * Virtualbox log crawler
  */
@@ -43,7 +79,7 @@ public:
 	VBoxLogProbe( const string& path, int tailSize = 81920 )
 		: hasState(false), state(0), hasFailures(false), failures(0),
 		  hasResolutionChange(false), resWidth(0), resHeight(0),
-		  resBpp(0)
+		  resBpp(0), blockStateChange(false)
 	{
         CRASH_REPORT_BEGIN;
 		this->logFile = path + "/VBox.log";
@@ -51,6 +87,11 @@ public:
         CRASH_REPORT_END;
 	};
 
+	/**
+	 * Virtual destructor
+	 */
+	virtual ~VBoxLogProbe() { };
+
 	/**
 	 * Check if the file exists
 	 */
@@ -61,6 +102,16 @@ public:
 	 */
 	void 			analyze();
 
+	/**
+	 * Reset the analysis results
+	 */
+	void 			reset();
+
+	/**
+	 * Analyze a single log line, updating the analysis results
+	 */
+	void 			analyzeLine( const string& line );
+
 	/**
 	 * Flag and information regarding state change
 	 */
@@ -87,6 +138,108 @@ public:
 	string 			logFile;
 	int				tailSize;
 
+protected:
+
+	/**
+	 * Analyze only the lines of the given buffer that contain
+	 * something interesting, using the VBoxLogScanner.
+	 */
+	void 			analyzeBuffer( const char * begin, const char * end );
+
+	/**
+	 * Set when the VM was saved, ignoring the state changes that follow
+	 */
+	bool 			blockStateChange;
+
+};
+
+/**
+ * Incremental Virtualbox log follower
+ *
+ * Unlike VBoxLogProbe, the follower remembers the byte offset it has reached and
+ * every poll() parses only the complete lines appended since then. Truncation
+ * restarts from the beginning of the file, while rotation (when Virtualbox renames
+ * VBox.log to VBox.log.1 on VM start) first finishes the old file and then continues
+ * with the new one. On linux, the log folder is watched with inotify so that
+ * hasChanges() does not need to touch the file at all. All the followers share
+ * a single inotify descriptor, with one watch per folder, and whichever follower
+ * calls hasChanges() first drains the events on behalf of the others.
+ */
+class VBoxLogFollower : public VBoxLogProbe {
+public:
+
+	/**
+	 * Create a log follower on the given log folder
+	 */
+	VBoxLogFollower( const string& path, int tailSize = 81920 );
+
+	/**
+	 * Release the inotify watch
+	 */
+	virtual ~VBoxLogFollower();
+
+	/**
+	 * Check if the log might have changed since the last poll()
+	 */
+	bool 			hasChanges();
+
+	/**
+	 * Parse the lines appended since the last poll(), returning true
+	 * if new lines were analyzed. The analysis results describe only
+	 * the new lines.
+	 */
+	bool 			poll();
+
+	/**
+	 * Restore a position previously obtained through getOffset() and getFileId()
+	 */
+	void 			setPosition( long offset, long fileId );
+
+	/**
+	 * The offset right after the last complete line that was analyzed
+	 */
+	long 			getOffset();
+
+	/**
+	 * The identity (inode) of the file the offset refers to
+	 */
+	long 			getFileId();
+
+	/**
+	 * Descriptor that becomes readable when the log folder changes,
+	 * or -1 if not available on this platform. The descriptor is shared
+	 * by all the followers and it's drained by hasChanges().
+	 */
+	int 			getWakeFd();
+
+private:
+
+	/**
+	 * Analyze the given file starting from the given offset, returning
+	 * the new offset. If 'flush' is true, a trailing incomplete line is
+	 * analyzed as well.
+	 */
+	long 			readFrom( const string& file, long from, bool flush );
+
+	/**
+	 * Get the size and the identity of the given file, returning false if it's missing
+	 */
+	bool 			fileStat( const string& file, long * size, long * fileId );
+
+	string 			logFolder;
+	string 			rotatedFile;
+
+	// Position in the log
+	long 			offset;
+	long 			fileId;
+	bool 			positioned;
+	string 			partialLine;
+
+	// Change detection
+	int 			watchFd;
+	unsigned long 	seenChanges;
+	long 			lastSize;
+
 };
 
 
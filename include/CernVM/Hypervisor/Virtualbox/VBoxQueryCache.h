@@ -0,0 +1,133 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef VBOXQUERYCACHE_H
+#define VBOXQUERYCACHE_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+
+#include <CernVM/Utilities.h>
+
+// How long (in milliseconds) a cached query result remains valid
+#define VBOX_QUERY_CACHE_TTL    2000
+
+// The classes of cacheable VBoxManage queries
+#define VBQ_NONE                0x00    // Not cacheable
+#define VBQ_VMS                 0x01    // list vms
+#define VBQ_HDDS                0x02    // list hdds
+#define VBQ_HOSTONLYIFS         0x04    // list hostonlyifs
+#define VBQ_DHCPSERVERS         0x08    // list dhcpservers
+#define VBQ_SYSTEMPROPERTIES    0x10    // list systemproperties
+#define VBQ_HDINFO              0x20    // showhdinfo / showmediuminfo
+#define VBQ_ALL                 0x3F
+#define VBQ_CLASSES             6
+
+/**
+ * Read-through cache for the results of idempotent VBoxManage queries.
+ *
+ * Results are keyed by their full argument vector, but they are grouped in classes,
+ * which are invalidated as a whole when a mutating command that affects them is executed.
+ *
+ * Every invalidation also bumps the generation of the class. A query captures the
+ * generation when it misses, and it's result is stored only if the generation is still
+ * the same, so a result that raced with a mutating command is never cached.
+ */
+class VBoxQueryCache {
+public:
+
+    /**
+     * Constructor
+     */
+    VBoxQueryCache( long ttl = VBOX_QUERY_CACHE_TTL ) : ttl(ttl), entries(), mutex() {
+        for (int i=0; i<VBQ_CLASSES; ++i) { hitCount[i]=0; missCount[i]=0; generation[i]=0; }
+    };
+
+    /**
+     * Return the class (VBQ_*) of the given command, or VBQ_NONE if it's not cacheable
+     */
+    static int              classOf             ( const std::vector<std::string>& args );
+
+    /**
+     * Return the classes (VBQ_* mask) affected by the given command
+     */
+    static int              affectedBy          ( const std::vector<std::string>& args );
+
+    /**
+     * Look-up the output of the given command, returning true on hit.
+     * On a miss, the current generation of the command's class is placed in *gen,
+     * to be passed to store() once the command completes.
+     */
+    bool                    lookup              ( const std::vector<std::string>& args, std::vector<std::string> * stdoutList,
+                                                  unsigned long * gen = NULL );
+
+    /**
+     * Store the output of a successful query, unless it's class was invalidated
+     * since the given generation was captured by lookup()
+     */
+    void                    store               ( const std::vector<std::string>& args, const std::vector<std::string>& stdoutList,
+                                                  unsigned long gen );
+
+    /**
+     * Drop all the entries of the given classes (VBQ_* mask)
+     */
+    void                    invalidate          ( int classes = VBQ_ALL );
+
+    /**
+     * Drop the classes affected by the given (just executed) command
+     */
+    void                    invalidateBy        ( const std::vector<std::string>& args );
+
+    /**
+     * Change the lifetime of the cached results (0 disables caching)
+     */
+    void                    setTTL              ( long ttl );
+
+    /**
+     * Hit and miss counters of the given classes (VBQ_* mask)
+     */
+    unsigned long           hits                ( int classes = VBQ_ALL );
+    unsigned long           misses              ( int classes = VBQ_ALL );
+
+private:
+
+    /**
+     * A cached query result
+     */
+    struct Entry {
+        int                         cls;
+        long                        expires;
+        std::vector<std::string>    lines;
+    };
+
+    long                            ttl;
+    std::map< std::string, Entry >  entries;
+    unsigned long                   hitCount[VBQ_CLASSES];
+    unsigned long                   missCount[VBQ_CLASSES];
+    unsigned long                   generation[VBQ_CLASSES];
+    boost::mutex                    mutex;
+
+};
+
+#endif /* end of include guard: VBOXQUERYCACHE_H */
@@ -26,6 +26,7 @@
 
 #include <string>
 #include <map>
+#include <set>
 
 #include <CernVM/SimpleFSM.h>
 #include <CernVM/Hypervisor.h>
@@ -45,6 +46,14 @@ enum VBoxDiskType {
     T_FLOPPY    // A Floppy disk drive
 };
 
+/**
+ * Concurrent branches of the FSM
+ */
+#define VBOX_BRANCH_MEDIA   1       // Media download, overlapping the VM configuration
+
+/* Forward-declaration of the log follower (VBoxProbes.h) */
+class VBoxLogFollower;
+
 /**
  * Virtualbox Session, built around a Finite-State-Machine model
  */
@@ -96,10 +105,12 @@ public:
                 FSM_HANDLER(209, &VBoxSession::ReleaseVMAPI,        4);         // Release the VM API media
 
             // 108: START SEQUENCE
-            FSM_HANDLER(108, &VBoxSession::PrepareVMBoot,           210);       // Prepare start parameters
+            FSM_HANDLER(108, &VBoxSession::PrepareVMBoot,           202);       // Prepare start parameters
+                FSM_FORK(202, VBOX_BRANCH_MEDIA,
+                              &VBoxSession::DownloadMedia,          210);       // Download required media files, while...
                 FSM_HANDLER(210, &VBoxSession::ConfigNetwork,       201);       // Configure the network devices
-                FSM_HANDLER(201, &VBoxSession::ConfigureVM,         202);       // Configure VM
-                FSM_HANDLER(202, &VBoxSession::DownloadMedia,       203);       // Download required media files
+                FSM_HANDLER(201, &VBoxSession::ConfigureVM,         212);       // Configure VM
+                FSM_HANDLER(212, &VBoxSession::JoinMedia,           203);       // Wait for the media download
                 FSM_HANDLER(203, &VBoxSession::ConfigureVMBoot,     204);       // Configure Boot media
                 FSM_HANDLER(204, &VBoxSession::ConfigureVMScratch,  205);       // Configure Scratch storage
                 FSM_HANDLER(205, &VBoxSession::ConfigureVMAPI,      206);       // Configure API Disks
@@ -126,6 +137,14 @@ public:
         errorMessage = "";
         lastMachineInfoTimestamp = 0;
         isAborting = false;
+        logPending = false;
+        stateChangedAt = 0;
+        bootStartedAt = 0;
+        bootFastPath = false;
+        apiHandshake = HSK_HTTP;
+
+        // The start profile completes when the API port responds
+        this->on( "apiAlive", boost::bind( &VBoxSession::finishBootProfile, this ) );
 
         CRASH_REPORT_END;
     }
@@ -142,6 +161,7 @@ public:
     void CreateVM();
     void ConfigureVM();
     void DownloadMedia();
+    void JoinMedia();
     void ConfigureVMBoot();
     void ReleaseVMBoot();
     void ConfigureVMScratch();
@@ -183,6 +203,7 @@ public:
     virtual void            abort               ();
     virtual int             update              ( bool waitTillInactive = true );
     virtual void            wait                ( );
+    virtual bool            isAPIAlive          ( unsigned char handshake = HSK_HTTP, int timeoutSec = 1 );
 
     /////////////////////////////////////
     // External updates feedback
@@ -201,6 +222,19 @@ public:
      */
     void                    hvStop              ();
 
+    /**
+     * Analyze the new log lines and compare the VM state with the given set of
+     * running VM UUIDs (if not NULL), obtained at the time 'listedAt'.
+     * Any state change is dispatched through FSMSkew. This is called by the
+     * instance state monitor, or by update() when the monitor is not running.
+     */
+    int                     refreshState        ( const std::set<std::string> * runningVMs = NULL, unsigned long long listedAt = 0 );
+
+    /**
+     * Descriptor that becomes readable when the VM log changes, or -1
+     */
+    int                     getLogWakeFd        ();
+
     /**
      *  Compile the user data and return it's string representation
      *  If macroReplace is true, the libcernvm macro procedure is performed
@@ -213,6 +247,11 @@ public:
      */
     void                    FSMEnteringState    ( const int state, const bool final );
 
+    /**
+     * Override to tag the handler spans of the trace file with our UUID
+     */
+    std::string             FSMTraceOwner       ( );
+
     /**
      * Destroy and unregister VM
      */
@@ -231,6 +270,10 @@ protected:
                                                   std::vector<std::string> * stdoutList, 
                                                   std::string * stderrMsg, 
                                                   const SysExecConfig& config );
+    int                     wrapExec            ( const VBoxCommand& cmd, 
+                                                  std::vector<std::string> * stdoutList, 
+                                                  std::string * stderrMsg, 
+                                                  const SysExecConfig& config );
 
     /**
      * (Re-)Mount a disk on the specified controller
@@ -244,15 +287,41 @@ protected:
      */
     int                     unmountDisk         ( const std::string & controller, const std::string & port, const std::string & device, const VBoxDiskType& type, const bool deleteFile = false );
 
+    /**
+     * Bring the VM to the given configuration, issuing only the VBoxManage
+     * commands needed to change what differs from the machine information.
+     */
+    int                     applyConfig         ( const VBoxMachineSpec& spec );
+
     /**
      * Forward the fact that an error has occured somewhere in the FSM handling
      */
     void                    errorOccured        ( const std::string & str, int errNo );
 
     /**
-     * Shorthand function for calling controlVM actions with predefined vboxid
+     * Shorthand function for calling controlVM actions with predefined vboxid.
+     * The string version splits the given command-line into arguments.
      */
     int                     controlVM           ( std::string how, int timeout = SYSEXEC_TIMEOUT );
+    int                     controlVM           ( const VBoxCommand& how, int timeout = SYSEXEC_TIMEOUT );
+
+    /**
+     * Hash everything the start sequence provisions the VM from, except the user
+     * data. It's compared with the one of the last boot to skip the unchanged steps.
+     */
+    std::string             getProvisionFingerprint ( );
+
+    /**
+     * Return the start sequence step to skew to when the provisioning has not
+     * changed since the last boot, or 0 if it has to run from the beginning.
+     */
+    int                     getFastBootStep     ( );
+
+    /**
+     * Complete the profile of the start sequence, storing it's breakdown in the
+     * 'bootProfile' local key and adding it to the BootProfiler samples
+     */
+    void                    finishBootProfile   ( );
 
     int                     getMachineUUID      ( std::string mname, std::string * ans_uuid,  int flags );
     std::string             getDataFolder       ();
@@ -281,13 +350,33 @@ protected:
     std::map<const std::string, const std::string>        
                             lastMachineInfo;
     long                    lastMachineInfoTimestamp;
+    MachineInfo             machineRecord;
+
+    // Incremental reader of the virtualbox log
+    boost::shared_ptr<VBoxLogFollower>
+                            logFollower;
+    bool                    logPending;
 
-    // Detection of virtualbox log modification time
-    unsigned long long      lastLogTime;
+    // Serializes refreshState(), which might be re-entered from the event callbacks
+    boost::recursive_mutex  refreshMutex;
+
+    // When the FSM entered the last checkpoint state
+    unsigned long long      stateChangedAt;
+
+    // When the current start sequence began, and if it skipped the provisioning
+    unsigned long long      bootStartedAt;
+    bool                    bootFastPath;
+
+    // The handshake of the last isAPIAlive() call, used by the background probes
+    unsigned char           apiHandshake;
 
     // For having only a single system command running
     boost::mutex            execMutex;
 
+    // The command currently started by wrapExec, cancelled on abort()
+    ExecHandlePtr           activeExec;
+    boost::mutex            activeExecMutex;
+
     /*  Default sysExecConfig */
     SysExecConfig           execConfig;
 
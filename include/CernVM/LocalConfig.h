@@ -201,6 +201,12 @@ private:
      */
     std::list<std::string>      keysDeleted;
 
+    /**
+     * The parameters as they were last loaded from or saved to the disk,
+     * used for telling our changes apart from the changes of others.
+     */
+    std::map<const std::string, const std::string>  parametersSynced;
+
 protected:
     
     /**
@@ -0,0 +1,209 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+#include <CernVM/TraceEvent.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+// How many value slots every thread can allocate, in chunks
+#define METRICS_CHUNK_SLOTS     512
+#define METRICS_MAX_CHUNKS      64
+
+// Histogram bucket bounds in seconds (1-2-5 steps in every decade from 1ms to 5000s)
+#define METRICS_BUCKETS         21
+
+/**
+ * The type of a metric family
+ */
+#define METRIC_COUNTER          0
+#define METRIC_HISTOGRAM        1
+
+/**
+ * A single registered time-series
+ */
+typedef struct {
+
+    std::string         name;           // ex. "cvmwa_exec_commands_total"
+    std::string         labels;         // ex. "verb=\"modifyvm\""
+    int                 type;           // METRIC_COUNTER or METRIC_HISTOGRAM
+    int                 slot;           // The first value slot
+
+} METRIC_SERIES;
+
+/**
+ * A process-wide registry of counters and latency histograms.
+ *
+ * Every thread updates it's own copy of the values, without locks or
+ * shared cache lines, and the copies are summed only when exporting.
+ * Registering a series takes a lock, so the callers on hot paths should
+ * keep the returned ID (ex. in a static variable).
+ */
+class Metrics {
+public:
+
+    /**
+     * Global function to return the process-wide registry
+     */
+    static Metrics&             Default         ( );
+
+    /**
+     * Return the ID of the counter with the given name and labels, registering it
+     * if needed. The labels are in the Prometheus format (see label()). Returns -1
+     * if the name is already used by a histogram or we are out of slots.
+     */
+    int                         counter         ( const std::string& name, const std::string& help, const std::string& labels = "" );
+
+    /**
+     * Return the ID of the latency histogram with the given name and labels,
+     * registering it if needed. Returns -1 on errors, like counter().
+     */
+    int                         histogram       ( const std::string& name, const std::string& help, const std::string& labels = "" );
+
+    /**
+     * Increment the given counter
+     */
+    void                        add             ( int series, unsigned long long value = 1 );
+
+    /**
+     * Add a duration (in seconds) to the given histogram
+     */
+    void                        observe         ( int series, double seconds );
+
+    /**
+     * Return the current value of the given counter (or the count of the given histogram)
+     */
+    unsigned long long          value           ( int series );
+
+    /**
+     * Return all the metrics in the Prometheus text exposition format
+     */
+    std::string                 toPrometheus    ( );
+
+    /**
+     * Start answering with toPrometheus() on the given local (Unix) socket,
+     * returning false if it could not be created. Both plain connections and
+     * HTTP GET requests are answered. Not available on Windows.
+     */
+    bool                        serve           ( const std::string& socketPath );
+
+    /**
+     * Stop answering on the local socket
+     */
+    void                        stop            ( );
+
+    /**
+     * Format a label for use in the labels of a series (ex. verb="modifyvm")
+     */
+    static std::string          label           ( const std::string& key, const std::string& value );
+
+private:
+
+    /**
+     * The values of a single thread
+     */
+    class Shard {
+    public:
+        Shard( Metrics * owner );
+        ~Shard();
+        boost::atomic<unsigned long long> *
+                                slot            ( int index );
+        unsigned long long      read            ( int index ) const;
+        Metrics *               owner;
+        boost::atomic< boost::atomic<unsigned long long> * >
+                                chunks[ METRICS_MAX_CHUNKS ];
+    };
+
+    /**
+     * Constructor, only through Default()
+     */
+    Metrics( );
+
+    /**
+     * Register a series of the given type
+     */
+    int                         registerSeries  ( const std::string& name, const std::string& help, const std::string& labels, int type );
+
+    /**
+     * Return the values of the calling thread
+     */
+    Shard *                     localShard      ( );
+
+    /**
+     * Fold the values of an exiting thread into the totals
+     */
+    static void                 retireShard     ( Shard * shard );
+
+    /**
+     * Return the sum of the given slot over all the threads (with the mutex locked)
+     */
+    unsigned long long          total           ( int index );
+
+    /**
+     * The local socket loop
+     */
+    void                        serveLoop       ( int fd );
+
+    // Registered series and their help texts
+    std::vector< METRIC_SERIES >    series;
+    std::map< std::string, int >    seriesIndex;
+    std::map< std::string, std::string > help;
+    int                             nextSlot;
+
+    // Per-thread values and the values of the exited threads
+    boost::thread_specific_ptr< Shard > shard;
+    std::vector< Shard * >          shards;
+    std::vector< unsigned long long > retired;
+    boost::mutex                    mutex;
+
+    // Local socket
+    boost::thread *                 server;
+    std::string                     serverPath;
+    boost::atomic<bool>             serverStop;
+
+};
+
+/**
+ * Add the time spent in this scope to the given histogram
+ */
+class MetricTimer {
+public:
+    MetricTimer( int series ) : series(series), start(traceNowUs()) { };
+    ~MetricTimer() {
+        if (series >= 0) Metrics::Default().observe( series, (traceNowUs() - start) / 1000000.0 );
+    };
+private:
+    int                         series;
+    unsigned long long          start;
+};
+
+#endif /* end of include guard: METRICS_H */
@@ -0,0 +1,108 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef PORTALLOCATOR_H
+#define PORTALLOCATOR_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/LocalConfig.h>
+#include <CernVM/CrashReport.h>
+
+#include <string>
+#include <map>
+
+/* How many kernel-chosen ports to try before giving up */
+#define PORT_ALLOCATOR_TRIES    16
+
+/* The named mutex that serializes all the allocators of the process */
+#define PORT_ALLOCATOR_MUTEX    "port-allocator"
+
+/* The file locked by the allocators of all the processes, next to the table */
+#define PORT_ALLOCATOR_LOCK     "ports.lock"
+
+/**
+ * Allocator of local TCP ports, shared by all the sessions of all the processes
+ *
+ * New ports are picked by the kernel by binding to port 0, so no probing is needed.
+ * Every allocated port is recorded in the 'ports' runtime config together with it's
+ * owner, so two sessions never get the same port even if neither of them has started
+ * listening on it yet. A reservation is validated again only when it's owner asks
+ * for it, by checking that the port can still be bound.
+ *
+ * Every operation re-loads the table, updates it and saves it while holding a
+ * named mutex (for the threads of this process) and a lock on PORT_ALLOCATOR_LOCK
+ * (for the other processes), so allocators sharing the table never interleave.
+ */
+class PortAllocator {
+public:
+
+    /**
+     * Constructor
+     */
+    PortAllocator( ) : table() { };
+
+    /**
+     * Return the port reserved for the given owner and purpose (ex. session UUID, "rdp"),
+     * allocating a new one if there is no reservation or if the reserved port has been
+     * taken by somebody else. Returns 0 if no port could be allocated.
+     */
+    int                         reserve         ( const std::string& owner, const std::string& name, const std::string& host = "127.0.0.1" );
+
+    /**
+     * Return the port reserved for the given owner and purpose, or 0 if there is none.
+     * The reservation is not validated.
+     */
+    int                         reserved        ( const std::string& owner, const std::string& name );
+
+    /**
+     * Record that the given port is used by the given owner and purpose. Returns
+     * false, leaving the table untouched, if the port is reserved by somebody else.
+     */
+    bool                        claim           ( const std::string& owner, const std::string& name, int port );
+
+    /**
+     * Release all the ports reserved by the given owner
+     */
+    void                        release         ( const std::string& owner );
+
+private:
+
+    /**
+     * Return the path of the lock file, creating the table object if needed
+     */
+    std::string                 lockPath        ( );
+
+    /**
+     * Re-load the reservation table from the disk (called with the lock file held)
+     */
+    void                        syncTable       ( );
+
+    /**
+     * Find the reservation of the given owner and purpose, returning it's port or 0
+     */
+    int                         findPort        ( const std::string& key );
+
+    // The persisted reservations, port -> "<owner>/<name>"
+    LocalConfigPtr              table;
+
+};
+
+#endif /* end of include guard: PORTALLOCATOR_H */
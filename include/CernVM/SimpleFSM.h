@@ -24,21 +24,29 @@
 
 #include "CernVM/Utilities.h"
 #include "CernVM/ProgressFeedback.h"
+#include "CernVM/FSMExecutor.h"
+#include "CernVM/BootProfiler.h"
 
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
 
 #include <boost/thread.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 
-typedef boost::function< void () >	fsmHandler;
-
 // Forward declerations
+class   SimpleFSM;
 struct  _FSMNode;
 typedef _FSMNode FSMNode;
 
+/**
+ * The FSM handlers are member functions of the SimpleFSM subclass, so that
+ * the same graph can be shared by all the instances of the class.
+ */
+typedef void (SimpleFSM::*fsmHandler)();
+
 /**
  * Structure of the FSM node
  * This is in principle a directional graph
@@ -49,23 +57,100 @@ struct  _FSMNode{
 	int								id;
 	unsigned char 					type;
 	fsmHandler						handler;
-	std::vector<FSMNode*>			children;
+	std::string 					name;		// The handler name, used for profiling
+	std::vector<int>				children;	// Indices in FSMGraph::nodes
+
+	// The branch started by a fork node
+	int 							branch;
+
+	// The index of this node in FSMGraph::nodes
+	int 							index;
+
+	// The duration histogram of the handler (see Metrics)
+	int 							metric;
 
 };
 
+/**
+ * The immutable FSM graph, built once and shared by all the instances
+ * of a SimpleFSM subclass.
+ */
+struct  FSMGraph {
+
+	// The nodes and their lookup table by ID
+	std::vector<FSMNode>			nodes;
+	std::map<int,int>				index;
+
+	// The next hop on the shortest path from every node to every other
+	// node, indexed by [from * nodes.size() + to]. It's -1 if there is no path.
+	std::vector<int>				routes;
+
+	/**
+	 * Return the node with the given ID or NULL if missing
+	 */
+	const FSMNode *					find 				( int id ) const {
+		std::map<int,int>::const_iterator it = index.find( id );
+		if (it == index.end()) return NULL;
+		return &nodes[ (*it).second ];
+	};
+
+	/**
+	 * Return the next node on the way from the given node to the
+	 * given node, or NULL if there is no path.
+	 */
+	const FSMNode *					nextHop 			( const FSMNode * from, const FSMNode * to ) const {
+		int i = routes[ from->index * nodes.size() + to->index ];
+		if (i < 0) return NULL;
+		return &nodes[ i ];
+	};
+
+};
+typedef boost::shared_ptr< const FSMGraph >		FSMGraphPtr;
+
 /**
  * Helper macro for FSM registry
+ *
+ * The block is evaluated only by the first instance of the class. The graph
+ * it builds is kept in a static variable and re-used by the following instances.
  */
 #define FSM_REGISTRY(root,block) \
- 	FSMRegistryBegin();\
- 	block; \
- 	FSMRegistryEnd(root);
+ 	{ static FSMGraphPtr __fsmGraph; \
+ 	  if (FSMRegistryBegin(&__fsmGraph)) { block; } \
+ 	  FSMRegistryEnd(root); }
 
 #define FSM_HANDLER(id,cb,...) \
- 	FSMRegistryAdd(id, boost::bind(cb, this), __VA_ARGS__, 0);
+ 	{ static const int __fsmLinks[] = { __VA_ARGS__, 0 }; \
+ 	  FSMRegistryAdd(id, static_cast<fsmHandler>(cb), __fsmLinks, #cb); }
 
 #define FSM_STATE(id,...) \
- 	FSMRegistryAdd(id, 0, __VA_ARGS__, 0);
+ 	{ static const int __fsmLinks[] = { __VA_ARGS__, 0 }; \
+ 	  FSMRegistryAdd(id, 0, __fsmLinks); }
+
+/**
+ * A fork node starts it's handler as a concurrent branch and continues
+ * to the next node immediately. The branch is joined with FSMJoin(branch).
+ */
+#define FSM_FORK(id,branch,cb,...) \
+ 	FSM_HANDLER(id,cb,__VA_ARGS__); \
+ 	FSMRegistryFork(id, branch);
+
+// Node types
+#define FSM_NODE_DEFAULT	0
+#define FSM_NODE_FORK		1
+
+/**
+ * State of a concurrent branch started by a fork node
+ */
+typedef struct {
+
+	boost::thread *					thread;
+	bool 							done;
+	bool 							failed;
+	bool 							stopped;	// Released by FSMThreadStop
+	std::string 					message;	// Failure details
+	int 							code;
+
+} FSMBranch;
 
 /**
  * Auto-routed Finite-State-Machine class
@@ -76,12 +161,15 @@ public:
 	/**
 	 * Constructor
 	 */
-	SimpleFSM() : fsmtPaused(true), fsmThread(NULL), fsmtPauseMutex(), fsmtPauseChanged(),
-			  	  fsmwState(NULL), fsmwStateWaiting(false), fsmwStateMutex(), fsmwStateChanged(),
-				  fsmInsideHandler(false), fsmProgress(), fsmGotoMutex(), fsmTargetState(0), 
-				  fsmwWaitCond(), fsmwWaitMutex(), fsmRootNode(NULL), fsmCurrentNode(),
-				  fsmTmpRouteLinks(), fsmNodes(), fsmCurrentPath(), fsmThreadActive(false),
-				  fsmtInterruptRequested(false)
+	SimpleFSM() : fsmProgress(), fsmTrace(), fsmTmpRouteLinks(), fsmGraph(), fsmRegistry(), fsmRegistrySlot(NULL),
+				  fsmRootNode(NULL), fsmCurrentNode(), fsmCurrentPath(), fsmTargetState(0),
+				  fsmInsideHandler(false), fsmThreadActive(false), fsmThread(NULL),
+				  fsmtPaused(true), fsmtInterruptRequested(false), fsmtPauseMutex(), fsmtPauseChanged(),
+				  fsmwState(NULL), fsmwStateWaiting(false), fsmwStateMutex(), fsmwStateChanged(),
+				  fsmwWaitMutex(), fsmwWaitCond(), fsmGotoMutex(),
+				  fsmBranches(), fsmBranchMutex(), fsmBranchCond(), fsmStoppingBranches(),
+				  fsmProgressMutex(), fsmExecutor(), fsmExecAttached(false), fsmExecScheduled(false),
+				  fsmExecWake(false), fsmExecThread(NULL), fsmExecMutex(), fsmExecIdle()
 				  { };
 
 	/**
@@ -111,15 +199,22 @@ public:
 	bool 							FSMContinue			( bool inThread = false );
 
 	/**
-	 * Start the FSM management thread
+	 * Start the FSM management thread. If an executor is used, the FSM is
+	 * attached to it instead and NULL is returned.
 	 */
 	boost::thread *					FSMThreadStart		();
 
 	/**
-	 * Stop the FSM thread
+	 * Stop the FSM thread (or detach from the executor), interrupting the active handler
 	 */
 	void 							FSMThreadStop		();
 
+	/**
+	 * Drive this FSM from the given shared executor instead of a dedicated thread.
+	 * It must be called before FSMThreadStart.
+	 */
+	void 							FSMUseExecutor		( const FSMExecutorPtr & executor );
+
 	/**
 	 * Enable progress feedback on this SimpleFSM instance
 	 */
@@ -140,11 +235,22 @@ public:
 	 */
 	bool 							FSMActive			( );
 
+	/**
+	 * Check if the calling thread is running a concurrent branch
+	 */
+	bool 							FSMInBranch			( );
+
 	/**
 	 * Public progress feedback instance used by actions
 	 */
 	FiniteTaskPtr					fsmProgress;
 
+	/**
+	 * The timeline of the handlers, the branches and the waits done by the
+	 * handlers. It records only after the owner calls fsmTrace.begin().
+	 */
+	ProfileTrace 					fsmTrace;
+
 protected:
 
 	/**
@@ -168,6 +274,32 @@ protected:
 	 */
 	void 							FSMFail				( const std::string & message, const int errorCode = -1 );
 
+	/**
+	 * Wait for the given concurrent branch to complete. Returns false and the
+	 * details passed to FSMBranchFail if it failed. A branch that has not
+	 * been started (ex. the fork node was skipped) is considered successful.
+	 * A branch that was interrupted or stopped fails with an empty message
+	 * and it's code, which is -1 unless FSMBranchFail was called before.
+	 * This is a boost::thread interruption point.
+	 *
+	 * When the FSM runs on an executor, the join of a running branch does not
+	 * block the worker: it unwinds the handler and the node is run again when
+	 * the branch completes. The code of the handler before the join must
+	 * therefore be safe to repeat.
+	 */
+	bool 							FSMJoin				( int branch, std::string * message = NULL, int * code = NULL );
+
+	/**
+	 * Mark the concurrent branch of the calling thread as failed. The branch
+	 * handler should return after it, since it must not steer the FSM.
+	 */
+	void 							FSMBranchFail		( const std::string & message, const int errorCode = -1 );
+
+	/**
+	 * Overridable function to name the owner of the handler spans in the trace file
+	 */
+	virtual std::string 			FSMTraceOwner		( ) { return ""; };
+
 	/**
 	 * Overridable function to get notified when we are entering a state
 	 */
@@ -181,9 +313,10 @@ protected:
 	 	boost::shared_ptr<T> 		FSMBegin 			( const std::string & message );
 
 	// Registry functions encapsulated by the FSM_ macros
-	void 					        FSMRegistryBegin	();
-	void 					        FSMRegistryAdd		( int id, fsmHandler handler, ... );
+	bool 					        FSMRegistryBegin	( FSMGraphPtr * slot );
+	void 					        FSMRegistryAdd		( int id, fsmHandler handler, const int * links, const char * name = NULL );
 	void 					        FSMRegistryEnd		( int rootID );
+	void 					        FSMRegistryFork		( int id, int branch );
 
 	/**
 	 * The entry point for the thread loop
@@ -192,10 +325,12 @@ protected:
 
 	// Private variables
     std::map<int,std::vector<int> > fsmTmpRouteLinks;
-	std::map<int,FSMNode>	        fsmNodes;
-	FSMNode	*						fsmRootNode;
-	FSMNode *						fsmCurrentNode;
-	std::list<FSMNode*>				fsmCurrentPath;
+	FSMGraphPtr						fsmGraph;
+	boost::shared_ptr<FSMGraph>		fsmRegistry;		// The graph being built
+	FSMGraphPtr *					fsmRegistrySlot;	// Where to publish it
+	const FSMNode *					fsmRootNode;
+	const FSMNode *					fsmCurrentNode;
+	std::list<const FSMNode*>		fsmCurrentPath;
 	int								fsmTargetState;
 	bool 							fsmInsideHandler;
 	bool 							fsmThreadActive;
@@ -210,7 +345,7 @@ private:
 	boost::condition_variable 		fsmtPauseChanged;
 
 	// Wait synchronization
-	FSMNode *						fsmwState;
+	const FSMNode *					fsmwState;
 	bool 							fsmwStateWaiting;
 	boost::mutex 					fsmwStateMutex;
 	boost::condition_variable 		fsmwStateChanged;
@@ -234,7 +369,39 @@ private:
 	void 							_fsmWakeup();
 
 	// Reusable function to run the node handler
-	bool 							_callHandler( FSMNode * node, bool inThread );
+	bool 							_callHandler( const FSMNode * node, bool inThread );
+
+	// Concurrent branches, indexed by branch ID
+	std::map<int, boost::shared_ptr<FSMBranch> >
+									fsmBranches;
+	boost::mutex 					fsmBranchMutex;
+	boost::condition_variable 		fsmBranchCond;
+
+	// Threads of the branches being stopped (no longer in fsmBranches)
+	std::set<boost::thread::id> 	fsmStoppingBranches;
+
+	// Serializes the progress updates of the branches
+	boost::mutex 					fsmProgressMutex;
+
+	// Branch management
+	void 							_forkBranch( const FSMNode * node );
+	void 							_branchMain( const FSMNode * node, boost::shared_ptr<FSMBranch> branch );
+	void 							_stopBranches( );
+
+	// Executor mode: at most one step of this FSM is queued or running
+	FSMExecutorPtr 					fsmExecutor;
+	bool 							fsmExecAttached;
+	bool 							fsmExecScheduled;	// A step is queued or running
+	bool 							fsmExecWake;		// Woken-up while the step was running
+	boost::thread *					fsmExecThread;		// The worker running the step
+	boost::mutex 					fsmExecMutex;
+	boost::condition_variable 		fsmExecIdle;
+
+	// Run one step on the executor and queue the next one if needed
+	void 							_executorStep( );
+
+	// Check if the caller is the worker running the step
+	bool 							_inExecutorStep( );
 
 };
 
@@ -0,0 +1,116 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef TRACEEVENT_H
+#define TRACEEVENT_H
+
+#include <string>
+#include <sstream>
+
+/**
+ * The environment variable with the path of the trace file. A "%p" in
+ * the path is replaced with the process ID.
+ */
+#define TRACE_FILE_ENV  "CVMWA_TRACE_FILE"
+
+/**
+ * Check if the trace output is enabled
+ */
+bool                    traceEnabled        ( );
+
+/**
+ * Return a monotonic timestamp in microseconds
+ */
+unsigned long long      traceNowUs          ( );
+
+/**
+ * Append a complete event to the trace file. The args must be a
+ * comma-separated list of JSON members (or empty).
+ *
+ * The events are buffered per thread and written in blocks, when a thread
+ * exits, at shutdown or by traceFlush.
+ */
+void                    traceWriteEvent     ( const char * category, const std::string& name,
+                                              unsigned long long startUs, unsigned long long durationUs,
+                                              const std::string& args );
+
+/**
+ * Write the events buffered by all the threads to the trace file
+ */
+void                    traceFlush          ( );
+
+/**
+ * Escape the given string for use in a JSON string
+ */
+std::string             traceEscape         ( const std::string& text );
+
+/**
+ * A scoped span that is written to the trace file as a Chrome trace-event
+ * "complete" event when it goes out of scope. Use it through the TRACE_SPAN
+ * and TRACE_SPAN_ARG macros, which are removed if TRACING is not defined.
+ */
+class TraceSpan {
+public:
+
+    /**
+     * Constructor
+     */
+    TraceSpan( const char * category ) : category(category), name(), args(), start(0), enabled(traceEnabled()) { };
+
+    /**
+     * Write the event
+     */
+    ~TraceSpan() {
+        if (enabled) traceWriteEvent( category, name, start, traceNowUs() - start, args );
+    };
+
+    /**
+     * Check if the span is recorded
+     */
+    bool                active              ( ) const { return enabled; };
+
+    /**
+     * Start the span with the given name
+     */
+    void                begin               ( const std::string& name ) {
+        this->name = name;
+        start = traceNowUs();
+    };
+
+    /**
+     * Attach an argument to the span
+     */
+    template <typename T> void arg( const char * key, const T& value ) {
+        std::ostringstream oss; oss << value;
+        if (!args.empty()) args += ",";
+        args += "\"" + traceEscape(key) + "\":\"" + traceEscape(oss.str()) + "\"";
+    };
+
+private:
+    const char *        category;
+    std::string         name;
+    std::string         args;
+    unsigned long long  start;
+    bool                enabled;
+
+};
+
+#endif /* end of include guard: TRACEEVENT_H */
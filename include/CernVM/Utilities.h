@@ -92,6 +92,18 @@
 
 // only for linux
 #ifdef __linux__
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+// System calls that might not be exposed by older libc headers
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open     434
+#endif
+#ifndef __NR_close_range
+#define __NR_close_range    436
+#endif
 #endif
 
 // Only for apple
@@ -112,6 +124,11 @@
 #define SYSEXEC_SLEEP_DELAY 100
 #define SYSEXEC_RETRY_DELAY 1000
 
+// Scheduling priorities of the system commands (See ExecScheduler)
+#define SYSEXEC_PRIORITY_INTERACTIVE    0   // Directly requested by the user
+#define SYSEXEC_PRIORITY_LIFECYCLE      1   // Part of a session state transition
+#define SYSEXEC_PRIORITY_POLLING        2   // Background status polling
+
 // GZip decompression block size (64k)
 #define GZ_BLOCK_SIZE 0x10000
 
@@ -149,6 +166,7 @@ typedef boost::function< void (const std::string&) >
 typedef boost::function< void (const std::string&, const int, const std::string&) >  callbackError;
 typedef boost::function<void ( const boost::shared_array<uint8_t>&, const size_t)>   callbackData;
 typedef boost::function<void ( const size_t, const size_t, const std::string& )>     callbackProgress;
+typedef boost::function< void (const std::string&) >                                 callbackLine;
 
 /* Parameters for the SysExec Function */
 class SysExecConfig {
@@ -163,13 +181,15 @@ public:
      * Default Constructor
      */
     SysExecConfig( int v_retries = 1, int v_timeout = SYSEXEC_TIMEOUT, bool v_gui = false )
-        : retries(v_retries), timeout(v_timeout), gui(v_gui), errStrings() { };
+        : retries(v_retries), timeout(v_timeout), gui(v_gui), errStrings(), 
+          priority(SYSEXEC_PRIORITY_LIFECYCLE), owner() { };
 
     /**
      * Copy Constructor
      */
     SysExecConfig( const SysExecConfig& src )
-        : retries(src.retries), timeout(src.timeout), gui(src.gui), errStrings(src.errStrings) { };
+        : retries(src.retries), timeout(src.timeout), gui(src.gui), errStrings(src.errStrings),
+          priority(src.priority), owner(src.owner) { };
 
     /**
      * Assign operator
@@ -198,10 +218,22 @@ public:
      */
     SysExecConfig&              setGUI( bool gui );
 
+    /**
+     * Change the scheduling priority (SYSEXEC_PRIORITY_*) and return this class reference
+     */
+    SysExecConfig&              setPriority( int p );
+
+    /**
+     * Change the owner (used for fair scheduling) and return this class reference
+     */
+    SysExecConfig&              setOwner( const std::string& owner );
+
     int                         retries; 
     int                         timeout;
     bool                        gui;
     std::map<std::string,int>   errStrings;
+    int                         priority;
+    std::string                 owner;
 
 };
 
@@ -294,6 +326,39 @@ int                                                 sysExec         ( const std:
                                                                       const SysExecConfig& config
                                                                     );
 
+/**
+ * Streaming version of sysExec() that passes every STDOUT line to the onLine consumer
+ * as soon as it arrives, instead of buffering the entire output.
+ *
+ * If the command is retried, onRetry is called before every new attempt, so the consumer
+ * can discard the lines it received from the failed one.
+ */
+int                                                 sysExec         ( const std::string& app, 
+                                                                      const std::string& cmdline, 
+                                                                      const callbackLine& onLine, 
+                                                                      std::string * rawStderr, 
+                                                                      const SysExecConfig& config,
+                                                                      const callbackVoid& onRetry = callbackVoid()
+                                                                    );
+
+/**
+ * Versions of sysExec() that pass the given arguments as-is to the application,
+ * without splitting a command-line string.
+ */
+int                                                 sysExec         ( const std::string& app, 
+                                                                      const std::vector<std::string>& args, 
+                                                                      std::vector<std::string> * stdoutList, 
+                                                                      std::string * rawStderr, 
+                                                                      const SysExecConfig& config
+                                                                    );
+int                                                 sysExec         ( const std::string& app, 
+                                                                      const std::vector<std::string>& args, 
+                                                                      const callbackLine& onLine, 
+                                                                      std::string * rawStderr, 
+                                                                      const SysExecConfig& config,
+                                                                      const callbackVoid& onRetry = callbackVoid()
+                                                                    );
+
 /**
  * Platform-independant function to execute the given command-line without
  * waiting for it to complete.
@@ -310,6 +375,18 @@ void                                                initSysExec     ( );
  */
 void                                                abortSysExec    ( );
 
+/**
+ * Internal sysExec() building blocks, shared with the ExecReactor
+ */
+bool                                                __sysExecCheckResult( int * res, const std::string& stdError, std::string * rawStderrAns, const SysExecConfig& config );
+void                                                __sysExecRecordMetrics( const std::string& app, const std::vector<std::string>& args, int attempts, int res, unsigned long long startedUs );
+void                                                __sysExecFeedLines  ( std::string * buffer, const callbackLine& onLine, bool flush );
+#ifdef __linux__
+pid_t                                               __sysExecFork       ( const std::string& app, const std::vector<std::string>& args, int * outRd, int * errRd );
+bool                                                __sysExecDrain      ( int fd, std::string * buffer );
+int                                                 __sysExecAbortFd    ( );
+#endif
+
 /**
  * Cross-platform function to return the temporary folder path
  */
@@ -368,16 +445,28 @@ int                                                 parseLines       ( std::vect
  */
 int                                                 splitArguments  ( std::string source, std::vector< std::string > * args );
 
+/**
+ * Join the given arguments into a command-line string, wrapping in double quotes
+ * the arguments that contain white space or quotes. The quoting follows the
+ * Windows (CommandLineToArgvW) rules, so the result can be passed to CreateProcess.
+ */
+std::string                                         joinArguments   ( const std::vector< std::string > & args );
+
 /**
  * Check if the specified port is accepting connections
  */
 bool                                                isPortOpen      ( const char * host, int port, unsigned char handshake = HSK_NONE, int timeoutSec = 1 );
 
 /**
- * Get a random free port (higher than 1024)
+ * Get a free port, picked by the kernel
  */
 int                                                 getFreePort     ( const char * host );
 
+/**
+ * Check if the specified port can be bound on the given host
+ */
+bool                                                isPortBindable  ( const char * host, int port );
+
 /**
  * Minimalistic HTTP GET helper (used for inter-process WebRPC interaction)
  */
@@ -535,6 +624,20 @@ inline long getMillis() {
     #endif
 }
 
+/**
+ * Returns a monotonic timestamp in milliseconds, suitable for calculating
+ * deadlines, since it's not affected by changes to the system clock.
+ */
+inline long getMonotonicMillis() {
+    #ifdef __linux__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec) * 1000 + (ts.tv_nsec) / 1000000;
+    #else
+    return getMillis();
+    #endif
+}
+
 /**
  * Returns the current time in milliseconds since unix epoch
  */
@@ -568,6 +671,30 @@ sharedMutex                                 __nmutex_get( std::string name );
 #define NAMED_MUTEX_LOCK(x)                 { sharedMutex __mutex = __nmutex_get(x); boost::unique_lock<boost::mutex> __mLock( *__mutex.get() );
 #define NAMED_MUTEX_UNLOCK                  }; 
 
+/**
+ * Exclusive lock of the given file, which is also respected by the other processes
+ * (flock on POSIX, LockFileEx on Windows). The file is created if it's missing, and
+ * the lock is held until the object is destroyed. (Use together with a named mutex,
+ * since on some platforms a process does not conflict with it's own locks)
+ */
+class FileLock {
+public:
+    FileLock( const std::string& file );
+    ~FileLock();
+
+    /**
+     * Check if the lock was obtained
+     */
+    bool                    isLocked( ) const;
+
+private:
+#ifdef _WIN32
+    HANDLE                  handle;
+#else
+    int                     fd;
+#endif
+};
+
 /**
  * Convert to lowercase the given string
  */
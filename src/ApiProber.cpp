@@ -0,0 +1,672 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/ApiProber.h>
+#include <CernVM/Hypervisor.h>
+#include <CernVM/Config.h>
+
+#include <sstream>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+/* Stages of a probe in progress */
+#define PROBE_CONNECTING        0
+#define PROBE_WAITING           1
+
+/////////////////////////////////////
+// ApiProbeBatch
+/////////////////////////////////////
+
+/**
+ * Wait for all the probes to complete
+ */
+void ApiProbeBatch::wait() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!done) cond.wait(lock);
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if all the probes have completed
+ */
+bool ApiProbeBatch::isDone() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return done;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark the batch as completed
+ */
+void ApiProbeBatch::complete() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    done = true;
+    cond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/////////////////////////////////////
+// ApiProber
+/////////////////////////////////////
+
+/**
+ * Constructor
+ */
+ApiProber::ApiProber() :
+#ifdef __linux__
+    epfd(-1), wakeFd(-1), inflight(),
+#endif
+    queueMutex(), pending(), watches(), batchListener(), proberThread(NULL), stopRequested(false) {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+
+    // Prepare the epoll set and the wake-up descriptor
+    epfd = epoll_create1( EPOLL_CLOEXEC );
+    wakeFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+    struct epoll_event ev;
+    ev.events = EPOLLIN; ev.data.fd = wakeFd;
+    epoll_ctl( epfd, EPOLL_CTL_ADD, wakeFd, &ev );
+
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Destructor
+ */
+ApiProber::~ApiProber() {
+    CRASH_REPORT_BEGIN;
+
+    // Stop the prober thread
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        stopRequested = true;
+    }
+    if (proberThread != NULL) {
+        notify();
+        proberThread->join();
+        delete proberThread;
+    }
+
+#ifdef __linux__
+    // Release descriptors
+    for (std::map< int, INFLIGHT >::iterator it = inflight.begin(); it != inflight.end(); ++it)
+        close( (*it).first );
+    if (epfd >= 0) close(epfd);
+    if (wakeFd >= 0) close(wakeFd);
+#endif
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Global function to return the process-wide prober
+ */
+ApiProber& ApiProber::Default() {
+    static ApiProber prober;
+    return prober;
+}
+
+/**
+ * Wake-up the prober thread
+ */
+void ApiProber::notify() {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+    if (wakeFd >= 0) eventfd_write( wakeFd, 1 );
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Probe the given endpoints in parallel and return immediately
+ */
+ApiProbeBatchPtr ApiProber::probeAsync( const std::vector<API_PROBE>& probes, int timeoutMs, const callbackProbeBatch& onDone ) {
+    CRASH_REPORT_BEGIN;
+    ApiProbeBatchPtr batch = boost::make_shared<ApiProbeBatch>( probes, timeoutMs, onDone );
+#ifdef __linux__
+
+    // Pass it to the prober thread, starting it if needed
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        pending.push_back( batch );
+        if (proberThread == NULL)
+            proberThread = new boost::thread( boost::bind( &ApiProber::proberLoop, this ) );
+    }
+    notify();
+
+#else
+
+    // Probe the batch in a thread of it's own
+    boost::thread( boost::bind( &ApiProber::fallbackRun, this, batch ) ).detach();
+
+#endif
+    return batch;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Probe the given endpoints in parallel and wait for the results
+ */
+void ApiProber::probeAll( std::vector<API_PROBE>& probes, int timeoutMs ) {
+    CRASH_REPORT_BEGIN;
+
+    // Called from a callback fired by the prober thread (ex. an "apiAlive"
+    // handler). Waiting for the prober would never return, so probe here.
+    if (isProberThread()) {
+        ApiProbeBatchPtr batch = boost::make_shared<ApiProbeBatch>( probes, timeoutMs, callbackProbeBatch() );
+        probeBlocking( batch );
+        probes = batch->probes;
+        return;
+    }
+
+    ApiProbeBatchPtr batch = probeAsync( probes, timeoutMs );
+    batch->wait();
+    probes = batch->probes;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if we are running in the prober thread
+ */
+bool ApiProber::isProberThread() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(queueMutex);
+    return (proberThread != NULL) && (proberThread->get_id() == boost::this_thread::get_id());
+    CRASH_REPORT_END;
+}
+
+/**
+ * Probe all the endpoints of the batch one after the other, with blocking connections
+ */
+void ApiProber::probeBlocking( const ApiProbeBatchPtr& batch ) {
+    CRASH_REPORT_BEGIN;
+    int timeoutSec = (batch->timeoutMs + 999) / 1000;
+    for (std::vector<API_PROBE>::iterator it = batch->probes.begin(); it != batch->probes.end(); ++it) {
+        unsigned long long started = getTimeInMs();
+        (*it).alive = isPortOpen( (*it).host.c_str(), (*it).port, (*it).handshake, timeoutSec );
+        (*it).latency = (int)(getTimeInMs() - started);
+    }
+    finishBatch( batch );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Probe a single endpoint and wait for the result
+ */
+bool ApiProber::probe( const std::string& host, int port, unsigned char handshake, int timeoutMs ) {
+    CRASH_REPORT_BEGIN;
+    std::vector<API_PROBE> probes(1);
+    probes[0].host = host;
+    probes[0].port = port;
+    probes[0].handshake = handshake;
+    probes[0].alive = false;
+    probes[0].latency = 0;
+    probeAll( probes, timeoutMs );
+    return probes[0].alive;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start watching the API port of the given session
+ */
+void ApiProber::watch( const boost::shared_ptr<HVSession>& session, unsigned char handshake ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+
+        // Keep the status if we are already watching it
+        std::map< std::string, WATCH >::iterator it = watches.find( session->uuid );
+        if (it != watches.end()) {
+            (*it).second.handshake = handshake;
+            return;
+        }
+
+        // Probe as soon as possible
+        WATCH w;
+        w.session = session;
+        w.handshake = handshake;
+        w.known = false;
+        w.alive = false;
+        w.interval = API_PROBE_MIN_INTERVAL;
+        w.nextAt = 0;
+        w.probing = false;
+        watches[ session->uuid ] = w;
+
+        if (proberThread == NULL)
+            proberThread = new boost::thread( boost::bind( &ApiProber::proberLoop, this ) );
+    }
+    notify();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop watching the given session
+ */
+void ApiProber::unwatch( const std::string& uuid ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(queueMutex);
+    std::map< std::string, WATCH >::iterator it = watches.find( uuid );
+    if (it != watches.end()) watches.erase( it );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Receive the results of every round of watched session probes
+ */
+void ApiProber::setBatchListener( const callbackProbeBatch& cb ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(queueMutex);
+    batchListener = cb;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Collect the due watched sessions and probe them as one batch
+ */
+void ApiProber::startWatches( unsigned long long now ) {
+    CRASH_REPORT_BEGIN;
+    std::vector<API_PROBE> probes;
+    std::vector< boost::shared_ptr<HVSession> > sessions;
+
+    // Pick the due sessions, dropping the ones that have gone away
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        for (std::map< std::string, WATCH >::iterator it = watches.begin(); it != watches.end(); ) {
+            WATCH& w = (*it).second;
+            boost::shared_ptr<HVSession> sess = w.session.lock();
+            if (!sess) {
+                watches.erase( it++ );
+                continue;
+            }
+            if (!w.probing && (w.nextAt <= now)) {
+                API_PROBE p;
+                p.uuid = (*it).first;
+                p.handshake = w.handshake;
+                p.alive = false;
+                p.latency = 0;
+                probes.push_back( p );
+                sessions.push_back( sess );
+                w.probing = true;
+            }
+            ++it;
+        }
+    }
+    if (probes.empty()) return;
+
+    // Ask the sessions for their endpoints (outside the lock)
+    for (size_t i=0; i<probes.size(); ++i) {
+        probes[i].host = sessions[i]->getAPIHost();
+        probes[i].port = sessions[i]->getAPIPort();
+    }
+
+    // Probe them together
+    ApiProbeBatchPtr batch = boost::make_shared<ApiProbeBatch>( probes, API_PROBE_TIMEOUT,
+        boost::bind( &ApiProber::watchDone, this, _1 ) );
+#ifdef __linux__
+    startBatch( batch, now );
+#else
+    boost::thread( boost::bind( &ApiProber::fallbackRun, this, batch ) ).detach();
+#endif
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Process the results of a round of watched session probes
+ */
+void ApiProber::watchDone( const std::vector<API_PROBE>& results ) {
+    CRASH_REPORT_BEGIN;
+    std::vector< std::pair< boost::shared_ptr<HVSession>, API_PROBE > > changes;
+    callbackProbeBatch listener;
+    unsigned long long now = getTimeInMs();
+
+    // Update the status, backing-off while it stays the same
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        for (std::vector<API_PROBE>::const_iterator it = results.begin(); it != results.end(); ++it) {
+            std::map< std::string, WATCH >::iterator jt = watches.find( (*it).uuid );
+            if (jt == watches.end()) continue;
+            WATCH& w = (*jt).second;
+
+            w.probing = false;
+            if (!w.known || (w.alive != (*it).alive)) {
+                w.known = true;
+                w.alive = (*it).alive;
+                w.interval = API_PROBE_MIN_INTERVAL;
+                boost::shared_ptr<HVSession> sess = w.session.lock();
+                if (sess) changes.push_back( std::make_pair( sess, *it ) );
+            } else {
+                w.interval *= 2;
+                if (w.interval > API_PROBE_MAX_INTERVAL)
+                    w.interval = API_PROBE_MAX_INTERVAL;
+            }
+            w.nextAt = now + w.interval;
+        }
+        listener = batchListener;
+    }
+
+    // Notify the sessions that changed
+    for (size_t i=0; i<changes.size(); ++i) {
+        const API_PROBE& p = changes[i].second;
+        CVMWA_LOG("Debug", "API of session " << p.uuid << " is " << (p.alive ? "alive" : "down"));
+        changes[i].first->fire( p.alive ? "apiAlive" : "apiDown", ArgumentList( p.host )( p.port ) );
+    }
+
+    // And the batch listener
+    if (listener) listener( results );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fire the completion of the given batch
+ */
+void ApiProber::finishBatch( const ApiProbeBatchPtr& batch ) {
+    CRASH_REPORT_BEGIN;
+
+    // Complete batch
+    batch->complete();
+
+    // Fire the callback, without letting it take down the prober
+    if (batch->onDone) {
+        try {
+            batch->onDone( batch->probes );
+        } catch (std::exception &e) {
+            CVMWA_LOG("Error", "Exception in probe completion callback: " << e.what());
+        }
+    }
+
+    CRASH_REPORT_END;
+}
+
+#ifdef __linux__
+
+/**
+ * Start all the probes of the given batch
+ */
+void ApiProber::startBatch( const ApiProbeBatchPtr& batch, unsigned long long now ) {
+    CRASH_REPORT_BEGIN;
+    batch->started = now;
+    batch->pending = batch->probes.size();
+    if (batch->pending == 0) {
+        finishBatch( batch );
+        return;
+    }
+
+    // Take a copy, since completing the last probe may release the batch
+    ApiProbeBatchPtr keep = batch;
+    size_t count = batch->probes.size();
+    for (size_t i=0; i<count; ++i) {
+        API_PROBE& p = batch->probes[i];
+
+        // Prepare the address
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(struct sockaddr_in));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons( p.port );
+        addr.sin_addr.s_addr = inet_addr( p.host.c_str() );
+
+        // Open a non-blocking socket
+        int fd = -1;
+        if (!p.host.empty() && (p.port > 0) && (addr.sin_addr.s_addr != INADDR_NONE))
+            fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+
+        // Don't leave the socket in a TIME_WAIT state when we close it
+        if (fd >= 0) {
+            struct linger fix_ling;
+            fix_ling.l_onoff = 1;
+            fix_ling.l_linger = 0;
+            setsockopt( fd, SOL_SOCKET, SO_LINGER, (char*)&fix_ling, sizeof(fix_ling) );
+        }
+
+        // Register it and start connecting
+        INFLIGHT f;
+        f.batch = batch;
+        f.index = i;
+        f.stage = PROBE_CONNECTING;
+        f.deadline = now + batch->timeoutMs;
+        f.graceAt = 0;
+        if (fd < 0) {
+            p.alive = false;
+            p.latency = 0;
+            if (--batch->pending == 0) finishBatch( batch );
+            continue;
+        }
+        inflight[fd] = f;
+
+        struct epoll_event ev;
+        ev.events = EPOLLOUT; ev.data.fd = fd;
+        epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev );
+
+        if ((connect( fd, (struct sockaddr *) &addr, sizeof(addr) ) < 0) && (errno != EINPROGRESS)) {
+            finishProbe( fd, false, now );
+        }
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Complete the probe on the given descriptor
+ */
+void ApiProber::finishProbe( int fd, bool alive, unsigned long long now ) {
+    CRASH_REPORT_BEGIN;
+    std::map< int, INFLIGHT >::iterator it = inflight.find( fd );
+    if (it == inflight.end()) return;
+    ApiProbeBatchPtr batch = (*it).second.batch;
+    size_t index = (*it).second.index;
+
+    // Release the connection
+    inflight.erase( it );
+    epoll_ctl( epfd, EPOLL_CTL_DEL, fd, NULL );
+    close( fd );
+
+    // Store the result
+    batch->probes[index].alive = alive;
+    batch->probes[index].latency = (int)(now - batch->started);
+    if (--batch->pending == 0)
+        finishBatch( batch );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Handle an epoll event on the given descriptor
+ */
+void ApiProber::handleEvent( int fd, unsigned int events, unsigned long long now ) {
+    CRASH_REPORT_BEGIN;
+    std::map< int, INFLIGHT >::iterator it = inflight.find( fd );
+    if (it == inflight.end()) return;
+    INFLIGHT& f = (*it).second;
+    const API_PROBE& p = f.batch->probes[f.index];
+
+    if (f.stage == PROBE_CONNECTING) {
+
+        // Check if the connection succeeded
+        int errorCode = 0;
+        socklen_t szErrorCode = sizeof(errorCode);
+        if ((getsockopt( fd, SOL_SOCKET, SO_ERROR, (char*) &errorCode, &szErrorCode ) != 0) || (errorCode != 0)) {
+            finishProbe( fd, false, now );
+            return;
+        }
+
+        // Without handshake, being able to connect is enough
+        if (p.handshake == HSK_NONE) {
+            finishProbe( fd, true, now );
+            return;
+        }
+
+        // Send the handshake
+        std::string request;
+        if (p.handshake == HSK_HTTP) {
+            std::ostringstream oss;
+            oss << "HEAD / HTTP/1.1\r\n"
+                << "Host: " << p.host << "\r\n"
+                << "Accept: */*" << "\r\n"
+                << "Connection: keep-alive\r\n"
+                << "User-Agent: CVMWebAPI/" << CERNVM_WEBAPI_VERSION << " CVMWebProbe/1.0" << "\r\n"
+                << "\r\n";
+            request = oss.str();
+        } else {
+            // HSK_SIMPLE: The connection must survive a space and a newline
+            request = " \n";
+            f.graceAt = now + API_PROBE_SIMPLE_GRACE;
+        }
+        if (send( fd, request.c_str(), request.length(), MSG_NOSIGNAL ) < 0) {
+            finishProbe( fd, false, now );
+            return;
+        }
+
+        // Wait for the response
+        f.stage = PROBE_WAITING;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP; ev.data.fd = fd;
+        epoll_ctl( epfd, EPOLL_CTL_MOD, fd, &ev );
+
+    } else {
+
+        // Any data means the other end is alive, while a reset connection
+        // means it's not. Like isPortOpen(), an orderly close is enough for
+        // the simple handshake, but not for the HTTP one.
+        char readBuf[1024];
+        ssize_t n = recv( fd, readBuf, sizeof(readBuf), MSG_DONTWAIT );
+        if (n > 0) {
+            finishProbe( fd, true, now );
+        } else if (n == 0) {
+            finishProbe( fd, (p.handshake == HSK_SIMPLE), now );
+        } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            finishProbe( fd, false, now );
+        } else if (events & (EPOLLERR | EPOLLHUP)) {
+            finishProbe( fd, false, now );
+        }
+
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * The prober thread main loop
+ */
+void ApiProber::proberLoop() {
+    CRASH_REPORT_BEGIN;
+    struct epoll_event events[64];
+
+    while (true) {
+        unsigned long long now = getTimeInMs();
+
+        // Start the new batches
+        std::list< ApiProbeBatchPtr > batches;
+        unsigned long long nextWatch = now + API_PROBE_MAX_INTERVAL;
+        {
+            boost::unique_lock<boost::mutex> lock(queueMutex);
+            if (stopRequested) break;
+            batches.swap( pending );
+            for (std::map< std::string, WATCH >::iterator it = watches.begin(); it != watches.end(); ++it) {
+                if (!(*it).second.probing && ((*it).second.nextAt < nextWatch))
+                    nextWatch = (*it).second.nextAt;
+            }
+        }
+        for (std::list< ApiProbeBatchPtr >::iterator it = batches.begin(); it != batches.end(); ++it)
+            startBatch( *it, now );
+
+        // Start the watched sessions that are due
+        if (nextWatch <= now) {
+            startWatches( now );
+            nextWatch = now + API_PROBE_MIN_INTERVAL;
+        }
+
+        // Sleep until the nearest deadline
+        unsigned long long wakeAt = nextWatch;
+        for (std::map< int, INFLIGHT >::iterator it = inflight.begin(); it != inflight.end(); ++it) {
+            if ((*it).second.deadline < wakeAt) wakeAt = (*it).second.deadline;
+            if ((*it).second.graceAt && ((*it).second.graceAt < wakeAt)) wakeAt = (*it).second.graceAt;
+        }
+        int timeout = (wakeAt > now) ? (int)(wakeAt - now) : 0;
+        int n = epoll_wait( epfd, events, 64, timeout );
+        now = getTimeInMs();
+
+        // Handle the events
+        for (int i=0; i<n; ++i) {
+            if (events[i].data.fd == wakeFd) {
+                eventfd_t v;
+                eventfd_read( wakeFd, &v );
+            } else {
+                handleEvent( events[i].data.fd, events[i].events, now );
+            }
+        }
+
+        // Expire the probes that reached their deadline or their grace period
+        std::vector< std::pair<int, bool> > expired;
+        for (std::map< int, INFLIGHT >::iterator it = inflight.begin(); it != inflight.end(); ++it) {
+            if ((*it).second.graceAt && ((*it).second.graceAt <= now)) {
+                expired.push_back( std::make_pair( (*it).first, true ) );
+            } else if ((*it).second.deadline <= now) {
+                expired.push_back( std::make_pair( (*it).first, false ) );
+            }
+        }
+        for (size_t i=0; i<expired.size(); ++i)
+            finishProbe( expired[i].first, expired[i].second, now );
+
+    }
+
+    CRASH_REPORT_END;
+}
+
+#else
+
+/**
+ * Probe a batch with blocking connections on platforms without epoll
+ */
+void ApiProber::fallbackRun( const ApiProbeBatchPtr& batch ) {
+    CRASH_REPORT_BEGIN;
+    probeBlocking( batch );
+    CRASH_REPORT_END;
+}
+
+/**
+ * The prober thread main loop, starting only the watched sessions
+ */
+void ApiProber::proberLoop() {
+    CRASH_REPORT_BEGIN;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(queueMutex);
+            if (stopRequested) break;
+        }
+        startWatches( getTimeInMs() );
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 100 ) );
+    }
+    CRASH_REPORT_END;
+}
+
+#endif
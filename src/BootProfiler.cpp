@@ -0,0 +1,292 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/BootProfiler.h>
+
+#include <algorithm>
+#include <sstream>
+#include <json/json.h>
+
+/**
+ * Start recording a new trace
+ */
+void ProfileTrace::begin( const std::string& label ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    this->label = label;
+    origin = getMonotonicMillis();
+    total = 0;
+    active = true;
+    spans.clear();
+    current.clear();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Open a new span under the innermost open span of the calling thread
+ */
+int ProfileTrace::enter( const std::string& name, bool nest ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!active) return -1;
+
+    // Find the parent
+    boost::thread::id self = boost::this_thread::get_id();
+    std::map< boost::thread::id, int >::iterator it = current.find( self );
+    int parent = (it == current.end()) ? -1 : (*it).second;
+
+    // Open the span
+    PROFILE_SPAN span = { name, parent, getMonotonicMillis() - origin, -1 };
+    spans.push_back( span );
+    int index = spans.size() - 1;
+    if (nest) current[self] = index;
+    return index;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Close a span
+ */
+void ProfileTrace::leave( int index ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!active || (index < 0) || (index >= (int)spans.size())) return;
+    PROFILE_SPAN& span = spans[index];
+    if (span.duration < 0)
+        span.duration = getMonotonicMillis() - origin - span.start;
+
+    // Return to the parent span if this was the innermost of the calling thread
+    boost::thread::id self = boost::this_thread::get_id();
+    std::map< boost::thread::id, int >::iterator it = current.find( self );
+    if ((it != current.end()) && ((*it).second == index)) {
+        if (span.parent < 0) {
+            current.erase( it );
+        } else {
+            (*it).second = span.parent;
+        }
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Complete the trace
+ */
+bool ProfileTrace::end( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!active) return false;
+    total = getMonotonicMillis() - origin;
+    for (std::vector< PROFILE_SPAN >::iterator it = spans.begin(); it != spans.end(); ++it) {
+        if ((*it).duration < 0) (*it).duration = total - (*it).start;
+    }
+    active = false;
+    current.clear();
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Abandon the trace
+ */
+void ProfileTrace::cancel( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    active = false;
+    spans.clear();
+    current.clear();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if we are recording
+ */
+bool ProfileTrace::isActive( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return active;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the calling thread has an open span
+ */
+bool ProfileTrace::inSpan( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return active && (current.find( boost::this_thread::get_id() ) != current.end());
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a copy of the spans
+ */
+std::vector< PROFILE_SPAN > ProfileTrace::getSpans( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return spans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Serialize the spans
+ */
+std::string ProfileTrace::toJSON( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    Json::Value root( Json::objectValue );
+    Json::Value list( Json::arrayValue );
+    for (std::vector< PROFILE_SPAN >::iterator it = spans.begin(); it != spans.end(); ++it) {
+        Json::Value span( Json::objectValue );
+        span["name"] = (*it).name;
+        span["parent"] = (*it).parent;
+        span["start"] = (Json::Int)(*it).start;
+        span["duration"] = (Json::Int)(*it).duration;
+        list.append( span );
+    }
+    root["label"] = label;
+    root["total"] = (Json::Int)total;
+    root["spans"] = list;
+    Json::FastWriter writer;
+    std::string json = writer.write( root );
+    if (!json.empty() && (json[json.length()-1] == '\n'))
+        json.erase( json.length()-1 );
+    return json;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Sum the durations by span path
+ */
+std::map< std::string, long > ProfileTrace::getBreakdown( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map< std::string, long > breakdown;
+    std::vector< std::string > paths;
+    for (std::vector< PROFILE_SPAN >::iterator it = spans.begin(); it != spans.end(); ++it) {
+        // (The parents always precede their children)
+        std::string path = (*it).name;
+        if ((*it).parent >= 0) path = paths[(*it).parent] + "." + path;
+        paths.push_back( path );
+        if ((*it).duration >= 0) breakdown[path] += (*it).duration;
+    }
+    breakdown["total"] = total;
+    return breakdown;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Global function to return the process-wide profiler
+ */
+BootProfiler& BootProfiler::Default() {
+    static BootProfiler profiler;
+    return profiler;
+}
+
+/**
+ * Load or synchronize the samples
+ */
+void BootProfiler::syncTable( ) {
+    CRASH_REPORT_BEGIN;
+    if (!table) {
+        table = LocalConfig::forRuntime( name );
+    } else {
+        table->sync();
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Append the breakdown of the trace to the samples
+ */
+void BootProfiler::record( ProfileTrace& trace ) {
+    CRASH_REPORT_BEGIN;
+    std::map< std::string, long > breakdown = trace.getBreakdown();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    syncTable();
+
+    table->lock();
+    for (std::map< std::string, long >::iterator it = breakdown.begin(); it != breakdown.end(); ++it) {
+        std::vector< std::string > samples;
+        std::string value = table->get( (*it).first, "" );
+        if (!value.empty()) explode( value, ',', &samples );
+
+        // Keep only the most recent samples
+        samples.push_back( ntos<long>( (*it).second ) );
+        if (samples.size() > BOOT_PROFILER_SAMPLES)
+            samples.erase( samples.begin(), samples.end() - BOOT_PROFILER_SAMPLES );
+
+        std::ostringstream oss;
+        for (size_t i=0; i<samples.size(); ++i) {
+            if (i > 0) oss << ",";
+            oss << samples[i];
+        }
+        table->set( (*it).first, oss.str() );
+    }
+    table->unlock();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Compute the percentiles of every step
+ */
+std::map< std::string, PROFILE_STATS > BootProfiler::getStats( ) {
+    CRASH_REPORT_BEGIN;
+    std::map< std::string, PROFILE_STATS > stats;
+    std::map< const std::string, const std::string > entries;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    syncTable();
+
+    table->toMap( &entries );
+    for (std::map< const std::string, const std::string >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        std::vector< std::string > values;
+        std::vector< long > samples;
+        explode( (*it).second, ',', &values );
+        for (std::vector< std::string >::iterator jt = values.begin(); jt != values.end(); ++jt)
+            samples.push_back( ston<long>( *jt ) );
+        if (samples.empty()) continue;
+
+        // Nearest-rank percentiles
+        std::sort( samples.begin(), samples.end() );
+        size_t n = samples.size();
+        PROFILE_STATS st = {
+            (int)n,
+            samples[ (n * 50 + 99) / 100 - 1 ],
+            samples[ (n * 90 + 99) / 100 - 1 ],
+            samples[ (n * 95 + 99) / 100 - 1 ],
+            samples[ (n * 99 + 99) / 100 - 1 ],
+            samples[ n - 1 ]
+        };
+        stats[ (*it).first ] = st;
+    }
+    return stats;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Discard all the samples
+ */
+void BootProfiler::reset( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    syncTable();
+    table->clear();
+    table->save();
+    CRASH_REPORT_END;
+}
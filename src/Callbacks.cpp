@@ -19,6 +19,7 @@
  */
 
 #include "CernVM/Callbacks.h"
+#include "CernVM/Metrics.h"
 
 /**
  * Register a callback that handles a named event
@@ -95,6 +96,10 @@ void Callbacks::offAnyEvent ( AnyEventSlotPtr cb ) {
  */
 void Callbacks::fire( const std::string& name, VariantArgList& args ){
     CRASH_REPORT_BEGIN;
+    static const int metricFired = Metrics::Default().counter( "cvmwa_callbacks_fired_total", "Events fired" );
+    static const int metricTime = Metrics::Default().histogram( "cvmwa_callbacks_duration_seconds", "Time spent in the handlers of an event" );
+    Metrics::Default().add( metricFired );
+    MetricTimer timer( metricTime );
 	boost::mutex::scoped_lock lock(shopMutex);
 
 	// First, call the anyEvent handlers
@@ -20,6 +20,16 @@
 
 #include "CernVM/DownloadProvider.h"
 #include "CernVM/Hypervisor.h"
+#include "CernVM/Metrics.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 DownloadProviderPtr systemProvider;
 
@@ -43,6 +53,108 @@ void DownloadProvider::setDefault( const DownloadProviderPtr& provider ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Providers that cannot hash while downloading just download the file
+ */
+int DownloadProvider::downloadFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf, const DigestSinkPtr& /* digest */ ) {
+    CRASH_REPORT_BEGIN;
+    return downloadFile( url, destination, pf );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Providers that cannot resume just download the file again, without leaving a partial file behind
+ */
+int DownloadProvider::resumeFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf, const DigestSinkPtr& digest ) {
+    CRASH_REPORT_BEGIN;
+    int ans = downloadFile( url, destination, pf, digest );
+    if (ans != HVE_OK) ::remove( destination.c_str() );
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Constructor
+ */
+DigestSink::DigestSink() : hex(), position(0), ctx(NULL) {
+    CRASH_REPORT_BEGIN;
+    ctx = EVP_MD_CTX_create();
+    reset();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Destructor
+ */
+DigestSink::~DigestSink() {
+    CRASH_REPORT_BEGIN;
+    EVP_MD_CTX_destroy( ctx );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start a new digest
+ */
+void DigestSink::reset( ) {
+    CRASH_REPORT_BEGIN;
+    EVP_DigestInit_ex( ctx, EVP_sha256(), NULL );
+    position = 0;
+    hex = "";
+    CRASH_REPORT_END;
+}
+
+/**
+ * Hash the part of the given data that continues the digest
+ */
+void DigestSink::update( curl_off_t offset, const char * ptr, size_t len ) {
+    if ((offset > position) || (offset + (curl_off_t)len <= position)) return;
+    size_t skip = position - offset;
+    EVP_DigestUpdate( ctx, ptr + skip, len - skip );
+    position += len - skip;
+}
+
+/**
+ * Hash the next bytes of the file
+ */
+bool DigestSink::readBack( int fd, curl_off_t len ) {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+    char buffer[65536];
+    while (len > 0) {
+        ssize_t n = pread( fd, buffer, (size_t) std::min( len, (curl_off_t) sizeof(buffer) ), position );
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return false;
+        EVP_DigestUpdate( ctx, buffer, n );
+        position += n;
+        len -= n;
+    }
+    return true;
+#else
+    return false;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Complete the digest, if it covers the whole file (of unknown size if 0)
+ */
+bool DigestSink::finish( curl_off_t size ) {
+    CRASH_REPORT_BEGIN;
+    unsigned int md_len;
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    if ((size > 0) && (position != size)) return false;
+
+    // Convert to hex
+    EVP_DigestFinal_ex( ctx, md_value, &md_len );
+    std::ostringstream oss; oss << std::hex;
+    for (unsigned int i = 0; i < md_len; i++) {
+        oss << std::setfill('0') << std::setw(2) << (int)md_value[i];
+    }
+    hex = oss.str();
+    return true;
+    CRASH_REPORT_END;
+}
+
 /**
  * Local function to fire the progress event accordingly
  */
@@ -116,6 +228,10 @@ size_t __curl_datacb_file(void *ptr, size_t size, size_t nmemb, CURLProvider * s
 
     // Write to file stream
     DownloadProvider::writeToStream( &(self->fStream), self->pf, self->maxStreamSize, (const char *) ptr, dataLen );
+
+    // The data arrive in order, so hash them right away
+    if (self->digest)
+        self->digest->update( self->digest->position, (const char *) ptr, dataLen );
     
     // Return data len
     return dataLen;
@@ -151,6 +267,10 @@ int __curl_xferinfo(CURLProvider * self, curl_off_t dltotal, curl_off_t dlnow, c
         return -1;
     }
 
+    // Also abort if the downloading thread is interrupted (ex. a FSM branch being stopped)
+    if (boost::this_thread::interruption_requested())
+        return -1;
+
     // Return 0 to continue downlad
     return 0;
 
@@ -158,13 +278,515 @@ int __curl_xferinfo(CURLProvider * self, curl_off_t dltotal, curl_off_t dlnow, c
 }
 
 /**
- * Download a file using CURL
+ * The metric series of a download kind
  */
-int CURLProvider::downloadFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf ) {
+typedef struct {
+    int     downloads;
+    int     errors;
+    int     bytes;
+    int     duration;
+} CURL_METRIC_IDS;
+
+/**
+ * Update the download metrics after a transfer of the given kind ("file" or "text")
+ */
+static void __curl_metrics( const char * kind, bool ok, curl_off_t bytes, unsigned long long startedUs ) {
     CRASH_REPORT_BEGIN;
+    static boost::mutex mutex;
+    static std::map< std::string, CURL_METRIC_IDS > cache;
+    Metrics & m = Metrics::Default();
 
-    // We are in operation
-    operationInstances++;
+    // Register the series of every kind only once
+    CURL_METRIC_IDS ids;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map< std::string, CURL_METRIC_IDS >::iterator it = cache.find( kind );
+        if (it != cache.end()) {
+            ids = (*it).second;
+        } else {
+            std::string labels = Metrics::label( "kind", kind );
+            ids.downloads = m.counter( "cvmwa_downloads_total", "Downloads attempted", labels );
+            ids.errors = m.counter( "cvmwa_download_errors_total", "Downloads that failed or were aborted", labels );
+            ids.bytes = m.counter( "cvmwa_download_bytes_total", "Bytes received by the downloads", labels );
+            ids.duration = m.histogram( "cvmwa_download_duration_seconds", "Duration of the downloads", labels );
+            cache[ kind ] = ids;
+        }
+    }
+
+    m.add( ids.downloads );
+    if (!ok)
+        m.add( ids.errors );
+    m.add( ids.bytes, (unsigned long long) bytes );
+    m.observe( ids.duration, (traceNowUs() - startedUs) / 1000000.0 );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the bytes received by the last transfer of the given handle
+ */
+static curl_off_t __curl_sizeDownloaded( CURL * curl ) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t bytes = 0;
+    curl_easy_getinfo( curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes );
+    return bytes;
+#else
+    double bytes = 0;
+    curl_easy_getinfo( curl, CURLINFO_SIZE_DOWNLOAD, &bytes );
+    return (curl_off_t) bytes;
+#endif
+}
+
+/**
+ * Return the Content-Length of the last transfer of the given handle, or -1 if unknown
+ */
+static curl_off_t __curl_contentLength( CURL * curl ) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t length = -1;
+    curl_easy_getinfo( curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length );
+    return length;
+#else
+    double length = -1;
+    curl_easy_getinfo( curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length );
+    return (curl_off_t) length;
+#endif
+}
+
+#ifndef _WIN32
+
+/**
+ * A range of a download in progress
+ */
+typedef struct {
+
+    CURLProvider *      self;
+    CURL *              curl;
+    struct curl_slist * headers;
+    int                 fd;
+    DP_RANGE *          range;
+    curl_off_t *        received;       // The bytes of the file we have, over all the ranges
+    curl_off_t          size;           // The size of the file (0 if unknown)
+    bool                ranged;         // We asked for a range
+    bool                checked;        // The response code was checked
+    bool                notRanged;      // ...but the server did not answer with it
+
+} DP_SEGMENT;
+
+/**
+ * Callback function for the data of a range, written at it's place in the file
+ */
+size_t __curl_datacb_segment( void *ptr, size_t size, size_t nmemb, DP_SEGMENT * seg ) {
+    CRASH_REPORT_BEGIN;
+    size_t dataLen = size * nmemb;
+    DP_RANGE * range = seg->range;
+
+    // If the server ignored the range (or the If-Range validator did not match)
+    // we would write the whole file in the wrong place
+    if (seg->ranged && !seg->checked) {
+        long code = 0;
+        seg->checked = true;
+        curl_easy_getinfo( seg->curl, CURLINFO_RESPONSE_CODE, &code );
+        if (code != 206) {
+            CVMWA_LOG("Warning", "Got HTTP " << code << " instead of 206 for bytes " << range->pos << "-" << range->end);
+            seg->notRanged = true;
+        }
+    }
+    if (seg->notRanged) return 0;
+    if ((range->end >= 0) && (range->pos + (curl_off_t)dataLen > range->end + 1)) {
+        CVMWA_LOG("Error", "Received more data than the range " << range->begin << "-" << range->end);
+        return 0;
+    }
+
+    // Write it (pwrite does not move the shared file offset)
+    const char * data = (const char *) ptr;
+    size_t written = 0;
+    while (written < dataLen) {
+        ssize_t n = pwrite( seg->fd, data + written, dataLen - written, range->pos + written );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            CVMWA_LOG("Error", "Unable to write downloaded data (errno=" << errno << ")");
+            return 0;
+        }
+        written += n;
+    }
+    if (seg->self->digest)
+        seg->self->digest->update( range->pos, data, dataLen );
+    range->pos += dataLen;
+
+    // Report the progress of all the ranges
+    *seg->received += dataLen;
+    if (seg->size > 0)
+        DownloadProvider::fireProgressEvent( seg->self->pf, *seg->received, seg->size );
+
+    return dataLen;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Open the file of a download. A new file gets it's final size, so the ranges can
+ * be written in any order and a full disk is detected before downloading anything.
+ */
+static int __openPartial( const std::string& file, curl_off_t size, bool create ) {
+    CRASH_REPORT_BEGIN;
+    int fd = open( file.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644 );
+    if (fd < 0) {
+        CVMWA_LOG("Error", "Unable to open '" << file << "' (errno=" << errno << ")");
+        return -1;
+    }
+    if (!create || (size <= 0)) return fd;
+
+    int allocated = -1;
+#ifdef __linux__
+    allocated = posix_fallocate( fd, 0, size );
+    if (allocated == ENOSPC) {
+        CVMWA_LOG("Error", "Not enough space for " << size << " bytes in '" << file << "'");
+        close( fd );
+        return -1;
+    }
+#endif
+    if ((allocated != 0) && (ftruncate( fd, size ) != 0)) {
+        CVMWA_LOG("Error", "Unable to resize '" << file << "' (errno=" << errno << ")");
+        close( fd );
+        return -1;
+    }
+    return fd;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Advance the digest over the bytes that are already written in the file (up to the given
+ * number of bytes, or all of them if negative), for the ranges that are ahead of it
+ */
+static void __digestReadBack( DigestSink * digest, int fd, const DP_PARTIAL& state, curl_off_t budget ) {
+    CRASH_REPORT_BEGIN;
+    static const int metricBytes = Metrics::Default().counter( "cvmwa_download_digest_readback_bytes_total",
+                                        "Bytes read back from the disk by the digests of the downloads" );
+    bool advanced = true;
+    while (advanced && (budget != 0)) {
+        advanced = false;
+        for (std::vector< DP_RANGE >::const_iterator it = state.ranges.begin(); it != state.ranges.end(); ++it) {
+            if ((digest->position < (*it).begin) || (digest->position >= (*it).pos)) continue;
+            curl_off_t len = (*it).pos - digest->position;
+            if ((budget > 0) && (len > budget)) len = budget;
+            if (!digest->readBack( fd, len )) return;
+            Metrics::Default().add( metricBytes, len );
+            if (budget > 0) budget -= len;
+            advanced = true;
+        }
+    }
+    CRASH_REPORT_END;
+}
+
+#endif
+
+/**
+ * Split a download in the given number of ranges
+ */
+static void __splitRanges( DP_PARTIAL * state, int count ) {
+    CRASH_REPORT_BEGIN;
+    state->ranges.clear();
+    if ((count < 2) || (state->size <= 0)) {
+        DP_RANGE r = { 0, 0, state->size - 1 };
+        state->ranges.push_back( r );
+        return;
+    }
+    curl_off_t step = state->size / count;
+    for (int i = 0; i < count; ++i) {
+        DP_RANGE r = { i * step, i * step, (i == count - 1) ? (state->size - 1) : ((i + 1) * step - 1) };
+        state->ranges.push_back( r );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Header callback of the probe, looking for the range support and the validators
+ */
+typedef struct {
+    bool                ranges;
+    std::string         etag;
+    std::string         modified;
+} DP_PROBE;
+size_t __curl_headerfunc_probe( void *ptr, size_t size, size_t nmemb, DP_PROBE * probe ) {
+    CRASH_REPORT_BEGIN;
+    size_t dataLen = size * nmemb;
+    std::string line( (char *) ptr, dataLen ), name, value;
+    size_t sep = line.find(':');
+    if (sep != std::string::npos) {
+        name = line.substr( 0, sep );
+        value = line.substr( sep + 1 );
+        value.erase( 0, value.find_first_not_of(" \t") );
+        value.erase( value.find_last_not_of(" \t\r\n") + 1 );
+    } else {
+        name = line;
+    }
+    for (std::string::iterator it = name.begin(); it != name.end(); ++it)
+        *it = tolower(*it);
+
+    // Every response of a redirect chain starts with the status line
+    if (name.compare(0, 5, "http/") == 0) {
+        probe->ranges = false;
+        probe->etag = "";
+        probe->modified = "";
+    } else if ((name == "accept-ranges") && (value.find("bytes") != std::string::npos)) {
+        probe->ranges = true;
+    } else if (name == "etag") {
+        probe->etag = value;
+    } else if (name == "last-modified") {
+        probe->modified = value;
+    }
+
+    return dataLen;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check with a HEAD request if the given URL can be downloaded in ranges. Fills the url,
+ * size and validator of the remote state, and returns the final URL after the redirects.
+ * Returns HVE_NOT_SUPPORTED if there are no ranges and HVE_IO_ERROR if the request failed.
+ */
+int CURLProvider::probeRanges( const std::string& url, DP_PARTIAL * remote, std::string * rangeURL ) {
+    CRASH_REPORT_BEGIN;
+    DP_PROBE probe;
+    curl_off_t length = -1;
+    char * effective = NULL;
+    probe.ranges = false;
+    remote->url = url;
+    remote->validator = "";
+    remote->size = 0;
+    remote->ranges.clear();
+    *rangeURL = url;
+
+    // Only HTTP has ranges
+    if ((url.compare(0, 7, "http://") != 0) && (url.compare(0, 8, "https://") != 0))
+        return HVE_NOT_SUPPORTED;
+
+    // Request only the headers
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __curl_headerfunc_probe);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &probe);
+    CURLcode res = curl_easy_perform(curl);
+    length = __curl_contentLength(curl);
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective);
+    if (effective != NULL) *rangeURL = effective;
+
+    // Restore the GET request
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __curl_headerfunc);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+
+    if (res != CURLE_OK) {
+        CVMWA_LOG("Debug", "Unable to probe '" << url << "' (cURL Error #" << res << ")");
+        return HVE_IO_ERROR;
+    }
+    if (length > 0) remote->size = length;
+
+    // Weak ETags cannot be used in If-Range, so use the modification time instead
+    if (!probe.etag.empty() && (probe.etag.compare(0, 2, "W/") != 0)) {
+        remote->validator = probe.etag;
+    } else {
+        remote->validator = probe.modified;
+    }
+
+    CVMWA_LOG("Debug", "Probed '" << url << "': size=" << remote->size << ", ranges=" << probe.ranges << ", validator=" << remote->validator);
+    return (probe.ranges && (length > 0)) ? HVE_OK : HVE_NOT_SUPPORTED;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Load the state of a partial download from it's sidecar file
+ */
+bool CURLProvider::loadPartial( const std::string& file, DP_PARTIAL * state ) {
+    CRASH_REPORT_BEGIN;
+    std::ifstream ifs( file.c_str() );
+    if (!ifs.good()) return false;
+
+    std::string line, key;
+    state->url = "";
+    state->validator = "";
+    state->size = 0;
+    state->ranges.clear();
+    while (std::getline( ifs, line )) {
+        std::istringstream iss( line );
+        iss >> key;
+        if (key == "range") {
+            DP_RANGE r;
+            if (iss >> r.begin >> r.pos >> r.end) state->ranges.push_back( r );
+        } else if (key == "size") {
+            iss >> state->size;
+        } else {
+            // The URL and the validator are the rest of the line
+            std::string value;
+            iss.get();
+            std::getline( iss, value );
+            if (key == "url") state->url = value;
+            if (key == "validator") state->validator = value;
+        }
+    }
+
+    // Check that the ranges make sense
+    if (state->url.empty() || state->ranges.empty()) return false;
+    for (std::vector< DP_RANGE >::iterator it = state->ranges.begin(); it != state->ranges.end(); ++it) {
+        if (((*it).pos < (*it).begin) || (((*it).end >= 0) && ((*it).pos > (*it).end + 1))) return false;
+    }
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Save the state of a partial download to it's sidecar file. The file is
+ * replaced atomically, so it's never found half-written.
+ */
+bool CURLProvider::savePartial( const std::string& file, const DP_PARTIAL& state ) {
+    CRASH_REPORT_BEGIN;
+    std::string tmpFile = file + ".tmp";
+    {
+        std::ofstream ofs( tmpFile.c_str(), std::ofstream::trunc );
+        if (!ofs.good()) return false;
+        ofs << "url " << state.url << "\n";
+        ofs << "validator " << state.validator << "\n";
+        ofs << "size " << state.size << "\n";
+        for (std::vector< DP_RANGE >::const_iterator it = state.ranges.begin(); it != state.ranges.end(); ++it)
+            ofs << "range " << (*it).begin << " " << (*it).pos << " " << (*it).end << "\n";
+        if (ofs.fail()) return false;
+    }
+#ifdef _WIN32
+    ::remove( file.c_str() );
+#endif
+    return (::rename( tmpFile.c_str(), file.c_str() ) == 0);
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download the incomplete ranges of the given state over parallel connections, writing them at
+ * their place in the given file. If a sidecar file is given, the state is regularly saved in it,
+ * after flushing the file, so it never claims bytes that are not on the disk.
+ *
+ * Returns HVE_NOT_SUPPORTED if the server did not answer with the requested ranges, so nothing
+ * was written and the caller has to download the file again from the beginning.
+ */
+int CURLProvider::transferRanges( const std::string& url, int fd, DP_PARTIAL * state, const std::string& sidecar ) {
+    CRASH_REPORT_BEGIN;
+#ifdef _WIN32
+    return HVE_NOT_SUPPORTED;
+#else
+    curl_off_t received = 0;
+    std::vector< DP_SEGMENT > segs;
+    std::vector< std::string > ranges;
+    segs.reserve( state->ranges.size() );
+    ranges.reserve( state->ranges.size() );
+
+    // Start the incomplete ranges, each with it's own handle that inherits our options
+    CURLM * multi = curl_multi_init();
+    for (std::vector< DP_RANGE >::iterator it = state->ranges.begin(); it != state->ranges.end(); ++it) {
+        DP_RANGE & r = *it;
+        received += r.pos - r.begin;
+        if ((r.end >= 0) && (r.pos > r.end)) continue;
+
+        DP_SEGMENT seg;
+        seg.self = this;
+        seg.headers = NULL;
+        seg.fd = fd;
+        seg.range = &r;
+        seg.received = &received;
+        seg.size = state->size;
+        seg.ranged = (state->ranges.size() > 1) || (r.pos > 0);
+        seg.checked = false;
+        seg.notRanged = false;
+        seg.curl = curl_easy_duphandle( curl );
+        curl_easy_setopt(seg.curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(seg.curl, CURLOPT_HEADERFUNCTION, NULL);
+        curl_easy_setopt(seg.curl, CURLOPT_HEADERDATA, NULL);
+        curl_easy_setopt(seg.curl, CURLOPT_WRITEFUNCTION, __curl_datacb_segment);
+
+        // Ask for the rest of the range, only if the file is still the same
+        if (seg.ranged) {
+            std::ostringstream oss; oss << r.pos << "-";
+            if (r.end >= 0) oss << r.end;
+            ranges.push_back( oss.str() );
+            curl_easy_setopt(seg.curl, CURLOPT_RANGE, ranges.back().c_str());
+            if (!state->validator.empty()) {
+                seg.headers = curl_slist_append( NULL, ("If-Range: " + state->validator).c_str() );
+                curl_easy_setopt(seg.curl, CURLOPT_HTTPHEADER, seg.headers);
+            }
+        }
+        segs.push_back( seg );
+    }
+    for (std::vector< DP_SEGMENT >::iterator it = segs.begin(); it != segs.end(); ++it) {
+        curl_easy_setopt((*it).curl, CURLOPT_WRITEDATA, &(*it));
+        curl_multi_add_handle( multi, (*it).curl );
+    }
+
+    // Drive all of them from this thread until they complete or one fails
+    CVMWA_LOG("Info", "Downloading '" << url << "' over " << segs.size() << " connection(s), " << received << " bytes already present");
+    bool failed = false;
+    int running = 0;
+    long checkpoint = getMillis();
+    do {
+        curl_multi_perform( multi, &running );
+
+        // Check the completed transfers
+        CURLMsg * msg;
+        int left;
+        while ((msg = curl_multi_info_read( multi, &left )) != NULL) {
+            if ((msg->msg == CURLMSG_DONE) && (msg->data.result != CURLE_OK)) {
+                CVMWA_LOG("Error", "cURL Error #" << msg->data.result << " while downloading '" << url << "'");
+                failed = true;
+            }
+        }
+        if (failed) break;
+
+        // Let the digest catch-up with the ranges that are ahead of it
+        if (digest)
+            __digestReadBack( digest.get(), fd, *state, DP_DIGEST_READBACK );
+
+        // Regularly save what we have
+        if (!sidecar.empty() && (getMillis() - checkpoint > DP_CHECKPOINT_INTERVAL)) {
+            fsync( fd );
+            savePartial( sidecar, *state );
+            checkpoint = getMillis();
+        }
+
+        // Wait for activity on any of them
+        if (running > 0)
+            curl_multi_wait( multi, NULL, 0, 1000, NULL );
+
+    } while (running > 0);
+
+    // Release the handles
+    bool notRanged = false;
+    for (std::vector< DP_SEGMENT >::iterator it = segs.begin(); it != segs.end(); ++it) {
+        if ((*it).notRanged) notRanged = true;
+        if (((*it).range->end >= 0) && ((*it).range->pos != (*it).range->end + 1)) failed = true;
+        curl_multi_remove_handle( multi, (*it).curl );
+        curl_easy_cleanup( (*it).curl );
+        if ((*it).headers) curl_slist_free_all( (*it).headers );
+    }
+    curl_multi_cleanup( multi );
+
+    // Keep the state of an incomplete download
+    if (failed && !notRanged && !sidecar.empty()) {
+        fsync( fd );
+        savePartial( sidecar, *state );
+    }
+
+    if (notRanged) return HVE_NOT_SUPPORTED;
+    if (failed) return HVE_IO_ERROR;
+
+    // Hash what the digest has not seen yet
+    if (digest)
+        __digestReadBack( digest.get(), fd, *state, -1 );
+    return HVE_OK;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Prepare the handle for downloading a file
+ */
+void CURLProvider::prepareFile( const std::string& url, const VariableTaskPtr& pf, const DigestSinkPtr& digest ) {
+    CRASH_REPORT_BEGIN;
 
     // Setup CURL url
     CVMWA_LOG("Debug", "Downloading file from '" << url << "'");
@@ -178,6 +800,8 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
     // Store a local pointer
     this->pf = pf;
     this->maxStreamSize = 0;
+    this->digest = digest;
+    if (digest) digest->reset();
 
     // Reset timestamp
     if (pf) pf->__lastEventTime = getMillis();
@@ -191,6 +815,64 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, this); //sharedPtr.get() );
     curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return in how many ranges a file of the given size should be downloaded
+ */
+int CURLProvider::segmentsFor( curl_off_t size ) {
+    if ((segments < 2) || (size < 2 * DP_SEGMENT_MIN_SIZE)) return 1;
+    return (int) std::min( (curl_off_t) segments, size / DP_SEGMENT_MIN_SIZE );
+}
+
+/**
+ * Download a file using CURL
+ */
+int CURLProvider::downloadFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    return downloadFile( url, destination, pf, DigestSinkPtr() );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file using CURL, hashing it on the way
+ */
+int CURLProvider::downloadFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf, const DigestSinkPtr& digest ) {
+    CRASH_REPORT_BEGIN;
+    TRACE_SPAN("download", "downloadFile");
+    TRACE_SPAN_ARG("url", url);
+
+    // We are in operation
+    operationInstances++;
+    prepareFile( url, pf, digest );
+
+#ifndef _WIN32
+    // Use several connections for big files, if the server supports ranges
+    DP_PARTIAL remote;
+    std::string rangeURL;
+    if ((segments > 1) && (probeRanges( url, &remote, &rangeURL ) == HVE_OK) && (segmentsFor( remote.size ) > 1)) {
+        unsigned long long started = traceNowUs();
+        int ans = HVE_IO_ERROR;
+        __splitRanges( &remote, segmentsFor( remote.size ) );
+        int fd = __openPartial( destination, remote.size, true );
+        if (fd >= 0) {
+            ans = transferRanges( rangeURL, fd, &remote, "" );
+            close( fd );
+        }
+        if (ans != HVE_NOT_SUPPORTED) {
+            if ((ans == HVE_OK) && digest) digest->finish( remote.size );
+            __curl_metrics( "file", ans == HVE_OK, (ans == HVE_OK) ? remote.size : 0, started );
+            if ((ans == HVE_OK) && pf) pf->complete("Download completed");
+            if (ans == HVE_OK) CVMWA_LOG("Info", "cURL Download completed" );
+            operationInstances--;
+            return ans;
+        }
+        CVMWA_LOG("Info", "The server ignored the ranges, falling back to a single connection");
+        if (digest) digest->reset();
+    }
+#endif
     
     // Open local file
     CVMWA_LOG("Debug", "Oppening local output stream '" << destination << "'");
@@ -203,7 +885,9 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
     }
     
     // Initiate connection (we have specified CURLOPT_CONNECT_ONLY)
+    unsigned long long started = traceNowUs();
     CURLcode res = curl_easy_perform(curl);
+    __curl_metrics( "file", res == CURLE_OK, __curl_sizeDownloaded( curl ), started );
     if (res != CURLE_OK) {
         CVMWA_LOG("Error", "cURL Error #" << res );
         operationInstances--;
@@ -212,22 +896,123 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
         CVMWA_LOG("Info", "cURL Download completed" );
     }
 
-    // Notify completion
-    if (pf) pf->complete("Download completed");
-    
     // Close stream
     fStream.close();
+    if (digest) digest->finish( 0 );
+
+    // Notify completion
+    if (pf) pf->complete("Download completed");
     operationInstances--;
     return HVE_OK;
     
     CRASH_REPORT_END;
 }
 
+/**
+ * Download a file into '<destination>.part', keeping it together with a '.part.info' sidecar
+ * if the download fails. The next call resumes it with ranges, as long as the server still has
+ * the same file (checked with If-Range).
+ */
+int CURLProvider::resumeFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf, const DigestSinkPtr& digest ) {
+#ifdef _WIN32
+    return DownloadProvider::resumeFile( url, destination, pf, digest );
+#else
+    CRASH_REPORT_BEGIN;
+    TRACE_SPAN("download", "resumeFile");
+    TRACE_SPAN_ARG("url", url);
+    std::string partFile = destination + ".part";
+    std::string infoFile = partFile + ".info";
+    int ans = HVE_IO_ERROR;
+
+    // We are in operation
+    operationInstances++;
+    prepareFile( url, pf, digest );
+    unsigned long long started = traceNowUs();
+
+    // Check what the server has, and if it's what we have started downloading
+    DP_PARTIAL remote, local;
+    std::string rangeURL;
+    int probe = probeRanges( url, &remote, &rangeURL );
+    bool partial = file_exists( partFile ) && loadPartial( infoFile, &local ) && (local.url == url);
+    bool ranges = (probe == HVE_OK);
+    bool resume = ranges && partial && !remote.validator.empty() &&
+                  (local.validator == remote.validator) && (local.size == remote.size);
+
+    // Do not throw away what we have because the server is unreachable right now
+    if ((probe == HVE_IO_ERROR) && partial) {
+        CVMWA_LOG("Error", "Unable to reach '" << url << "', keeping the partial download");
+        __curl_metrics( "file", false, 0, started );
+        operationInstances--;
+        return HVE_IO_ERROR;
+    }
+
+    // (Twice if the server refused to resume, to start over)
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (resume) {
+            CVMWA_LOG("Info", "Resuming the download of '" << url << "'");
+        } else {
+            local = remote;
+            __splitRanges( &local, ranges ? segmentsFor( remote.size ) : 1 );
+        }
+
+        // Without a validator we cannot tell if the file changed, so it's not resumable
+        int fd = __openPartial( partFile, local.size, !resume );
+        if (fd < 0) {
+            ans = HVE_IO_ERROR;
+            break;
+        }
+        std::string sidecar = local.validator.empty() ? "" : infoFile;
+        if (!sidecar.empty()) savePartial( sidecar, local );
+        if (digest) digest->reset();
+        ans = transferRanges( rangeURL, fd, &local, sidecar );
+        close( fd );
+
+        if (ans != HVE_NOT_SUPPORTED) break;
+        CVMWA_LOG("Info", "The server did not return the requested ranges, downloading again from the beginning");
+        resume = false;
+        ranges = false;
+    }
+
+    // Measure what we got in this call
+    curl_off_t bytes = 0;
+    for (std::vector< DP_RANGE >::iterator it = local.ranges.begin(); it != local.ranges.end(); ++it)
+        bytes += (*it).pos - (*it).begin;
+    __curl_metrics( "file", ans == HVE_OK, bytes, started );
+
+    if (ans == HVE_OK) {
+
+        // Put the completed file in place
+        if (digest) digest->finish( local.size );
+        ::remove( infoFile.c_str() );
+        if (::rename( partFile.c_str(), destination.c_str() ) != 0) {
+            CVMWA_LOG("Error", "Unable to rename '" << partFile << "' (errno=" << errno << ")");
+            ans = HVE_IO_ERROR;
+        } else {
+            CVMWA_LOG("Info", "cURL Download completed" );
+            if (pf) pf->complete("Download completed");
+        }
+
+    } else if (local.validator.empty()) {
+
+        // Nothing we can resume
+        ::remove( partFile.c_str() );
+        ::remove( infoFile.c_str() );
+
+    }
+
+    operationInstances--;
+    return ans;
+    CRASH_REPORT_END;
+#endif
+}
+
 /**
  * Download a file using CURL
  */
 int CURLProvider::downloadText( const std::string& url, std::string * destination, const VariableTaskPtr& pf ) {
     CRASH_REPORT_BEGIN;
+    TRACE_SPAN("download", "downloadText");
+    TRACE_SPAN_ARG("url", url);
     
     // We are in operation
     operationInstances++;
@@ -261,7 +1046,9 @@ int CURLProvider::downloadText( const std::string& url, std::string * destinatio
     sStream.str("");
     
     // Initiate connection (we have specified CURLOPT_CONNECT_ONLY)
+    unsigned long long started = traceNowUs();
     CURLcode res = curl_easy_perform(curl);
+    __curl_metrics( "text", res == CURLE_OK, __curl_sizeDownloaded( curl ), started );
     if (res != CURLE_OK) {
         CVMWA_LOG("Error", "cURL Error #" << res );
         sStream.str("");
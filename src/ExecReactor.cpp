@@ -0,0 +1,638 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/ExecReactor.h>
+#include <CernVM/ExecScheduler.h>
+#include <CernVM/TraceEvent.h>
+
+using namespace std;
+
+/* Global abort flag of sysExec() (Utilities.cpp) */
+extern bool sysExecAborted;
+
+/////////////////////////////////////
+// ExecHandle
+/////////////////////////////////////
+
+/**
+ * Return a handle that has already completed with the given exit code
+ */
+ExecHandlePtr ExecHandle::Completed( int exitCode ) {
+    CRASH_REPORT_BEGIN;
+    ExecHandlePtr handle = boost::make_shared<ExecHandle>( "", std::vector<std::string>(), SysExecConfig::Default() );
+    handle->complete( exitCode );
+    return handle;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait for the command to complete and return it's exit code
+ */
+int ExecHandle::wait() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!done) cond.wait(lock);
+    return exitCode;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait up to the given time for the command to complete
+ */
+bool ExecHandle::waitFor( int timeoutMs ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::system_time const timeout = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMs);
+    while (!done) {
+        if (!cond.timed_wait(lock, timeout)) break;
+    }
+    return done;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Kill this command
+ */
+void ExecHandle::cancel() {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (done) return;
+        cancelRequested = true;
+    }
+    if (reactor != NULL) reactor->withdraw( this );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the command has completed
+ */
+bool ExecHandle::isDone() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return done;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark the handle as completed and wake-up the waiters
+ */
+void ExecHandle::complete( int code ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        exitCode = code;
+        done = true;
+    }
+    cond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Line consumer used when no custom one is specified
+ */
+void ExecHandle::collectLine( const std::string& line ) {
+    stdoutList.push_back( line );
+}
+
+/**
+ * Discard the output of a failed attempt before the command is retried
+ */
+void ExecHandle::discardOutput() {
+    stdoutList.clear();
+    if (onRetry) onRetry();
+}
+
+/////////////////////////////////////
+// ExecReactor
+/////////////////////////////////////
+
+/**
+ * Constructor
+ */
+ExecReactor::ExecReactor() :
+#ifdef __linux__
+    epfd(-1), wakeFd(-1), active(), fdHandles(),
+#endif
+    queueMutex(), pending(), queued(), reactorThread(NULL), cancelAllRequested(false), stopRequested(false) {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+
+    // Prepare the epoll set and the wake-up descriptor
+    epfd = epoll_create1( EPOLL_CLOEXEC );
+    wakeFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+    struct epoll_event ev;
+    ev.events = EPOLLIN; ev.data.fd = wakeFd;
+    epoll_ctl( epfd, EPOLL_CTL_ADD, wakeFd, &ev );
+
+    // Wake-up also on abortSysExec(), but only once per call
+    if (__sysExecAbortFd() >= 0) {
+        ev.events = EPOLLIN | EPOLLET; ev.data.fd = __sysExecAbortFd();
+        epoll_ctl( epfd, EPOLL_CTL_ADD, __sysExecAbortFd(), &ev );
+    }
+
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Destructor
+ */
+ExecReactor::~ExecReactor() {
+    CRASH_REPORT_BEGIN;
+
+    // Cancel the commands still running and stop the reactor thread
+    cancelAll();
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        stopRequested = true;
+    }
+    if (reactorThread != NULL) {
+        notify();
+        reactorThread->join();
+        delete reactorThread;
+    }
+
+#ifdef __linux__
+    // Release descriptors
+    if (epfd >= 0) close(epfd);
+    if (wakeFd >= 0) close(wakeFd);
+#endif
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Global function to return the process-wide reactor
+ */
+ExecReactor& ExecReactor::Default() {
+    static ExecReactor reactor;
+    return reactor;
+}
+
+/**
+ * Start the given command and return immediately a handle to it
+ */
+ExecHandlePtr ExecReactor::exec( const std::string& app, const std::vector<std::string>& args, const SysExecConfig& config, const callbackExecDone& onDone, const callbackLine& onLine, const callbackVoid& onRetry, ExecScheduler * scheduler ) {
+    CRASH_REPORT_BEGIN;
+
+    // Prepare handle
+    ExecHandlePtr handle = boost::make_shared<ExecHandle>( app, args, config );
+    handle->onDone = onDone;
+    handle->onLine = onLine;
+    handle->onRetry = onRetry;
+    if (!handle->onLine)
+        handle->onLine = boost::bind( &ExecHandle::collectLine, handle.get(), _1 );
+    handle->reactor = this;
+    handle->scheduler = scheduler;
+    handle->started = traceNowUs();
+
+    CVMWA_LOG("Debug", "Queuing: " << app << " " << joinArguments(args));
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+
+        // Wait for a slot in our queue instead of the caller's thread
+        // (grant() cannot run before we are done here, since it needs the queueMutex)
+        if (scheduler != NULL) {
+            if (!scheduler->acquireAsync( config.priority, config.owner, boost::bind( &ExecReactor::grant, this, handle ), &handle->ticket )) {
+                queued.push_back( handle );
+                return handle;
+            }
+            handle->granted = true;
+        }
+
+        start( handle );
+    }
+    notify();
+    return handle;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Pass the handle to the reactor thread
+ */
+void ExecReactor::start( const ExecHandlePtr& handle ) {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+
+    // Pass it to the reactor thread, starting it if needed
+    pending.push_back( handle );
+    if (reactorThread == NULL)
+        reactorThread = new boost::thread( boost::bind( &ExecReactor::reactorLoop, this ) );
+
+#else
+
+    // Drive it from a dedicated thread
+    boost::thread runner( boost::bind( &ExecReactor::fallbackRun, this, handle ) );
+    runner.detach();
+
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * A queued handle was granted a scheduler slot
+ */
+void ExecReactor::grant( const ExecHandlePtr& handle ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        queued.remove( handle );
+        handle->granted = true;
+
+        // Too late, the reactor thread is gone
+        if (stopRequested) {
+            lock.unlock();
+            handle->stderrMsg = "ERROR: Aborted";
+            finish( handle, 254 );
+            return;
+        }
+
+        start( handle );
+    }
+    notify();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Take a cancelled handle out of the scheduler queue
+ */
+void ExecReactor::withdraw( ExecHandle * handle ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        for (std::list< ExecHandlePtr >::iterator it = queued.begin(); it != queued.end(); ++it) {
+            if (it->get() != handle) continue;
+
+            // Let the reactor thread complete it, unless it was granted a slot meanwhile
+            // (then grant() is about to pass it, and it's killed before it starts)
+            if (handle->scheduler->cancelAsync( handle->ticket )) {
+                ExecHandlePtr h = *it;
+                queued.erase( it );
+                start( h );
+            }
+            break;
+        }
+    }
+    notify();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cancel all the active commands
+ */
+void ExecReactor::cancelAll() {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(queueMutex);
+        cancelAllRequested = true;
+
+        // Also those still waiting for a slot
+        for (std::list< ExecHandlePtr >::iterator it = queued.begin(); it != queued.end(); ) {
+            ExecHandlePtr h = *it;
+            {
+                boost::unique_lock<boost::mutex> handleLock(h->mutex);
+                h->cancelRequested = true;
+            }
+            if (h->scheduler->cancelAsync( h->ticket )) {
+                it = queued.erase( it );
+                start( h );
+            } else {
+                ++it;
+            }
+        }
+    }
+    notify();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wake-up the reactor thread
+ */
+void ExecReactor::notify() {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+    if (wakeFd >= 0) eventfd_write( wakeFd, 1 );
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fire the completion of the given handle
+ */
+void ExecReactor::finish( const ExecHandlePtr& handle, int code ) {
+    CRASH_REPORT_BEGIN;
+    CVMWA_LOG("Debug", "Exec EXIT_CODE: " << code << " (" << handle->app << " " << joinArguments(handle->args) << ")");
+#ifdef __linux__
+    // (Without epoll, the commands are accounted by sysExec)
+    __sysExecRecordMetrics( handle->app, handle->args, handle->tries, code, handle->started );
+#endif
+
+    // Pass the slot to the next queued command
+    if (handle->granted) {
+        handle->granted = false;
+        handle->scheduler->release();
+    }
+
+    // Complete handle
+    handle->complete( code );
+
+    // Fire the callback, without letting it take down the reactor
+    if (handle->onDone) {
+        try {
+            handle->onDone( handle );
+        } catch (std::exception &e) {
+            CVMWA_LOG("Error", "Exception in exec completion callback: " << e.what());
+        }
+    }
+
+    CRASH_REPORT_END;
+}
+
+#ifdef __linux__
+
+/**
+ * Start or stop watching the given descriptor
+ */
+void ExecReactor::watch( int fd, const ExecHandlePtr& handle ) {
+    if (fd < 0) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN; ev.data.fd = fd;
+    epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev );
+    fdHandles[fd] = handle;
+}
+void ExecReactor::unwatch( int fd ) {
+    if (fd < 0) return;
+    epoll_ctl( epfd, EPOLL_CTL_DEL, fd, NULL );
+    fdHandles.erase( fd );
+}
+
+/**
+ * Close the descriptors of the running attempt
+ */
+void ExecReactor::release( const ExecHandlePtr& h ) {
+    CRASH_REPORT_BEGIN;
+    int * fds[3] = { &h->outfd, &h->errfd, &h->pidfd };
+    for (int i=0; i<3; i++) {
+        if (*fds[i] < 0) continue;
+        unwatch( *fds[i] );
+        close( *fds[i] );
+        *fds[i] = -1;
+    }
+    h->outOpen = false;
+    h->errOpen = false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start a new attempt for the given handle
+ */
+bool ExecReactor::spawn( const ExecHandlePtr& h, long now ) {
+    CRASH_REPORT_BEGIN;
+
+    // Check if app does not exist
+    if (!file_exists(h->app)) {
+        finish( h, 252 );
+        return false;
+    }
+
+    // Let the consumer discard the output of the previous attempt
+    if (h->tries > 0) h->discardOutput();
+
+    // Reset attempt state
+    h->outBuffer = "";
+    h->errBuffer = "";
+    h->exited = false;
+    h->status = 0;
+    h->deadline = now + h->config.timeout;
+
+    // Spawn child
+    CVMWA_LOG("Debug", "Executing: " << h->app << " " << joinArguments(h->args));
+    h->pid = __sysExecFork( h->app, h->args, &h->outfd, &h->errfd );
+    if (h->pid == -1) {
+        h->pid = 0;
+        finish( h, 254 );
+        return false;
+    }
+
+    // Watch everything
+    h->outOpen = true;
+    h->errOpen = true;
+    h->pidfd = syscall(__NR_pidfd_open, h->pid, 0);
+    watch( h->outfd, h );
+    watch( h->errfd, h );
+    watch( h->pidfd, h );
+    return true;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Advance the state of the given handle, returning false when it's completed
+ */
+bool ExecReactor::step( const ExecHandlePtr& h, long now, bool cancel ) {
+    CRASH_REPORT_BEGIN;
+
+    // Check for cancellation
+    {
+        boost::unique_lock<boost::mutex> lock(h->mutex);
+        if (cancel) h->cancelRequested = true;
+        cancel = h->cancelRequested;
+    }
+
+    // Not running (new or waiting for a retry)
+    if (h->pid == 0) {
+        if (cancel || sysExecAborted) {
+            h->stderrMsg = "ERROR: Aborted";
+            finish( h, 254 );
+            return false;
+        }
+        if (now < h->retryAt) return true;
+        return spawn( h, now );
+    }
+
+    // Kill if aborted, or if it takes way too long
+    if (cancel || sysExecAborted || (now >= h->deadline)) {
+        bool timedOut = !cancel && !sysExecAborted;
+        kill( h->pid, SIGKILL );
+        release( h );
+        waitpid( h->pid, &h->status, 0 );
+        h->pid = 0;
+        if (timedOut) {
+            CVMWA_LOG("Debug", "Timed out while waiting for response");
+            h->stderrMsg = "ERROR: Timed out";
+            finish( h, 255 );
+        } else {
+            CVMWA_LOG("Debug", "Aborting execution");
+            h->stderrMsg = "ERROR: Aborted";
+            finish( h, 254 );
+        }
+        return false;
+    }
+
+    // Without a pidfd, the child is reaped after both pipes hang-up
+    bool reaped = false;
+    if ((h->pidfd < 0) && !h->outOpen && !h->errOpen && !h->exited) {
+        if (waitpid( h->pid, &h->status, WNOHANG ) == h->pid) {
+            h->exited = true;
+            reaped = true;
+        }
+    }
+    if (!h->exited) return true;
+
+    // The child has exited. Whatever it wrote is already in the pipes,
+    // so don't wait for grandchildren that might still hold them open.
+    if (h->outOpen) __sysExecDrain( h->outfd, &h->outBuffer );
+    if (h->errOpen) __sysExecDrain( h->errfd, &h->errBuffer );
+    __sysExecFeedLines( &h->outBuffer, h->onLine, true );
+    release( h );
+    if (!reaped) waitpid( h->pid, &h->status, 0 );
+    h->pid = 0;
+
+    // Apply the same rules as sysExec()
+    int res = h->status;
+    string stdError = h->errBuffer;
+    h->tries++;
+    if (__sysExecCheckResult( &res, stdError, &h->stderrMsg, h->config ) || (h->tries >= h->config.retries)) {
+        finish( h, res );
+        return false;
+    }
+
+    // Schedule retry
+    CVMWA_LOG( "Info", "Going to retry in " << SYSEXEC_RETRY_DELAY << "ms. Try " << h->tries << "/" << h->config.retries  );
+    h->retryAt = now + SYSEXEC_RETRY_DELAY;
+    return true;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * The reactor thread main loop
+ */
+void ExecReactor::reactorLoop() {
+    CRASH_REPORT_BEGIN;
+    struct epoll_event events[32];
+    int numEvents, waitMs;
+    long now, nextTime;
+    bool cancel, stop;
+
+    for (;;) {
+
+        // Pick new commands and requests (stopping cancels everything)
+        {
+            boost::unique_lock<boost::mutex> lock(queueMutex);
+            active.splice( active.end(), pending );
+            stop = stopRequested;
+            cancel = cancelAllRequested || stop;
+            cancelAllRequested = false;
+        }
+
+        // Advance the state of all commands and find when we should wake-up next
+        now = getMonotonicMillis();
+        waitMs = -1;
+        for (std::list< ExecHandlePtr >::iterator it = active.begin(); it != active.end(); ) {
+            ExecHandlePtr h = *it;
+            if (!step( h, now, cancel )) {
+                it = active.erase( it );
+                continue;
+            }
+
+            // Running commands wake us up on their deadline, idle ones on their retry
+            nextTime = (h->pid != 0) ? h->deadline : h->retryAt;
+            if ((h->pid != 0) && (h->pidfd < 0) && !h->outOpen && !h->errOpen)
+                nextTime = now + SYSEXEC_SLEEP_DELAY;
+            if (nextTime < now) nextTime = now;
+            if ((waitMs < 0) || (nextTime - now < waitMs))
+                waitMs = (int)(nextTime - now);
+            ++it;
+        }
+
+        // When cancelling, every command has completed by now
+        if (stop) break;
+
+        // Sleep until something happens
+        numEvents = epoll_wait( epfd, events, 32, waitMs );
+        for (int i=0; i<numEvents; i++) {
+            int fd = events[i].data.fd;
+
+            // Drain wake-up notifications
+            if (fd == wakeFd) {
+                eventfd_t value;
+                eventfd_read( wakeFd, &value );
+                continue;
+            }
+
+            // Find the command this descriptor belongs to
+            std::map< int, ExecHandlePtr >::iterator jt = fdHandles.find( fd );
+            if (jt == fdHandles.end()) continue;
+            ExecHandlePtr h = jt->second;
+
+            if (fd == h->outfd) {
+                h->outOpen = __sysExecDrain( fd, &h->outBuffer );
+                if (!h->outOpen) unwatch( fd );
+                __sysExecFeedLines( &h->outBuffer, h->onLine, false );
+
+            } else if (fd == h->errfd) {
+                h->errOpen = __sysExecDrain( fd, &h->errBuffer );
+                if (!h->errOpen) unwatch( fd );
+
+            } else if (fd == h->pidfd) {
+                h->exited = true;
+                unwatch( fd );
+
+            }
+        }
+
+    }
+
+    CRASH_REPORT_END;
+}
+
+#else
+
+/**
+ * Thread body driving a single command on platforms without epoll
+ */
+void ExecReactor::fallbackRun( const ExecHandlePtr& h ) {
+    CRASH_REPORT_BEGIN;
+    SysExecConfig config( h->config );
+    string stdError;
+    int res;
+
+    // Honor cancellations that arrived before we started
+    {
+        boost::unique_lock<boost::mutex> lock(h->mutex);
+        if (h->cancelRequested) {
+            h->stderrMsg = "ERROR: Aborted";
+            lock.unlock();
+            finish( h, 254 );
+            return;
+        }
+    }
+
+    // Run the command
+    res = sysExec( h->app, h->args, h->onLine, &stdError, config, boost::bind( &ExecHandle::discardOutput, h.get() ) );
+    h->stderrMsg = stdError;
+    finish( h, res );
+
+    CRASH_REPORT_END;
+}
+
+#endif
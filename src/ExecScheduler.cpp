@@ -0,0 +1,280 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/ExecScheduler.h>
+#include <CernVM/CrashReport.h>
+
+using namespace std;
+
+/**
+ * Clamp the priority in the valid range
+ */
+static int __execPriority( int priority ) {
+    if (priority < 0) return 0;
+    if (priority >= EXEC_SCHEDULER_PRIORITIES) return EXEC_SCHEDULER_PRIORITIES-1;
+    return priority;
+}
+
+/**
+ * Constructor
+ */
+ExecScheduler::ExecScheduler( int maxConcurrency ) : maxConcurrency(maxConcurrency), running(0), asyncWaiters(), lastTicket(0), mutex(), cond() {
+    CRASH_REPORT_BEGIN;
+    if (this->maxConcurrency < 1) this->maxConcurrency = 1;
+    for (int i=0; i<EXEC_SCHEDULER_PRIORITIES; ++i) {
+        EXEC_QUEUE_STATS empty = { 0, 0, 0, 0, 0 };
+        stats[i] = empty;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Take a slot right away if one is free and nobody is waiting
+ */
+bool ExecScheduler::tryFastPath( int priority ) {
+    if (running >= maxConcurrency) return false;
+    for (int i=0; i<EXEC_SCHEDULER_PRIORITIES; ++i)
+        if (!rotation[i].empty()) return false;
+    running++;
+    stats[priority].scheduled++;
+    return true;
+}
+
+/**
+ * Wait for a free slot
+ */
+void ExecScheduler::acquire( int priority, const string& owner ) {
+    CRASH_REPORT_BEGIN;
+    priority = __execPriority( priority );
+    std::list< callbackVoid > granted;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    EXEC_QUEUE_STATS& st = stats[priority];
+
+    // Fast path when nobody is waiting
+    if (tryFastPath( priority )) return;
+
+    // Enqueue in the owner's queue
+    TRACE_SPAN("exec", "queued");
+    TRACE_SPAN_ARG("owner", owner);
+    TRACE_SPAN_ARG("priority", priority);
+    Waiter waiter = { false, getMonotonicMillis(), 0, callbackVoid() };
+    std::deque< Waiter* >& queue = queues[priority][owner];
+    if (queue.empty()) rotation[priority].push_back( owner );
+    queue.push_back( &waiter );
+    if (++st.queued > st.maxQueued) st.maxQueued = st.queued;
+    dispatch( &granted );
+    if (!granted.empty()) {
+        lock.unlock();
+        fire( granted );
+        granted.clear();
+        lock.lock();
+    }
+
+    // Wait until we are granted a slot
+    try {
+        while (!waiter.granted) cond.wait(lock);
+    } catch (boost::thread_interrupted &e) {
+        if (waiter.granted) {
+            running--;
+            dispatch( &granted );
+        } else {
+            dequeue( priority, owner, &waiter );
+            st.queued--;
+        }
+        lock.unlock();
+        fire( granted );
+        throw;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Queue for a free slot without waiting for it
+ */
+bool ExecScheduler::acquireAsync( int priority, const string& owner, const callbackVoid& onGrant, unsigned long * ticket ) {
+    CRASH_REPORT_BEGIN;
+    priority = __execPriority( priority );
+    std::list< callbackVoid > granted;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    EXEC_QUEUE_STATS& st = stats[priority];
+
+    // Fast path when nobody is waiting
+    if (tryFastPath( priority )) return true;
+
+    // Enqueue in the owner's queue, where it's served like the blocking waiters
+    AsyncWaiter * async = new AsyncWaiter();
+    async->priority = priority;
+    async->owner = owner;
+    async->waiter.granted = false;
+    async->waiter.since = getMonotonicMillis();
+    async->waiter.ticket = ++lastTicket;
+    async->waiter.onGrant = onGrant;
+    asyncWaiters[ async->waiter.ticket ] = async;
+    *ticket = async->waiter.ticket;
+
+    std::deque< Waiter* >& queue = queues[priority][owner];
+    if (queue.empty()) rotation[priority].push_back( owner );
+    queue.push_back( &async->waiter );
+    if (++st.queued > st.maxQueued) st.maxQueued = st.queued;
+    dispatch( &granted );
+    lock.unlock();
+
+    // (Only other waiters can be granted here, since this one is queued last)
+    fire( granted );
+    return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remove a command queued with acquireAsync() that was not granted a slot yet
+ */
+bool ExecScheduler::cancelAsync( unsigned long ticket ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map< unsigned long, AsyncWaiter* >::iterator it = asyncWaiters.find( ticket );
+    if (it == asyncWaiters.end()) return false;
+    AsyncWaiter * async = it->second;
+    asyncWaiters.erase( it );
+    dequeue( async->priority, async->owner, &async->waiter );
+    stats[async->priority].queued--;
+    delete async;
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release a slot and pass it to the next waiting command
+ */
+void ExecScheduler::release() {
+    CRASH_REPORT_BEGIN;
+    std::list< callbackVoid > granted;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        running--;
+        dispatch( &granted );
+    }
+    fire( granted );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fire the grant callbacks of the asynchronous waiters
+ */
+void ExecScheduler::fire( const std::list< callbackVoid >& granted ) {
+    for (std::list< callbackVoid >::const_iterator it = granted.begin(); it != granted.end(); ++it)
+        (*it)();
+}
+
+/**
+ * Grant the free slots, by priority and round-robin between the owners
+ */
+void ExecScheduler::dispatch( std::list< callbackVoid > * grantedAsync ) {
+    bool granted = false;
+    for (int p=0; (p<EXEC_SCHEDULER_PRIORITIES) && (running < maxConcurrency); ) {
+        if (rotation[p].empty()) { ++p; continue; }
+
+        // Serve the next owner and move it at the end of the line
+        string owner = rotation[p].front();
+        rotation[p].pop_front();
+        std::deque< Waiter* >& queue = queues[p][owner];
+        Waiter * waiter = queue.front();
+        queue.pop_front();
+        if (queue.empty()) {
+            queues[p].erase( owner );
+        } else {
+            rotation[p].push_back( owner );
+        }
+
+        // Update metrics
+        unsigned long waited = (unsigned long)( getMonotonicMillis() - waiter->since );
+        stats[p].totalWaitMs += waited;
+        if (waited > stats[p].maxWaitMs) stats[p].maxWaitMs = waited;
+        stats[p].queued--;
+        stats[p].scheduled++;
+        running++;
+
+        // Asynchronous waiters are called back, the others are woken up
+        if (waiter->onGrant) {
+            std::map< unsigned long, AsyncWaiter* >::iterator it = asyncWaiters.find( waiter->ticket );
+            grantedAsync->push_back( waiter->onGrant );
+            if (it != asyncWaiters.end()) {
+                delete it->second;
+                asyncWaiters.erase( it );
+            }
+        } else {
+            waiter->granted = true;
+            granted = true;
+        }
+    }
+    if (granted) cond.notify_all();
+}
+
+/**
+ * Remove a waiter that gave up
+ */
+void ExecScheduler::dequeue( int priority, const string& owner, Waiter * waiter ) {
+    std::map< std::string, std::deque< Waiter* > >::iterator it = queues[priority].find( owner );
+    if (it == queues[priority].end()) return;
+    for (std::deque< Waiter* >::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+        if (*w == waiter) {
+            it->second.erase( w );
+            break;
+        }
+    }
+    if (it->second.empty()) {
+        queues[priority].erase( it );
+        rotation[priority].remove( owner );
+    }
+}
+
+/**
+ * Change the maximum concurrency
+ */
+void ExecScheduler::setMaxConcurrency( int maxConcurrency ) {
+    CRASH_REPORT_BEGIN;
+    std::list< callbackVoid > granted;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        this->maxConcurrency = (maxConcurrency < 1) ? 1 : maxConcurrency;
+        dispatch( &granted );
+    }
+    fire( granted );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a snapshot of the metrics of the given priority class
+ */
+EXEC_QUEUE_STATS ExecScheduler::getStats( int priority ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return stats[ __execPriority(priority) ];
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the number of running commands
+ */
+int ExecScheduler::getRunning() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return running;
+    CRASH_REPORT_END;
+}
@@ -0,0 +1,144 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/FSMExecutor.h>
+
+/**
+ * Start the worker threads
+ */
+FSMExecutor::FSMExecutor( int threads ) : workers(), queue(), stopRequested(false), mutex(), cond() {
+    CRASH_REPORT_BEGIN;
+    if (threads < 1) threads = 1;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (int i=0; i<threads; ++i)
+        workers.push_back( new boost::thread( boost::bind( &FSMExecutor::workerMain, this ) ) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the worker threads
+ */
+FSMExecutor::~FSMExecutor() {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stopRequested = true;
+        queue.clear();
+    }
+    cond.notify_all();
+    for (std::vector< boost::thread* >::iterator it = workers.begin(); it != workers.end(); ++it) {
+        (*it)->interrupt();
+        (*it)->join();
+        delete *it;
+    }
+    workers.clear();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Queue a task
+ */
+void FSMExecutor::post( const callbackVoid& task ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (stopRequested) return;
+        queue.push_back( task );
+    }
+    cond.notify_one();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the worker thread of the caller
+ */
+boost::thread * FSMExecutor::currentWorker( ) {
+    CRASH_REPORT_BEGIN;
+    boost::thread::id self = boost::this_thread::get_id();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (std::vector< boost::thread* >::iterator it = workers.begin(); it != workers.end(); ++it) {
+        if ((*it)->get_id() == self) return *it;
+    }
+    return NULL;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the number of the worker threads
+ */
+int FSMExecutor::getThreads( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return workers.size();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the number of the queued tasks
+ */
+int FSMExecutor::getQueued( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queue.size();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Run the queued tasks until we are stopped
+ */
+void FSMExecutor::workerMain( ) {
+    CRASH_REPORT_BEGIN;
+    while (true) {
+        callbackVoid task;
+
+        // Wait for a task
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            try {
+                while (queue.empty() && !stopRequested) cond.wait(lock);
+            } catch (boost::thread_interrupted &e) {
+                // Only the destructor interrupts idle workers
+            }
+            if (stopRequested) return;
+            task = queue.front();
+            queue.pop_front();
+        }
+
+        // Run it
+        try {
+            task();
+        } catch (boost::thread_interrupted &e) {
+            CVMWA_LOG("Debug", "FSM task interrupted");
+        } catch ( std::exception &e ) {
+            CVMWA_LOG("Exception", e.what() );
+        } catch ( ... ) {
+            CVMWA_LOG("Exception", "Unknown exception" );
+        }
+
+        // Clear a pending interruption of the task, so that
+        // it does not leak to the next one
+        try {
+            boost::this_thread::interruption_point();
+        } catch (boost::thread_interrupted &e) {
+        }
+
+    }
+    CRASH_REPORT_END;
+}
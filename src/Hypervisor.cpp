@@ -35,6 +35,7 @@
 #include "CernVM/Utilities.h"
 #include "CernVM/Hypervisor.h"
 #include "CernVM/DaemonCtl.h"
+#include "CernVM/ApiProber.h"
 
 #include "contextiso.h"
 #include "floppyIO.h"
@@ -338,7 +339,7 @@ bool HVSession::isAPIAlive( unsigned char handshake, int timeoutSec ) {
     CRASH_REPORT_BEGIN;
     std::string ip = this->getAPIHost();
     if (ip.empty()) return false;
-    return isPortOpen( ip.c_str(), this->getAPIPort(), handshake, timeoutSec );
+    return ApiProber::Default().probe( ip, this->getAPIPort(), handshake, timeoutSec * 1000 );
     CRASH_REPORT_END;
 }
 
@@ -628,6 +629,7 @@ int __downloadFile( const std::string & fileURL, const std::string & sOutFilenam
     // Start actual file download and validation
     if (pf) pf->doing("Preparing file download");
     for (int i=0; i<retries; i++) {
+        std::string     sChecksumFile = "";
 
         // (3) If file does not exist, download it
         if (!file_exists(sOutFilename)) {
@@ -635,23 +637,25 @@ int __downloadFile( const std::string & fileURL, const std::string & sOutFilenam
             // Restart VariableTaskPtr
             if (pfDownload) pfDownload->restart("Downloading file", false);
 
-            // Download file
-            ans = downloadProvider->downloadFile( fileURL, sOutFilename, pfDownload );
+            // Download file (keeping what we got for the next try)
+            DigestSinkPtr digest = boost::make_shared<DigestSink>();
+            ans = downloadProvider->resumeFile( fileURL, sOutFilename, pfDownload, digest );
             if (ans != HVE_OK) {
-                // Invalid contents. Erase and re-download
-                if (pf) pf->doing("Error while downloading. Will retry.");
-                ::remove( sOutFilename.c_str());
+                if (pf) pf->doing("Error while downloading. Will resume.");
                 continue;
             }
 
+            // We might have the checksum already
+            sChecksumFile = digest->hex;
+
         }
 
         // (4) File exists, validate contents
         if (file_exists(sOutFilename)) {
 
-            // Calculate checksum
-            std::string     sChecksumFile = "";
-            sha256_file( sOutFilename, &sChecksumFile );
+            // Calculate checksum (if not calculated while downloading)
+            if (sChecksumFile.empty())
+                sha256_file( sOutFilename, &sChecksumFile );
 
             // Compare checksums
             if (sChecksumFile.compare( sChecksumString ) != 0) {
@@ -815,6 +819,7 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
     // Start actual file download and validation
     pfDownload = pf->begin<VariableTask>("Downloading file");
     for (int i=0; i<retries; i++) {
+        std::string  sChecksumFile = "";
 
         // (1) If no file exists, download compressed file
         if ( !file_exists(sExtractedFilename) && !file_exists(sOutFilename) ) {
@@ -822,23 +827,25 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
             // Restart VariableTaskPtr
             if (pfDownload) pfDownload->restart("Downloading compressed file", false);
 
-            // Download file
-            ans = dp->downloadFile( fileURL, sOutFilename, pfDownload );
+            // Download file (keeping what we got for the next try)
+            DigestSinkPtr digest = boost::make_shared<DigestSink>();
+            ans = dp->resumeFile( fileURL, sOutFilename, pfDownload, digest );
             if (ans != HVE_OK) {
-                // Invalid contents. Erase and re-download
-                if (pf) pf->doing("Error while downloading. Will retry.");
-                ::remove( sOutFilename.c_str());
+                if (pf) pf->doing("Error while downloading. Will resume.");
                 continue;
             }
 
+            // We might have the checksum already
+            sChecksumFile = digest->hex;
+
         }
 
         // (2) If input file exists, but no extracted file exists, decompress
         if ( !file_exists(sExtractedFilename) && file_exists(sOutFilename) ) {
 
-            // Validate downloaded file checksum
-            std::string  sChecksumFile = "";
-            sha256_file( sOutFilename, &sChecksumFile );
+            // Validate downloaded file checksum (if not calculated while downloading)
+            if (sChecksumFile.empty())
+                sha256_file( sOutFilename, &sChecksumFile );
 
             // Compare checksums
             if (sChecksumFile.compare( checksumString ) != 0) {
@@ -895,25 +902,87 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
 }
 
 
+/**
+ * Helper functions to collect the streamed lines into a vector
+ */
+void __execCollectLine( vector<string> * stdoutList, const string& line ) {
+    stdoutList->push_back( line );
+}
+void __execClearLines( vector<string> * stdoutList ) {
+    stdoutList->clear();
+}
+
 /**
  * Cross-platform exec and return for the hypervisor control binary
  */
 int HVInstance::exec( string args, vector<string> * stdoutList, string * stderrMsg, const SysExecConfig& config ) {
     CRASH_REPORT_BEGIN;
+    vector<string> argv;
+    splitArguments( args, &argv );
+    return this->exec( argv, stdoutList, stderrMsg, config );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cross-platform exec for the hypervisor control binary that streams the output lines
+ */
+int HVInstance::exec( string args, const callbackLine& onLine, string * stderrMsg, const SysExecConfig& config, const callbackVoid& onRetry ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> argv;
+    splitArguments( args, &argv );
+    return this->exec( argv, onLine, stderrMsg, config, onRetry );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cross-platform exec and return for the hypervisor control binary, using an argument vector
+ */
+int HVInstance::exec( const vector<string>& args, vector<string> * stdoutList, string * stderrMsg, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+
+    /* Without a buffer, just discard the output */
+    if (stdoutList == NULL)
+        return this->exec( args, callbackLine(), stderrMsg, config );
+
+    /* Otherwise collect the lines of the last attempt */
+    stdoutList->clear();
+    return this->exec( args, 
+                       boost::bind( &__execCollectLine, stdoutList, _1 ), 
+                       stderrMsg, config, 
+                       boost::bind( &__execClearLines, stdoutList ) );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cross-platform exec for the hypervisor control binary, using an argument vector
+ * and streaming the output lines
+ */
+int HVInstance::exec( const vector<string>& args, const callbackLine& onLine, string * stderrMsg, const SysExecConfig& config, const callbackVoid& onRetry ) {
+    CRASH_REPORT_BEGIN;
+    TRACE_SPAN("exec", args.empty() ? "" : args[0]);
+    TRACE_SPAN_ARG("owner", config.owner);
     int execRes = 0;
 
     /* If retries is negative, do not monitor the execution */
     if (config.retries < 0) {
 
         /* Execute asynchronously */
-        execRes = sysExecAsync( this->hvBinary, args );
+        execRes = sysExecAsync( this->hvBinary, joinArguments(args) );
+
+    } else if (this->isReadOnlyCommand( args )) {
+
+        /* Coalesce with an identical command in progress */
+        execRes = this->execShared( args, onLine, stderrMsg, config, onRetry );
 
     } else {
     
-        /* Execute */
+        /* Execute when the scheduler allows it */
         string execError;
-        execRes = sysExec( this->hvBinary, args, stdoutList, &execError, config );
+        ExecSlot slot( this->execScheduler, config );
+        execRes = sysExec( this->hvBinary, args, onLine, &execError, config, onRetry );
         if (stderrMsg != NULL) *stderrMsg = execError;
+        this->execMutated( config.owner );
 
         /* Store the last error occured */
         if (!execError.empty())
@@ -921,16 +990,181 @@ int HVInstance::exec( string args, vector<string> * stdoutList, string * stderrM
 
     }
 
+    TRACE_SPAN_ARG("exit", execRes);
+    return execRes;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Line consumer of the command that leads a shared execution
+ */
+void __execSharedLine( HVSharedExec * shared, const callbackLine& onLine, const string& line ) {
+    shared->lines.push_back( line );
+    if (onLine) onLine( line );
+}
+void __execSharedRetry( HVSharedExec * shared, const callbackVoid& onRetry ) {
+    shared->lines.clear();
+    if (onRetry) onRetry();
+}
+
+/**
+ * Complete a shared execution and wake-up the attached callers
+ */
+void __execSharedPublish( HVSharedExec * shared, int result, const string& stderrMsg ) {
+    {
+        boost::unique_lock<boost::mutex> lock(shared->mutex);
+        shared->result = result;
+        shared->stderrMsg = stderrMsg;
+        shared->done = true;
+    }
+    shared->cond.notify_all();
+}
+
+/**
+ * Stop new callers from attaching to a shared execution, unless
+ * a newer one has already taken it's place
+ */
+void __execSharedUnregister( std::map< std::string, HVSharedExecPtr > * sharedExecs, boost::mutex * mutex, const string& key, const HVSharedExecPtr& shared ) {
+    boost::unique_lock<boost::mutex> lock(*mutex);
+    std::map< std::string, HVSharedExecPtr >::iterator it = sharedExecs->find( key );
+    if ((it != sharedExecs->end()) && (it->second == shared))
+        sharedExecs->erase( it );
+}
+
+/**
+ * Build the single-flight key of a shared execution. Besides the arguments, it includes
+ * every setting that can change the outcome of the command, or when it's scheduled.
+ * (The owner is left out, so that identical queries of different sessions are coalesced)
+ */
+string __execSharedKey( const vector<string>& args, const SysExecConfig& config ) {
+    ostringstream oss;
+    oss << joinArguments( args ) << "\n" << config.retries << "," << config.timeout << ","
+        << config.gui << "," << config.priority;
+    for (std::map<std::string,int>::const_iterator it = config.errStrings.begin(); it != config.errStrings.end(); ++it)
+        oss << "\n" << it->second << ":" << it->first;
+    return oss.str();
+}
+
+/**
+ * Execute a read-only command, or attach to an identical one already running
+ * with the same configuration
+ */
+int HVInstance::execShared( const vector<string>& args, const callbackLine& onLine, string * stderrMsg, const SysExecConfig& config, const callbackVoid& onRetry ) {
+    CRASH_REPORT_BEGIN;
+    string key = __execSharedKey( args, config );
+    HVSharedExecPtr shared;
+    bool leader = false;
+
+    /* Find the command in progress or register a new one. A command started before the
+       last change of this caller might miss it, so then we start a new one instead. */
+    {
+        boost::unique_lock<boost::mutex> lock(sharedExecsMutex);
+        std::map< std::string, HVSharedExecPtr >::iterator it = sharedExecs.find( key );
+        std::map< std::string, unsigned long >::iterator mt = execMutations.find( config.owner );
+        unsigned long mutated = (mt == execMutations.end()) ? 0 : mt->second;
+        if ((it != sharedExecs.end()) && (it->second->started > mutated)) {
+            shared = it->second;
+        } else {
+            shared = boost::make_shared<HVSharedExec>();
+            shared->started = ++execSequence;
+            sharedExecs[key] = shared;
+            leader = true;
+        }
+    }
+
+    /* Late callers wait for the output of the running command */
+    if (!leader) {
+        CVMWA_LOG("Debug", "Attaching to the running '" << joinArguments(args) << "'");
+        {
+            boost::unique_lock<boost::mutex> lock(shared->mutex);
+            while (!shared->done) shared->cond.wait(lock);
+        }
+        if (onLine) {
+            for (vector<string>::iterator it = shared->lines.begin(); it != shared->lines.end(); ++it)
+                onLine( *it );
+        }
+        if (stderrMsg != NULL) *stderrMsg = shared->stderrMsg;
+        return shared->result;
+    }
+
+    /* Otherwise run it when the scheduler allows it, collecting the output for the others */
+    string execError;
+    int execRes;
+    try {
+        ExecSlot slot( this->execScheduler, config );
+        execRes = sysExec( this->hvBinary, args, 
+                           boost::bind( &__execSharedLine, shared.get(), onLine, _1 ), 
+                           &execError, config, 
+                           boost::bind( &__execSharedRetry, shared.get(), onRetry ) );
+    } catch (...) {
+        __execSharedUnregister( &sharedExecs, &sharedExecsMutex, key, shared );
+        __execSharedPublish( shared.get(), 254, "ERROR: Aborted" );
+        throw;
+    }
+
+    /* Publish the result */
+    __execSharedUnregister( &sharedExecs, &sharedExecsMutex, key, shared );
+    __execSharedPublish( shared.get(), execRes, execError );
+
+    /* Store the last error occured */
+    if (stderrMsg != NULL) *stderrMsg = execError;
+    if (!execError.empty())
+        this->lastExecError = execError;
+
     return execRes;
     CRASH_REPORT_END;
 }
 
+/**
+ * Note that a mutating command of the given owner has completed
+ */
+void HVInstance::execMutated( const string& owner ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(sharedExecsMutex);
+    execMutations[owner] = ++execSequence;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Completion handler of execAsync() that keeps the lastExecError up to date
+ */
+void __execAsyncDone( HVInstance * hv, callbackExecDone onDone, bool mutating, const string& owner, const ExecHandlePtr& handle ) {
+    if (mutating)
+        hv->execMutated( owner );
+    if (!handle->stderrMsg.empty())
+        hv->lastExecError = handle->stderrMsg;
+    if (onDone) onDone( handle );
+}
+
+/**
+ * Start the hypervisor binary asynchronously, using an argument vector
+ */
+ExecHandlePtr HVInstance::execAsync( const vector<string>& args, const SysExecConfig& config, const callbackExecDone& onDone ) {
+    CRASH_REPORT_BEGIN;
+
+    /* If retries is negative, do not monitor the execution */
+    if (config.retries < 0) {
+        ExecHandlePtr handle = ExecHandle::Completed( sysExecAsync( this->hvBinary, joinArguments(args) ) );
+        if (onDone) onDone( handle );
+        return handle;
+    }
+
+    /* Otherwise let the reactor drive it when the scheduler allows it */
+    return ExecReactor::Default().exec( this->hvBinary, args, config,
+                                        boost::bind( &__execAsyncDone, this, onDone, !this->isReadOnlyCommand( args ), config.owner, _1 ),
+                                        callbackLine(), callbackVoid(), &this->execScheduler );
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Initialize hypervisor 
  */
-HVInstance::HVInstance() : version(""), openSessions(), sessions(), downloadProvider(), userInteraction() {
+HVInstance::HVInstance() : version(""), execScheduler(), portAllocator(), sessionExecutor(), openSessions(), sessions(), downloadProvider(), userInteraction(),
+                           monitorThread(NULL), monitorInterval(HV_MONITOR_INTERVAL) {
     CRASH_REPORT_BEGIN;
     this->sessionID = 1;
+    this->execSequence = 0;
     
     // Pick a system folder to store persistent information
     this->dirData = getAppDataPath();
@@ -1063,7 +1297,10 @@ HVSessionPtr HVInstance::sessionOpen( const ParameterMapPtr& parameters, const F
 
     // Store it on open sessions
     sess->instances += 1;
-    openSessions.push_back( sess );
+    {
+        boost::unique_lock<boost::mutex> lock(openSessionsMutex);
+        openSessions.push_back( sess );
+    }
     
     // Return the handler
     CVMWA_LOG("Debug", "Successfully reached end" );
@@ -1157,6 +1394,105 @@ void HVInstance::setUserInteraction( UserInteractionPtr p ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Return a copy of the currently open sessions
+ */
+std::list< HVSessionPtr > HVInstance::getOpenSessions( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(openSessionsMutex);
+    return openSessions;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start the instance state monitor
+ */
+void HVInstance::monitorStart( int intervalMs ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(monitorMutex);
+    if (monitorThread != NULL) return;
+
+    CVMWA_LOG("Debug", "Starting state monitor every " << intervalMs << " ms");
+    monitorInterval = intervalMs;
+    monitorThread = new boost::thread( boost::bind( &HVInstance::monitorLoop, this ) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the instance state monitor
+ */
+void HVInstance::monitorStop( ) {
+    CRASH_REPORT_BEGIN;
+    boost::thread * thread;
+    {
+        boost::unique_lock<boost::mutex> lock(monitorMutex);
+        thread = monitorThread;
+        monitorThread = NULL;
+    }
+    if (thread == NULL) return;
+
+    // Interrupt and wait for the thread, unless we are called from it
+    thread->interrupt();
+    if (thread->get_id() != boost::this_thread::get_id()) {
+        thread->join();
+        delete thread;
+    } else {
+        thread->detach();
+        delete thread;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the instance state monitor is running
+ */
+bool HVInstance::monitorRunning( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(monitorMutex);
+    return (monitorThread != NULL);
+    CRASH_REPORT_END;
+}
+
+/**
+ * Default wait function of the monitor, without change notifications
+ */
+bool HVInstance::monitorWait( int timeoutMs ) {
+    CRASH_REPORT_BEGIN;
+    boost::this_thread::sleep( boost::posix_time::milliseconds( timeoutMs ) );
+    return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * The monitor thread main loop
+ */
+void HVInstance::monitorLoop( ) {
+    CRASH_REPORT_BEGIN;
+    unsigned long long nextFull = getTimeInMs();
+
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            // Wait for a change or for the next full check
+            unsigned long long now = getTimeInMs();
+            bool full = (now >= nextFull);
+            if (!full && !monitorWait( (int)(nextFull - now) ))
+                continue;
+
+            // Update the sessions
+            if (full) nextFull = getTimeInMs() + monitorInterval;
+            monitorTick( full );
+        }
+
+    } catch (boost::thread_interrupted &e) {
+        CVMWA_LOG("Debug", "State monitor interrupted");
+
+    }
+
+    CRASH_REPORT_END;
+}
+
 
 /**
  * Search the system's folders and try to detect what hypervisor
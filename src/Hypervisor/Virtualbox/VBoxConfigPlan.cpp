@@ -0,0 +1,156 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/CrashReport.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxConfigPlan.h>
+
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Compare two setting values, ignoring the case
+ */
+static bool __planSame( const string& a, const string& b ) {
+    if (a.length() != b.length()) return false;
+    for (size_t i=0; i<a.length(); ++i)
+        if (::tolower(a[i]) != ::tolower(b[i])) return false;
+    return true;
+}
+
+/**
+ * The 'showvminfo' key of the given 'modifyvm' option
+ */
+static string __planSettingKey( const string& option ) {
+    if (option == "clipboard-mode") return "clipboard";
+    return option;
+}
+
+/**
+ * Return the key in the 'applied' map
+ */
+string VBoxConfigPlan::appliedKey( const string& kind, const string& name ) {
+    // The '/' is the parameter map group separator
+    string key = kind + ":" + name;
+    replace( key.begin(), key.end(), '/', ':' );
+    return key;
+}
+
+/**
+ * Diff the desired and the current state
+ */
+VBoxConfigPlan::VBoxConfigPlan( const string& vboxid, const VBoxMachineSpec& spec,
+                                const MachineInfo& current, const ParameterMapPtr& applied ) : steps(), naive(0) {
+    CRASH_REPORT_BEGIN;
+
+    // 1) Merge all the modifyvm options and NAT rules in a single invocation
+    VBoxConfigStep modify( VBoxCommand("modifyvm").arg(vboxid) );
+    size_t changes = 0;
+    if (!spec.options.empty()) naive++;
+
+    for (vector< pair<string, string> >::const_iterator it = spec.options.begin(); it != spec.options.end(); ++it) {
+        const string& option = it->first;
+        const string& value = it->second;
+
+        // Check what showvminfo reports, or what we have applied before
+        map<string, string>::const_iterator cur = current.settings.find( __planSettingKey(option) );
+        if (cur != current.settings.end()) {
+            if (__planSame(cur->second, value)) continue;
+        } else {
+            string key = appliedKey("opt", option);
+            if (applied && applied->contains(key) && __planSame(applied->get(key), value)) continue;
+            modify.applied.push_back( make_pair( key, value ) );
+        }
+
+        modify.command.opt( "--" + option, value );
+        changes++;
+    }
+
+    // NAT rules come last, so that a stale rule does not block the other options
+    for (vector< pair<string, string> >::const_iterator it = spec.natRules.begin(); it != spec.natRules.end(); ++it) {
+        map<string, string>::const_iterator cur = current.natRules.find( it->first );
+        naive++;
+        if (cur != current.natRules.end()) {
+            if (__planSame(cur->second, it->second)) continue;
+
+            // Replace the existing rule
+            modify.command.opt( "--natpf1", "delete" ).arg( it->first );
+            naive++;
+        }
+        modify.command.opt( "--natpf1", it->second );
+        changes++;
+    }
+    if (changes > 0) steps.push_back( modify );
+
+    // 2) Shared folders missing from the VM, or pointing to another host folder
+    for (vector<VBOX_SHARED_FOLDER>::const_iterator it = spec.sharedFolders.begin(); it != spec.sharedFolders.end(); ++it) {
+        naive++;
+        vector<VBOX_SHARED_FOLDER>::const_iterator jt = current.sharedFolders.begin();
+        for (; jt != current.sharedFolders.end(); ++jt) {
+            if (jt->name == it->name) break;
+        }
+        if (jt != current.sharedFolders.end()) {
+            if (jt->hostPath == it->hostPath) continue;
+
+            // A folder cannot be modified, so replace it
+            steps.push_back( VBoxConfigStep( VBoxCommand("sharedfolder")
+                .arg("remove")
+                .arg(vboxid)
+                .opt("--name",      it->name) ) );
+            naive++;
+        }
+
+        steps.push_back( VBoxConfigStep( VBoxCommand("sharedfolder")
+            .arg("add")
+            .arg(vboxid)
+            .opt("--name",          it->name)
+            .opt("--hostpath",      it->hostPath)
+            .arg("--automount") ) );
+    }
+
+    // 3) Extra data we have not applied before
+    for (vector< pair<string, string> >::const_iterator it = spec.extraData.begin(); it != spec.extraData.end(); ++it) {
+        naive++;
+        string key = appliedKey("extra", it->first);
+        if (applied && applied->contains(key) && (applied->get(key) == it->second)) continue;
+
+        VBoxConfigStep step( VBoxCommand("setextradata").arg(vboxid).arg(it->first).arg(it->second) );
+        step.applied.push_back( make_pair( key, it->second ) );
+        steps.push_back( step );
+    }
+
+    // 4) Storage controllers missing from the VM
+    for (vector<VBOX_CONTROLLER_SPEC>::const_iterator it = spec.controllers.begin(); it != spec.controllers.end(); ++it) {
+        naive++;
+        if (find( current.controllers.begin(), current.controllers.end(), it->name ) != current.controllers.end())
+            continue;
+
+        VBoxCommand ctlCmd("storagectl");
+        ctlCmd
+            .arg(vboxid)
+            .opt("--name",          it->name)
+            .opt("--add",           it->type);
+        if (it->portCount > 0)
+            ctlCmd.opt("--portcount", it->portCount);
+        steps.push_back( VBoxConfigStep( ctlCmd ) );
+    }
+
+    CRASH_REPORT_END;
+}
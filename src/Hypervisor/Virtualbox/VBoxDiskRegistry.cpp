@@ -0,0 +1,224 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/CrashReport.h>
+#include <CernVM/Utilities.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxDiskRegistry.h>
+
+using namespace std;
+
+/**
+ * Normalize the path separators, the same way samePath() compares them
+ */
+string VBoxDiskRegistry::normalize( const string& location ) {
+    string ans( location );
+    for (size_t i=0; i<ans.length(); ++i)
+        if (ans[i] == '\\') ans[i] = '/';
+    return ans;
+}
+
+/**
+ * Load the output of 'list hdds'
+ */
+void VBoxDiskRegistry::load( const vector< map< const string, const string > >& list ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    disks.clear();
+    byLocation.clear();
+    byParent.clear();
+
+    for (vector< map< const string, const string > >::const_iterator it = list.begin(); it != list.end(); ++it) {
+        map< const string, const string >::const_iterator v;
+        VBOX_DISK_RECORD disk;
+        if ((v = it->find("UUID")) == it->end()) continue;
+        disk.uuid = v->second;
+        if ((v = it->find("Parent UUID")) != it->end()) disk.parentUUID = v->second;
+        if ((v = it->find("Location")) != it->end()) disk.location = v->second;
+        if ((v = it->find("Type")) != it->end()) disk.type = v->second;
+        if ((v = it->find("State")) != it->end()) disk.state = v->second;
+        link( disk );
+    }
+
+    loaded = true;
+    loadedTime = getMonotonicMillis();
+    CVMWA_LOG("Debug", "Loaded " << disks.size() << " disks in the registry");
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the registry is loaded
+ */
+bool VBoxDiskRegistry::isLoaded() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return loaded;
+}
+
+/**
+ * Return the time the registry was loaded
+ */
+long VBoxDiskRegistry::getLoadedTime() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return loadedTime;
+}
+
+/**
+ * Drop the registry contents
+ */
+void VBoxDiskRegistry::invalidate() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    disks.clear();
+    byLocation.clear();
+    byParent.clear();
+    loaded = false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Add or replace a disk record
+ */
+void VBoxDiskRegistry::update( const VBOX_DISK_RECORD& disk ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!loaded) return;
+
+    // A location is owned by a single disk
+    boost::unordered_map< string, string >::iterator l = byLocation.find( normalize(disk.location) );
+    if (l != byLocation.end()) unlink( l->second );
+    unlink( disk.uuid );
+    link( disk );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Record the differencing disk of a multi-attach mount
+ */
+bool VBoxDiskRegistry::addDifferencing( const string& baseLocation, const string& uuid ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!loaded) return false;
+
+    // Find the base disk
+    boost::unordered_map< string, string >::iterator l = byLocation.find( normalize(baseLocation) );
+    if (l == byLocation.end()) return false;
+    boost::unordered_map< string, VBOX_DISK_RECORD >::iterator it = disks.find( l->second );
+    if (it == disks.end()) return false;
+    it->second.type = "multiattach";
+
+    // The differencing image lives in the machine's snapshot folder, under
+    // a name chosen by VirtualBox, so it's indexed only by UUID and parent.
+    VBOX_DISK_RECORD child;
+    child.uuid = uuid;
+    child.parentUUID = it->second.uuid;
+    child.type = "normal";
+    child.state = "created";
+    unlink( uuid );
+    link( child );
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remove a disk record
+ */
+void VBoxDiskRegistry::remove( const string& uuidOrLocation ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::unordered_map< string, string >::iterator l = byLocation.find( normalize(uuidOrLocation) );
+    if (l != byLocation.end()) {
+        unlink( l->second );
+    } else {
+        unlink( uuidOrLocation );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find a disk by UUID
+ */
+bool VBoxDiskRegistry::findByUUID( const string& uuid, VBOX_DISK_RECORD * disk ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::unordered_map< string, VBOX_DISK_RECORD >::iterator it = disks.find( uuid );
+    if (it == disks.end()) return false;
+    if (disk != NULL) *disk = it->second;
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find a disk by location
+ */
+bool VBoxDiskRegistry::findByLocation( const string& location, VBOX_DISK_RECORD * disk ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::unordered_map< string, string >::iterator l = byLocation.find( normalize(location) );
+    if (l == byLocation.end()) return false;
+    boost::unordered_map< string, VBOX_DISK_RECORD >::iterator it = disks.find( l->second );
+    if (it == disks.end()) return false;
+    if (disk != NULL) *disk = it->second;
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the children of a disk
+ */
+vector<string> VBoxDiskRegistry::findChildren( const string& parentUUID ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    vector<string> ans;
+    typedef boost::unordered_multimap< string, string >::iterator iter;
+    std::pair<iter, iter> range = byParent.equal_range( parentUUID );
+    for (iter it = range.first; it != range.second; ++it)
+        ans.push_back( it->second );
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Insert a record in all the indexes
+ */
+void VBoxDiskRegistry::link( const VBOX_DISK_RECORD& disk ) {
+    if (disk.uuid.empty()) return;
+    disks[disk.uuid] = disk;
+    if (!disk.location.empty()) byLocation[normalize(disk.location)] = disk.uuid;
+    if (!disk.parentUUID.empty()) byParent.insert( make_pair(disk.parentUUID, disk.uuid) );
+}
+
+/**
+ * Remove a record from all the indexes
+ */
+void VBoxDiskRegistry::unlink( const string& uuid ) {
+    boost::unordered_map< string, VBOX_DISK_RECORD >::iterator it = disks.find( uuid );
+    if (it == disks.end()) return;
+
+    const VBOX_DISK_RECORD& disk = it->second;
+    boost::unordered_map< string, string >::iterator l = byLocation.find( normalize(disk.location) );
+    if ((l != byLocation.end()) && (l->second == uuid)) byLocation.erase( l );
+
+    typedef boost::unordered_multimap< string, string >::iterator iter;
+    std::pair<iter, iter> range = byParent.equal_range( disk.parentUUID );
+    for (iter p = range.first; p != range.second; ++p) {
+        if (p->second == uuid) { byParent.erase( p ); break; }
+    }
+
+    disks.erase( it );
+}
@@ -24,8 +24,13 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <set>
 #include <algorithm>
 
+#ifdef __linux__
+#include <poll.h>
+#endif
+
 #include <CernVM/Config.h>
 #include <CernVM/Hypervisor/Virtualbox/VBoxInstance.h>
 #include <CernVM/Hypervisor.h>
@@ -96,7 +101,7 @@ bool VBoxInstance::validateIntegrity() {
         // Query system properties in order to find the 
         // location of the guest additions ISO
         this->hvGuestAdditions = "";
-        if (this->exec("list systemproperties", &out, &err, execConfig) == 0) {
+        if (this->query(VBoxCommand("list").arg("systemproperties"), &out, &err, execConfig) == 0) {
             map<string, string> data;
 
             // Parse system output
@@ -122,66 +127,97 @@ bool VBoxInstance::validateIntegrity() {
  */
 map<const string, const string> VBoxInstance::getMachineInfo( std::string uuid, int timeout ) {
     CRASH_REPORT_BEGIN;
-    vector<string> lines;
     map<const string, const string> dat;
+    MachineInfo info;
+
+    // Query and export using the human-readable keys
+    int ans = this->getMachineInfo( uuid, &info, timeout );
+    if (ans != HVE_OK) {
+        dat.insert(make_pair(":ERROR:", ntos<int>( ans )));
+        return dat;
+    }
+    info.toMap( &dat );
+    return dat;
+    CRASH_REPORT_END;
+};
+
+/** 
+ * Return the typed virtual machine information
+ */
+int VBoxInstance::getMachineInfo( std::string uuid, MachineInfo * info, int timeout ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
     string err;
     
     // Local exec config
     SysExecConfig config(execConfig);
     config.timeout = timeout;
+    config.setPriority( SYSEXEC_PRIORITY_POLLING ).setOwner( uuid );
 
     // Perform property update
     int ans;
-    NAMED_MUTEX_LOCK( uuid );
-    ans = this->exec("showvminfo "+uuid, &lines, &err, config );
-    NAMED_MUTEX_UNLOCK;
+    ans = this->exec(VBoxCommand("showvminfo").arg(uuid).arg("--machinereadable"), &lines, &err, config );
     if (ans != 0) {
-        dat.insert(make_pair(":ERROR:", ntos<int>( ans )));
-        return dat;
+        info->clear();
+        return ans;
     }
     
-    /* Tokenize response */
-    return tokenize( &lines, ':' );
+    /* Parse response */
+    if (!info->parse( lines )) return HVE_QUERY_ERROR;
+    return HVE_OK;
     CRASH_REPORT_END;
 };
 
 /**
- * Return all the properties of the guest
+ * Parse a line from 'guestproperty enumerate' as soon as it arrives
  */
-map<string, string> VBoxInstance::getAllProperties( string uuid ) {
+void __parseGuestProperty( map<string, string> * ans, const string& line ) {
     CRASH_REPORT_BEGIN;
-    map<string, string> ans;
-    vector<string> lines;
-    string errOut;
 
-    // Get guest properties
-    NAMED_MUTEX_LOCK( uuid );
-    if (this->exec( "guestproperty enumerate "+uuid, &lines, &errOut, execConfig ) == 0) {
-        for (vector<string>::iterator it = lines.begin(); it < lines.end(); ++it) {
-            string line = *it;
+    /* Find the anchor locations */
+    size_t kBegin = line.find("Name: ");
+    if (kBegin == string::npos) return;
+    size_t kEnd = line.find(", value:");
+    if (kEnd == string::npos) return;
+    size_t vEnd = line.find(", timestamp:");
+    if (vEnd == string::npos) return;
 
-            /* Find the anchor locations */
-            size_t kBegin = line.find("Name: ");
-            if (kBegin == string::npos) continue;
-            size_t kEnd = line.find(", value:");
-            if (kEnd == string::npos) continue;
-            size_t vEnd = line.find(", timestamp:");
-            if (vEnd == string::npos) continue;
+    /* Get key */
+    kBegin += 6;
+    string vKey = line.substr( kBegin, kEnd - kBegin );
 
-            /* Get key */
-            kBegin += 6;
-            string vKey = line.substr( kBegin, kEnd - kBegin );
+    /* Get value */
+    size_t vBegin = kEnd + 9;
+    string vValue = line.substr( vBegin, vEnd - vBegin );
 
-            /* Get value */
-            size_t vBegin = kEnd + 9;
-            string vValue = line.substr( vBegin, vEnd - vBegin );
+    /* Store values */
+    (*ans)[vKey] = vValue;
 
-            /* Store values */
-            ans[vKey] = vValue;
+    CRASH_REPORT_END;
+}
 
-        }
+/**
+ * Discard the properties collected from a failed attempt
+ */
+void __clearGuestProperties( map<string, string> * ans ) {
+    ans->clear();
+}
+
+/**
+ * Return all the properties of the guest
+ */
+map<string, string> VBoxInstance::getAllProperties( string uuid ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string> ans;
+    string errOut;
+
+    // Get guest properties, parsing them while VBoxManage is still writing
+    if (this->exec( VBoxCommand("guestproperty").arg("enumerate").arg(uuid), 
+                    boost::bind( &__parseGuestProperty, &ans, _1 ), 
+                    &errOut, SysExecConfig(execConfig).setPriority( SYSEXEC_PRIORITY_POLLING ).setOwner( uuid ), 
+                    boost::bind( &__clearGuestProperties, &ans ) ) != 0) {
+        ans.clear();
     }
-    NAMED_MUTEX_UNLOCK;
 
     return ans;
     CRASH_REPORT_END;
@@ -303,9 +339,7 @@ std::string VBoxInstance::getProperty( std::string uuid, std::string name ) {
     
     /* Invoke property query */
     int ans;
-    NAMED_MUTEX_LOCK( uuid );
-    ans = this->exec("guestproperty get "+uuid+" \""+name+"\"", &lines, &err, execConfig);
-    NAMED_MUTEX_UNLOCK;
+    ans = this->exec(VBoxCommand("guestproperty").arg("get").arg(uuid).arg(name), &lines, &err, SysExecConfig(execConfig).setPriority( SYSEXEC_PRIORITY_POLLING ).setOwner( uuid ));
     if (ans != 0) return "";
     if (lines.empty()) return "";
     
@@ -355,9 +389,7 @@ int VBoxInstance::getCapabilities ( HVINFO_CAPS * caps ) {
     
     // List the CPUID information
     int ans;
-    NAMED_MUTEX_LOCK("generic");
     ans = this->exec("list hostcpuids", &lines, &err, execConfig);
-    NAMED_MUTEX_UNLOCK;
     if (ans != 0) return HVE_QUERY_ERROR;
     if (lines.empty()) return HVE_EXTERNAL_ERROR;
     
@@ -410,9 +442,7 @@ int VBoxInstance::getCapabilities ( HVINFO_CAPS * caps ) {
         ( (caps->cpu.featuresC & 0x20000000) != 0 ); // Long mode 'lm'
         
     // List the system properties
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list systemproperties", &lines, &err, execConfig);
-    NAMED_MUTEX_UNLOCK;
+    ans = this->query(VBoxCommand("list").arg("systemproperties"), &lines, &err, execConfig);
     if (ans != 0) return HVE_QUERY_ERROR;
     if (lines.empty()) return HVE_EXTERNAL_ERROR;
 
@@ -446,9 +476,7 @@ std::vector< std::map< const std::string, const std::string > > VBoxInstance::ge
 
     // List the running VMs in the system
     int ans;
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list hdds", &lines, &err, execConfig);
-    NAMED_MUTEX_UNLOCK;
+    ans = this->query(VBoxCommand("list").arg("hdds"), &lines, &err, execConfig);
     if (ans != 0) return emptyMap;
     if (lines.empty()) return emptyMap;
 
@@ -458,6 +486,49 @@ std::vector< std::map< const std::string, const std::string > > VBoxInstance::ge
     CRASH_REPORT_END;
 }
 
+/**
+ * Load the disk registry from the list of mediums managed by VirtualBox
+ */
+int VBoxInstance::loadDiskRegistry() {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
+    string err;
+
+    int ans = this->query(VBoxCommand("list").arg("hdds"), &lines, &err, execConfig);
+    if (ans != 0) return HVE_QUERY_ERROR;
+
+    diskRegistry.load( tokenizeList( &lines, ':' ) );
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find a hard disk by UUID or location, without spawning any process
+ * unless the registry is not loaded or the disk is unknown.
+ */
+bool VBoxInstance::findDisk( const std::string& uuidOrLocation, VBOX_DISK_RECORD * disk ) {
+    CRASH_REPORT_BEGIN;
+
+    // Lazy load
+    if (!diskRegistry.isLoaded()) {
+        if (loadDiskRegistry() != HVE_OK) return false;
+    }
+
+    // Look-up
+    if (diskRegistry.findByUUID( uuidOrLocation, disk )) return true;
+    if (diskRegistry.findByLocation( uuidOrLocation, disk )) return true;
+
+    // The disk might have been registered externally, so reload
+    // if we have not done so recently.
+    if (getMonotonicMillis() - diskRegistry.getLoadedTime() < VBOX_DISK_REGISTRY_RELOAD)
+        return false;
+    if (loadDiskRegistry() != HVE_OK) return false;
+    if (diskRegistry.findByUUID( uuidOrLocation, disk )) return true;
+    return diskRegistry.findByLocation( uuidOrLocation, disk );
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Parse VirtualBox Log file in order to get the launched process PID
  */
@@ -529,6 +600,43 @@ HVSessionPtr VBoxInstance::sessionByVBID ( const std::string& virtualBoxGUID ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Check if the given VBoxManage command only queries information
+ */
+bool VBoxInstance::isReadOnlyCommand ( const std::vector<std::string>& args ) {
+    if (args.empty()) return false;
+    const string& cmd = args[0];
+    if ((cmd == "list") || (cmd == "showvminfo") || (cmd == "showhdinfo") || 
+        (cmd == "showmediuminfo") || (cmd == "--version"))
+        return true;
+    if ((cmd == "guestproperty") && (args.size() > 1))
+        return (args[1] == "enumerate") || (args[1] == "get");
+    return false;
+}
+
+/**
+ * Execute an idempotent query through the query cache
+ */
+int VBoxInstance::query ( const VBoxCommand& cmd, std::vector<std::string> * stdoutList, std::string * stderrMsg, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+
+    // Check if we have a recent result
+    unsigned long generation = 0;
+    if (queryCache.lookup( cmd, stdoutList, &generation )) {
+        if (stderrMsg != NULL) stderrMsg->clear();
+        return HVE_OK;
+    }
+
+    // Otherwise execute and keep the result
+    vector<string> lines;
+    int ans = this->exec( cmd, &lines, stderrMsg, config );
+    if (ans == 0) queryCache.store( cmd, lines, generation );
+    if (stdoutList != NULL) *stdoutList = lines;
+    return ans;
+
+    CRASH_REPORT_END;
+}
+
 HVSessionPtr VBoxInstance::sessionOpen ( const ParameterMapPtr& parameters, const FiniteTaskPtr & pf, const bool checkSecret ) {
     CRASH_REPORT_BEGIN;
 
@@ -547,6 +655,11 @@ HVSessionPtr VBoxInstance::sessionOpen ( const ParameterMapPtr& parameters, cons
     // Open session
     vbs->open();
 
+    // Keep the state of the open sessions up to date from a single thread
+    int monitorInterval = hvConfig->getNum<int>("monitorInterval", HV_MONITOR_INTERVAL);
+    if (monitorInterval > 0)
+        monitorStart( monitorInterval );
+
     // Return instance
     return vbs;
 
@@ -568,18 +681,25 @@ void VBoxInstance::sessionDelete ( const HVSessionPtr& session ) {
         if ( uuid.compare(session->uuid) == 0 ) {
 
             // Loook for the session object in the open sessions
-            for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
-                HVSessionPtr openSess = (*jt);
-                // Check if the session has gone away
-                if ( uuid.compare(openSess->uuid) == 0 ) {
-                    // Remove from open sessions
-                    openSessions.erase( jt );
-                    // Let session know that it has gone away
-                    boost::static_pointer_cast<VBoxSession>(sess)->hvNotifyDestroyed();
-                    break;
+            bool wasOpen = false;
+            {
+                boost::unique_lock<boost::mutex> lock(openSessionsMutex);
+                for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
+                    HVSessionPtr openSess = (*jt);
+                    // Check if the session has gone away
+                    if ( uuid.compare(openSess->uuid) == 0 ) {
+                        // Remove from open sessions
+                        openSessions.erase( jt );
+                        wasOpen = true;
+                        break;
+                    }
                 }
             }
 
+            // Let session know that it has gone away
+            if (wasOpen)
+                boost::static_pointer_cast<VBoxSession>(sess)->hvNotifyDestroyed();
+
             // Erase session from the sessions list
             this->sessions.erase( i );
 
@@ -610,13 +730,16 @@ void VBoxInstance::sessionClose( const HVSessionPtr& session ) {
     session->abort();
 
     // Loook for the session object in the open sessions & remove it
-    for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
-        HVSessionPtr openSess = (*jt);
-        // Check if the session has gone away
-        if ( session->uuid.compare(openSess->uuid) == 0 ) {
-            // Remove from open sessions
-            openSessions.erase( jt );
-            break;
+    {
+        boost::unique_lock<boost::mutex> lock(openSessionsMutex);
+        for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
+            HVSessionPtr openSess = (*jt);
+            // Check if the session has gone away
+            if ( session->uuid.compare(openSess->uuid) == 0 ) {
+                // Remove from open sessions
+                openSessions.erase( jt );
+                break;
+            }
         }
     }
 
@@ -639,9 +762,7 @@ std::vector<std::string> VBoxInstance::getRunningMachines( ) {
 
     // List the running VMs in the system
     int ans;
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list runningvms", &lines, &err, execConfig);
-    NAMED_MUTEX_UNLOCK;
+    ans = this->exec("list runningvms", &lines, &err, SysExecConfig(execConfig).setPriority( SYSEXEC_PRIORITY_POLLING ));
     if (ans != 0)
         return runningVms; // empty map
 
@@ -663,6 +784,95 @@ std::vector<std::string> VBoxInstance::getRunningMachines( ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Return the UUIDs of the running VMs
+ */
+int VBoxInstance::getRunningUUIDs( std::set<std::string> * uuids ) {
+    CRASH_REPORT_BEGIN;
+    std::vector<std::string> lines;
+    std::string err;
+
+    // List the running VMs in the system
+    int ans = this->exec(VBoxCommand("list").arg("runningvms"), &lines, &err, SysExecConfig(execConfig).setPriority( SYSEXEC_PRIORITY_POLLING ));
+    if (ans != 0) return HVE_QUERY_ERROR;
+
+    // Parse lines, they have the following format:
+    //      "name_of_the_VM" {vboxid}
+    for (std::vector<std::string>::iterator it = lines.begin(); it != lines.end(); ++it) {
+        size_t uStart = (*it).find_last_of('{');
+        size_t uEnd = (*it).find_last_of('}');
+        if ((uStart == string::npos) || (uEnd == string::npos) || (uEnd < uStart))
+            continue;
+        uuids->insert( (*it).substr(uStart+1, uEnd-uStart-1) );
+    }
+
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait until the log of an open session changes
+ */
+bool VBoxInstance::monitorWait( int timeoutMs ) {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+
+    // Collect the log watches of the open sessions (the followers
+    // share their descriptor, so it's usually just one)
+    std::vector<struct pollfd> fds;
+    std::set<int> seen;
+    std::list< HVSessionPtr > open = getOpenSessions();
+    for (std::list< HVSessionPtr >::iterator it = open.begin(); it != open.end(); ++it) {
+        int fd = boost::static_pointer_cast<VBoxSession>(*it)->getLogWakeFd();
+        if ((fd < 0) || !seen.insert(fd).second) continue;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        fds.push_back( pfd );
+    }
+
+    if (!fds.empty()) {
+
+        // Wait in small steps, so that we can be interrupted
+        while (timeoutMs > 0) {
+            int step = (timeoutMs > 250) ? 250 : timeoutMs;
+            if (::poll( &fds[0], fds.size(), step ) > 0)
+                return true;
+            boost::this_thread::interruption_point();
+            timeoutMs -= step;
+        }
+        return false;
+
+    }
+
+#endif
+    return HVInstance::monitorWait( timeoutMs );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Update the state of all the open sessions
+ */
+void VBoxInstance::monitorTick( bool full ) {
+    CRASH_REPORT_BEGIN;
+    std::list< HVSessionPtr > open = getOpenSessions();
+    if (open.empty()) return;
+
+    // A single listing of the running VMs for all the sessions
+    std::set<std::string> running;
+    unsigned long long listedAt = getTimeInMs();
+    bool haveRunning = full && (getRunningUUIDs( &running ) == HVE_OK);
+
+    // Let every session compare it's state
+    for (std::list< HVSessionPtr >::iterator it = open.begin(); it != open.end(); ++it) {
+        boost::this_thread::interruption_point();
+        boost::static_pointer_cast<VBoxSession>(*it)->refreshState( haveRunning ? &running : NULL, listedAt );
+    }
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Load session state from VirtualBox
  */
@@ -711,7 +921,7 @@ int VBoxInstance::loadSessions( const FiniteTaskPtr & pf ) {
 
     // List the running VMs in the system
     int ans;
-    ans = this->exec("list vms", &lines, &err, execConfig);
+    ans = this->query(VBoxCommand("list").arg("vms"), &lines, &err, execConfig);
     if (ans != 0) return HVE_QUERY_ERROR;
 
     // Forward progress
@@ -780,24 +990,25 @@ int VBoxInstance::loadSessions( const FiniteTaskPtr & pf ) {
     // [4] Check if some of the currently open session 
     //     was lost.
     // ===========================================
-    for (std::list< HVSessionPtr >::iterator it = openSessions.begin(); it != openSessions.end(); ++it) {
-        HVSessionPtr sess = (*it);
-
-        // Check if the session has gone away
-        if (sessions.find(sess->uuid) == sessions.end()) {
-   
-            // Let session know that it has gone away
-            boost::static_pointer_cast<VBoxSession>(sess)->hvNotifyDestroyed();
-
-            // Remove it from open and rewind
-            openSessions.erase( it );
-            it = openSessions.begin();
-
-            // Quit if we are done
-            if (openSessions.size() == 0) break;
-
+    std::list< HVSessionPtr > lost;
+    {
+        boost::unique_lock<boost::mutex> openLock(openSessionsMutex);
+        for (std::list< HVSessionPtr >::iterator it = openSessions.begin(); it != openSessions.end(); ) {
+            // Check if the session has gone away
+            if (sessions.find((*it)->uuid) == sessions.end()) {
+                lost.push_back( *it );
+                it = openSessions.erase( it );
+            } else {
+                ++it;
+            }
         }
+    }
 
+    // Let the lost sessions know that they have gone away. This is
+    // done without holding the lock, since the session might call
+    // back to the instance while handling the notification.
+    for (std::list< HVSessionPtr >::iterator it = lost.begin(); it != lost.end(); ++it) {
+        boost::static_pointer_cast<VBoxSession>(*it)->hvNotifyDestroyed();
     }
 
     // Notify progress
@@ -814,14 +1025,21 @@ int VBoxInstance::loadSessions( const FiniteTaskPtr & pf ) {
 void VBoxInstance::abort() {
     CRASH_REPORT_BEGIN;
 
+    // Stop monitoring the sessions
+    monitorStop();
+
     // Abort all open sessions
-    for (std::list< HVSessionPtr >::iterator it = openSessions.begin(); it != openSessions.end(); ++it) {
+    std::list< HVSessionPtr > aborted = getOpenSessions();
+    for (std::list< HVSessionPtr >::iterator it = aborted.begin(); it != aborted.end(); ++it) {
         HVSessionPtr sess = (*it);
         sess->abort();
     }
 
     // Cleanup
-    openSessions.clear();
+    {
+        boost::unique_lock<boost::mutex> lock(openSessionsMutex);
+        openSessions.clear();
+    }
     sessions.clear();
 
     CRASH_REPORT_END;
@@ -838,9 +1056,7 @@ bool VBoxInstance::hasExtPack() {
      */
     vector<string> lines;
     string err;
-    NAMED_MUTEX_LOCK("generic");
     this->exec("list extpacks", &lines, &err, execConfig);
-    NAMED_MUTEX_UNLOCK;
     for (std::vector<std::string>::iterator l = lines.begin(); l != lines.end(); l++) {
         if (l->find("Oracle VM VirtualBox Extension Pack") != string::npos) {
             return true;
@@ -948,7 +1164,7 @@ int VBoxInstance::installExtPack( DomainKeystore & keystore, const DownloadProvi
     if (pf) pf->doing("Installing extension pack");
     if (pf) pf->markLengthy(true);
     NAMED_MUTEX_LOCK("generic");
-    res = this->exec( "extpack install \"" + tmpExtpackFile + "\"", NULL, &err, config.setGUI(true) );
+    res = this->exec( VBoxCommand("extpack").arg("install").arg(tmpExtpackFile), NULL, &err, config.setGUI(true) );
     NAMED_MUTEX_UNLOCK;
     if (res != HVE_OK) {
         if (pf) pf->fail("Extension pack failed to install", HVE_EXTERNAL_ERROR);
@@ -0,0 +1,328 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/CrashReport.h>
+#include <CernVM/Hypervisor.h>
+#include <CernVM/Utilities.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxMachineInfo.h>
+
+#include <string.h>
+#include <sstream>
+
+using namespace std;
+
+/**
+ * A non-owning view to a part of an output line
+ */
+typedef struct {
+    const char *    p;
+    size_t          n;
+} __mrView;
+
+/**
+ * Check if the view equals to the given literal
+ */
+static inline bool __mrIs( const __mrView& v, const char * s, size_t len ) {
+    return (v.n == len) && (memcmp(v.p, s, len) == 0);
+}
+#define MR_IS(v, lit) __mrIs( v, lit, sizeof(lit)-1 )
+
+/**
+ * Check if the view starts with the given literal
+ */
+static inline bool __mrStarts( const __mrView& v, const char * s, size_t len ) {
+    return (v.n >= len) && (memcmp(v.p, s, len) == 0);
+}
+#define MR_STARTS(v, lit) __mrStarts( v, lit, sizeof(lit)-1 )
+
+/**
+ * Parse the decimal number in the view, returning -1 if it's not a number
+ */
+static int __mrNum( const char * p, size_t n ) {
+    if (n == 0) return -1;
+    int v = 0;
+    for (size_t i=0; i<n; ++i) {
+        if ((p[i] < '0') || (p[i] > '9')) return -1;
+        v = v*10 + (p[i] - '0');
+    }
+    return v;
+}
+
+/**
+ * Find the last occurence of the given character
+ */
+static const char * __mrLast( const char * p, size_t n, char c ) {
+    while (n > 0) {
+        if (p[--n] == c) return p + n;
+    }
+    return NULL;
+}
+
+/**
+ * Convert a number to string
+ */
+static string __mrStr( int v ) {
+    ostringstream oss; oss << v;
+    return oss.str();
+}
+
+/**
+ * Reset all the fields
+ */
+void MachineInfo::clear() {
+    valid = false;
+    uuid.clear(); name.clear(); configFile.clear(); logFolder.clear();
+    state = SS_MISSING; stateName.clear();
+    cpus = 0; memory = 0; vram = 0; executionCap = 0;
+    acpi = false; ioapic = false;
+    videoWidth = 0; videoHeight = 0; videoBpp = 0;
+    for (int i=0; i<VBOX_MAX_BOOT; ++i) boot[i].clear();
+    for (int i=0; i<VBOX_MAX_NICS; ++i) nics[i].clear();
+    controllers.clear();
+    slots.clear();
+    natRules.clear();
+    sharedFolders.clear();
+    settings.clear();
+}
+
+/**
+ * Parse all the output lines
+ */
+bool MachineInfo::parse( const vector<string>& lines ) {
+    CRASH_REPORT_BEGIN;
+    clear();
+    for (vector<string>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+        parseLine( it->data(), it->length() );
+    valid = !uuid.empty();
+    return valid;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Parse a single 'key=value' line, without copying anything but the values we keep
+ */
+void MachineInfo::parseLine( const char * line, size_t length ) {
+    CRASH_REPORT_BEGIN;
+
+    // Split on the first '=' and strip the quotes
+    const char * eq = (const char *) memchr( line, '=', length );
+    if (eq == NULL) return;
+    __mrView k = { line, (size_t)(eq - line) };
+    __mrView v = { eq + 1, length - k.n - 1 };
+    if ((k.n >= 2) && (k.p[0] == '"') && (k.p[k.n-1] == '"')) { k.p++; k.n -= 2; }
+    if ((v.n >= 2) && (v.p[0] == '"') && (v.p[v.n-1] == '"')) { v.p++; v.n -= 2; }
+    if (k.n == 0) return;
+
+    // Keep the raw value of the plain settings
+    bool plain = true;
+    for (size_t i=0; (i<k.n) && plain; ++i)
+        plain = ((k.p[i] >= 'a') && (k.p[i] <= 'z')) || ((k.p[i] >= '0') && (k.p[i] <= '9'));
+    if (plain) settings[ string(k.p, k.n) ].assign(v.p, v.n);
+
+    // Identity
+    if (MR_IS(k, "UUID")) { uuid.assign(v.p, v.n); return; }
+    if (MR_IS(k, "name")) { name.assign(v.p, v.n); return; }
+    if (MR_IS(k, "CfgFile")) { configFile.assign(v.p, v.n); return; }
+    if (MR_IS(k, "LogFldr")) { logFolder.assign(v.p, v.n); return; }
+
+    // State
+    if (MR_IS(k, "VMState")) {
+        stateName.assign(v.p, v.n);
+        if (MR_IS(v, "running")) state = SS_RUNNING;
+        else if (MR_IS(v, "paused")) state = SS_PAUSED;
+        else if (MR_IS(v, "saved")) state = SS_SAVED;
+        else if (MR_IS(v, "poweroff") || MR_IS(v, "aborted")) state = SS_POWEROFF;
+        else state = SS_AVAILABLE;
+        return;
+    }
+
+    // Resources
+    if (MR_IS(k, "cpus")) { cpus = __mrNum(v.p, v.n); return; }
+    if (MR_IS(k, "memory")) { memory = __mrNum(v.p, v.n); return; }
+    if (MR_IS(k, "vram")) { vram = __mrNum(v.p, v.n); return; }
+    if (MR_IS(k, "cpuexecutioncap")) { executionCap = __mrNum(v.p, v.n); return; }
+    if (MR_IS(k, "acpi")) { acpi = MR_IS(v, "on"); return; }
+    if (MR_IS(k, "ioapic")) { ioapic = MR_IS(v, "on"); return; }
+
+    // Video mode, in the format "<width>,<height>,<bpp>"@<x>,<y> <enabled>
+    // (the value is not fully quoted, so the leading quote is still there)
+    if (MR_IS(k, "VideoMode")) {
+        const char * p = v.p, * e = v.p + v.n;
+        if ((p < e) && (*p == '"')) p++;
+        int * dst[3] = { &videoWidth, &videoHeight, &videoBpp };
+        for (int i=0; i<3; ++i) {
+            const char * q = p;
+            while ((q < e) && (*q >= '0') && (*q <= '9')) q++;
+            *dst[i] = __mrNum(p, q - p);
+            if ((q >= e) || ((*q != ',') && (i < 2))) break;
+            p = q + 1;
+        }
+        if ((videoWidth <= 0) || (videoHeight <= 0) || (videoBpp <= 0))
+            videoWidth = videoHeight = videoBpp = 0;
+        return;
+    }
+
+    // Boot order (bootN) and network adapters (nicN)
+    if ((k.n == 5) && MR_STARTS(k, "boot")) {
+        int i = __mrNum(k.p + 4, 1);
+        if ((i >= 1) && (i <= VBOX_MAX_BOOT)) boot[i-1].assign(v.p, v.n);
+        return;
+    }
+    if ((k.n == 4) && MR_STARTS(k, "nic")) {
+        int i = __mrNum(k.p + 3, 1);
+        if ((i >= 1) && (i <= VBOX_MAX_NICS)) nics[i-1].assign(v.p, v.n);
+        return;
+    }
+
+    // Storage controllers
+    if (MR_STARTS(k, "storagecontrollername")) {
+        int i = __mrNum(k.p + 21, k.n - 21);
+        if (i >= 0) {
+            if ((size_t)i >= controllers.size()) controllers.resize(i+1);
+            controllers[i].assign(v.p, v.n);
+        }
+        return;
+    }
+
+    // NAT rules, in the format "<name>,<proto>,<host ip>,<host port>,<guest ip>,<guest port>"
+    if (MR_STARTS(k, "Forwarding(")) {
+        const char * comma = (const char *) memchr( v.p, ',', v.n );
+        if (comma != NULL) natRules[ string(v.p, comma - v.p) ].assign(v.p, v.n);
+        return;
+    }
+
+    // Shared folders
+    if (MR_STARTS(k, "SharedFolderNameMachineMapping") || MR_STARTS(k, "SharedFolderPathMachineMapping")) {
+        int i = __mrNum(k.p + 30, k.n - 30);
+        if (i >= 1) {
+            if ((size_t)i > sharedFolders.size()) sharedFolders.resize(i);
+            if (k.p[12] == 'N') {
+                sharedFolders[i-1].name.assign(v.p, v.n);
+            } else {
+                sharedFolders[i-1].hostPath.assign(v.p, v.n);
+            }
+        }
+        return;
+    }
+
+    // Storage slots, in the format "<controller>-<port>-<device>" or
+    // "<controller>-ImageUUID-<port>-<device>"
+    const char * dash2 = __mrLast( k.p, k.n, '-' );
+    if ((dash2 == NULL) || (dash2 == k.p)) return;
+    const char * dash1 = __mrLast( k.p, dash2 - k.p, '-' );
+    if (dash1 == NULL) return;
+    int device = __mrNum( dash2 + 1, k.p + k.n - dash2 - 1 );
+    int port = __mrNum( dash1 + 1, dash2 - dash1 - 1 );
+    if ((port < 0) || (device < 0)) return;
+    if (MR_IS(v, "none") || MR_IS(v, "emptydrive")) return;
+
+    __mrView ctl = { k.p, (size_t)(dash1 - k.p) };
+    bool isUUID = false;
+    if ((ctl.n > 10) && (memcmp(ctl.p + ctl.n - 10, "-ImageUUID", 10) == 0)) {
+        ctl.n -= 10;
+        isUUID = true;
+    }
+
+    // Must be a known controller
+    bool known = false;
+    for (vector<string>::iterator it = controllers.begin(); it != controllers.end(); ++it) {
+        if ((it->length() == ctl.n) && (memcmp(it->data(), ctl.p, ctl.n) == 0)) { known = true; break; }
+    }
+    if (!known) return;
+
+    // Find or allocate the slot
+    VBOX_STORAGE_SLOT * s = NULL;
+    for (vector<VBOX_STORAGE_SLOT>::iterator it = slots.begin(); it != slots.end(); ++it) {
+        if ((it->port == port) && (it->device == device) && 
+            (it->controller.length() == ctl.n) && (memcmp(it->controller.data(), ctl.p, ctl.n) == 0)) {
+            s = &(*it); break;
+        }
+    }
+    if (s == NULL) {
+        VBOX_STORAGE_SLOT empty;
+        empty.controller.assign(ctl.p, ctl.n);
+        empty.port = port;
+        empty.device = device;
+        slots.push_back( empty );
+        s = &slots.back();
+    }
+    if (isUUID) {
+        s->uuid.assign(v.p, v.n);
+    } else {
+        s->medium.assign(v.p, v.n);
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the medium on the given slot
+ */
+const VBOX_STORAGE_SLOT * MachineInfo::slot( const string& controller, int port, int device ) const {
+    for (vector<VBOX_STORAGE_SLOT>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+        if ((it->port == port) && (it->device == device) && (it->controller == controller))
+            return &(*it);
+    }
+    return NULL;
+}
+
+/**
+ * Export using the human-readable keys
+ */
+void MachineInfo::toMap( map<const string, const string> * ans ) const {
+    CRASH_REPORT_BEGIN;
+    ans->clear();
+    if (!valid) return;
+
+    ans->insert(make_pair( "UUID", uuid ));
+    ans->insert(make_pair( "Name", name ));
+    ans->insert(make_pair( "Config file", configFile ));
+    ans->insert(make_pair( "Log folder", logFolder ));
+    ans->insert(make_pair( "State", (stateName == "poweroff") ? string("powered off") : stateName ));
+    ans->insert(make_pair( "Number of CPUs", __mrStr(cpus) ));
+    ans->insert(make_pair( "Memory size", __mrStr(memory) + "MB" ));
+    ans->insert(make_pair( "VRAM size", __mrStr(vram) + "MB" ));
+    ans->insert(make_pair( "CPU exec cap", __mrStr(executionCap) + "%" ));
+    ans->insert(make_pair( "ACPI", string(acpi ? "on" : "off") ));
+    ans->insert(make_pair( "IOAPIC", string(ioapic ? "on" : "off") ));
+    if (videoWidth > 0) {
+        // Same format as the resolution changes the log follower reports
+        ans->insert(make_pair( "Video mode", __mrStr(videoWidth) + "x" + __mrStr(videoHeight) + "x" + __mrStr(videoBpp) ));
+    }
+
+    for (int i=0; i<VBOX_MAX_BOOT; ++i) {
+        if (boot[i].empty()) continue;
+        ans->insert(make_pair( "Boot Device (" + __mrStr(i+1) + ")", boot[i] ));
+    }
+    for (int i=0; i<VBOX_MAX_NICS; ++i) {
+        if (nics[i].empty()) continue;
+        ans->insert(make_pair( "NIC " + __mrStr(i+1), 
+            (nics[i] == "none") ? string("disabled") : "Attachment: " + nics[i] ));
+    }
+    for (size_t i=0; i<controllers.size(); ++i) {
+        ans->insert(make_pair( "Storage Controller Name (" + __mrStr(i) + ")", controllers[i] ));
+    }
+    for (vector<VBOX_STORAGE_SLOT>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+        ans->insert(make_pair( it->controller + " (" + __mrStr(it->port) + ", " + __mrStr(it->device) + ")",
+                               it->medium + " (UUID: " + it->uuid + ")" ));
+    }
+
+    CRASH_REPORT_END;
+}
@@ -22,6 +22,244 @@
 #include <CernVM/Hypervisor/Virtualbox/VBoxProbes.h>
 #include <CernVM/Hypervisor.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VBOX_SCANNER_SSE2
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <boost/thread/mutex.hpp>
+#include <map>
+
+/**
+ * A folder watch on the shared inotify descriptor
+ */
+struct __lwWatch {
+	int 			refs;
+	bool 			removed;
+	unsigned long 	changes;
+};
+
+/**
+ * The inotify descriptor shared by all the log followers, and
+ * the watches registered on it, indexed by watch descriptor.
+ */
+static boost::mutex 				__lwMutex;
+static int 							__lwFd = -1;
+static std::map< int, __lwWatch > 	__lwWatches;
+
+/**
+ * Add (or reference) a watch on the given folder, returning the watch descriptor
+ */
+static int __lwAdd( const string& folder ) {
+	boost::unique_lock<boost::mutex> lock(__lwMutex);
+
+	// Create the shared descriptor on first use
+	if (__lwFd < 0) {
+		__lwFd = inotify_init();
+		if (__lwFd < 0) return -1;
+		fcntl( __lwFd, F_SETFL, fcntl(__lwFd, F_GETFL) | O_NONBLOCK );
+		fcntl( __lwFd, F_SETFD, FD_CLOEXEC );
+	}
+
+	// The same folder returns the same watch descriptor
+	int wd = inotify_add_watch( __lwFd, folder.c_str(), IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE );
+	if (wd < 0) return -1;
+	std::map< int, __lwWatch >::iterator it = __lwWatches.find( wd );
+	if (it == __lwWatches.end()) {
+		__lwWatch w;
+		w.refs = 0;
+		w.removed = false;
+		w.changes = 0;
+		it = __lwWatches.insert( std::make_pair(wd, w) ).first;
+	} else if (it->second.removed) {
+		it->second.removed = false;
+		it->second.changes++;
+	}
+	it->second.refs++;
+	return wd;
+}
+
+/**
+ * Release a watch obtained through __lwAdd
+ */
+static void __lwRelease( int wd ) {
+	boost::unique_lock<boost::mutex> lock(__lwMutex);
+	std::map< int, __lwWatch >::iterator it = __lwWatches.find( wd );
+	if (it == __lwWatches.end()) return;
+	if (--it->second.refs > 0) return;
+	if (!it->second.removed) inotify_rm_watch( __lwFd, wd );
+	__lwWatches.erase( it );
+}
+
+/**
+ * Drain the pending events of the shared descriptor and get the change
+ * counter of the given watch. Returns false if the watch is gone.
+ */
+static bool __lwChanges( int wd, unsigned long * changes ) {
+	boost::unique_lock<boost::mutex> lock(__lwMutex);
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	// Drain all the pending events, on behalf of all the followers
+	while ((len = read( __lwFd, buf, sizeof(buf) )) > 0) {
+		for (char * ptr = buf; ptr < buf + len; ) {
+			struct inotify_event * ev = (struct inotify_event *) ptr;
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			// Events were lost, everybody has to check
+			if (ev->mask & IN_Q_OVERFLOW) {
+				for (std::map< int, __lwWatch >::iterator it = __lwWatches.begin(); it != __lwWatches.end(); ++it)
+					it->second.changes++;
+				continue;
+			}
+
+			std::map< int, __lwWatch >::iterator it = __lwWatches.find( ev->wd );
+			if (it == __lwWatches.end()) continue;
+
+			// The folder has gone away
+			if (ev->mask & IN_IGNORED) {
+				it->second.removed = true;
+				it->second.changes++;
+
+			// Something happened to VBox.log
+			} else if ((ev->len > 0) && (strcmp(ev->name, "VBox.log") == 0)) {
+				it->second.changes++;
+
+			}
+		}
+	}
+
+	std::map< int, __lwWatch >::iterator it = __lwWatches.find( wd );
+	if (it == __lwWatches.end()) return false;
+	*changes = it->second.changes;
+	return !it->second.removed;
+}
+
+#endif
+
+/**
+ * Build the shift table of the known patterns
+ */
+VBoxLogScanner::VBoxLogScanner() {
+	CRASH_REPORT_BEGIN;
+
+	// The patterns VBoxLogProbe::analyzeLine looks for
+	patterns[0] = "Changing the VM state from";
+	patterns[1] = "Display::handleDisplayResize";
+	patterns[2] = "WARNING! ";
+
+	minLength = 0;
+	for (int i=0; i<3; i++) {
+		lengths[i] = strlen(patterns[i]);
+		if ((minLength == 0) || (lengths[i] < minLength))
+			minLength = lengths[i];
+	}
+
+	// By default, a window can move past the entire block
+	memset( shift, (unsigned char)(minLength - 1), sizeof(shift) );
+
+	// Blocks found in the first minLength bytes of a pattern
+	// move the window only until they are aligned with it
+	for (int i=0; i<3; i++) {
+		const unsigned char * p = (const unsigned char *) patterns[i];
+		for (size_t q=2; q<=minLength; q++) {
+			unsigned char s = (unsigned char)(minLength - q);
+			unsigned int block = (p[q-2] << 8) | p[q-1];
+			if (s < shift[block]) shift[block] = s;
+		}
+	}
+
+	CRASH_REPORT_END;
+}
+
+/**
+ * Return the shared scanner
+ */
+const VBoxLogScanner& VBoxLogScanner::Default() {
+	static VBoxLogScanner scanner;
+	return scanner;
+}
+
+/**
+ * Find the first occurence of any pattern
+ */
+const char * VBoxLogScanner::find( const char * begin, const char * end ) const {
+	const char * start = begin;
+
+#ifdef VBOX_SCANNER_SSE2
+
+	// Compare 16 window positions at a time against the first and the last byte
+	// of every pattern, and verify only the positions where both of them match.
+	size_t maxLength = lengths[0];
+	for (int i=1; i<3; i++) if (lengths[i] > maxLength) maxLength = lengths[i];
+
+	__m128i firstByte[3], lastByte[3];
+	for (int i=0; i<3; i++) {
+		firstByte[i] = _mm_set1_epi8( patterns[i][0] );
+		lastByte[i] = _mm_set1_epi8( patterns[i][lengths[i]-1] );
+	}
+
+	while ((size_t)(end - start) >= maxLength + 15) {
+		__m128i block = _mm_loadu_si128( (const __m128i *) start );
+		unsigned int mask = 0;
+		for (int i=0; i<3; i++) {
+			__m128i blockLast = _mm_loadu_si128( (const __m128i *)(start + lengths[i] - 1) );
+			mask |= _mm_movemask_epi8( _mm_and_si128( _mm_cmpeq_epi8(block, firstByte[i]), _mm_cmpeq_epi8(blockLast, lastByte[i]) ) );
+		}
+
+		// Verify the candidates in order
+		for (int bit=0; mask != 0; bit++, mask >>= 1) {
+			if (!(mask & 1)) continue;
+			const char * pos = start + bit;
+			for (int i=0; i<3; i++) {
+				if ((pos[0] == patterns[i][0]) && (memcmp( pos, patterns[i], lengths[i] ) == 0))
+					return pos;
+			}
+		}
+
+		start += 16;
+	}
+
+	// The remaining bytes are handled below
+
+#endif
+
+	if ((size_t)(end - start) < minLength) return NULL;
+
+	// The window ends on 'p'
+	const unsigned char * p = (const unsigned char *) start + minLength - 1;
+	const unsigned char * last = (const unsigned char *) end;
+	while (p < last) {
+
+		// Skip windows that cannot contain a match
+		unsigned char s = shift[ (p[-1] << 8) | p[0] ];
+		if (s != 0) {
+			p += s;
+			continue;
+		}
+
+		// Verify the candidates
+		const char * cand = (const char *) p - (minLength - 1);
+		for (int i=0; i<3; i++) {
+			if (((size_t)(end - cand) >= lengths[i]) && (cand[0] == patterns[i][0]) &&
+			    (memcmp( cand, patterns[i], lengths[i] ) == 0))
+				return cand;
+		}
+		p++;
+
+	}
+
+	return NULL;
+}
+
 /**
  * Check if log file exists
  */
@@ -30,27 +268,37 @@ bool VBoxLogProbe::exists() {
 }
 
 /**
- * Analyze log file
+ * Reset analysis results
  */
-void VBoxLogProbe::analyze() {
-    CRASH_REPORT_BEGIN;
+void VBoxLogProbe::reset() {
+	CRASH_REPORT_BEGIN;
 
 	// Reset state
 	hasState = false;
-    state = SS_POWEROFF;
+	state = SS_POWEROFF;
 
-    // Reset failures
-    hasFailures = false;
-    failures = 0;
+	// Reset failures
+	hasFailures = false;
+	failures = 0;
 
 	// Reset resolution
 	hasResolutionChange = false;
-    resWidth = 0;
-    resHeight = 0;
-    resBpp = 0;
+	resWidth = 0;
+	resHeight = 0;
+	resBpp = 0;
 
-    // Local config
-    bool blockStateChange = false;
+	CRASH_REPORT_END;
+}
+
+/**
+ * Analyze log file
+ */
+void VBoxLogProbe::analyze() {
+    CRASH_REPORT_BEGIN;
+
+    // Reset results
+    reset();
+    blockStateChange = false;
 
     // Locate Logfile
     CVMWA_LOG("Debug", "Looking for state change  in " << logFile );
@@ -60,123 +308,380 @@ void VBoxLogProbe::analyze() {
     }
 
     // Open input stream
-    ifstream fIn(logFile.c_str(), ifstream::in);
+    ifstream fIn(logFile.c_str(), ifstream::in | ifstream::binary);
+    if (!fIn.is_open()) return;
 
-    // Read as few bytes as possible
-    string inBufferLine, stateStr;
-    size_t iStart, iEnd, i1, i2, qStart, qEnd;
-    char inBuffer[1024];
+    // Calculate file length
+    fIn.seekg( 0, fIn.end );
+    long seekSize = fIn.tellg();
 
     // If we are doing tailRead, seek to the
     // specified tail size.
-    if (tailSize > 0) {
+    if ((tailSize > 0) && (seekSize > tailSize))
+        seekSize = tailSize;
+
+    // Move 80kb before te end of the file
+    fIn.clear();
+    fIn.seekg( -seekSize, fIn.end );
 
-		// Calculate file length
-		fIn.seekg( 0, fIn.end );
-		int seekSize = fIn.tellg();
-		if (seekSize > tailSize) seekSize = tailSize;
+    // Read everything at once and scan the raw bytes
+    string inBuffer( seekSize, '\0' );
+    fIn.read( &inBuffer[0], seekSize );
+    inBuffer.resize( fIn.gcount() );
+    fIn.close();
 
-		// Move 80kb before te end of the file
-		fIn.clear();
-		fIn.seekg( -seekSize, fIn.end );
+    if (!inBuffer.empty())
+        analyzeBuffer( inBuffer.data(), inBuffer.data() + inBuffer.length() );
 
-    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Analyze the lines of the buffer that contain any of the patterns
+ */
+void VBoxLogProbe::analyzeBuffer( const char * begin, const char * end ) {
+    CRASH_REPORT_BEGIN;
+    const VBoxLogScanner& scanner = VBoxLogScanner::Default();
+    const char * ptr = begin, * match, * lineStart, * lineEnd;
+    string line;
 
-    // Start scanning
-    while (!fIn.eof()) {
+    while ((match = scanner.find( ptr, end )) != NULL) {
 
-        // Read line
-        fIn.getline( inBuffer, 1023 );
+        // Expand the match to the entire line
+        lineStart = match;
+        while ((lineStart > begin) && (lineStart[-1] != '\n')) lineStart--;
+        lineEnd = (const char *) memchr( match, '\n', end - match );
+        if (lineEnd == NULL) lineEnd = end;
 
-        // Handle it via higher-level API
-        inBufferLine.assign( inBuffer );
+        // Analyze only this line
+        line.assign( lineStart, lineEnd - lineStart );
+        if (!line.empty() && (line[line.length()-1] == '\r'))
+            line.erase( line.length()-1 );
+        analyzeLine( line );
 
-        if ( ((iStart = inBufferLine.find("Changing the VM state from")) != string::npos) && !blockStateChange ) {
+        // Continue with the next line
+        if (lineEnd == end) break;
+        ptr = lineEnd + 1;
 
-        	// We got a state change
-			hasState = true;
+    }
 
-            // Pick the appropriate ending
-            iEnd = inBufferLine.length();
-            i1 = inBufferLine.find("\r");
-            i2 = inBufferLine.find("\n");
-            if (i1 < iEnd) iEnd=i1;
-            if (i2 < iEnd) iEnd=i2;
+    CRASH_REPORT_END;
+}
 
-            // Find first quotation
-            qStart = inBufferLine.find('\'', iStart);
-            if (qStart == string::npos) continue;
-            qEnd = inBufferLine.find('\'', qStart+1);
-            if (qEnd == string::npos) continue;
+/**
+ * Analyze a single line of the log file
+ */
+void VBoxLogProbe::analyzeLine( const string& inBufferLine ) {
+    CRASH_REPORT_BEGIN;
+    size_t iStart, qStart, qEnd;
+    string stateStr;
+
+    if ( ((iStart = inBufferLine.find("Changing the VM state from")) != string::npos) && !blockStateChange ) {
+
+        // Find first quotation
+        qStart = inBufferLine.find('\'', iStart);
+        if (qStart == string::npos) return;
+        qEnd = inBufferLine.find('\'', qStart+1);
+        if (qEnd == string::npos) return;
+
+        // Find second quotation
+        qStart = inBufferLine.find('\'', qEnd+1);
+        if (qStart == string::npos) return;
+        qEnd = inBufferLine.find('\'', qStart+1);
+        if (qEnd == string::npos) return;
+
+    	// We got a state change
+		hasState = true;
+
+        // Extract string
+        stateStr = inBufferLine.substr( qStart+1, qEnd-qStart-1 );
+
+        // Compare to known state names
+        CVMWA_LOG("Debug","Got switch to " << stateStr);
+        if      (stateStr.compare("RUNNING") == 0) state = SS_RUNNING;
+        else if (stateStr.compare("SUSPENDED") == 0) state = SS_PAUSED;
+        else if (stateStr.compare("OFF") == 0) state = SS_POWEROFF;
+
+        // If we got 'SAVING' it means the VM was saved, and
+        // the state changes that follow should be ignored.
+        if (stateStr.compare("SAVING") == 0) {
+            blockStateChange = true;
+            state = SS_SAVED;
+        }
 
-            // Find second quotation
-            qStart = inBufferLine.find('\'', qEnd+1);
-            if (qStart == string::npos) continue;
-            qEnd = inBufferLine.find('\'', qStart+1);
-            if (qEnd == string::npos) continue;
+    } else if ((iStart = inBufferLine.find("Display::handleDisplayResize")) != string::npos) {
 
-            // Extract string
-            stateStr = inBufferLine.substr( qStart+1, qEnd-qStart-1 );
+    	// We got a resolutino change
+    	hasResolutionChange = true;
 
-            // Compare to known state names
-            CVMWA_LOG("Debug","Got switch to " << stateStr);
-            if      (stateStr.compare("RUNNING") == 0) state = SS_RUNNING;
-            else if (stateStr.compare("SUSPENDED") == 0) state = SS_PAUSED;
-            else if (stateStr.compare("OFF") == 0) state = SS_POWEROFF;
+		// Get W component
+		qStart = inBufferLine.find("w=", iStart);
+		if (qStart == string::npos) return;
+		qEnd = inBufferLine.find(" ", qStart);
+		if (qEnd == string::npos) return;
+		resWidth = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
 
-            // If we got 'SAVING' it means the VM was saved
-            if (stateStr.compare("SAVING") == 0) {
-                fIn.close();
-                blockStateChange = true;
-                state = SS_SAVED;
-            }
+		// Get H component
+		qStart = inBufferLine.find("h=", iStart);
+		if (qStart == string::npos) return;
+		qEnd = inBufferLine.find(" ", qStart);
+		if (qEnd == string::npos) return;
+		resHeight = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
 
-        } else if ((iStart = inBufferLine.find("Display::handleDisplayResize")) != string::npos) {
+		// Get BPP component
+		qStart = inBufferLine.find("bpp=", iStart);
+		if (qStart == string::npos) return;
+		qEnd = inBufferLine.find(" ", qStart);
+		if (qEnd == string::npos) return;
+		resBpp = ston<int>( inBufferLine.substr( qStart+4, qEnd-qStart-4 ) );
 
-        	// We got a resolutino change
-        	hasResolutionChange = true;
+    } else if ((iStart = inBufferLine.find("WARNING! ")) != string::npos) {
 
-			// Get W component
-			qStart = inBufferLine.find("w=", iStart);
-			if (qStart == string::npos) continue;
-			qEnd = inBufferLine.find(" ", qStart);
-			if (qEnd == string::npos) continue;
-			resWidth = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
+        // We got failures
+        hasFailures = true;
 
-			// Get H component
-			qStart = inBufferLine.find("h=", iStart);
-			if (qStart == string::npos) continue;
-			qEnd = inBufferLine.find(" ", qStart);
-			if (qEnd == string::npos) continue;
-			resHeight = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
+        // Check what kind of warning this was
+        if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support 64-bit") != string::npos) {
+            failures |= HFL_NO_VIRTUALIZATION;
 
-			// Get BPP component
-			qStart = inBufferLine.find("bpp=", iStart);
-			if (qStart == string::npos) continue;
-			qEnd = inBufferLine.find(" ", qStart);
-			if (qEnd == string::npos) continue;
-			resBpp = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-4 ) );
+        } else if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support HW virtualization") != string::npos) {
+            failures |= HFL_NO_VIRTUALIZATION;
 
-        } else if ((iStart = inBufferLine.find("WARNING! ")) != string::npos) {
+        }
 
-            // We got failures
-            hasFailures = true;
+    }
 
-            // Check what kind of warning this was
-            if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support 64-bit") != string::npos) {
-                failures |= HFL_NO_VIRTUALIZATION;
+    CRASH_REPORT_END;
+}
 
-            } else if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support HW virtualization") != string::npos) {
-                failures |= HFL_NO_VIRTUALIZATION;
+/**
+ * Create a log follower on the given folder
+ */
+VBoxLogFollower::VBoxLogFollower( const string& path, int tailSize )
+	: VBoxLogProbe( path, tailSize ), logFolder(path), rotatedFile(path + "/VBox.log.1"),
+	  offset(0), fileId(0), positioned(false), partialLine(), watchFd(-1), seenChanges(0), lastSize(-1)
+{
+	CRASH_REPORT_BEGIN;
+#ifdef __linux__
+
+	// Watch the log folder, so that rotations are reported as well
+	watchFd = __lwAdd( logFolder );
+	if (watchFd < 0) {
+		CVMWA_LOG("Warning", "Unable to watch " << logFolder << ", falling back to polling");
+	} else {
+		__lwChanges( watchFd, &seenChanges );
+	}
+
+#endif
+	CRASH_REPORT_END;
+}
 
-            }
+/**
+ * Release the inotify watch
+ */
+VBoxLogFollower::~VBoxLogFollower() {
+	CRASH_REPORT_BEGIN;
+#ifdef __linux__
+	if (watchFd >= 0) __lwRelease( watchFd );
+#endif
+	CRASH_REPORT_END;
+}
 
+/**
+ * Get the size and the identity of the given file
+ */
+bool VBoxLogFollower::fileStat( const string& file, long * size, long * id ) {
+	CRASH_REPORT_BEGIN;
+	struct stat attrib;
+	if (stat( file.c_str(), &attrib ) != 0) return false;
+	*size = (long) attrib.st_size;
+	*id = (long) attrib.st_ino;
+	return true;
+	CRASH_REPORT_END;
+}
 
-        }
+/**
+ * Check if the log might have changed since the last poll
+ */
+bool VBoxLogFollower::hasChanges() {
+	CRASH_REPORT_BEGIN;
+
+	// We have not read the file since the follower was (re)positioned
+	if (!positioned || (lastSize == -1)) return true;
+
+#ifdef __linux__
+	if (watchFd >= 0) {
+		unsigned long changes = seenChanges;
+
+		// The folder has gone away, fall back to polling
+		if (!__lwChanges( watchFd, &changes )) {
+			__lwRelease( watchFd );
+			watchFd = -1;
+			return true;
+		}
+
+		bool changed = (changes != seenChanges);
+		seenChanges = changes;
+		return changed;
+	}
+#endif
+
+	// Compare the size and the identity of the file
+	long size, id;
+	if (!fileStat( logFile, &size, &id )) return (lastSize != -1);
+	return (size != lastSize) || (id != fileId);
+
+	CRASH_REPORT_END;
+}
 
-    }
+/**
+ * Analyze the lines appended since the last poll
+ */
+bool VBoxLogFollower::poll() {
+	CRASH_REPORT_BEGIN;
+
+	// Reset results
+	reset();
+
+	// Check if the file is there
+	long size, id;
+	if (!fileStat( logFile, &size, &id )) {
+		lastSize = -1;
+		return false;
+	}
+
+	long lastOffset = offset;
+	bool restarted = false;
+	if (!positioned) {
+
+		// Start from the tail of the file
+		offset = 0;
+		if ((tailSize > 0) && (size > tailSize))
+			offset = size - tailSize;
+		fileId = id;
+		positioned = true;
+		restarted = true;
+
+	} else if (id != fileId) {
+
+		// The log was rotated. Finish the previous file if it's still around.
+		long rSize, rId;
+		if ((fileId != 0) && fileStat( rotatedFile, &rSize, &rId ) && (rId == fileId) && (rSize > offset)) {
+			CVMWA_LOG("Debug", "Log rotated, finishing " << rotatedFile << " from " << offset);
+			readFrom( rotatedFile, offset, true );
+		}
+
+		// Then continue with the new file
+		partialLine.clear();
+		blockStateChange = false;
+		offset = 0;
+		fileId = id;
+		restarted = true;
+
+	} else if (size < offset) {
+
+		// The log was truncated
+		CVMWA_LOG("Debug", "Log truncated, restarting " << logFile);
+		partialLine.clear();
+		blockStateChange = false;
+		offset = 0;
+		restarted = true;
+
+	}
+
+	// Analyze the new bytes
+	if (size > offset)
+		offset = readFrom( logFile, offset, false );
+	lastSize = size;
+
+	return restarted || (offset != lastOffset);
+	CRASH_REPORT_END;
+}
 
-    fIn.close();
+/**
+ * Analyze the given file starting from the given offset
+ */
+long VBoxLogFollower::readFrom( const string& file, long from, bool flush ) {
+	CRASH_REPORT_BEGIN;
+
+	// Open input stream
+	ifstream fIn(file.c_str(), ifstream::in | ifstream::binary);
+	if (!fIn.is_open()) return from;
+	fIn.seekg( from, fIn.beg );
+
+	// Read in chunks, scanning only the complete lines
+	char inBuffer[16384];
+	long pos = from;
+	while (fIn.good()) {
+		fIn.read( inBuffer, sizeof(inBuffer) );
+		size_t len = (size_t) fIn.gcount();
+		if (len == 0) break;
+		pos += len;
+
+		// Without a newline the whole chunk belongs to the incomplete line
+		const char * end = inBuffer + len;
+		const char * nl = (const char *) memchr( inBuffer, '\n', len );
+		if (nl == NULL) {
+			partialLine.append( inBuffer, len );
+			continue;
+		}
+
+		// Complete the line carried from the previous chunk
+		partialLine.append( inBuffer, nl - inBuffer );
+		analyzeBuffer( partialLine.data(), partialLine.data() + partialLine.length() );
+		partialLine.clear();
+
+		// Scan the lines up to the last newline at once
+		const char * lastNl = end - 1;
+		while (*lastNl != '\n') lastNl--;
+		if (lastNl > nl)
+			analyzeBuffer( nl + 1, lastNl );
+		partialLine.assign( lastNl + 1, end - lastNl - 1 );
+	}
+
+	// Analyze the trailing incomplete line if requested
+	if (flush && !partialLine.empty()) {
+		analyzeBuffer( partialLine.data(), partialLine.data() + partialLine.length() );
+		partialLine.clear();
+	}
+
+	return pos;
+	CRASH_REPORT_END;
+}
 
-    CRASH_REPORT_END;
-}
\ No newline at end of file
+/**
+ * Restore a previously obtained position
+ */
+void VBoxLogFollower::setPosition( long offset, long fileId ) {
+	CRASH_REPORT_BEGIN;
+	this->offset = offset;
+	this->fileId = fileId;
+	this->positioned = true;
+	this->lastSize = -1;
+	partialLine.clear();
+	CRASH_REPORT_END;
+}
+
+/**
+ * The offset right after the last complete line that was analyzed
+ */
+long VBoxLogFollower::getOffset() {
+	return offset - (long) partialLine.length();
+}
+
+/**
+ * The identity of the file the offset refers to
+ */
+long VBoxLogFollower::getFileId() {
+	return fileId;
+}
+
+/**
+ * Descriptor that becomes readable when the log folder changes
+ */
+int VBoxLogFollower::getWakeFd() {
+#ifdef __linux__
+	if (watchFd >= 0) return __lwFd;
+#endif
+	return -1;
+}
@@ -0,0 +1,217 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/CrashReport.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxQueryCache.h>
+
+using namespace std;
+
+/**
+ * Return the class of a cacheable VBoxManage query
+ */
+int VBoxQueryCache::classOf( const vector<string>& args ) {
+    if (args.size() < 2) return VBQ_NONE;
+    const string& cmd = args[0];
+
+    if (cmd == "list") {
+        const string& what = args[1];
+        if (what == "vms")                  return VBQ_VMS;
+        if (what == "hdds")                 return VBQ_HDDS;
+        if (what == "hostonlyifs")          return VBQ_HOSTONLYIFS;
+        if (what == "dhcpservers")          return VBQ_DHCPSERVERS;
+        if (what == "systemproperties")     return VBQ_SYSTEMPROPERTIES;
+    } else if ((cmd == "showhdinfo") || (cmd == "showmediuminfo")) {
+        return VBQ_HDINFO;
+    }
+
+    return VBQ_NONE;
+}
+
+/**
+ * Return the query classes whose results might change by the given command
+ */
+int VBoxQueryCache::affectedBy( const vector<string>& args ) {
+    if (args.empty()) return VBQ_NONE;
+    const string& cmd = args[0];
+
+    // Machine registration (might also register disks)
+    if ((cmd == "createvm") || (cmd == "registervm") || (cmd == "import") || (cmd == "clonevm"))
+        return VBQ_VMS | VBQ_HDDS;
+    if (cmd == "unregistervm")
+        return VBQ_VMS | VBQ_HDDS | VBQ_HDINFO;
+    if (cmd == "modifyvm")
+        return VBQ_VMS;
+
+    // Snapshots create, merge and discard differencing images
+    if (cmd == "snapshot")
+        return VBQ_HDDS | VBQ_HDINFO;
+
+    // Medium management
+    if ((cmd == "storageattach") || (cmd == "closemedium") || 
+        (cmd == "createhd") || (cmd == "createmedium") ||
+        (cmd == "modifyhd") || (cmd == "modifymedium") ||
+        (cmd == "clonehd") || (cmd == "clonemedium"))
+        return VBQ_HDDS | VBQ_HDINFO;
+
+    // Host networking
+    if (cmd == "hostonlyif")
+        return VBQ_HOSTONLYIFS | VBQ_DHCPSERVERS;
+    if (cmd == "dhcpserver")
+        return VBQ_DHCPSERVERS;
+
+    // Global configuration
+    if (cmd == "setproperty")
+        return VBQ_SYSTEMPROPERTIES;
+
+    return VBQ_NONE;
+}
+
+/**
+ * Return the index of the counters of the given (single) class
+ */
+static int __classSlot( int cls ) {
+    int slot = 0; while ((cls >> slot) != 1) slot++;
+    return slot;
+}
+
+/**
+ * Look-up the cached output of a command
+ */
+bool VBoxQueryCache::lookup( const vector<string>& args, vector<string> * stdoutList, unsigned long * gen ) {
+    CRASH_REPORT_BEGIN;
+    int cls = classOf( args );
+    if (cls == VBQ_NONE) return false;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    int slot = __classSlot( cls );
+
+    // Check for a valid entry, dropping it if it has expired
+    map< string, Entry >::iterator it = entries.find( joinArguments(args) );
+    if (it != entries.end()) {
+        if (it->second.expires > getMonotonicMillis()) {
+            hitCount[slot]++;
+            if (stdoutList != NULL) *stdoutList = it->second.lines;
+            return true;
+        }
+        entries.erase( it );
+    }
+
+    missCount[slot]++;
+    if (gen != NULL) *gen = generation[slot];
+    return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Store the output of a successful command
+ */
+void VBoxQueryCache::store( const vector<string>& args, const vector<string>& stdoutList, unsigned long gen ) {
+    CRASH_REPORT_BEGIN;
+    int cls = classOf( args );
+    if (cls == VBQ_NONE) return;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (ttl <= 0) return;
+
+    // The class was invalidated while the query was running
+    if (generation[ __classSlot(cls) ] != gen) return;
+
+    // Drop the expired entries, so queries that are not repeated don't pile-up
+    long now = getMonotonicMillis();
+    for (map< string, Entry >::iterator it = entries.begin(); it != entries.end(); ) {
+        if (it->second.expires <= now) {
+            entries.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+
+    Entry& entry = entries[ joinArguments(args) ];
+    entry.cls = cls;
+    entry.expires = now + ttl;
+    entry.lines = stdoutList;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Drop the entries of the given classes
+ */
+void VBoxQueryCache::invalidate( int classes ) {
+    CRASH_REPORT_BEGIN;
+    if (classes == VBQ_NONE) return;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (int i=0; i<VBQ_CLASSES; ++i)
+        if ((classes & (1 << i)) != 0) generation[i]++;
+    for (map< string, Entry >::iterator it = entries.begin(); it != entries.end(); ) {
+        if ((it->second.cls & classes) != 0) {
+            entries.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Drop the entries affected by the given command
+ */
+void VBoxQueryCache::invalidateBy( const vector<string>& args ) {
+    CRASH_REPORT_BEGIN;
+    int classes = affectedBy( args );
+    if (classes != VBQ_NONE) {
+        CVMWA_LOG("Debug", "Invalidating query cache classes " << classes << " after '" << args[0] << "'");
+        invalidate( classes );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the lifetime of the cached results
+ */
+void VBoxQueryCache::setTTL( long ttl ) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        this->ttl = ttl;
+    }
+    if (ttl <= 0) invalidate();
+}
+
+/**
+ * Sum the hit counters of the given classes
+ */
+unsigned long VBoxQueryCache::hits( int classes ) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    unsigned long total = 0;
+    for (int i=0; i<VBQ_CLASSES; ++i)
+        if ((classes & (1 << i)) != 0) total += hitCount[i];
+    return total;
+}
+
+/**
+ * Sum the miss counters of the given classes
+ */
+unsigned long VBoxQueryCache::misses( int classes ) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    unsigned long total = 0;
+    for (int i=0; i<VBQ_CLASSES; ++i)
+        if ((classes & (1 << i)) != 0) total += missCount[i];
+    return total;
+}
@@ -22,6 +22,7 @@
 #include <CernVM/Hypervisor/Virtualbox/VBoxSession.h>
 #include <CernVM/Hypervisor/Virtualbox/VBoxInstance.h>
 #include <CernVM/Hypervisor/Virtualbox/VBoxProbes.h>
+#include <CernVM/ApiProber.h>
 #include <CernVM/Utilities.h>
 
 #include <boost/filesystem.hpp>
@@ -351,15 +352,10 @@ void VBoxSession::CreateVM() {
     CRASH_REPORT_BEGIN;
     if (isAborting) return;
     FSMDoing("Creating Virtual Machine");
-    ostringstream args;
     vector<string> lines;
     string vboxid;
     int ans;
 
-    bool add_IDE = true,
-         add_SATA = true,
-         add_FLOPPY = true;
-
     SysExecConfig createExecConfig(execConfig);
     createExecConfig.handleErrString("already exists", 500);
 
@@ -382,12 +378,12 @@ void VBoxSession::CreateVM() {
             return;
         }
 
-        args.str("");
-        args << "import " << ovaFilename;
+        VBoxCommand importCmd("import");
+        importCmd.arg(ovaFilename);
         if (!name.empty())
-            args << " --vsys 0 --vmname " << name;
+            importCmd.opt("--vsys", 0).opt("--vmname", name);
 
-        ans = this->wrapExec(args.str(), &lines, NULL, createExecConfig);
+        ans = this->wrapExec(importCmd, &lines, NULL, createExecConfig);
         if (ans == 500) { //already exists
             // Try to fetch VM info by name
             map<const string, const string> info = getMachineInfo( name );
@@ -412,25 +408,17 @@ void VBoxSession::CreateVM() {
             return;
 
         } else {
-            // Get and store VBox UUID
-            args.str("");
-            args << "showvminfo \"" << name << "\"";
-            ans = this->wrapExec(args.str(), &lines, NULL, createExecConfig);
-
-            map<const string, const string> toks = tokenize( &lines, ':' );
-            if (ans != 0 || toks.find("UUID") == toks.end()) {
+            // Get and store VBox UUID and machine info
+            map<const string, const string> info = getMachineInfo( name );
+            if ((info.find(":ERROR:") != info.end()) || !machineRecord.valid) {
                 errorOccured("Unable to detect the VirtualBox ID of the imported VM", HVE_CREATE_ERROR);
                 return;
             }
+            machine->fromMap( &info, true );
 
             // Store VBox UUID
-            vboxid = toks["UUID"];
+            vboxid = machineRecord.uuid;
             parameters->set("vboxid", vboxid);
-
-            // Try to fetch VM info by name
-            map<const string, const string> info = getMachineInfo( name );
-            if (info.find(":ERROR:") == info.end()) // No error => store machine info
-                machine->fromMap( &info, true );
         }
     }
     else {
@@ -445,15 +433,15 @@ void VBoxSession::CreateVM() {
         local->set("baseFolder", baseFolder);
 
         // Create and register a new VM
-        args.str("");
-        args << "createvm"
-            << " --name \"" << name << "\""
-            << " --ostype " << osType
-            << " --basefolder \"" << baseFolder << "\""
-            << " --register";
+        VBoxCommand createCmd("createvm");
+        createCmd
+            .opt("--name",          name)
+            .opt("--ostype",        osType)
+            .opt("--basefolder",    baseFolder)
+            .arg("--register");
 
         // Execute and handle errors
-        ans = this->wrapExec(args.str(), &lines, NULL, createExecConfig);
+        ans = this->wrapExec(createCmd, &lines, NULL, createExecConfig);
 
         // If VM already exists, update sysconfig
         if (ans == 500) {
@@ -497,76 +485,18 @@ void VBoxSession::CreateVM() {
         }
     }
 
-    // Look if we have controllers and disable the creation
-    // flag for each one of these.
-    ostringstream oss;
-    for (int i=0; i<4; i++) {
-        oss.str(""); oss << "Storage Controller Name (" << i << ")";
-        if (machine->contains(oss.str())) {
-            string controllerName = machine->get(oss.str());
-            if (controllerName.compare("IDE") == 0) {
-                add_IDE = false;
-            } else if (controllerName.compare("SATA") == 0) {
-                add_SATA = false;
-            } else if (controllerName.compare("Floppy") == 0) {
-                add_FLOPPY = false;
-            }
-        }
-    }
-
-    // Attach an IDE controller
-    if (add_IDE) {
-        args.str("");
-        args << "storagectl "
-            << vboxid
-            << " --name "       << "IDE"
-            << " --add "        << "ide";
-
-        ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
-        if (ans != 0) {
-            // Destroy VM
-            destroyVM();
-            // Trigger Error
-            errorOccured("Unable to attach a new IDE controller", HVE_CREATE_ERROR);
-            return;
-        }
-    }
-
-    // Attach a SATA controller
-    if (add_SATA) {
-        args.str("");
-        args << "storagectl "
-            << vboxid
-            << " --name "       << "SATA"
-            << " --add "        << "sata"
-            << " --portcount 4";
-
-        ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
-        if (ans != 0) {
-            // Destroy VM
-            destroyVM();
-            // Trigger Error
-            errorOccured("Unable to attach a new SATA controller", HVE_CREATE_ERROR);
-            return;
-        }
-    }
-
-    // Attach a floppy controller
-    if (add_FLOPPY) {
-        args.str("");
-        args << "storagectl "
-            << vboxid
-            << " --name "       << FLOPPYIO_CONTROLLER
-            << " --add "        << "floppy";
-
-        ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
-        if (ans != 0) {
-            // Destroy VM
-            destroyVM();
-            // Trigger Error
-            errorOccured("Unable to attach a new SATA controller", HVE_CREATE_ERROR);
-            return;
-        }
+    // Attach the IDE, SATA and floppy controllers that are missing
+    VBoxMachineSpec spec;
+    spec.controller( "IDE", "ide" )
+        .controller( "SATA", "sata", 4 )
+        .controller( FLOPPYIO_CONTROLLER, "floppy" );
+    ans = applyConfig( spec );
+    if (ans != HVE_OK) {
+        // Destroy VM
+        destroyVM();
+        // Trigger Error
+        errorOccured("Unable to attach the storage controllers", HVE_CREATE_ERROR);
+        return;
     }
 
     // The current (known) VM state is 'created'
@@ -585,19 +515,22 @@ void VBoxSession::ConfigureVM() {
     CRASH_REPORT_BEGIN;
     if (isAborting) return;
     FSMDoing("Configuring Virtual Machine");
-    ostringstream args;
-    vector<string> lines;
-    map<string, string> toks;
-    string uuid;
     int ans;
 
     // Extract flags
     int flags = parameters->getNum<int>("flags", 0);
 
-    // Find a random free port for VRDE
+    // Reserve a free port for VRDE, keeping the previous one if it's still free
     int rdpPort = local->getNum<int>("rdpPort", 0);
-    if (rdpPort == 0 || isPortOpen("127.0.0.1", rdpPort)) {
-        rdpPort = getFreePort("127.0.0.1");
+    if ((rdpPort != 0) && (hypervisor->portAllocator.reserved(uuid, "rdp") == 0))
+        hypervisor->portAllocator.claim(uuid, "rdp", rdpPort);
+    int newRdpPort = hypervisor->portAllocator.reserve(uuid, "rdp");
+    if (newRdpPort == 0) {
+        errorOccured("Unable to allocate a port for the remote display", HVE_EXTERNAL_ERROR);
+        return;
+    }
+    if (newRdpPort != rdpPort) {
+        rdpPort = newRdpPort;
         local->setNum<int>("rdpPort", rdpPort);
     }
 
@@ -605,140 +538,85 @@ void VBoxSession::ConfigureVM() {
     string bootMedium = "dvd";
     if ((flags & HVF_DEPLOYMENT_HDD) != 0 || (flags & HVF_DEPLOYMENT_HDD_LOCAL) != 0) bootMedium = "disk";
 
-    // Modify VM to match our needs
-    args.str("");
-    args << "modifyvm " << parameters->get("vboxid");
-
-    // Go through the machine configuration
+    // Describe the VM we need
+    VBoxMachineSpec spec;
     {
-        string vM, vC;
-
-        // 1) CPUS
-        vC = parameters->get("cpus", "2"); vM = machine->get("Number of CPUs", "");
-        if (vC != vM)
-            args << " --cpus "                  << vC;
+        string vM;
 
-        // 2) Memory
-        vC = parameters->get("memory", "1024"); vM = machine->get("Memory size", "");
-        if (vM.find("MB") != string::npos) vM = vM.substr(0, vM.length()-2);
-        if (vC != vM)
-            args << " --memory "                << vC;
+        // 1) Resources
+        spec.set("cpus",            parameters->get("cpus", "2"));
+        spec.set("memory",          parameters->get("memory", "1024"));
+        spec.set("vram",            parameters->get("vram", "32"));
 
-        /*
-        // 3) Execution cap
-        vC = parameters->get("executionCap", "80"); vM = machine->get("CPU exec cap", "");
-        if (vM.find("%") != string::npos) vM = vM.substr(0, vM.length()-1);
-        if (vC != vM)
-        */
-        // 3) Always apply execution cap (not for CernVM Launch)
-        // args    << " --cpuexecutioncap "       << parameters->get("executionCap", "80");
+        // 2) Execution cap is not applied (not for CernVM Launch)
 
-        // 4) VRAM
-        vC = parameters->get("vram", "32"); vM = machine->get("VRAM size", "");
-        if (vM.find("MB") != string::npos) vM = vM.substr(0, vM.length()-2);
-        if (vC != vM)
-            args << " --vram "                  << vC;
+        // 3) ACPI & IOAPIC
+        spec.set("acpi",            "on");
+        spec.set("ioapic",          "on");
 
-        // 5) ACPI
-        vC = "on"; vM = machine->get("ACPI", "");
-        if (vC != vM)
-            args << " --acpi "                  << vC;
+        // 4) VRDE: dropped support
 
-        // 5) IOAPIC
-        vC = "on"; vM = machine->get("IOAPIC", "");
-        if (vC != vM)
-            args << " --ioapic "                << vC;
+        // 5) New VBox: fix graphics adapter
+        if (hypervisor->version.compare(HypervisorVersion("6.1")) <= 0)
+            spec.set("graphicscontroller", "vboxsvga");
 
-        // 6) VRDE: dropped support
+        // 6) Boot medium
+        spec.set("boot1",           bootMedium);
 
-        // 6) New VBox: fix graphics adapter
-        if (hypervisor->version.compare(HypervisorVersion("6.1")) <= 0)
-            args << " --graphicscontroller vboxsvga";
-
-        // 7) Boot medium
-        vC = bootMedium; vM = machine->get("Boot Device (1)", "");
-        std::transform(vM.begin(), vM.end(), vM.begin(), ::tolower);
-        if (vC != vM)
-            args << " --boot1 "             << vC;
-
-        // 8) NIC 1
-        vM = machine->get("NIC 1", "");
-        if (vM.empty() || (vM == "disabled")) {
-            args << " --nic1 "              << "nat";
-            args << " --nictype1 "          << "virtio";
+        // 7) NIC 1, unless the user has configured it
+        vM = machineRecord.nics[0];
+        if (vM.empty() || (vM == "none")) {
+            spec.set("nic1",        "nat");
+            spec.set("nictype1",    "virtio");
         }
 
-        // 9) NAT DNS Host Resolver (bugfix for hibernate cases)
-        args << " --natdnshostresolver1 "    << "on";
+        // 8) NAT DNS Host Resolver (bugfix for hibernate cases)
+        spec.set("natdnshostresolver1", "on");
 
-        // 10) Enable graphical additions if instructed to do so
+        // 9) Enable graphical additions if instructed to do so
         if ((flags & HVF_GRAPHICAL) != 0) {
-            args << " --draganddrop "       << "bidirectional";
+            spec.set("draganddrop", "bidirectional");
             if (hypervisor->version.compare(HypervisorVersion("6.1")) <= 0)
-                args << " --clipboard-mode "         << "bidirectional";
+                spec.set("clipboard-mode", "bidirectional");
             else
-                args << " --clipboard "         << "bidirectional";
+                spec.set("clipboard", "bidirectional");
         }
 
-        // 11) Second nost-only NIC
+        // 10) Second host-only NIC
         if ((flags & HVF_DUAL_NIC) != 0) {
-            vM = machine->get("NIC 2", "");
-            if (vM.empty() || (vM == "disabled")) {
-                args << " --nic2 "          << "hostonly"
-                     << " --hostonlyadapter2 \"" << local->get("hostonlyif") << "\"";
-                args << " --nictype2 "          << "virtio";
+            vM = machineRecord.nics[1];
+            if (vM.empty() || (vM == "none")) {
+                spec.set("nic2",                "hostonly");
+                spec.set("hostonlyadapter2",    local->get("hostonlyif"));
+                spec.set("nictype2",            "virtio");
             }
         }
     }
 
-    // Execute and handle errors
-    ans = this->wrapExec(args.str(), &lines, NULL, execConfig);
-    if (ans != 0) {
-        errorOccured("Unable to modify the Virtual Machine", HVE_EXTERNAL_ERROR);
-        return;
-    }
-
-    // We add the NIC rules in a separate step, because if the NIC was previously
-    // disabled, there was no way to know which rules there were applied
+    // Forward the API port with a NAT rule, when we don't have a host-only NIC
     if ((flags & HVF_DUAL_NIC) == 0) {
-        // If our previous port is taken, find a free port
-        if (isPortOpen("127.0.0.1", this->getAPIPort())) {
-            // First we need to delete the rule, if it already exists
-            args.str("");
-            args << "modifyvm " << parameters->get("vboxid")
-                 << " --natpf1" << " delete" << " guestapi";
-
-            // Use custom execConfig to ignore "nonexisting" errors
-            SysExecConfig localExecCfg( execConfig );
-            localExecCfg.handleErrString( "Code NS_ERROR_INVALID_ARG (0x80070057) - Invalid argument value (extended info not available)", 256 );
-            this->wrapExec(args.str(), &lines, NULL, localExecCfg);
-
+        // If our previous port is taken, reserve a new one
+        int apiPort = this->getAPIPort();
+        if ((apiPort != 0) && (hypervisor->portAllocator.reserved(uuid, "api") == 0))
+            hypervisor->portAllocator.claim(uuid, "api", apiPort);
+        int newPort = hypervisor->portAllocator.reserve(uuid, "api");
+        if (newPort == 0) {
+            errorOccured("Unable to allocate a port for the API", HVE_EXTERNAL_ERROR);
+            return;
+        }
+        if (newPort != apiPort) {
             // Save the new port
-            int newPort = getFreePort("127.0.0.1");
             local->setNum<int>("apiPort", newPort);
         }
 
-        // Add a new NAT forwarding rule (or submit the same as existing)
-        args.str("");
-        args << "modifyvm "
-             << parameters->get("vboxid")
-             << " --natpf1 " << "guestapi,tcp,127.0.0.1," << this->getAPIPort() << ",," << parameters->get("apiPort");
-
-        // Use custom execConfig to ignore "already exists" errors
-        SysExecConfig localExecCfgCreate( execConfig );
-        localExecCfgCreate.handleErrString( "A NAT rule of this name already exists", 100 );
-
-        // Add NAT rule
-        ans = this->wrapExec(args.str(), &lines, NULL, localExecCfgCreate);
-        if ((ans != 0) && (ans != 100)) {
-            errorOccured("Unable to modify the Virtual Machine", HVE_EXTERNAL_ERROR);
-            return;
-        }
-
+        // The planner replaces the existing rule if the port has changed
+        ostringstream rule;
+        rule << "guestapi,tcp,127.0.0.1," << this->getAPIPort() << ",," << parameters->get("apiPort");
+        spec.natRule("guestapi", rule.str());
     }
-    // Add shared folder if needed
-    int vM = local->getNum<int>("sharedFolderAdded", 0); // We cannot use machine/Shared Folders, because it doesn't get parsed correctly
-    if (! vM) {
+
+    // Share a folder with the guest and allow creating symlinks in it
+    {
         std::string sharedFolder;
         if (! (parameters->get("sharedFolder", "")).empty()) // User has specified which folder he wants to share
             sharedFolder = parameters->get("sharedFolder");
@@ -746,58 +624,16 @@ void VBoxSession::ConfigureVM() {
             sharedFolder = getHomeDir(); // Defaulting to a user's home directory
 
         std::string sharedFolderName = parameters->get("name", "") + "_sf";
-        args.str("");
-        args << "sharedfolder " << "add " << parameters->get("vboxid")
-             << " --name " << sharedFolderName << " --hostpath " << sharedFolder
-             << " --automount";
-
-        // Use custom execConfig to ignore "already exists" errors
-        std::string alreadyExistsString = "Shared folder named '" + sharedFolderName + "' already exists";
-        SysExecConfig localExecCfgCreate( execConfig );
-        localExecCfgCreate.handleErrString( alreadyExistsString, 100 );
-        ans = this->wrapExec(args.str(), &lines, NULL, localExecCfgCreate);
-        if ((ans != 0) && (ans != 100)) {
-            errorOccured("Unable to modify the Virtual Machine", HVE_EXTERNAL_ERROR);
-            return;
-        }
-        // Now enable creating symlinks from the guest OS
-        args.str("");
-        args << "setextradata " << parameters->get("vboxid") << " VBoxInternal2/SharedFoldersEnableSymlinksCreate/"
-             << sharedFolderName << " 1";
-        ans = this->wrapExec(args.str(), &lines, NULL, localExecCfgCreate);
-        if ((ans != 0) && (ans != 100))
-            CVMWA_LOG("log", "Unable to enable symlink creation from the host OS");
-
-        local->setNum<int>("sharedFolderAdded", 1);
-    }
-
-
-
-//        << " --cpus "                   << parameters->get("cpus", "2")
-//        << " --memory "                 << parameters->get("memory", "1024")
-//        << " --cpuexecutioncap "        << parameters->get("executionCap", "80")
-//        << " --vram "                   << "32"
-//        << " --acpi "                   << "on"
-//        << " --ioapic "                 << "on"
-//        << " --vrde "                   << "on"
-//        << " --vrdeaddress "            << "127.0.0.1"
-//        << " --vrdeauthtype "           << "null"
-//        << " --vrdeport "               << rdpPort
-//        << " --boot1 "                  << bootMedium
-//        << " --boot2 "                  << "none"
-//        << " --boot3 "                  << "none"
-//        << " --boot4 "                  << "none"
-//        << " --nic1 "                   << "nat"
-//        << " --natdnshostresolver1 "    << "on";
-//
-//    // Setup network
-//    if ((flags & HVF_DUAL_NIC) != 0) {
-//        // Create two adapters if DUAL_NIC is specified
-//        args << " --nic2 "              << "hostonly" << " --hostonlyadapter2 \"" << local->get("hostonlyif") << "\"";
-//    } else {
-//        // Otherwise create a NAT rule
-//        args << " --natpf1 "            << "guestapi,tcp,127.0.0.1," << local->get("apiPort") << ",," << parameters->get("apiPort");
-//    }
+        spec.sharedFolder(sharedFolderName, sharedFolder);
+        spec.extra("VBoxInternal2/SharedFoldersEnableSymlinksCreate/" + sharedFolderName, "1");
+    }
+
+    // Apply only what has changed
+    ans = applyConfig( spec );
+    if (ans != HVE_OK) {
+        errorOccured("Unable to modify the Virtual Machine", HVE_EXTERNAL_ERROR);
+        return;
+    }
 
     // We are initialized
     local->set("initialized","1");
@@ -874,8 +710,12 @@ void VBoxSession::ConfigNetwork() {
         int localApiPort = local->getNum<int>("apiPort", 0);
         if (localApiPort == 0) {
 
-            // Find a random free port for API
-            localApiPort = getFreePort("127.0.0.1");
+            // Reserve a free port for API
+            localApiPort = hypervisor->portAllocator.reserve(uuid, "api");
+            if (localApiPort == 0) {
+                errorOccured("Unable to allocate a port for the API", HVE_EXTERNAL_ERROR);
+                return;
+            }
 
             // Store the API Port info
             local->setNum<int>("apiPort", localApiPort);
@@ -1050,6 +890,29 @@ void VBoxSession::DownloadMedia() {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Wait for the media download that started concurrently with the VM configuration
+ */
+void VBoxSession::JoinMedia() {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return;
+    FSMDoing("Waiting for the required media");
+
+    // Raise the download errors in the FSM thread
+    std::string message;
+    int code = HVE_EXTERNAL_ERROR;
+    if (!FSMJoin( VBOX_BRANCH_MEDIA, &message, &code )) {
+        if (message.empty()) message = "Media download aborted";
+        errorOccured( message, code );
+        return;
+    }
+
+    FSMDone("Required media available");
+    CRASH_REPORT_END;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 /**
  * Configure boot media of the VM
  */
@@ -1189,7 +1052,6 @@ void VBoxSession::ConfigureVMScratch() {
     CRASH_REPORT_BEGIN;
     if (isAborting) return;
     FSMDoing("Preparing scratch storage");
-    ostringstream args;
     int ans;
     int flags = parameters->getNum<int>("flags", 0);
 
@@ -1217,13 +1079,12 @@ void VBoxSession::ConfigureVMScratch() {
         string vmDisk = getTmpFile(".vdi", this->getDataFolder());
 
         // (4) Create disk
-        args.str("");
-        args << "createhd"
-            << " --filename "   << "\"" << vmDisk << "\""
-            << " --size "       << parameters->get("disk");
+        VBoxCommand createCmd("createhd");
+        createCmd.opt("--filename", vmDisk)
+                 .opt("--size", parameters->get("disk"));
 
         // Execute and handle errors
-        ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+        ans = this->wrapExec(createCmd, NULL, NULL, execConfig);
         if (ans != 0) {
             errorOccured("Unable to allocate a scratch disk", HVE_EXTERNAL_ERROR);
             return;
@@ -1233,18 +1094,17 @@ void VBoxSession::ConfigureVMScratch() {
         std::string diskGUID = newGUID();
 
         // Attach disk to the SATA controller
-        args.str("");
-        args << "storageattach "
-            << parameters->get("vboxid")
-            << " --storagectl " << scratchController
-            << " --port "       << scratchPort
-            << " --device "     << scratchDevice
-            << " --type "       << "hdd"
-            << " --setuuid "    << diskGUID
-            << " --medium "     << "\"" << vmDisk << "\"";
+        VBoxCommand attachCmd("storageattach");
+        attachCmd.arg(parameters->get("vboxid"))
+                 .opt("--storagectl", scratchController)
+                 .opt("--port", scratchPort)
+                 .opt("--device", scratchDevice)
+                 .opt("--type", "hdd")
+                 .opt("--setuuid", diskGUID)
+                 .opt("--medium", vmDisk);
 
         // Execute and handle errors
-        ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+        ans = this->wrapExec(attachCmd, NULL, NULL, execConfig);
         if (ans != 0) {
             errorOccured("Unable to attach the scratch disk", HVE_EXTERNAL_ERROR);
             return;
@@ -1467,6 +1327,9 @@ void VBoxSession::ReleaseVMAPI() {
     if (isAborting) return;
     FSMDoing("Releasing VM API medium");
 
+    // The medium must be re-created on the next boot
+    local->set("apiFingerprint", "");
+
     // Extract flags
     int flags = parameters->getNum<int>("flags", 0);
 
@@ -1492,6 +1355,28 @@ void VBoxSession::ReleaseVMAPI() {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Complete the profile of the start sequence
+ */
+void VBoxSession::finishBootProfile() {
+    CRASH_REPORT_BEGIN;
+    if (!fsmTrace.end()) return;
+
+    // Keep the breakdown of the last start and add it to the samples
+    local->set("bootProfile", fsmTrace.toJSON());
+    BootProfiler::Default().record( fsmTrace );
+
+    // Log the top-level steps
+    std::ostringstream oss;
+    std::vector< PROFILE_SPAN > spans = fsmTrace.getSpans();
+    for (std::vector< PROFILE_SPAN >::iterator it = spans.begin(); it != spans.end(); ++it) {
+        if ((*it).parent >= 0) continue;
+        oss << " " << (*it).name << "=" << (*it).duration;
+    }
+    CVMWA_LOG("Info", "Start profile (ms):" << oss.str());
+    CRASH_REPORT_END;
+}
+
 /**
  * Prepare the VM for booting
  */
@@ -1499,6 +1384,17 @@ void VBoxSession::PrepareVMBoot() {
     CRASH_REPORT_BEGIN;
     if (isAborting) return;
     FSMDoing("Preparing for VM Boot");
+    bootStartedAt = getTimeInMs();
+    bootFastPath = false;
+
+    // Skip the provisioning steps if nothing has changed since the last boot
+    int step = getFastBootStep();
+    if (step != 0) {
+        bootFastPath = true;
+        FSMSkew( step );
+        FSMDone("Provisioning has not changed since the last boot");
+        return;
+    }
 
     FSMDone("VM prepared for boot");
     CRASH_REPORT_END;
@@ -1558,7 +1454,7 @@ void VBoxSession::DiscardVMState() {
     FSMDoing("Discarding saved VM state");
 
     // Discard vm state
-    int ans = this->wrapExec("discardstate " + parameters->get("vboxid"), NULL, NULL, execConfig);
+    int ans = this->wrapExec(VBoxCommand("discardstate").arg(parameters->get("vboxid")), NULL, NULL, execConfig);
     if (ans != 0) {
         errorOccured("Unable to discard the saved VM state", ans);
         return;
@@ -1588,9 +1484,9 @@ void VBoxSession::StartVM() {
 
     // Start VM
     if ((flags & HVF_HEADFUL) != 0) {
-        ans = this->wrapExec("startvm " + parameters->get("vboxid") + " --type gui", NULL, NULL, config);
+        ans = this->wrapExec(VBoxCommand("startvm").arg(parameters->get("vboxid")).opt("--type", "gui"), NULL, NULL, config);
     } else {
-        ans = this->wrapExec("startvm " + parameters->get("vboxid") + " --type headless", NULL, NULL, config);
+        ans = this->wrapExec(VBoxCommand("startvm").arg(parameters->get("vboxid")).opt("--type", "headless"), NULL, NULL, config);
     }
 
     // Handle errors
@@ -1608,6 +1504,21 @@ void VBoxSession::StartVM() {
     // Get PID from the log file
     local->setNum<int>("pid", getPIDFromFile( machine->get("Log folder") ));
 
+    // Remember what we booted from, for skipping the provisioning next time
+    std::string apiFingerprint;
+    sha256_buffer( getUserData(), &apiFingerprint );
+    local->lock();
+    local->set("provisionFingerprint", getProvisionFingerprint());
+    local->set("apiFingerprint", apiFingerprint);
+    local->unlock();
+
+    // Report the start latency
+    if (bootStartedAt != 0) {
+        CVMWA_LOG("Info", "VM started in " << (getTimeInMs() - bootStartedAt) << " ms ("
+                  << (bootFastPath ? "warm" : "cold") << " path)");
+        bootStartedAt = 0;
+    }
+
     // We are done
     FSMDone("VM Started");
     CRASH_REPORT_END;
@@ -1711,7 +1622,9 @@ int VBoxSession::open ( ) {
     // Reset properties
     isAborting = false;
 
-    // Start the FSM thread
+    // Start the FSM thread (or use the shared pool of the hypervisor)
+    if (hypervisor->sessionExecutor)
+        FSMUseExecutor( hypervisor->sessionExecutor );
     FSMThreadStart();
 
     // Goto SessionUpdate
@@ -1844,6 +1757,10 @@ int VBoxSession::start ( const ParameterMapPtr& userData ) {
     }
     parameters->unlock();
 
+    // Profile the start sequence until the API responds
+    if (local->getNum<int>("state", 0) != SS_RUNNING)
+        fsmTrace.begin("start");
+
     // Switch to running state
     FSMGoto(7);
 
@@ -1860,7 +1777,6 @@ int VBoxSession::setExecutionCap ( int cap ) {
     CRASH_REPORT_BEGIN;
     if (isAborting) return HVE_INVALID_STATE;
 
-    ostringstream args;
     int state = local->getNum<int>("state", 0);
 
     // Update the execution cap parameter
@@ -1871,18 +1787,19 @@ int VBoxSession::setExecutionCap ( int cap ) {
         return HVE_INVALID_STATE;
 
     // Prepare for VM modification task according to it's state
+    VBoxCommand capCmd( (state == SS_RUNNING) ? "controlvm" : "modifyvm" );
     if (state == SS_RUNNING) {
         // If VM is running, we are using controlvm
-        args << "controlvm "            << parameters->get("vboxid")
-             << " cpuexecutioncap "     << parameters->get("executionCap", "80");
+        capCmd.arg(parameters->get("vboxid"))
+              .arg("cpuexecutioncap").arg(parameters->get("executionCap", "80"));
     } else {
         // If VM is stopped, we use modifyvm
-        args << "modifyvm "             << parameters->get("vboxid")
-             << " --cpuexecutioncap "   << parameters->get("executionCap", "80");
+        capCmd.arg(parameters->get("vboxid"))
+              .opt("--cpuexecutioncap", parameters->get("executionCap", "80"));
     }
 
     // Execute and handle errors
-    int ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+    int ans = this->wrapExec(capCmd, NULL, NULL, SysExecConfig(execConfig).setPriority( SYSEXEC_PRIORITY_INTERACTIVE ));
     if (ans != 0) {
         return HVE_EXTERNAL_ERROR;
     }
@@ -2015,34 +1932,80 @@ int VBoxSession::update ( bool waitTillInactive ) {
     FSMWaitInactive();
     if (isAborting) return HVE_INVALID_STATE;
 
+    // The instance state monitor keeps the state up to date
+    if (hypervisor->monitorRunning())
+        return HVE_OK;
+
+    // Otherwise check it now
+    return refreshState();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Descriptor that becomes readable when the VM log changes
+ */
+int VBoxSession::getLogWakeFd () {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::recursive_mutex> lock(refreshMutex);
+    if (!logFollower) return -1;
+    return logFollower->getWakeFd();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Analyze the new log lines and the running VMs, and
+ * dispatch the state changes to the FSM
+ */
+int VBoxSession::refreshState ( const std::set<std::string> * runningVMs, unsigned long long listedAt ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return HVE_INVALID_STATE;
+    boost::unique_lock<boost::recursive_mutex> lock(refreshMutex);
+
+    // Check if log file is missing
+    std::string logFolder = machine->get("Log folder");
+    std::string logFile = logFolder + kPathSeparator + "VBox.log";
+    bool logExists = file_exists(logFile);
+    if (logExists) {
+
+        // Start following the log, resuming from the last position
+        // we have processed, if we know it.
+        if (!logFollower || (logFollower->logFile != logFolder + "/VBox.log")) {
+            logFollower = boost::make_shared<VBoxLogFollower>( logFolder );
+            if (local->contains("logFileId"))
+                logFollower->setPosition( local->getNum<long>("logOffset", 0), local->getNum<long>("logFileId", 0) );
+        }
+
+        // Remember the changes until the FSM is idle
+        if (logFollower->hasChanges())
+            logPending = true;
+
+    }
+
+    // Do not interfere with an active FSM
+    if (FSMActive())
+        return HVE_SCHEDULED;
+
     // Get current state
     int lastState = local->getNum<int>("state", 0);
     int newState = lastState;
 
-    // Check if log file is missing
-    std::string logFile = machine->get("Log folder") + kPathSeparator + "VBox.log";
-    if (file_exists(logFile)) {
-
-        // Look for changes in the timestamp
-        unsigned long long newFileTime = getFileTimeMs(logFile);
-        if (lastLogTime != newFileTime) {
-            lastLogTime = newFileTime;
+    if (logExists) {
 
-            // Create a log probe in order to extract as many information
-            // as possible from a single pass.
-            VBoxLogProbe logProbe( machine->get("Log folder") );
-            logProbe.analyze();
+        // Analyze only the lines appended since the last update
+        bool hasChanges = logPending;
+        logPending = false;
+        if (hasChanges && logFollower->poll()) {
 
             // Check if we had a state change
-            if (logProbe.hasState)
-                newState = logProbe.state;
+            if (logFollower->hasState)
+                newState = logFollower->state;
 
             // Check if we had a resolution change
-            if (logProbe.hasResolutionChange) {
+            if (logFollower->hasResolutionChange) {
                 ostringstream oss;
-                oss << logProbe.resWidth << "x"
-                    << logProbe.resHeight << "x"
-                    << logProbe.resBpp;
+                oss << logFollower->resWidth << "x"
+                    << logFollower->resHeight << "x"
+                    << logFollower->resBpp;
 
                 // Check if video mode has changed
                 std::string vC = machine->get("Video mode", ""),
@@ -2053,19 +2016,26 @@ int VBoxSession::update ( bool waitTillInactive ) {
                     // Update video mde
                     machine->set("Video mode", vM);
                     // Notify listeners that resolution has changed
-                    this->fire( "resolutionChanged", ArgumentList(logProbe.resWidth)(logProbe.resHeight)(logProbe.resBpp) );
+                    this->fire( "resolutionChanged", ArgumentList(logFollower->resWidth)(logFollower->resHeight)(logFollower->resBpp) );
                 }
 
             }
 
             // Check if failures appeared
-            if (logProbe.hasFailures) {
+            if (logFollower->hasFailures) {
 
                 // Forward failures
-                this->fire( "failure", ArgumentList(logProbe.failures) );
+                this->fire( "failure", ArgumentList(logFollower->failures) );
 
             }
 
+            // Persist the position only when something was found, since
+            // replaying lines without events after a restart is harmless.
+            if (logFollower->hasState || logFollower->hasResolutionChange || logFollower->hasFailures) {
+                local->setNum<long>("logOffset", logFollower->getOffset());
+                local->setNum<long>("logFileId", logFollower->getFileId());
+            }
+
         }
 
     } else {
@@ -2073,6 +2043,17 @@ int VBoxSession::update ( bool waitTillInactive ) {
         newState = SS_MISSING;
     }
 
+    // If the log did not report anything, compare with the list of running VMs,
+    // unless it's older than the last state change of the FSM.
+    if ((runningVMs != NULL) && (newState == lastState) && (listedAt > stateChangedAt)) {
+        bool isRunning = (runningVMs->find( parameters->get("vboxid", "") ) != runningVMs->end());
+        if (isRunning && ((lastState == SS_POWEROFF) || (lastState == SS_SAVED))) {
+            newState = SS_RUNNING;
+        } else if (!isRunning && ((lastState == SS_RUNNING) || (lastState == SS_PAUSED))) {
+            newState = SS_POWEROFF;
+        }
+    }
+
     // Handle state switches
     if (isAborting) return HVE_INVALID_STATE;
     if (newState != lastState) {
@@ -2111,6 +2092,15 @@ void VBoxSession::abort ( ) {
     // We are aborting
     isAborting = true;
 
+    // Stop probing our API port
+    ApiProber::Default().unwatch( uuid );
+
+    // Kill the command we are waiting for (if any)
+    {
+        boost::unique_lock<boost::mutex> activeLock(activeExecMutex);
+        if (activeExec) activeExec->cancel();
+    }
+
     // Stop the FSM thread
     // (This will send an interrupt signal,
     // causing all intermediate code to except)
@@ -2129,6 +2119,25 @@ void VBoxSession::wait ( ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Check if the API port responds, completing the start profile if it does
+ */
+bool VBoxSession::isAPIAlive ( unsigned char handshake, int timeoutSec ) {
+    CRASH_REPORT_BEGIN;
+
+    // Let the background probes use the same handshake
+    if (handshake != apiHandshake) {
+        apiHandshake = handshake;
+        if (local->getNum<int>("state", 0) == SS_RUNNING)
+            ApiProber::Default().watch( shared_from_this(), handshake );
+    }
+
+    bool alive = HVSession::isAPIAlive( handshake, timeoutSec );
+    if (alive) finishBootProfile();
+    return alive;
+    CRASH_REPORT_END;
+}
+
 /////////////////////////////////////
 /////////////////////////////////////
 ////
@@ -2174,6 +2183,13 @@ void VBoxSession::hvStop () {
 /////////////////////////////////////
 /////////////////////////////////////
 
+/**
+ * Name the owner of the handler spans in the trace file
+ */
+std::string VBoxSession::FSMTraceOwner( ) {
+    return this->uuid;
+}
+
 /**
  * Notification from the SimpleFSM instance when we enter a state
  */
@@ -2183,6 +2199,8 @@ void VBoxSession::FSMEnteringState( const int state, const bool final ) {
 
     // On checkpoint states, update the VM state
     // in the local config file.
+    if ((state >= 3) && (state <= 7))
+        stateChangedAt = getTimeInMs();
 
     if (state == 3) { // Destroyed
         local->setNum<int>( "state", SS_MISSING );
@@ -2201,6 +2219,25 @@ void VBoxSession::FSMEnteringState( const int state, const bool final ) {
         if (final) this->fire( "stateChanged", ArgumentList( SS_RUNNING ) );
     }
 
+    // Close the start profile when the start sequence completes, waiting for the
+    // API port if we have one. Drop it if we ended in another state.
+    if (final && (state >= 2) && (state <= 6)) {
+        fsmTrace.cancel();
+    } else if (final && (state == 7) && fsmTrace.isActive()) {
+        if (getAPIPort() == 0) {
+            finishBootProfile();
+        } else {
+            fsmTrace.enter("WaitAPI", false);
+        }
+    }
+
+    // Probe the API port in the background only while running
+    if ((state >= 3) && (state <= 6)) {
+        ApiProber::Default().unwatch( uuid );
+    } else if ((state == 7) && final && (getAPIPort() != 0)) {
+        ApiProber::Default().watch( shared_from_this(), apiHandshake );
+    }
+
     CRASH_REPORT_END;
 }
 
@@ -2221,9 +2258,93 @@ int VBoxSession::wrapExec ( std::string cmd, std::vector<std::string> * stdoutLi
     CRASH_REPORT_BEGIN;
     if (isAborting) return HVE_INVALID_STATE;
 
+    // Split the command-line and pass it as-is
+    std::vector<std::string> argv;
+    splitArguments( cmd, &argv );
+    return this->wrapExec( VBoxCommand(argv), stdoutList, stderrMsg, config );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Execute the specified VBoxManage command, passing the arguments as-is.
+ *
+ * The command is driven by the ExecReactor, so an abort() of this session
+ * kills only this command, while the wait remains a thread interruption point.
+ * Read-only queries are instead coalesced with identical ones of the other sessions.
+ */
+int VBoxSession::wrapExec ( const VBoxCommand& cmd, std::vector<std::string> * stdoutList, std::string * stderrMsg, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return HVE_INVALID_STATE;
+
+    // Re-use a recent result of an idempotent query
+    VBoxQueryCache& queryCache = boost::static_pointer_cast<VBoxInstance>(hypervisor)->queryCache;
+    unsigned long generation = 0;
+    if (queryCache.lookup( cmd, stdoutList, &generation )) {
+        if (stderrMsg != NULL) stderrMsg->clear();
+        return HVE_OK;
+    }
+
+    // Account the command to the FSM handler that runs it
+    TRACE_SPAN("exec", cmd.args[0]);
+    TRACE_SPAN_ARG("owner", this->uuid);
+    ProfileScope span( fsmTrace, "exec:" + cmd.args[0], true );
+
     // Allow only a single thread to invoke a system command
     boost::unique_lock<boost::mutex> lock(execMutex);
-    return this->hypervisor->exec(cmd, stdoutList, stderrMsg, config );
+
+    // Queue the command under this session for fair scheduling
+    SysExecConfig sessionConfig( config );
+    if (sessionConfig.owner.empty())
+        sessionConfig.setOwner( this->uuid );
+
+    int ans;
+    std::vector<std::string> lines;
+    std::string errMsg;
+    if (this->hypervisor->isReadOnlyCommand( cmd )) {
+
+        // Queries are short, so it's enough that they are aborted by interrupting the thread
+        ans = this->hypervisor->exec( cmd, &lines, &errMsg, sessionConfig );
+
+    } else {
+
+        // Start the command and keep it's handle for abort()
+        ExecHandlePtr handle = this->hypervisor->execAsync( cmd, sessionConfig );
+        {
+            boost::unique_lock<boost::mutex> activeLock(activeExecMutex);
+            activeExec = handle;
+        }
+
+        // Wait for it, killing it if we are interrupted
+        try {
+            ans = handle->wait();
+        } catch (boost::thread_interrupted &e) {
+            handle->cancel();
+            {
+                boost::unique_lock<boost::mutex> activeLock(activeExecMutex);
+                activeExec.reset();
+            }
+            throw;
+        }
+        {
+            boost::unique_lock<boost::mutex> activeLock(activeExecMutex);
+            activeExec.reset();
+        }
+        lines.swap( handle->stdoutList );
+        errMsg = handle->stderrMsg;
+
+    }
+
+    TRACE_SPAN_ARG("exit", ans);
+
+    // Update the query cache
+    if (ans == 0) queryCache.store( cmd, lines, generation );
+    queryCache.invalidateBy( cmd );
+
+    // Collect the results
+    if (stdoutList != NULL) stdoutList->swap( lines );
+    if (stderrMsg != NULL) *stderrMsg = errMsg;
+    return ans;
 
     CRASH_REPORT_END;
 }
@@ -2236,17 +2357,18 @@ int VBoxSession::destroyVM ( const bool forwardErrors ) {
     if (isAborting) return HVE_INVALID_STATE;
 
     // Destroy session
-    ostringstream args;
     int ans;
 
     // Unregister and destroy all VM resources
-    args.str("");
-    args << "unregistervm"
-        << " " << parameters->get("vboxid")
-        << " --delete";
+    VBoxCommand unregisterCmd("unregistervm");
+    unregisterCmd.arg(parameters->get("vboxid")).arg("--delete");
 
     // Execute and handle errors
-    ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+    ans = this->wrapExec(unregisterCmd, NULL, NULL, execConfig);
+
+    // The attached disks (and their children) are gone as well
+    boost::static_pointer_cast<VBoxInstance>(hypervisor)->diskRegistry.invalidate();
+
     if (ans != 0) {
         if (forwardErrors)
             errorOccured("Unable to destroy the Virtual Machine", HVE_EXTERNAL_ERROR);
@@ -2257,14 +2379,92 @@ int VBoxSession::destroyVM ( const bool forwardErrors ) {
     cleanupFolder( local->get("baseFolder") );
 
     // Reset properties
+    local->subgroup("applied")->clear();
+    local->erase("provisionFingerprint");
+    local->erase("apiFingerprint");
+    local->erase("sharedFolderAdded");
     local->set("initialized","0");
     local->erase("vboxid");
+    local->erase("logOffset");
+    local->erase("logFileId");
     machine->clear();
+    hypervisor->portAllocator.release(uuid);
+    logFollower.reset();
 
     return HVE_OK;
     CRASH_REPORT_END;
 }
 
+/**
+ * Apply the given configuration with the least VBoxManage commands
+ */
+int VBoxSession::applyConfig ( const VBoxMachineSpec& spec ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return HVE_INVALID_STATE;
+    string vboxid = parameters->get("vboxid");
+    ParameterMapPtr applied = local->subgroup("applied");
+
+    // Ignore what VBoxManage reports as already existing
+    SysExecConfig localExecCfg( execConfig );
+    localExecCfg.handleErrString( "already exists", 100 );
+
+    for (int attempt = 0; ; ++attempt) {
+
+        // Diff against the machine record, if it's about this VM
+        MachineInfo unknown;
+        VBoxConfigPlan plan( vboxid, spec, (machineRecord.uuid == vboxid) ? machineRecord : unknown, applied );
+        if (plan.empty()) {
+            CVMWA_LOG("Info", "VM configuration is up to date (" << plan.saved() << " commands saved)");
+            return HVE_OK;
+        }
+
+        // Execute the plan
+        int ans = HVE_OK;
+        bool stale = false;
+        applied->lock();
+        for (vector<VBoxConfigStep>::iterator it = plan.steps.begin(); it != plan.steps.end(); ++it) {
+            const string& kind = it->command.args[0];
+            int ret = this->wrapExec( it->command, NULL, NULL, localExecCfg );
+
+            // A conflict on modifyvm means that our machine record is stale
+            if ((ret != 0) && (kind == "modifyvm") && (attempt == 0)) {
+                stale = true;
+                break;
+            }
+
+            // Extra data are not critical
+            if ((ret != 0) && (kind == "setextradata")) {
+                CVMWA_LOG("Warning", "Unable to apply " << it->command.str());
+                continue;
+            }
+
+            if ((ret != 0) && (ret != 100)) {
+                ans = ret;
+                break;
+            }
+            for (vector< pair<string, string> >::iterator jt = it->applied.begin(); jt != it->applied.end(); ++jt)
+                applied->set( jt->first, jt->second );
+        }
+        applied->unlock();
+
+        // Re-plan once with fresh machine information
+        if (stale) {
+            CVMWA_LOG("Info", "Machine information is stale, re-planning the VM configuration");
+            lastMachineInfoTimestamp = 0;
+            getMachineInfo();
+            continue;
+        }
+
+        // The machine record does not reflect the changes any more
+        lastMachineInfoTimestamp = 0;
+        CVMWA_LOG("Info", "VM configured with " << plan.steps.size() << " commands (" << plan.saved() << " saved)");
+        return ans;
+
+    }
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Update error info and switch to error state
  */
@@ -2272,6 +2472,13 @@ void VBoxSession::errorOccured ( const std::string & str, int errNo ) {
     CRASH_REPORT_BEGIN;
     if (isAborting) return;
 
+    // Concurrent branches must not steer the FSM, the
+    // error is raised again when they are joined.
+    if (FSMInBranch()) {
+        FSMBranchFail( str, errNo );
+        return;
+    }
+
     // Update error info
     errorCode = errNo;
     errorMessage = str;
@@ -2332,7 +2539,6 @@ int VBoxSession::unmountDisk ( const std::string & controller,
                                const bool deleteFile ) {
     CRASH_REPORT_BEGIN;
     if (isAborting) return HVE_INVALID_STATE;
-    ostringstream args;
     string kk, kv;
     int ans;
 
@@ -2349,16 +2555,16 @@ int VBoxSession::unmountDisk ( const std::string & controller,
     if (machine->contains( DISK_SLOT, true )) {
 
         // Otherwise unmount the existing disk
-        args.str("");
-        args << "storageattach "
-            << parameters->get("vboxid")
-            << " --storagectl " << controller
-            << " --port "       << port
-            << " --device "     << device
-            << " --medium "     << "none";
+        VBoxCommand detachCmd("storageattach");
+        detachCmd
+            .arg(parameters->get("vboxid"))
+            .opt("--storagectl",    controller)
+            .opt("--port",          port)
+            .opt("--device",        device)
+            .opt("--medium",        "none");
 
         // Execute and handle errors
-        ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+        ans = this->wrapExec(detachCmd, NULL, NULL, execConfig);
         if (ans != HVE_OK) return ans;
 
         // If we are also asked to erase the file, do it now
@@ -2370,31 +2576,26 @@ int VBoxSession::unmountDisk ( const std::string & controller,
             kk = kk.substr(0, kk.length()-1);
 
             // Close and unregister medium
-            args.str("");
-            args << "closemedium " << type << " "
-                << "\"" << kk << "\" --delete";
-
-            // Execute and handle errors
-            ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+            VBoxDiskRegistry& diskRegistry = boost::static_pointer_cast<VBoxInstance>(hypervisor)->diskRegistry;
+            ans = this->wrapExec(VBoxCommand("closemedium").arg(type).arg(kk).arg("--delete"), NULL, NULL, execConfig);
             if (ans != HVE_OK) {
 
                 // Try again with UUID
                 kv = kv.substr(6, kv.length()-7);
 
                 // Close and unregister medium
-                args.str("");
-                args << "closemedium " << type << " "
-                    << "\"" << kv << "\" --delete";
-
-                // Execute and handle errors
-                ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+                ans = this->wrapExec(VBoxCommand("closemedium").arg(type).arg(kv).arg("--delete"), NULL, NULL, execConfig);
                 if (ans != HVE_OK) {
 
                     // Try manual removal
                     ::remove( kk.c_str() );
 
+                } else {
+                    diskRegistry.remove( kv );
                 }
 
+            } else {
+                diskRegistry.remove( kk );
             }
 
         }
@@ -2424,9 +2625,9 @@ int VBoxSession::mountDisk ( const std::string & controller,
     if (isAborting) return HVE_INVALID_STATE;
 
     vector<string> lines;
-    ostringstream args;
     string kk, kv;
     int ans;
+    VBoxInstance * vbox = boost::static_pointer_cast<VBoxInstance>(hypervisor).get();
 
     // Switch multiAttach to false if we are not using 'hdd' type
     if (multiAttach && (dtype != T_HDD)) {
@@ -2458,25 +2659,13 @@ int VBoxSession::mountDisk ( const std::string & controller,
 
         } else {
 
-            // If we are using multiAttach, we have to investigate a bit more
+            // If we are using multiAttach, check if the mounted disk is a child of the one we want
             if (multiAttach) {
-                string parentUUID = "_child_", actualParentUUID = "_parent_";
-
-                // Get more information for this disk
-                map<const string, const string> infoParent = this->getDiskInfo(kv);
-                if (infoParent.find("Parent UUID") != infoParent.end())
-                    parentUUID = infoParent["Parent UUID"];
-
-                // Get more information regarding the parent disk
-                map<const string, const string> infoDisk = this->getDiskInfo(diskFile);
-                if (infoDisk.find("UUID") != infoDisk.end())
-                    actualParentUUID = infoDisk["UUID"];
-
-                // If these two UUID matches, we are done
-                if (parentUUID.compare( actualParentUUID ) == 0) {
+                VBOX_DISK_RECORD mountedDisk, parentDisk;
+                if (vbox->findDisk( kv, &mountedDisk ) && vbox->findDisk( diskFile, &parentDisk ) &&
+                    (mountedDisk.parentUUID.compare( parentDisk.uuid ) == 0)) {
                     return HVE_ALREADY_EXISTS;
                 }
-
             }
 
             // Otherwise unmount the existing disk
@@ -2489,25 +2678,18 @@ int VBoxSession::mountDisk ( const std::string & controller,
 
     // Prepare two locations where we can find the disk: By filename and by UUID.
     // That's because before some version VirtualBox we need the disk UUID, while for others we need the full path
-    string masterDiskPath = "\"" + diskFile + "\"";
+    string masterDiskPath = diskFile;
     string masterDiskUUID = "";
 
     // If we are doing multi-attach, try to use UUID-based mounting
     if (multiAttach) {
-        // Get a list of the disks in order to properly compute multi-attach
-        vector< map< const string, const string > > disks = boost::static_pointer_cast<VBoxInstance>(hypervisor)->getDiskList();
-        for (vector< map<const string, const string> >::iterator i = disks.begin(); i != disks.end(); i++) {
-            map<const string, const string> disk = *i;
-            // Look of the master disk of what we are using
-            if ( (disk.find("Type") != disk.end()) && (disk.find("Parent UUID") != disk.end()) && (disk.find("Location") != disk.end()) && (disk.find("UUID") != disk.end()) ) {
-                // Check if all the component maches
-                if ( (disk["Type"].compare("multiattach") == 0) && (disk["Parent UUID"].compare("base") == 0) && samePath(disk["Location"],diskFile) ) {
-                    // Use the master UUID instead of the filename
-                    CVMWA_LOG("Info", "Found master with UUID " << disk["UUID"]);
-                    masterDiskUUID = disk["UUID"]; //{" + disk["UUID"] + "}";
-                    break;
-                }
-            }
+        // Look for the master disk of what we are using
+        VBOX_DISK_RECORD masterDisk;
+        if (vbox->findDisk( diskFile, &masterDisk ) &&
+            (masterDisk.type.compare("multiattach") == 0) && (masterDisk.parentUUID.compare("base") == 0)) {
+            // Use the master UUID instead of the filename
+            CVMWA_LOG("Info", "Found master with UUID " << masterDisk.uuid);
+            masterDiskUUID = masterDisk.uuid;
         }
     }
 
@@ -2515,29 +2697,29 @@ int VBoxSession::mountDisk ( const std::string & controller,
     std::string diskGUID = newGUID();
 
     // (B.1) Try to attach disk to the SATA controller using full path
-    args.str("");
-    args << "storageattach "
-        << parameters->get("vboxid")
-        << " --storagectl " << controller
-        << " --port "       << port
-        << " --device "     << device
-        << " --type "       << type
-        << " --medium "     <<  masterDiskPath;
+    VBoxCommand attachCmd("storageattach");
+    attachCmd
+        .arg(parameters->get("vboxid"))
+        .opt("--storagectl",    controller)
+        .opt("--port",          port)
+        .opt("--device",        device)
+        .opt("--type",          type)
+        .opt("--medium",        masterDiskPath);
 
     // If we are having a disk
     if (dtype != T_DVD) {
-        args << " --setuuid " << diskGUID;
+        attachCmd.opt("--setuuid", diskGUID);
     } else {
         diskGUID = "<irrelevant>";
     }
 
     // Append multiattach flag if we are instructed to do so
     if (multiAttach)
-        args << " --mtype " << "multiattach";
+        attachCmd.opt("--mtype", "multiattach");
 
     // Execute
     std::string errStr;
-    ans = this->wrapExec(args.str(), &lines, &errStr, execConfig);
+    ans = this->wrapExec(attachCmd, &lines, &errStr, execConfig);
 
     // If we are using multi-attach, try to mount by UUID if mounting
     // by filename has failed
@@ -2547,29 +2729,46 @@ int VBoxSession::mountDisk ( const std::string & controller,
         if (ans == 0) {
             // Update mounted medium info
             machine->set( DISK_SLOT, diskFile + " (UUID: " + diskGUID + ")" );
+            vbox->diskRegistry.addDifferencing( diskFile, diskGUID );
             return HVE_OK;
         }
 
         // (B.2) Try to attach disk to the SATA controller using UUID (For older VirtualBox versions)
-        args.str("");
-        args << "storageattach "
-            << parameters->get("vboxid")
-            << " --storagectl " << controller
-            << " --port "       << port
-            << " --device "     << device
-            << " --type "       << type
-            << " --mtype "      << "multiattach"
-            << " --setuuid "    << diskGUID
-            << " --medium "     <<  masterDiskUUID;
+        VBoxCommand attachUUIDCmd("storageattach");
+        attachUUIDCmd
+            .arg(parameters->get("vboxid"))
+            .opt("--storagectl",    controller)
+            .opt("--port",          port)
+            .opt("--device",        device)
+            .opt("--type",          type)
+            .opt("--mtype",         "multiattach")
+            .opt("--setuuid",       diskGUID)
+            .opt("--medium",        masterDiskUUID);
 
         // Execute
-        ans = this->wrapExec(args.str(), &lines, NULL, execConfig);
+        ans = this->wrapExec(attachUUIDCmd, &lines, NULL, execConfig);
 
     }
 
     // Update mounted medium info if it was OK
     if (ans == HVE_OK) {
         machine->set( DISK_SLOT, diskFile + " (UUID: " + diskGUID + ")" );
+
+        // Keep the disk registry up to date. A multi-attach creates a differencing
+        // disk under the base disk. Only if the base was registered by this very
+        // mount, it's UUID is unknown and the registry has to be re-loaded.
+        if (multiAttach) {
+            if (!vbox->diskRegistry.addDifferencing( diskFile, diskGUID ))
+                vbox->diskRegistry.invalidate();
+        } else if (dtype == T_HDD) {
+            VBOX_DISK_RECORD disk;
+            disk.uuid = diskGUID;
+            disk.parentUUID = "base";
+            disk.location = diskFile;
+            disk.type = "normal";
+            disk.state = "created";
+            vbox->diskRegistry.update( disk );
+        }
     }
 
     // Retun last execution result
@@ -2639,7 +2838,7 @@ int VBoxSession::getHostOnlyAdapter ( std::string * adapterName, const FiniteTas
 
     // Check if we already have host-only interfaces
     if (fp) fp->doing("Enumerating host-only adapters");
-    int ans = this->wrapExec("list hostonlyifs", &lines, NULL, execConfig);
+    int ans = this->wrapExec(VBoxCommand("list").arg("hostonlyifs"), &lines, NULL, execConfig);
     if (ans != 0) {
         if (fp) fp->fail("Unable to enumerate the host-only adapters", HVE_QUERY_ERROR);
         return HVE_QUERY_ERROR;
@@ -2651,7 +2850,7 @@ int VBoxSession::getHostOnlyAdapter ( std::string * adapterName, const FiniteTas
 
         // Create adapter
         if (fp) fp->doing("Creating missing host-only adapter");
-        ans = this->wrapExec("hostonlyif create", NULL, NULL, execConfig);
+        ans = this->wrapExec(VBoxCommand("hostonlyif").arg("create"), NULL, NULL, execConfig);
         if (ans != 0) {
             if (fp) fp->fail("Unable to create a host-only adapter", HVE_CREATE_ERROR);
             return HVE_CREATE_ERROR;
@@ -2659,7 +2858,7 @@ int VBoxSession::getHostOnlyAdapter ( std::string * adapterName, const FiniteTas
 
         // Repeat check
         if (fp) fp->doing("Validating created host-only adapter");
-        ans = this->wrapExec("list hostonlyifs", &lines, NULL, execConfig);
+        ans = this->wrapExec(VBoxCommand("list").arg("hostonlyifs"), &lines, NULL, execConfig);
         if (ans != 0) {
             if (fp) fp->fail("Unable to enumerate the host-only adapters", HVE_QUERY_ERROR);
             return HVE_QUERY_ERROR;
@@ -2686,7 +2885,7 @@ int VBoxSession::getHostOnlyAdapter ( std::string * adapterName, const FiniteTas
 
     // Dump the DHCP server states
     if (fp) fp->doing("Checking for DHCP server in the interface");
-    ans = this->wrapExec("list dhcpservers", &lines, NULL, execConfig);
+    ans = this->wrapExec(VBoxCommand("list").arg("dhcpservers"), &lines, NULL, execConfig);
     if (ans != 0) {
         if (fp) fp->fail("Unable to enumerate the host-only adapters", HVE_QUERY_ERROR);
         return HVE_QUERY_ERROR;
@@ -2751,19 +2950,20 @@ int VBoxSession::getHostOnlyAdapter ( std::string * adapterName, const FiniteTas
                         ipMax = _vbox_changeUpperIP( iface["IPAddress"], 254 );
 
                         // Modify server
-                        ans = this->wrapExec(
-                            "dhcpserver modify --ifname \"" + ifName + "\"" +
-                            " --ip " + ipServer +
-                            " --netmask " + iface["NetworkMask"] +
-                            " --lowerip " + ipMin +
-                            " --upperip " + ipMax
-                             , NULL, NULL, execConfig);
+                        VBoxCommand modifyCmd("dhcpserver");
+                        modifyCmd.arg("modify")
+                                 .opt("--ifname", ifName)
+                                 .opt("--ip", ipServer)
+                                 .opt("--netmask", iface["NetworkMask"])
+                                 .opt("--lowerip", ipMin)
+                                 .opt("--upperip", ipMax);
+                        ans = this->wrapExec(modifyCmd, NULL, NULL, execConfig);
                         if (ans != 0) continue;
 
                     }
 
                     // Check if we can enable the server
-                    ans = this->wrapExec("dhcpserver modify --ifname \"" + ifName + "\" --enable", NULL, NULL, execConfig);
+                    ans = this->wrapExec(VBoxCommand("dhcpserver").arg("modify").opt("--ifname", ifName).arg("--enable"), NULL, NULL, execConfig);
                     if (ans == 0) {
                         hasDHCP = true;
                         break;
@@ -2835,14 +3035,12 @@ int VBoxSession::getHostOnlyAdapter ( std::string * adapterName, const FiniteTas
 std::map<const std::string, const std::string> VBoxSession::getDiskInfo( const std::string& disk ) {
     vector<string> lines;
     map<const string, const string> info;
-    ostringstream args;
     int ans;
 
     if (isAborting) return info;
 
     // Get more information for this disk
-    args << "showhdinfo \"" << disk << "\"";
-    ans = this->wrapExec(args.str(), &lines, NULL, execConfig);
+    ans = this->wrapExec(VBoxCommand("showhdinfo").arg(disk), &lines, NULL, execConfig);
     if (ans == 0) {
         // Tokenize information
         return tokenize( &lines, ':' );
@@ -2877,16 +3075,19 @@ std::map<const std::string, const std::string> VBoxSession::getMachineInfo ( con
     config.timeout = timeout;
 
     /* Perform property update */
-    int ans = this->wrapExec("showvminfo \"" + vbox_id + "\"", &lines, NULL, config);
+    int ans = this->wrapExec(VBoxCommand("showvminfo").arg(vbox_id).arg("--machinereadable"), &lines, NULL, config);
     if (ans != 0) {
+        machineRecord.clear();
         dat.insert(std::make_pair(":ERROR:", ntos<int>( ans )));
         return dat;
     }
 
-    /* Tokenize response */
-    map<const string, const string> machineInfo = tokenize( &lines, ':' );
-    lastMachineInfo.clear();
-    lastMachineInfo.insert( machineInfo.begin(), machineInfo.end() );
+    /* Parse response */
+    if (!machineRecord.parse( lines )) {
+        dat.insert(std::make_pair(":ERROR:", ntos<int>( ans = HVE_QUERY_ERROR )));
+        return dat;
+    }
+    machineRecord.toMap( &lastMachineInfo );
     lastMachineInfoTimestamp = ms;
 
     return lastMachineInfo;
@@ -2894,6 +3095,96 @@ std::map<const std::string, const std::string> VBoxSession::getMachineInfo ( con
     CRASH_REPORT_END;
 }
 
+/**
+ * Hash the parameters, media and hypervisor the VM was provisioned from
+ */
+std::string VBoxSession::getProvisionFingerprint ( ) {
+    CRASH_REPORT_BEGIN;
+    static const char * paramKeys[] = {
+        "vboxid", "name", "flags", "cpus", "memory", "vram", "disk", "apiPort", "sharedFolder",
+        "diskURL", "diskChecksum", "diskPath", "isoPath", "cernvmVersion", "cernvmFlavor",
+        "ovaImport", "ovaPath", NULL
+    };
+    static const char * localKeys[] = {
+        "hostonlyif", "apiPort", "rdpPort", "bootDisk", "bootISO", NULL
+    };
+    ostringstream oss;
+
+    // The parameters the start sequence reads
+    for (const char ** k = paramKeys; *k != NULL; ++k)
+        oss << "p:" << *k << "=" << parameters->get(*k, "") << "\n";
+    for (const char ** k = localKeys; *k != NULL; ++k)
+        oss << "l:" << *k << "=" << local->get(*k, "") << "\n";
+
+    // The media, which are validated by their checksum only when downloaded, so
+    // their size and modification time are enough to detect a replacement.
+    std::string media[2] = { local->get("bootDisk", ""), local->get("bootISO", "") };
+    for (int i=0; i<2; ++i) {
+        if (media[i].empty()) continue;
+        boost::system::error_code ec;
+        boost::uintmax_t size = boost::filesystem::file_size( media[i], ec );
+        if (ec) size = 0;
+        std::time_t mtime = boost::filesystem::last_write_time( media[i], ec );
+        if (ec) mtime = 0;
+        oss << "m:" << media[i] << "=" << size << "," << mtime << "\n";
+    }
+
+    // The hypervisor and it's guest additions
+    oss << "h:" << hypervisor->version.verString << "\n";
+    if ((parameters->getNum<int>("flags", 0) & HVF_GUEST_ADDITIONS) != 0)
+        oss << "g:" << boost::static_pointer_cast<VBoxInstance>(hypervisor)->hvGuestAdditions << "\n";
+
+    std::string checksum;
+    sha256_buffer( oss.str(), &checksum );
+    return checksum;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if we can skip the provisioning steps of the start sequence
+ */
+int VBoxSession::getFastBootStep ( ) {
+    CRASH_REPORT_BEGIN;
+    int flags = parameters->getNum<int>("flags", 0);
+
+    // Nothing we have provisioned from must have changed
+    std::string fingerprint = local->get("provisionFingerprint", "");
+    if (fingerprint.empty() || (fingerprint != getProvisionFingerprint()))
+        return 0;
+
+    // Our ports must still be ours, otherwise ConfigureVM has to move them
+    if (local->getNum<int>("rdpPort", 0) != hypervisor->portAllocator.reserve(uuid, "rdp"))
+        return 0;
+    if (((flags & HVF_DUAL_NIC) == 0) && (local->getNum<int>("apiPort", 0) != hypervisor->portAllocator.reserve(uuid, "api")))
+        return 0;
+
+    // The media must still be attached
+    map<const string, const string> info = getMachineInfo();
+    if ((info.find(":ERROR:") != info.end()) || (machineRecord.uuid != parameters->get("vboxid")))
+        return 0;
+    bool ova = ((flags & HVF_IMPORT_OVA) != 0);
+    if (!ova && (machineRecord.slot( BOOT_CONTROLLER, ston<int>(BOOT_PORT), ston<int>(BOOT_DEVICE) ) == NULL))
+        return 0;
+    if ((parameters->getNum<int>("disk", 0) != 0) &&
+        (machineRecord.slot( SCRATCH_CONTROLLER, ova ? 1 : ston<int>(SCRATCH_PORT), ston<int>(SCRATCH_DEVICE) ) == NULL))
+        return 0;
+
+    // Re-create the VM API medium if the user data have changed or it has been released
+    if (ova) return 206;
+    std::string apiFingerprint;
+    sha256_buffer( getUserData(), &apiFingerprint );
+    if (local->get("apiFingerprint", "") != apiFingerprint)
+        return 205;
+    const VBOX_STORAGE_SLOT * apiSlot = ((flags & HVF_FLOPPY_IO) != 0)
+        ? machineRecord.slot( FLOPPYIO_CONTROLLER, ston<int>(FLOPPYIO_PORT), ston<int>(FLOPPYIO_DEVICE) )
+        : machineRecord.slot( CONTEXT_CONTROLLER, ston<int>(CONTEXT_PORT), ston<int>(CONTEXT_DEVICE) );
+    if (apiSlot == NULL)
+        return 205;
+
+    return 206;
+    CRASH_REPORT_END;
+}
+
 /**
  * Launch the VM
  */
@@ -2902,9 +3193,20 @@ int VBoxSession::startVM ( ) {
 }
 
 /**
- * Send control commands to the VM.
+ * Send control commands to the VM, given as a command-line (ex. "setlinkstate1 on").
  */
 int VBoxSession::controlVM ( std::string how, int timeout ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> args;
+    splitArguments( how, &args );
+    return controlVM( VBoxCommand(args), timeout );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Shorthand function for calling controlVM actions with arguments
+ */
+int VBoxSession::controlVM ( const VBoxCommand& how, int timeout ) {
     CRASH_REPORT_BEGIN;
     if (isAborting) return HVE_INVALID_STATE;
 
@@ -2912,7 +3214,7 @@ int VBoxSession::controlVM ( std::string how, int timeout ) {
     SysExecConfig config(execConfig);
     config.timeout = timeout;
 
-    int ans = this->wrapExec("controlvm " + parameters->get("vboxid") + " " + how, NULL, NULL, config);
+    int ans = this->wrapExec(VBoxCommand("controlvm").arg(parameters->get("vboxid")).append(how), NULL, NULL, config);
     if (ans != 0) return HVE_CONTROL_ERROR;
     return 0;
     CRASH_REPORT_END;
@@ -22,6 +22,9 @@
 
 #include <CernVM/Hypervisor.h>
 #include <CernVM/LocalConfig.h>
+#include <CernVM/Metrics.h>
+
+#include <set>
 
 // Initialize singletons
 LocalConfigPtr LocalConfig::globalConfigSingleton;
@@ -76,7 +79,7 @@ LocalConfigPtr LocalConfig::forRuntime( const std::string& name ) {
 /**
  * Create custom configuration file from the given map file
  */
-LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap(), timeLoaded(0), timeModified(0), keysDeleted() {
+LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap(), timeLoaded(0), timeModified(0), keysDeleted(), parametersSynced() {
     CRASH_REPORT_BEGIN;
 
     // Prepare names
@@ -89,6 +92,7 @@ LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap()
 
         // Load parameters in the parameters map
         this->loadMap( name, parameters.get() );
+        parametersSynced = *parameters;
     }
 
     // Update time it was loaded and modified
@@ -531,13 +535,20 @@ void LocalConfig::commitChanges ( ) {
  */
 bool LocalConfig::save ( ) {
     CRASH_REPORT_BEGIN;
+    TRACE_SPAN("config", "save");
+    TRACE_SPAN_ARG("name", configName);
+    static const int metricSaves = Metrics::Default().counter( "cvmwa_config_saves_total", "Local config files written" );
+    static const int metricTime = Metrics::Default().histogram( "cvmwa_config_save_duration_seconds", "Time spent writing local config files" );
+    Metrics::Default().add( metricSaves );
+    MetricTimer timer( metricTime );
     bool ans = false;
 
     {
         // Mutex for making this thread-safe
         boost::unique_lock<boost::mutex> lock(*parametersMutex);
         // Save map to file
-        bool ans = this->saveMap( configName, parameters.get() );
+        ans = this->saveMap( configName, parameters.get() );
+        if (ans) parametersSynced = *parameters;
     }
 
     // Check answer
@@ -569,7 +580,8 @@ bool LocalConfig::load ( ) {
         // Mutex for making this thread-safe
         boost::unique_lock<boost::mutex> lock(*parametersMutex);
         // Load map from file
-        bool ans = this->loadMap( configName, parameters.get() );
+        ans = this->loadMap( configName, parameters.get() );
+        if (ans) parametersSynced = *parameters;
     }
 
     // Check answer
@@ -604,9 +616,19 @@ bool LocalConfig::sync ( ) {
     // Load the time the file was modified
     unsigned long long fileModified = getFileTimeMs( fName );
 
+    // Check if we have changes of our own
+    bool changed;
+    {
+        // Mutex for making this thread-safe
+        boost::unique_lock<boost::mutex> lock(*parametersMutex);
+        changed = (*parameters != parametersSynced);
+    }
+
     // Check for missing modifications
-    if (timeModified <= timeLoaded) {
-        if (fileModified > timeLoaded) {
+    if (!changed) {
+
+        // (The modification time might have a resolution of a second)
+        if (fileModified + 1000 > timeLoaded) {
 
             // [1] Memory : No changes
             //       Disk : Changed
@@ -624,60 +646,60 @@ bool LocalConfig::sync ( ) {
     }
 
     // [3] Memory : Changed
-    //       Disk : No changes
-    //         DO : Replace disk contents
-    if (fileModified <= timeLoaded) {
-        return this->save();
-    }
-
-    // [4] Memory : Changed
-    //       Disk : Changed
-    //         DO : Do DIFF, preferring 'ours'
+    //       Disk : Maybe changed
+    //         DO : Do DIFF, preferring 'ours'. If the disk has not
+    //              changed, this just replaces the disk contents.
 
     // Load file map in a new dictionary
     std::map<const std::string, const std::string> map;
     if (!this->loadMap( configName, &map ))
         return false;
 
-    // Erase keys from file from which the erase() function was called
-    for (std::list<std::string>::iterator it = keysDeleted.begin(); it != keysDeleted.end(); ++it) {
-        std::map<const std::string, const std::string>::iterator jt = map.find(*it);
-        if (jt != map.end()) map.erase(jt);
-    }
-
-    // Reset 'keysDeleted'
-    keysDeleted.clear();
-
     {
         // Mutex for making this thread-safe
         boost::unique_lock<boost::mutex> lock(*parametersMutex);
 
-        // Update the parameters that still exist in the config file and add new ones if they are missing.
-        for (std::map<const std::string, const std::string>::iterator it = parameters->begin(); it != parameters->end(); ++it) {
-            std::string key = (*it).first;
-            std::string value = (*it).second;
+        // Apply only the keys we have changed since the last time we were in
+        // sync with the disk. Everything else follows the file, so the keys
+        // that somebody else has removed in the meantime are not brought back.
+        std::set<std::string> keys;
+        for (std::map<const std::string, const std::string>::iterator it = parameters->begin(); it != parameters->end(); ++it)
+            keys.insert( (*it).first );
+        for (std::map<const std::string, const std::string>::iterator it = parametersSynced.begin(); it != parametersSynced.end(); ++it)
+            keys.insert( (*it).first );
+        for (std::set<std::string>::iterator it = keys.begin(); it != keys.end(); ++it) {
+            std::map<const std::string, const std::string>::iterator ours = parameters->find(*it);
+            std::map<const std::string, const std::string>::iterator base = parametersSynced.find(*it);
+
+            // Unchanged by us
+            if (ours == parameters->end()) {
+                if (base == parametersSynced.end()) continue;
+            } else if ((base != parametersSynced.end()) && (base->second == ours->second)) {
+                continue;
+            }
 
-            // Update field
-            std::map<const std::string, const std::string>::iterator jt = map.find(key);
+            // Changed (or erased) by us
+            std::map<const std::string, const std::string>::iterator jt = map.find(*it);
             if (jt != map.end()) map.erase(jt);
-            map.insert(std::make_pair(key, value));
-            
-        }
-
-        // Import new keys found in the config file
-        for (std::map<const std::string, const std::string>::iterator it = map.begin(); it != map.end(); ++it) {
-            std::string key = (*it).first;
-            std::string value = (*it).second;
-
-            // Update missing
-            if (parameters->find(key) == parameters->end())
-                putOnMap(parameters, key, value);
+            if (ours != parameters->end())
+                map.insert(std::make_pair(ours->first, ours->second));
 
         }
+
+        // Replace our parameters with the merged ones
+        parameters->clear();
+        for (std::map<const std::string, const std::string>::iterator it = map.begin(); it != map.end(); ++it)
+            putOnMap(parameters, (*it).first, (*it).second);
+        parametersSynced = map;
     }
 
+    // Reset 'keysDeleted'
+    keysDeleted.clear();
+
     // Save file contents
-    this->saveMap( configName, &map );
+    if (!this->saveMap( configName, &map ))
+        return false;
+    timeLoaded = getTimeInMs();
 
     return true;
     CRASH_REPORT_END;
@@ -0,0 +1,436 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/Metrics.h>
+
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// Do not get killed by SIGPIPE when a client goes away
+#ifdef MSG_NOSIGNAL
+#define METRICS_SEND_FLAGS  MSG_NOSIGNAL
+#else
+#define METRICS_SEND_FLAGS  0
+#endif
+
+/**
+ * The upper bounds of the histogram buckets, in seconds
+ */
+static const double metricBuckets[ METRICS_BUCKETS ] = {
+    0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5,
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+
+// The slots of a histogram: the buckets, the overflow, the sum (in us) and the count
+#define METRICS_HISTOGRAM_SLOTS     ( METRICS_BUCKETS + 3 )
+
+/**
+ * Return the process-wide registry. It's never destroyed, so the
+ * threads that exit during the shutdown can still retire their values.
+ */
+Metrics& Metrics::Default( ) {
+    static Metrics * metrics = new Metrics();
+    return *metrics;
+}
+
+/**
+ * Constructor
+ */
+Metrics::Metrics( ) : series(), seriesIndex(), help(), nextSlot(0), shard( &Metrics::retireShard ),
+    shards(), retired(), mutex(), server(NULL), serverPath(), serverStop(false) {
+}
+
+/**
+ * Allocate the slot table of a thread
+ */
+Metrics::Shard::Shard( Metrics * owner ) : owner(owner) {
+    for (int i = 0; i < METRICS_MAX_CHUNKS; ++i)
+        chunks[i].store( NULL, boost::memory_order_relaxed );
+}
+
+/**
+ * Release the chunks of a thread
+ */
+Metrics::Shard::~Shard( ) {
+    for (int i = 0; i < METRICS_MAX_CHUNKS; ++i)
+        delete [] chunks[i].load( boost::memory_order_relaxed );
+}
+
+/**
+ * Return the given slot, allocating it's chunk if needed (only called by the owning thread)
+ */
+boost::atomic<unsigned long long> * Metrics::Shard::slot( int index ) {
+    boost::atomic<unsigned long long> * chunk = chunks[ index / METRICS_CHUNK_SLOTS ].load( boost::memory_order_relaxed );
+    if (chunk == NULL) {
+        chunk = new boost::atomic<unsigned long long>[ METRICS_CHUNK_SLOTS ];
+        for (int i = 0; i < METRICS_CHUNK_SLOTS; ++i)
+            chunk[i].store( 0, boost::memory_order_relaxed );
+        chunks[ index / METRICS_CHUNK_SLOTS ].store( chunk, boost::memory_order_release );
+    }
+    return &chunk[ index % METRICS_CHUNK_SLOTS ];
+}
+
+/**
+ * Read the given slot from any thread
+ */
+unsigned long long Metrics::Shard::read( int index ) const {
+    boost::atomic<unsigned long long> * chunk = chunks[ index / METRICS_CHUNK_SLOTS ].load( boost::memory_order_acquire );
+    if (chunk == NULL) return 0;
+    return chunk[ index % METRICS_CHUNK_SLOTS ].load( boost::memory_order_relaxed );
+}
+
+/**
+ * Return the values of the calling thread, creating them on first use
+ */
+Metrics::Shard * Metrics::localShard( ) {
+    Shard * s = shard.get();
+    if (s == NULL) {
+        s = new Shard( this );
+        shard.reset( s );
+        boost::unique_lock<boost::mutex> lock(mutex);
+        shards.push_back( s );
+    }
+    return s;
+}
+
+/**
+ * Fold the values of an exiting thread into the totals
+ */
+void Metrics::retireShard( Shard * s ) {
+    Metrics * self = s->owner;
+    {
+        boost::unique_lock<boost::mutex> lock(self->mutex);
+        for (int i = 0; i < self->nextSlot; ++i)
+            self->retired[i] += s->read(i);
+        self->shards.erase( std::remove( self->shards.begin(), self->shards.end(), s ), self->shards.end() );
+    }
+    delete s;
+}
+
+/**
+ * Sum the given slot over the live and the exited threads
+ */
+unsigned long long Metrics::total( int index ) {
+    unsigned long long ans = retired[index];
+    for (std::vector< Shard * >::iterator it = shards.begin(); it != shards.end(); ++it)
+        ans += (*it)->read( index );
+    return ans;
+}
+
+/**
+ * Register a series of the given type, or return the existing one.
+ * The ID of a series is the index of it's first slot.
+ */
+int Metrics::registerSeries( const std::string& name, const std::string& helpText, const std::string& labels, int type ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::string key = name + "{" + labels + "}";
+
+    // Return the existing series
+    std::map< std::string, int >::iterator it = seriesIndex.find( key );
+    if (it != seriesIndex.end()) {
+        if (series[ (*it).second ].type != type) {
+            CVMWA_LOG("Error", "Metric " << key << " is registered with a different type");
+            return -1;
+        }
+        return series[ (*it).second ].slot;
+    }
+
+    // A name is used by a single type of series
+    for (std::vector< METRIC_SERIES >::iterator jt = series.begin(); jt != series.end(); ++jt) {
+        if (((*jt).name == name) && ((*jt).type != type)) {
+            CVMWA_LOG("Error", "Metric " << name << " is registered with a different type");
+            return -1;
+        }
+    }
+
+    // Allocate the slots
+    int slots = (type == METRIC_HISTOGRAM) ? METRICS_HISTOGRAM_SLOTS : 1;
+    if (nextSlot + slots > METRICS_CHUNK_SLOTS * METRICS_MAX_CHUNKS) {
+        CVMWA_LOG("Error", "Out of metric slots for " << key);
+        return -1;
+    }
+
+    METRIC_SERIES s;
+    s.name = name;
+    s.labels = labels;
+    s.type = type;
+    s.slot = nextSlot;
+    nextSlot += slots;
+    retired.resize( nextSlot, 0 );
+
+    series.push_back( s );
+    seriesIndex[key] = series.size() - 1;
+    if (help.find(name) == help.end()) help[name] = helpText;
+    return s.slot;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Register a counter
+ */
+int Metrics::counter( const std::string& name, const std::string& helpText, const std::string& labels ) {
+    return registerSeries( name, helpText, labels, METRIC_COUNTER );
+}
+
+/**
+ * Register a histogram
+ */
+int Metrics::histogram( const std::string& name, const std::string& helpText, const std::string& labels ) {
+    return registerSeries( name, helpText, labels, METRIC_HISTOGRAM );
+}
+
+/**
+ * Increment a slot of the calling thread. Only the owning thread writes
+ * to it, so a relaxed load and store are enough.
+ */
+static inline void metricBump( boost::atomic<unsigned long long> * s, unsigned long long v ) {
+    s->store( s->load( boost::memory_order_relaxed ) + v, boost::memory_order_relaxed );
+}
+
+/**
+ * Increment a counter
+ */
+void Metrics::add( int id, unsigned long long v ) {
+    if (id < 0) return;
+    metricBump( localShard()->slot( id ), v );
+}
+
+/**
+ * Add a duration to a histogram
+ */
+void Metrics::observe( int id, double seconds ) {
+    if (id < 0) return;
+    if (seconds < 0) seconds = 0;
+    Shard * s = localShard();
+
+    // Find the bucket (the last slot before the sum is the overflow)
+    int bucket = std::lower_bound( metricBuckets, metricBuckets + METRICS_BUCKETS, seconds ) - metricBuckets;
+    metricBump( s->slot( id + bucket ), 1 );
+    metricBump( s->slot( id + METRICS_BUCKETS + 1 ), (unsigned long long)( seconds * 1000000.0 ) );
+    metricBump( s->slot( id + METRICS_BUCKETS + 2 ), 1 );
+}
+
+/**
+ * Return the value of a counter or the count of a histogram
+ */
+unsigned long long Metrics::value( int id ) {
+    CRASH_REPORT_BEGIN;
+    if (id < 0) return 0;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (std::vector< METRIC_SERIES >::iterator it = series.begin(); it != series.end(); ++it) {
+        if ((*it).slot != id) continue;
+        return total( (*it).type == METRIC_HISTOGRAM ? id + METRICS_BUCKETS + 2 : id );
+    }
+    return 0;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Format a label, escaping the value
+ */
+std::string Metrics::label( const std::string& key, const std::string& value ) {
+    std::string ans = key + "=\"";
+    for (std::string::const_iterator it = value.begin(); it != value.end(); ++it) {
+        if ((*it == '"') || (*it == '\\')) {
+            ans += '\\'; ans += *it;
+        } else if (*it == '\n') {
+            ans += "\\n";
+        } else {
+            ans += *it;
+        }
+    }
+    return ans + "\"";
+}
+
+/**
+ * Append the labels of a series, with an optional extra label
+ */
+static std::string metricLabels( const std::string& labels, const std::string& extra = "" ) {
+    if (labels.empty() && extra.empty()) return "";
+    if (labels.empty()) return "{" + extra + "}";
+    if (extra.empty()) return "{" + labels + "}";
+    return "{" + labels + "," + extra + "}";
+}
+
+/**
+ * Export in the Prometheus text format, with the series of every family together
+ */
+std::string Metrics::toPrometheus( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::ostringstream oss;
+
+    // Group the series by name
+    std::map< std::string, std::vector<int> > families;
+    for (size_t i = 0; i < series.size(); ++i)
+        families[ series[i].name ].push_back( i );
+
+    for (std::map< std::string, std::vector<int> >::iterator it = families.begin(); it != families.end(); ++it) {
+        const std::string & name = (*it).first;
+        bool isHistogram = (series[ (*it).second.front() ].type == METRIC_HISTOGRAM);
+        oss << "# HELP " << name << " " << help[name] << "\n";
+        oss << "# TYPE " << name << " " << (isHistogram ? "histogram" : "counter") << "\n";
+
+        for (std::vector<int>::iterator jt = (*it).second.begin(); jt != (*it).second.end(); ++jt) {
+            const METRIC_SERIES & s = series[*jt];
+            if (!isHistogram) {
+                oss << name << metricLabels( s.labels ) << " " << total( s.slot ) << "\n";
+                continue;
+            }
+
+            // The buckets are cumulative
+            unsigned long long cumulative = 0;
+            for (int b = 0; b <= METRICS_BUCKETS; ++b) {
+                cumulative += total( s.slot + b );
+                std::ostringstream le;
+                if (b < METRICS_BUCKETS) le << metricBuckets[b]; else le << "+Inf";
+                oss << name << "_bucket" << metricLabels( s.labels, label("le", le.str()) ) << " " << cumulative << "\n";
+            }
+            oss << name << "_sum" << metricLabels( s.labels ) << " " << (total( s.slot + METRICS_BUCKETS + 1 ) / 1000000.0) << "\n";
+            oss << name << "_count" << metricLabels( s.labels ) << " " << total( s.slot + METRICS_BUCKETS + 2 ) << "\n";
+        }
+    }
+
+    return oss.str();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start answering on a local socket
+ */
+bool Metrics::serve( const std::string& socketPath ) {
+    CRASH_REPORT_BEGIN;
+#ifdef _WIN32
+    CVMWA_LOG("Error", "The metrics socket is not available on this platform");
+    return false;
+#else
+    struct sockaddr_un addr;
+
+    // Only one server at a time
+    stop();
+    if (socketPath.length() >= sizeof(addr.sun_path)) {
+        CVMWA_LOG("Error", "Metrics socket path is too long: " << socketPath);
+        return false;
+    }
+
+    // Create the socket, replacing a stale one
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if (fd < 0) return false;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1 );
+    unlink( socketPath.c_str() );
+    if ((bind( fd, (struct sockaddr *) &addr, sizeof(addr) ) != 0) || (listen( fd, 8 ) != 0)) {
+        CVMWA_LOG("Error", "Unable to listen on metrics socket " << socketPath << " (errno=" << errno << ")");
+        close( fd );
+        return false;
+    }
+
+    // Start the server thread
+    CVMWA_LOG("Info", "Serving metrics on " << socketPath);
+    serverPath = socketPath;
+    serverStop = false;
+    server = new boost::thread( boost::bind( &Metrics::serveLoop, this, fd ) );
+    return true;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the local socket server
+ */
+void Metrics::stop( ) {
+    CRASH_REPORT_BEGIN;
+    if (server == NULL) return;
+    serverStop = true;
+    server->join();
+    delete server;
+    server = NULL;
+#ifndef _WIN32
+    unlink( serverPath.c_str() );
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Answer the connections of the local socket until stopped
+ */
+void Metrics::serveLoop( int fd ) {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+    while (!serverStop) {
+
+        // Wait for a connection, checking regularly if we are stopped
+        struct pollfd pfd;
+        pfd.fd = fd; pfd.events = POLLIN; pfd.revents = 0;
+        if (poll( &pfd, 1, 250 ) <= 0) continue;
+        int client = accept( fd, NULL, NULL );
+        if (client < 0) continue;
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt( client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one) );
+#endif
+
+        // Peek the request, without waiting for clients that send nothing
+        char request[512];
+        ssize_t len = 0;
+        pfd.fd = client; pfd.events = POLLIN; pfd.revents = 0;
+        if (poll( &pfd, 1, 100 ) > 0) {
+            len = recv( client, request, sizeof(request), 0 );
+        }
+
+        // Answer with HTTP to HTTP requests, otherwise with plain text
+        std::string body = toPrometheus(), reply;
+        if ((len >= 4) && (strncmp( request, "GET ", 4 ) == 0)) {
+            std::ostringstream oss;
+            oss << "HTTP/1.0 200 OK\r\n"
+                << "Content-Type: text/plain; version=0.0.4\r\n"
+                << "Content-Length: " << body.length() << "\r\n"
+                << "Connection: close\r\n\r\n" << body;
+            reply = oss.str();
+        } else {
+            reply = body;
+        }
+
+        // Send it
+        size_t sent = 0;
+        while (sent < reply.length()) {
+            ssize_t n = send( client, reply.c_str() + sent, reply.length() - sent, METRICS_SEND_FLAGS );
+            if (n <= 0) break;
+            sent += n;
+        }
+        close( client );
+
+    }
+    close( fd );
+#endif
+    CRASH_REPORT_END;
+}
@@ -0,0 +1,184 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/PortAllocator.h>
+
+#include <sstream>
+
+/**
+ * Return the path of the lock file
+ */
+std::string PortAllocator::lockPath( ) {
+    CRASH_REPORT_BEGIN;
+    if (!table) table = LocalConfig::forRuntime( "ports" );
+    return table->getPath( PORT_ALLOCATOR_LOCK );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Re-load the reservation table
+ */
+void PortAllocator::syncTable( ) {
+    CRASH_REPORT_BEGIN;
+    // Every operation saves it's changes before returning, so there is
+    // nothing of ours to merge. Re-load instead of relying on the file
+    // modification time, which might not change within the same second.
+    table->load();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the port reserved under the given key
+ */
+int PortAllocator::findPort( const std::string& key ) {
+    CRASH_REPORT_BEGIN;
+    std::map<const std::string, const std::string> entries;
+    table->toMap( &entries );
+    for (std::map<const std::string, const std::string>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if ((*it).second == key)
+            return ston<int>( (*it).first );
+    }
+    return 0;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the reserved port, allocating a new one if needed
+ */
+int PortAllocator::reserve( const std::string& owner, const std::string& name, const std::string& host ) {
+    CRASH_REPORT_BEGIN;
+    NAMED_MUTEX_LOCK(PORT_ALLOCATOR_MUTEX);
+    FileLock fileLock( lockPath() );
+    std::string key = owner + "/" + name;
+    syncTable();
+
+    // Hold the changes until we are done with the table
+    table->lock();
+
+    // Re-use the existing reservation if the port is still free
+    int port = findPort( key );
+    if (port != 0) {
+        if (isPortBindable( host.c_str(), port )) {
+            table->unlock();
+            return port;
+        }
+
+        // Somebody else has taken it
+        CVMWA_LOG("Debug", "Port " << port << " reserved for " << key << " is taken, allocating a new one");
+        std::ostringstream oss; oss << port;
+        table->erase( oss.str() );
+    }
+
+    // Let the kernel pick a port, skipping the ones reserved by others
+    for (int i=0; i<PORT_ALLOCATOR_TRIES; i++) {
+        port = getFreePort( host.c_str() );
+        if (port == 0) break;
+
+        std::ostringstream oss; oss << port;
+        if (table->contains( oss.str() ))
+            continue;
+
+        // (Unlocking commits the changes)
+        CVMWA_LOG("Debug", "Reserved port " << port << " for " << key);
+        table->set( oss.str(), key );
+        table->unlock();
+        return port;
+    }
+
+    CVMWA_LOG("Error", "Unable to allocate a port for " << key);
+    table->unlock();
+    table->save();
+    return 0;
+    NAMED_MUTEX_UNLOCK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the reserved port without validating it
+ */
+int PortAllocator::reserved( const std::string& owner, const std::string& name ) {
+    CRASH_REPORT_BEGIN;
+    NAMED_MUTEX_LOCK(PORT_ALLOCATOR_MUTEX);
+    FileLock fileLock( lockPath() );
+    syncTable();
+    return findPort( owner + "/" + name );
+    NAMED_MUTEX_UNLOCK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Record an externally chosen port
+ */
+bool PortAllocator::claim( const std::string& owner, const std::string& name, int port ) {
+    CRASH_REPORT_BEGIN;
+    NAMED_MUTEX_LOCK(PORT_ALLOCATOR_MUTEX);
+    FileLock fileLock( lockPath() );
+    std::string key = owner + "/" + name;
+    syncTable();
+
+    // Do not take over somebody else's reservation
+    std::ostringstream oss; oss << port;
+    std::string current = table->get( oss.str(), "" );
+    if (!current.empty() && (current != key)) {
+        CVMWA_LOG("Warning", "Port " << port << " claimed by " << key << " is reserved for " << current);
+        return false;
+    }
+
+    // Drop the previous reservation for the same purpose
+    table->lock();
+    int prev = findPort( key );
+    if ((prev != 0) && (prev != port)) {
+        std::ostringstream pss; pss << prev;
+        table->erase( pss.str() );
+    }
+    table->set( oss.str(), key );
+    table->unlock();
+    return true;
+
+    NAMED_MUTEX_UNLOCK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release all the ports of the given owner
+ */
+void PortAllocator::release( const std::string& owner ) {
+    CRASH_REPORT_BEGIN;
+    NAMED_MUTEX_LOCK(PORT_ALLOCATOR_MUTEX);
+    FileLock fileLock( lockPath() );
+    std::string prefix = owner + "/";
+    syncTable();
+
+    std::map<const std::string, const std::string> entries;
+    table->toMap( &entries );
+    bool changed = false;
+    for (std::map<const std::string, const std::string>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if ((*it).second.compare(0, prefix.length(), prefix) == 0) {
+            table->erase( (*it).first );
+            changed = true;
+        }
+    }
+
+    // (Erasing does not commit the changes)
+    if (changed) table->save();
+
+    NAMED_MUTEX_UNLOCK;
+    CRASH_REPORT_END;
+}
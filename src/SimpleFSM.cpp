@@ -19,109 +19,221 @@
  */
 
 #include <CernVM/SimpleFSM.h>
+#include <CernVM/Metrics.h>
 #include <cstdarg>
 #include <stdexcept>
 #include <iostream>
 
+/**
+ * Thrown by FSMJoin on the executor worker of the FSM when the branch is still
+ * running. It unwinds the handler like an interruption (so the CRASH_REPORT
+ * wrappers let it through) and FSMContinue re-queues the node.
+ */
+class FSMJoinPending : public boost::thread_interrupted { };
+
 /**
  * Void function FSMEnteringState
  */
 void SimpleFSM::FSMEnteringState( const int state, bool final ) { }
 
 /**
- * Reset FSM registry variables
+ * The FSM graphs are published once per class
  */
-void SimpleFSM::FSMRegistryBegin() {
+static boost::mutex fsmRegistryMutex;
+
+/**
+ * Reset FSM registry variables and check if the graph of this class
+ * is already built. Returns true if the registry entries should be added.
+ */
+bool SimpleFSM::FSMRegistryBegin( FSMGraphPtr * slot ) {
     CRASH_REPORT_BEGIN;
     // Reset
-    fsmNodes.clear();
     fsmTmpRouteLinks.clear();
     fsmCurrentPath.clear();
     fsmRootNode = NULL;
     fsmCurrentNode = NULL;
+    fsmRegistrySlot = slot;
+
+    // Use the existing graph if we have one
+    {
+        boost::unique_lock<boost::mutex> lock(fsmRegistryMutex);
+        fsmGraph = *slot;
+    }
+    if (fsmGraph) {
+        fsmRegistry.reset();
+        return false;
+    }
+
+    // Otherwise start a new one
+    fsmRegistry = boost::make_shared<FSMGraph>();
+    return true;
     CRASH_REPORT_END;
 }
 
 /**
  * Add entry to the FSM registry
  */
-void SimpleFSM::FSMRegistryAdd( int id, fsmHandler handler, ... ) {
+void SimpleFSM::FSMRegistryAdd( int id, fsmHandler handler, const int * links, const char * name ) {
     CRASH_REPORT_BEGIN;
     std::vector<int> v;
-    va_list pl;
-    int l;
+
+    // Allocate node
+    std::map<int,int>::iterator it = fsmRegistry->index.find( id );
+    if (it == fsmRegistry->index.end()) {
+        it = fsmRegistry->index.insert( std::pair<int,int>( id, fsmRegistry->nodes.size() ) ).first;
+        fsmRegistry->nodes.push_back( FSMNode() );
+    }
 
     // Initialize node
-    fsmNodes[id].id = id;
-    fsmNodes[id].handler = handler;
-    fsmNodes[id].children.clear();
+    FSMNode & node = fsmRegistry->nodes[ (*it).second ];
+    node.id = id;
+    node.type = FSM_NODE_DEFAULT;
+    node.handler = handler;
+    node.children.clear();
+    node.branch = 0;
+    node.index = (*it).second;
+    node.metric = -1;
+
+    // Keep only the function name of the handler (ex. "&Class::Name")
+    node.name = (name == NULL) ? "" : name;
+    if (!node.name.empty() && (node.name[0] == '&')) node.name = node.name.substr(1);
+    if (handler)
+        node.metric = Metrics::Default().histogram( "cvmwa_fsm_handler_duration_seconds", "Time spent in the FSM handlers",
+                                                    Metrics::label( "handler", node.name ) );
+    size_t sep = node.name.rfind("::");
+    if (sep != std::string::npos) node.name = node.name.substr(sep + 2);
     
     // Store route mapping to temp routes vector
     // (Will be synced by FSMRegistryEnd)
-    va_start(pl, handler);
-    while ((l = va_arg(pl,int)) != 0) {
-        v.push_back(l);
+    for (; *links != 0; ++links) {
+        v.push_back( *links );
     }
-    va_end(pl);
     fsmTmpRouteLinks[id] = v;
     CRASH_REPORT_END;
 }
 
+/**
+ * Fill the next-hop table of the given graph, by doing a breadth-first search
+ * from every node. The children are visited in the order they were declared,
+ * so among the paths of equal length, the one through the earlier children wins.
+ */
+static void buildRoutes( FSMGraph * graph ) {
+    CRASH_REPORT_BEGIN;
+    const int n = graph->nodes.size();
+    std::vector<int> queue;
+
+    graph->routes.assign( n * n, -1 );
+    for (int from = 0; from < n; ++from) {
+        int * hop = &graph->routes[ from * n ];
+
+        // The starting node is never re-visited
+        hop[from] = from;
+        queue.clear();
+        queue.push_back( from );
+
+        for (size_t i = 0; i < queue.size(); ++i) {
+            const FSMNode & node = graph->nodes[ queue[i] ];
+            for (std::vector<int>::const_iterator it = node.children.begin(); it != node.children.end(); ++it) {
+                if (hop[*it] != -1) continue;
+                hop[*it] = (node.index == from) ? *it : hop[node.index];
+                queue.push_back( *it );
+            }
+        }
+
+        hop[from] = -1;
+    }
+    CRASH_REPORT_END;
+}
+
 /**
  * Complete FSM registry decleration and build FSM tree
  */
 void SimpleFSM::FSMRegistryEnd( int rootID ) {
     CRASH_REPORT_BEGIN;
-	std::map<int,FSMNode>::iterator pt;
-	std::vector<FSMNode*> 			nodePtr;
-	std::vector<int> 				links;
 
-	// Build FSM linked list
-	for (std::map<int,FSMNode>::iterator it = fsmNodes.begin(); it != fsmNodes.end(); ++it) {
-		int id = (*it).first;
-		FSMNode * node = &((*it).second);
+    // Complete the graph if we are building it
+    if (fsmRegistry) {
 
-		// Create links
-		nodePtr.clear();
-		links = fsmTmpRouteLinks[id];
-		for (std::vector<int>::iterator jt = links.begin(); jt != links.end(); ++jt) {
+        // Build FSM links
+        for (std::vector<FSMNode>::iterator it = fsmRegistry->nodes.begin(); it != fsmRegistry->nodes.end(); ++it) {
+            std::vector<int> & links = fsmTmpRouteLinks[ (*it).id ];
+            for (std::vector<int>::iterator jt = links.begin(); jt != links.end(); ++jt) {
 
-			// Get pointer to node element in map
-			pt = fsmNodes.find( *jt );
-			FSMNode * refNode = &((*pt).second);
+                // Get the index of the node element
+                std::map<int,int>::iterator pt = fsmRegistry->index.find( *jt );
+                if (pt == fsmRegistry->index.end()) {
+                    CVMWA_LOG("Error", "Node " << (*it).id << " links to missing node " << *jt);
+                    continue;
+                }
 
-			// Update node
-			node->children.push_back( refNode );
+                // Update node
+                (*it).children.push_back( (*pt).second );
 
-		}
+            }
+        }
 
-	}
+        // Pre-compute the routes
+        buildRoutes( fsmRegistry.get() );
+
+        // Publish it, unless another instance was faster
+        {
+            boost::unique_lock<boost::mutex> lock(fsmRegistryMutex);
+            if (!*fsmRegistrySlot)
+                *fsmRegistrySlot = fsmRegistry;
+            fsmGraph = *fsmRegistrySlot;
+        }
+        fsmRegistry.reset();
+
+    }
 
 	// Fetch root node
 	fsmTargetState = rootID;
-	pt = fsmNodes.find( rootID );
-	fsmRootNode = &((*pt).second);
+	fsmRootNode = fsmGraph->find( rootID );
 
 	// Reset current node
 	fsmCurrentNode = fsmRootNode;
 
 	// Flush temp arrays
 	fsmTmpRouteLinks.clear();
+    fsmRegistrySlot = NULL;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark the given node as a fork of the given branch
+ */
+void SimpleFSM::FSMRegistryFork( int id, int branch ) {
+    CRASH_REPORT_BEGIN;
+    FSMNode & node = fsmRegistry->nodes[ fsmRegistry->index[id] ];
+    node.type = FSM_NODE_FORK;
+    node.branch = branch;
     CRASH_REPORT_END;
 }
 
 /**
  * Helper function to call a handler
  */
-bool SimpleFSM::_callHandler( FSMNode * node, bool inThread ) {
+bool SimpleFSM::_callHandler( const FSMNode * node, bool inThread ) {
     CRASH_REPORT_BEGIN;
 
 	// Use guarded execution
 	try {
 
 		// Run the new state
-		if (node->handler)
-			node->handler();
+		if (node->handler) {
+			TRACE_SPAN("fsm", node->name);
+			TRACE_SPAN_ARG("state", node->id);
+			TRACE_SPAN_ARG("owner", FSMTraceOwner());
+			ProfileScope span( fsmTrace, node->name );
+			MetricTimer timer( node->metric );
+			(this->*(node->handler))();
+		}
+
+	} catch (FSMJoinPending &e) {
+
+		// Let FSMContinue re-queue the node
+		fsmInsideHandler = false;
+		throw;
 
 	} catch (boost::thread_interrupted &e) {
 		CVMWA_LOG("Debuf", "FSM Handler interrupted");
@@ -164,7 +276,7 @@ bool SimpleFSM::FSMContinue( bool inThread ) {
 	if (fsmCurrentPath.empty() && (fsmCurrentNode != NULL)) return false;
 	fsmInsideHandler = true;
 
-	FSMNode * next;
+	const FSMNode * next;
 	{ /* mutex(fsmCurrentPath)) */
 		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
 		// Get next action in the path
@@ -187,12 +299,30 @@ bool SimpleFSM::FSMContinue( bool inThread ) {
     }
 
 	// Change current node
+	static const int metricTransitions = Metrics::Default().counter( "cvmwa_fsm_transitions_total", "FSM nodes reached while following a path" );
+	Metrics::Default().add( metricTransitions );
 	fsmCurrentNode = next;
 	FSMEnteringState( next->id, (const bool) fsmCurrentPath.empty() );
 
-	// Call handler
-	if (!_callHandler(next, inThread)) 
+	// Start fork nodes in their own branch and continue immediately
+	if (next->type == FSM_NODE_FORK) {
+		_forkBranch(next);
+		fsmInsideHandler = false;
+		return true;
+	}
+
+	// Call handler. If it has to wait for a branch on the executor, run it
+	// again when the branch completes (see FSMJoin)
+	try {
+		if (!_callHandler(next, inThread)) 
+			return false;
+	} catch (FSMJoinPending &e) {
+		CVMWA_LOG("Debug", "Node " << next->id << " waits for a branch");
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmCurrentPath.push_front( next );
+		fsmInsideHandler = false;
 		return false;
+	}
 
 	// We are now outside the handler
 	fsmInsideHandler = false;
@@ -200,59 +330,6 @@ bool SimpleFSM::FSMContinue( bool inThread ) {
     CRASH_REPORT_END;
 }
 
-/**
- * Helper function to traverse the FSM graph, trying to find the
- * shortest path that leads to the given action.
- */
-void findShortestPath( std::vector< FSMNode * > path, FSMNode * node, int state,	// Arguments
-					  size_t * clipLength, std::vector< FSMNode * > ** bestPath ) {	// State
-    CRASH_REPORT_BEGIN;
-
-	// Update path
-	path.push_back( node );
-
-	// Clip protection
-	if (path.size() >= *clipLength)
-		return;
-
-	// Iterate through the children
-	for (std::vector<FSMNode*>::iterator it = node->children.begin(); it != node->children.end(); ++it) {
-		FSMNode * n = *it;
-
-		// Ignore if it's already visited
-		if (std::find(path.begin(), path.end(), n) != path.end())
-			continue;
-
-		// Check if we found the node
-		if (n->id == state) {
-
-			// Set new clip path
-			*clipLength = path.size();
-			path.push_back( n );
-
-			// Replace best path
-			if (*bestPath != NULL) delete *bestPath;
-			*bestPath = new std::vector<FSMNode*>(path);
-
-#ifdef LOGGING
-			// Present best path
-			std::ostringstream oss;
-			for (std::vector<FSMNode*>::iterator j= (*bestPath)->begin(); j!=(*bestPath)->end(); ++j) {
-				if (!oss.str().empty()) oss << ", "; oss << (*j)->id;
-			}
-			CVMWA_LOG("Debug", "Preferred path: " << oss.str() );
-#endif
-
-			// We cannot continue (since we found a better path)
-			return;
-		}
-
-		// Continue with the items
-		findShortestPath( path, n, state, clipLength, bestPath );
-	}
-    CRASH_REPORT_END;
-}
-
 /**
  * Build the path to go to the given state and start the FSM subsystem
  * @param int state - The target state
@@ -272,23 +349,25 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 		fsmCurrentPath.clear();
 	}
 
-	// Prepare clip length
-	size_t clipLength = fsmNodes.size();
-
-	// Prepare solver
-	std::vector< FSMNode * > srcPath;
-	std::vector< FSMNode * > *resPath = NULL;
-	findShortestPath( srcPath, fsmCurrentNode, state, &clipLength, &resPath );
+	// Follow the pre-computed routes towards the target
+	const FSMNode * target = fsmGraph->find( state );
+	const FSMNode * hop = NULL;
+	if ((target != NULL) && (fsmCurrentNode != NULL))
+		hop = fsmGraph->nextHop( fsmCurrentNode, target );
 
 	// Check if we actually found a path
-	if (resPath != NULL) {
+	if (hop != NULL) {
 
-		// Update target path and release resPath memory
+		// Update target path, stripping the requested components
+		// from the beginning (the first one being the current node)
 		{
 			boost::unique_lock<boost::mutex> lock(fsmPathMutex);
-			fsmCurrentPath.assign( resPath->begin()+stripPathComponents, resPath->end() );
+			if (stripPathComponents < 1) fsmCurrentPath.push_back( fsmCurrentNode );
+			for (int i = 1; hop != NULL; ++i) {
+				if (i >= stripPathComponents) fsmCurrentPath.push_back( hop );
+				hop = (hop == target) ? NULL : fsmGraph->nextHop( hop, target );
+			}
 		}
-		delete resPath;
 
 		// Switch active target
 		fsmTargetState = state;
@@ -303,8 +382,8 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 		{ /* mutex(fsmCurrentPath)) */
 			boost::unique_lock<boost::mutex> lock(fsmPathMutex);			
 			pathCount = 0;
-			for (std::list<FSMNode*>::iterator j= fsmCurrentPath.begin(); j!=fsmCurrentPath.end(); ++j) {
-				FSMNode* node = *j;
+			for (std::list<const FSMNode*>::iterator j= fsmCurrentPath.begin(); j!=fsmCurrentPath.end(); ++j) {
+				const FSMNode* node = *j;
 				if (node->handler) pathCount++;
 			}
 		}
@@ -318,7 +397,7 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 	}
 
 	// Notify possibly paused thread
-	if (fsmThread != NULL)
+	if ((fsmThread != NULL) || fsmExecAttached)
 		_fsmWakeup();
 
 #ifdef LOGGING
@@ -327,7 +406,7 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 	{ /* mutex(fsmCurrentPath)) */
 		boost::unique_lock<boost::mutex> lock(fsmPathMutex);		
 	    if (!fsmCurrentPath.empty()) {
-	        for (std::list<FSMNode*>::iterator j= fsmCurrentPath.begin(); j!=fsmCurrentPath.end(); ++j) {
+	        for (std::list<const FSMNode*>::iterator j= fsmCurrentPath.begin(); j!=fsmCurrentPath.end(); ++j) {
 			    if (!oss.str().empty()) oss << ", "; oss << (*j)->id;
 		    }
 	    }
@@ -357,16 +436,16 @@ void SimpleFSM::FSMJump(int state) {
 	}
 
 	// Pick the current node
-	std::map<int,FSMNode>::iterator it = fsmNodes.find( state );
+	const FSMNode * node = fsmGraph->find( state );
 
-	if (it == fsmNodes.end()) {
+	if (node == NULL) {
 		// Skip missing nodes
 		fsmCurrentNode = fsmRootNode;
 
 	} else {
 
         // Change current node
-        fsmCurrentNode = &it->second;
+        fsmCurrentNode = node;
 
         // Handle only non-state nodes
         if (fsmCurrentNode->handler) {
@@ -390,14 +469,13 @@ void SimpleFSM::FSMJump(int state) {
 void SimpleFSM::FSMSkew(int state) {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Skewing through " << state << " towards " << fsmTargetState);
-	std::map<int,FSMNode>::iterator pt;
 
 	// Search given state
-	pt = fsmNodes.find( state );
-	if (pt == fsmNodes.end()) return;
+	const FSMNode * node = fsmGraph->find( state );
+	if (node == NULL) return;
 
 	// Switch current node to the skewed state
-	fsmCurrentNode = &((*pt).second);
+	fsmCurrentNode = node;
 
 	// Notify state change
 	bool isEmpty = false;
@@ -452,7 +530,10 @@ void SimpleFSM::FSMThreadLoop() {
 			};
 
 			// Unlock people waiting for completion
-			fsmwWaitCond.notify_all();
+			{
+				boost::unique_lock<boost::mutex> lock(fsmwWaitMutex);
+				fsmwWaitCond.notify_all();
+			}
 
 			// After the above loop, we have drained the
 			// event queue. Enter paused state and wait
@@ -470,6 +551,193 @@ void SimpleFSM::FSMThreadLoop() {
     CRASH_REPORT_END;
 }
 
+/**
+ * Start the handler of the given fork node in a concurrent branch
+ */
+void SimpleFSM::_forkBranch( const FSMNode * node ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+
+	// If the branch is still running, let it complete. If it has completed
+	// without being joined, it's results might be stale, so start it again.
+	std::map<int, boost::shared_ptr<FSMBranch> >::iterator it = fsmBranches.find( node->branch );
+	if (it != fsmBranches.end()) {
+		boost::shared_ptr<FSMBranch> old = (*it).second;
+		if (!old->done) {
+			CVMWA_LOG("Debug", "Branch " << node->branch << " is already running");
+			return;
+		}
+		old->thread->join();
+		delete old->thread;
+		fsmBranches.erase( it );
+	}
+
+    CVMWA_LOG("Debug", "Forking branch " << node->branch << " from " << node->id);
+	boost::shared_ptr<FSMBranch> branch = boost::make_shared<FSMBranch>();
+	branch->done = false;
+	branch->failed = false;
+	branch->stopped = false;
+	branch->code = 0;
+	branch->thread = new boost::thread( boost::bind( &SimpleFSM::_branchMain, this, node, branch ) );
+	fsmBranches[ node->branch ] = branch;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * The entry point of a concurrent branch
+ */
+void SimpleFSM::_branchMain( const FSMNode * node, boost::shared_ptr<FSMBranch> branch ) {
+    CRASH_REPORT_BEGIN;
+	bool failed = false;
+	std::string failure;
+
+	// Run the handler, catching everything that would abort the FSM thread
+	try {
+		TRACE_SPAN("fsm", node->name);
+		TRACE_SPAN_ARG("state", node->id);
+		TRACE_SPAN_ARG("owner", FSMTraceOwner());
+		TRACE_SPAN_ARG("branch", node->branch);
+		ProfileScope span( fsmTrace, node->name );
+		MetricTimer timer( node->metric );
+		(this->*(node->handler))();
+	} catch (boost::thread_interrupted &e) {
+		CVMWA_LOG("Debug", "Branch " << node->branch << " interrupted");
+		failed = true;
+	} catch ( std::exception &e ) {
+		CVMWA_LOG("Exception", e.what() );
+		failed = true;
+		failure = e.what();
+	} catch ( ... ) {
+		CVMWA_LOG("Exception", "Unknown exception" );
+		failed = true;
+		failure = "Unknown exception";
+	}
+
+	// Mark as completed and wake-up the joiner
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		if (failed && !branch->failed) {
+			branch->failed = true;
+			branch->message = failure;
+			branch->code = -1;
+		}
+		branch->done = true;
+	}
+	fsmBranchCond.notify_all();
+
+	// Run again the step that is waiting for us on the executor
+	if (fsmExecAttached)
+		_fsmWakeup();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait for the given branch to complete
+ */
+bool SimpleFSM::FSMJoin( int id, std::string * message, int * code ) {
+    CRASH_REPORT_BEGIN;
+	ProfileScope span( fsmTrace, "join" );
+	boost::shared_ptr<FSMBranch> branch;
+	bool stopped;
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		std::map<int, boost::shared_ptr<FSMBranch> >::iterator it = fsmBranches.find( id );
+		if (it == fsmBranches.end()) return true;
+		branch = (*it).second;
+
+		// Do not hold the executor worker while the branch runs
+		if (!branch->done && _inExecutorStep())
+			throw FSMJoinPending();
+		while (!branch->done) fsmBranchCond.wait(lock);
+
+		// If it was stopped meanwhile, _stopBranches releases the thread
+		stopped = branch->stopped;
+		if (!stopped) fsmBranches.erase( id );
+	}
+
+	// Release the thread
+	if (!stopped) {
+		branch->thread->join();
+		delete branch->thread;
+		branch->thread = NULL;
+	}
+
+	// Forward the result. A branch stopped after it completed is reported
+	// as interrupted, since it's results are no longer expected.
+	if (branch->failed || stopped) {
+		if (message != NULL) *message = branch->failed ? branch->message : "";
+		if (code != NULL) *code = branch->failed ? branch->code : -1;
+		return false;
+	}
+	return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the branch of the calling thread
+ */
+bool SimpleFSM::FSMInBranch( ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+	boost::thread::id self = boost::this_thread::get_id();
+	if (fsmStoppingBranches.find( self ) != fsmStoppingBranches.end()) return true;
+	for (std::map<int, boost::shared_ptr<FSMBranch> >::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it) {
+		if ((*it).second->thread && ((*it).second->thread->get_id() == self)) return true;
+	}
+	return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark the branch of the calling thread as failed
+ */
+void SimpleFSM::FSMBranchFail( const std::string & message, const int errorCode ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+	boost::thread::id self = boost::this_thread::get_id();
+	for (std::map<int, boost::shared_ptr<FSMBranch> >::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it) {
+		FSMBranch * b = (*it).second.get();
+		if (b->thread && (b->thread->get_id() == self) && !b->failed) {
+			b->failed = true;
+			b->message = message;
+			b->code = errorCode;
+		}
+	}
+    CRASH_REPORT_END;
+}
+
+/**
+ * Interrupt and release all the concurrent branches
+ */
+void SimpleFSM::_stopBranches( ) {
+    CRASH_REPORT_BEGIN;
+	std::map<int, boost::shared_ptr<FSMBranch> > branches;
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+
+		// The branches still see themselves as such while they wind down
+		for (std::map<int, boost::shared_ptr<FSMBranch> >::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it) {
+			fsmStoppingBranches.insert( (*it).second->thread->get_id() );
+			(*it).second->stopped = true;
+		}
+		branches.swap( fsmBranches );
+	}
+	for (std::map<int, boost::shared_ptr<FSMBranch> >::iterator it = branches.begin(); it != branches.end(); ++it) {
+		boost::thread::id id = (*it).second->thread->get_id();
+		(*it).second->thread->interrupt();
+		(*it).second->thread->join();
+		delete (*it).second->thread;
+		(*it).second->thread = NULL;
+
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		fsmStoppingBranches.erase( id );
+	}
+	fsmBranchCond.notify_all();
+    CRASH_REPORT_END;
+}
+
 /**
  * Local function to exit the FSM Thread
  */
@@ -477,6 +745,35 @@ void SimpleFSM::FSMThreadStop() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Stopping FSM thread");
 
+	// Detach from the executor, if we use one
+	if (fsmExecAttached) {
+		boost::unique_lock<boost::mutex> lock(fsmExecMutex);
+
+		// Interrupt the active step
+		fsmtInterruptRequested = true;
+		bool inStep = (fsmExecThread != NULL) && (fsmExecThread == fsmExecutor->currentWorker());
+		if ((fsmExecThread != NULL) && !inStep)
+			fsmExecThread->interrupt();
+		fsmExecAttached = false;
+		lock.unlock();
+
+		// Stop the concurrent branches
+		_stopBranches();
+
+		// Unlock people waiting for completion
+		{
+			boost::unique_lock<boost::mutex> lock(fsmwWaitMutex);
+			fsmwWaitCond.notify_all();
+		}
+
+		// Wait for the step to complete, unless we are called by it
+		lock.lock();
+		if (!inStep) {
+			while (fsmExecScheduled) fsmExecIdle.wait(lock);
+		}
+		return;
+	}
+
 	// Ensure we have a running thread
 	if ((fsmThread == NULL) || (!fsmThreadActive)) {
 	    CVMWA_LOG("Debug", "Thread already stopped");
@@ -487,6 +784,9 @@ void SimpleFSM::FSMThreadStop() {
 	fsmtInterruptRequested = true;
 	fsmThread->interrupt();
 
+	// Stop the concurrent branches
+	_stopBranches();
+
 	// Notify all condition variables
 	fsmwWaitCond.notify_all();
 	fsmtPauseChanged.notify_all();
@@ -507,6 +807,70 @@ void SimpleFSM::FSMThreadStop() {
     CRASH_REPORT_END;
 }
 
+/**
+ * Run the next step of the FSM on the executor
+ */
+void SimpleFSM::_executorStep() {
+    CRASH_REPORT_BEGIN;
+	bool res = false;
+
+	// Mark the step as running
+	{
+		boost::unique_lock<boost::mutex> lock(fsmExecMutex);
+		fsmExecWake = false;
+		if (!fsmtInterruptRequested)
+			fsmExecThread = fsmExecutor->currentWorker();
+	}
+
+	// Run the next action, like FSMThreadLoop does
+	if (fsmExecThread != NULL) {
+		try {
+			boost::unique_lock<boost::mutex> lock(fsmmThreadSafe);
+			res = FSMContinue(true);
+		} catch (boost::thread_interrupted &e) {
+			CVMWA_LOG("Debug", "Step interrupted");
+		}
+	}
+
+	// Unlock people waiting for completion
+	if (!res) {
+		boost::unique_lock<boost::mutex> lock(fsmwWaitMutex);
+		fsmwWaitCond.notify_all();
+	}
+
+	// Queue the next step if we have more to do or we were woken-up meanwhile.
+	// Otherwise the next wake-up will queue it. This is the last time we touch
+	// the instance when we are not re-queued, since it might be released after.
+	// The executor is not shared here: it outlives this step because it joins
+	// it's workers, while dropping the last reference in a worker would not.
+	FSMExecutor * executor = NULL;
+	{
+		boost::unique_lock<boost::mutex> lock(fsmExecMutex);
+		fsmExecThread = NULL;
+		if ((res || fsmExecWake) && !fsmtInterruptRequested) {
+			executor = fsmExecutor.get();
+		} else {
+			fsmExecScheduled = false;
+			fsmExecIdle.notify_all();
+		}
+	}
+	if (executor != NULL)
+		executor->post( boost::bind( &SimpleFSM::_executorStep, this ) );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the caller is the executor worker running the step of this FSM
+ */
+bool SimpleFSM::_inExecutorStep() {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmExecMutex);
+	if (!fsmExecAttached || (fsmExecThread == NULL)) return false;
+	return fsmExecThread == fsmExecutor->currentWorker();
+    CRASH_REPORT_END;
+}
+
 /**
  * Infinitely pause, waiting for a wakeup signal
  */
@@ -544,6 +908,17 @@ void SimpleFSM::_fsmWakeup() {
     if (fsmtInterruptRequested) return;
     CVMWA_LOG("Debug", "Waking-up paused thread");
 
+    // Queue a step on the executor, unless there is one already
+    if (fsmExecAttached) {
+        boost::unique_lock<boost::mutex> lock(fsmExecMutex);
+        fsmExecWake = true;
+        if (!fsmExecScheduled && !fsmtInterruptRequested) {
+            fsmExecScheduled = true;
+            fsmExecutor->post( boost::bind( &SimpleFSM::_executorStep, this ) );
+        }
+        return;
+    }
+
     {
         boost::unique_lock<boost::mutex> lock(fsmtPauseMutex);
         fsmtPaused = false;
@@ -577,6 +952,7 @@ void SimpleFSM::FSMDoing ( const std::string & message ) {
     CRASH_REPORT_BEGIN;
 	CVMWA_LOG("Debug", "Doing " << message);
 	if (fsmProgress) {
+		boost::unique_lock<boost::mutex> lock(fsmProgressMutex);
 		fsmProgress->doing(message);
 	}
     CRASH_REPORT_END;
@@ -592,6 +968,7 @@ void SimpleFSM::FSMDone ( const std::string & message ) {
     CRASH_REPORT_BEGIN;
 	CVMWA_LOG("Debug", "Done " << message);
 	if (fsmProgress) {
+		boost::unique_lock<boost::mutex> lock(fsmProgressMutex);
 		fsmProgress->done(message);
 	}
     CRASH_REPORT_END;
@@ -606,6 +983,7 @@ SimpleFSM::FSMBegin( const std::string& message ) {
     CRASH_REPORT_BEGIN;
 	boost::shared_ptr<T> ptr = boost::shared_ptr<T>();
 	if (fsmProgress) {
+		boost::unique_lock<boost::mutex> lock(fsmProgressMutex);
 		ptr = fsmProgress->begin<T>(message);
 	}
 	return ptr;
@@ -619,6 +997,7 @@ void SimpleFSM::FSMFail ( const std::string & message, const int errorCode ) {
     CRASH_REPORT_BEGIN;
 	CVMWA_LOG("Debug", "Done " << message);
 	if (fsmProgress) {
+		boost::unique_lock<boost::mutex> lock(fsmProgressMutex);
 		fsmProgress->fail(message, errorCode);
 	}
     CRASH_REPORT_END;
@@ -632,15 +1011,14 @@ void SimpleFSM::FSMWaitFor ( int state, int timeout ) {
     CVMWA_LOG("Debug", "Waiting for state " << state );
 
 	// Find the state
-	std::map<int,FSMNode>::iterator pt;
-	pt = fsmNodes.find( state );
-	if (pt == fsmNodes.end()) return;
+	const FSMNode * node = fsmGraph->find( state );
+	if (node == NULL) return;
 
 	// If we are already on this state, don't do anything
 	if (fsmCurrentNode == fsmwState) return;
 
 	// Switch to the target state
-	fsmwState = &((*pt).second);
+	fsmwState = node;
 
 	/*
     {
@@ -665,6 +1043,8 @@ void SimpleFSM::FSMWaitFor ( int state, int timeout ) {
  */
 void SimpleFSM::FSMWaitInactive ( int timeout ) {
     CRASH_REPORT_BEGIN;
+	// (Only as part of a handler, the callers from other threads are not part of the trace)
+	ProfileScope span( fsmTrace, "wait", true );
 
 	// Wait until we are no longer active
 	{
@@ -696,6 +1076,17 @@ boost::thread * SimpleFSM::FSMThreadStart() {
 	if (fsmThread != NULL)
 		return fsmThread;
 
+	// Attach to the executor if we use one
+	if (fsmExecutor) {
+		boost::unique_lock<boost::mutex> lock(fsmExecMutex);
+		if (!fsmExecAttached) {
+			fsmtInterruptRequested = false;
+			fsmtPaused = true;
+			fsmExecAttached = true;
+		}
+		return NULL;
+	}
+
 	// Reset properties
 	fsmtInterruptRequested = false;
 	
@@ -709,6 +1100,19 @@ boost::thread * SimpleFSM::FSMThreadStart() {
     CRASH_REPORT_END;
 }
 
+/**
+ * Use a shared executor instead of a dedicated thread
+ */
+void SimpleFSM::FSMUseExecutor( const FSMExecutorPtr & executor ) {
+    CRASH_REPORT_BEGIN;
+	if ((fsmThread != NULL) || fsmExecAttached) {
+		CVMWA_LOG("Error", "Cannot change the executor of a running FSM");
+		return;
+	}
+	fsmExecutor = executor;
+    CRASH_REPORT_END;
+}
+
 /**
  * Release mutex upon destruction
  */
@@ -717,6 +1121,7 @@ SimpleFSM::~SimpleFSM() {
 
 	// Join thread
 	FSMThreadStop();
+	_stopBranches();
 
     CRASH_REPORT_END;
 }
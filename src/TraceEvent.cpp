@@ -0,0 +1,283 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/TraceEvent.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+// The size of the per-thread buffer that makes it written to the file
+#define TRACE_BUFFER_SIZE       65536
+
+// The time after which the buffered events are written anyway (microseconds)
+#define TRACE_FLUSH_INTERVAL    1000000ULL
+
+/**
+ * The events of a thread that are not written yet. Only the owner thread
+ * appends to it, so the mutex is contended only by the flushes of others.
+ */
+struct TraceBuffer {
+    int                     tid;
+    std::string             data;
+    unsigned long long      flushedAt;
+    boost::mutex            mutex;
+};
+
+/**
+ * The trace file, opened on first use.
+ *
+ * The events are collected in the buffer of their thread and written in
+ * blocks, when the buffer grows over TRACE_BUFFER_SIZE, when it was last
+ * written more than TRACE_FLUSH_INTERVAL ago, when the thread exits and
+ * at shutdown.
+ */
+class TraceOutput {
+public:
+
+    /**
+     * Open the file given by the environment, if any
+     */
+    TraceOutput() : file(NULL), pid(0), lastTid(0), buffers(), local( &TraceOutput::threadExit ), mutex() {
+#ifdef _WIN32
+        pid = (int)GetCurrentProcessId();
+#else
+        pid = (int)getpid();
+#endif
+        const char * env = getenv( TRACE_FILE_ENV );
+        if ((env == NULL) || (env[0] == '\0')) return;
+
+        // Expand the process ID
+        std::string path = env;
+        size_t p = path.find("%p");
+        if (p != std::string::npos) {
+            std::ostringstream oss; oss << pid;
+            path.replace( p, 2, oss.str() );
+        }
+
+        file = fopen( path.c_str(), "w" );
+        if (file != NULL) fputs( "[\n", file );
+    };
+
+    /**
+     * Write what is left and complete the JSON array
+     */
+    ~TraceOutput() {
+        if (file == NULL) return;
+        flushAll();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            closed = true;
+            fprintf( file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"libcernvm\"}}\n]\n", pid );
+            fclose( file );
+            file = NULL;
+        }
+    };
+
+    /**
+     * Return the buffer of the calling thread, creating it on first use
+     */
+    TraceBuffer * buffer() {
+        TraceBuffer * buf = local.get();
+        if (buf != NULL) return buf;
+        buf = new TraceBuffer();
+        buf->flushedAt = traceNowUs();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            buf->tid = ++lastTid;
+            buffers.push_back( buf );
+        }
+        local.reset( buf );
+        return buf;
+    };
+
+    /**
+     * Write the given buffer to the file (called with the buffer mutex locked)
+     */
+    void write( TraceBuffer * buf ) {
+        if (!buf->data.empty()) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (file != NULL) {
+                fwrite( buf->data.data(), 1, buf->data.length(), file );
+                fflush( file );
+            }
+        }
+        buf->data.clear();
+        buf->flushedAt = traceNowUs();
+    };
+
+    /**
+     * Write the buffers of all the threads
+     */
+    void flushAll() {
+        std::list< TraceBuffer* > all;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            all = buffers;
+        }
+        for (std::list< TraceBuffer* >::iterator it = all.begin(); it != all.end(); ++it) {
+            boost::unique_lock<boost::mutex> lock((*it)->mutex);
+            write( *it );
+        }
+    };
+
+    /**
+     * Write and release the buffer of an exiting thread
+     */
+    static void threadExit( TraceBuffer * buf );
+
+    // Set when the output is destroyed, for the threads that exit after it
+    static bool             closed;
+
+    FILE *                  file;
+    int                     pid;
+    int                     lastTid;
+    std::list< TraceBuffer* >
+                            buffers;
+    boost::thread_specific_ptr< TraceBuffer >
+                            local;
+    boost::mutex            mutex;
+
+};
+
+/**
+ * Return the process-wide trace output
+ */
+static TraceOutput& traceOutput() {
+    static TraceOutput output;
+    return output;
+}
+
+bool TraceOutput::closed = false;
+
+/**
+ * Write and release the buffer of an exiting thread
+ */
+void TraceOutput::threadExit( TraceBuffer * buf ) {
+    if (closed) {
+        delete buf;
+        return;
+    }
+    TraceOutput& out = traceOutput();
+    {
+        boost::unique_lock<boost::mutex> lock(buf->mutex);
+        out.write( buf );
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(out.mutex);
+        out.buffers.remove( buf );
+    }
+    delete buf;
+}
+
+/**
+ * Check if we have a trace file
+ */
+bool traceEnabled( ) {
+    return traceOutput().file != NULL;
+}
+
+/**
+ * Monotonic microseconds
+ */
+unsigned long long traceNowUs( ) {
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency( &freq );
+    QueryPerformanceCounter( &now );
+    return (unsigned long long)( now.QuadPart / freq.QuadPart * 1000000 + (now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart );
+#elif defined(__linux__)
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/**
+ * Escape a JSON string
+ */
+std::string traceEscape( const std::string& text ) {
+    std::string ans;
+    ans.reserve( text.length() );
+    for (std::string::const_iterator it = text.begin(); it != text.end(); ++it) {
+        unsigned char c = *it;
+        if ((c == '"') || (c == '\\')) {
+            ans += '\\'; ans += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf( buf, sizeof(buf), "\\u%04x", c );
+            ans += buf;
+        } else {
+            ans += c;
+        }
+    }
+    return ans;
+}
+
+/**
+ * Append a complete ("X") event to the buffer of the calling thread
+ */
+void traceWriteEvent( const char * category, const std::string& name,
+                      unsigned long long startUs, unsigned long long durationUs, const std::string& args ) {
+    TraceOutput& out = traceOutput();
+    if (out.file == NULL) return;
+    TraceBuffer * buf = out.buffer();
+    char times[128];
+    snprintf( times, sizeof(times), "\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{",
+              startUs, durationUs, out.pid, buf->tid );
+
+    boost::unique_lock<boost::mutex> lock(buf->mutex);
+    buf->data += "{\"name\":\"";
+    buf->data += traceEscape( name );
+    buf->data += "\",\"cat\":\"";
+    buf->data += category;
+    buf->data += times;
+    buf->data += args;
+    buf->data += "}},\n";
+
+    // Write it if it's full or old enough
+    if ((buf->data.length() >= TRACE_BUFFER_SIZE) || (traceNowUs() - buf->flushedAt >= TRACE_FLUSH_INTERVAL))
+        out.write( buf );
+}
+
+/**
+ * Write the buffered events
+ */
+void traceFlush( ) {
+    TraceOutput& out = traceOutput();
+    if (out.file == NULL) return;
+    out.flushAll();
+}
@@ -38,8 +38,13 @@
 #include <errno.h>
 #include "zlib.h"
 
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
+
 #include <CernVM/Utilities.h>
 #include <CernVM/Hypervisor.h>
+#include <CernVM/Metrics.h>
 
 using namespace std;
 namespace fs = boost::filesystem;
@@ -125,6 +130,70 @@ sharedMutex __nmutex_get( std::string name ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Block until we have an exclusive lock of the given file
+ */
+FileLock::FileLock( const std::string& file ) {
+    CRASH_REPORT_BEGIN;
+#ifdef _WIN32
+    handle = CreateFileA( file.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                          NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+    if (handle != INVALID_HANDLE_VALUE) {
+        OVERLAPPED overlapped = { 0 };
+        if (!LockFileEx( handle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped )) {
+            CVMWA_LOG("Error", "Unable to lock '" << file << "' (error=" << GetLastError() << ")");
+            CloseHandle( handle );
+            handle = INVALID_HANDLE_VALUE;
+        }
+    } else {
+        CVMWA_LOG("Error", "Unable to open '" << file << "' (error=" << GetLastError() << ")");
+    }
+#else
+    fd = open( file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+    if (fd >= 0) {
+        int res;
+        do { res = flock( fd, LOCK_EX ); } while ((res != 0) && (errno == EINTR));
+        if (res != 0) {
+            CVMWA_LOG("Error", "Unable to lock '" << file << "' (errno=" << errno << ")");
+            close( fd );
+            fd = -1;
+        }
+    } else {
+        CVMWA_LOG("Error", "Unable to open '" << file << "' (errno=" << errno << ")");
+    }
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the lock
+ */
+FileLock::~FileLock() {
+    CRASH_REPORT_BEGIN;
+#ifdef _WIN32
+    if (handle != INVALID_HANDLE_VALUE) {
+        OVERLAPPED overlapped = { 0 };
+        UnlockFileEx( handle, 0, MAXDWORD, MAXDWORD, &overlapped );
+        CloseHandle( handle );
+    }
+#else
+    // (Closing the descriptor releases the lock)
+    if (fd >= 0) close( fd );
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the lock was obtained
+ */
+bool FileLock::isLocked() const {
+#ifdef _WIN32
+    return handle != INVALID_HANDLE_VALUE;
+#else
+    return fd >= 0;
+#endif
+}
+
 /**
  * Return a singleton with default SysExec Config
  */
@@ -144,6 +213,8 @@ SysExecConfig& SysExecConfig::operator=(const SysExecConfig& rhs) {
     timeout = rhs.timeout;
     gui = rhs.gui;
     errStrings = rhs.errStrings;
+    priority = rhs.priority;
+    owner = rhs.owner;
 
     return *this;
 }
@@ -180,6 +251,22 @@ SysExecConfig& SysExecConfig::setGUI( bool gui ) {
     return *this;
 };
 
+/**
+ * Change priority and return this class reference
+ */
+SysExecConfig& SysExecConfig::setPriority( int p ) { 
+    priority = p;
+    return *this;
+};
+
+/**
+ * Change owner and return this class reference
+ */
+SysExecConfig& SysExecConfig::setOwner( const std::string& owner ) { 
+    this->owner = owner;
+    return *this;
+};
+
 
 /**
  * Release memory from the named mutexes already acquired
@@ -588,9 +675,9 @@ void splitLines( string rawString, vector<string> * out ) {
  * Split the given string into a vector of strings using white space as delimiter, while preserving
  * strin contents found in double quotes.
  */
-int splitArguments( std::string source, char ** charBuffer, int bufferSize, int bufferOffset ) {
+int splitArguments( std::string source, std::vector< std::string > * argv ) {
     CRASH_REPORT_BEGIN;
-    static vector<string> args;
+    vector<string> & args = *argv;
     size_t wsPos=0, sqPos=0, dqPos=0, qPos=0, iPos=0;
     string chunk; char nextChar = ' ';
 
@@ -664,6 +751,22 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
 
     }
 
+    // Return how many components were found
+    return args.size();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Split the given string into a NULL-terminated char* buffer, suitable for execv(),
+ * starting from the given offset.
+ */
+int splitArguments( std::string source, char ** charBuffer, int bufferSize, int bufferOffset ) {
+    CRASH_REPORT_BEGIN;
+    static vector<string> args;
+    args.clear();
+    splitArguments( source, &args );
+
     // Cast back to the charBuffer
     int i = bufferOffset;
     for (vector<string>::iterator it = args.begin(); it < args.end(); it++) {
@@ -691,6 +794,47 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
     CRASH_REPORT_END;
 }
 
+/**
+ * Join the given arguments into a command-line, quoting the ones that need it
+ */
+std::string joinArguments( const std::vector< std::string > & args ) {
+    CRASH_REPORT_BEGIN;
+    string ans;
+    for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+        const string& arg = *it;
+        if (!ans.empty()) ans += " ";
+
+        // Pass-through safe arguments
+        if (!arg.empty() && (arg.find_first_of(" \t\"'") == string::npos)) {
+            ans += arg;
+            continue;
+        }
+
+        // Otherwise wrap in double quotes. Backslashes are literal, unless they
+        // precede a quote: then they are doubled and the quote is escaped.
+        ans += "\"";
+        size_t backslashes = 0;
+        for (string::const_iterator c = arg.begin(); c != arg.end(); ++c) {
+            if (*c == '\\') {
+                backslashes++;
+                continue;
+            }
+            if (*c == '"') {
+                ans.append( backslashes * 2 + 1, '\\' );
+            } else {
+                ans.append( backslashes, '\\' );
+            }
+            backslashes = 0;
+            ans += *c;
+        }
+        // Double the trailing backslashes, so they don't escape the closing quote
+        ans.append( backslashes * 2, '\\' );
+        ans += "\"";
+    }
+    return ans;
+    CRASH_REPORT_END;
+}
+
 /**
  * Tokenize a key-value like output from VBoxManage into an easy-to-use hashmap
  */
@@ -835,6 +979,17 @@ std::string getTmpFile( string suffix, string folder ) {
  */
 bool    sysExecAborted = false;
 
+#ifdef __linux__
+/**
+ * Event descriptor that becomes readable when abortSysExec() is called,
+ * waking up any sysExec() currently waiting on it.
+ */
+int __sysExecAbortFd() {
+    static int abortFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+    return abortFd;
+}
+#endif
+
 /**
  * Global initialization to sysExec
  */
@@ -842,6 +997,12 @@ void initSysExec() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Initializing sysExec()");
     sysExecAborted = false;
+#ifdef __linux__
+    // Drain any pending abort notification
+    eventfd_t value;
+    if (__sysExecAbortFd() >= 0)
+        eventfd_read( __sysExecAbortFd(), &value );
+#endif
     CRASH_REPORT_END;
 }
 
@@ -852,6 +1013,11 @@ void abortSysExec() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Aborting sysExec()");
     sysExecAborted = true;
+#ifdef __linux__
+    // Wake up everybody waiting for a process
+    if (__sysExecAbortFd() >= 0)
+        eventfd_write( __sysExecAbortFd(), 1 );
+#endif
     CRASH_REPORT_END;
 }
 
@@ -871,13 +1037,298 @@ int checkMatchingErrorCode( const std::string& buffer, const SysExecConfig& conf
     CRASH_REPORT_END;
 }
 
+/**
+ * Pass every complete line found in the given buffer to the line consumer and
+ * remove it from the buffer. If flush is true, the trailing partial line is passed too.
+ */
+void __sysExecFeedLines( string * buffer, const callbackLine& onLine, bool flush ) {
+    size_t iStart = 0, iEnd, iTrim;
+
+    /* Nobody is interested in the output */
+    if (!onLine) {
+        buffer->clear();
+        return;
+    }
+
+    /* Process complete lines, stripping the junk after '\r' */
+    while ((iEnd = buffer->find('\n', iStart)) != string::npos) {
+        iTrim = buffer->find('\r', iStart);
+        if (iTrim > iEnd) iTrim = iEnd;
+        onLine( buffer->substr(iStart, iTrim - iStart) );
+        iStart = iEnd + 1;
+    }
+
+    /* Process the remaining characters when flushing */
+    if (flush && (iStart < buffer->length())) {
+        iTrim = buffer->find('\r', iStart);
+        if (iTrim == string::npos) iTrim = buffer->length();
+        onLine( buffer->substr(iStart, iTrim - iStart) );
+        iStart = buffer->length();
+    }
+
+    /* Keep only the partial line */
+    buffer->erase(0, iStart);
+
+}
+
+#ifdef __linux__
+
+/**
+ * Read everything currently available on the given non-blocking descriptor
+ * and return false if the other end has hung-up.
+ */
+bool __sysExecDrain( int fd, string * buffer ) {
+    char data[4096];
+    ssize_t dataLen;
+    for (;;) {
+        dataLen = read(fd, data, sizeof(data));
+        if (dataLen > 0) {
+            buffer->append(data, dataLen);
+        } else if (dataLen == 0) {
+            return false;
+        } else if (errno != EINTR) {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        }
+    }
+}
+
+/**
+ * Spawn the given application with vfork(), returning the pid of the child and the
+ * non-blocking read ends of it's STDOUT and STDERR pipes (used by __sysExec() and the ExecReactor).
+ *
+ * The child cleans-up the inherited descriptors with a single close_range() call.
+ * Returns -1 if the process could not be spawned.
+ */
+pid_t __sysExecFork( const string& app, const vector<string>& args, int * outRd, int * errRd ) {
+    CRASH_REPORT_BEGIN;
+
+    /* Build argv now, since the vfork() child is not allowed to allocate memory */
+    vector<char*> argv;
+    argv.push_back( (char *)app.c_str() );
+    for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it)
+        argv.push_back( (char *)(*it).c_str() );
+    argv.push_back( (char *)NULL );
+
+    /* Prepare the two pipes (close-on-exec, so they don't leak to other spawned processes) */
+    int outfd[2]; if (pipe2(outfd, O_CLOEXEC) < 0) return -1;
+    int errfd[2]; if (pipe2(errfd, O_CLOEXEC) < 0) {
+        close(outfd[0]); close(outfd[1]);
+        return -1;
+    }
+
+    /* Spawn child instance */
+    pid_t pidChild = vfork();
+    if (pidChild == -1) {
+
+        /* Close pipes */
+        close(outfd[0]); close(outfd[1]);
+        close(errfd[0]); close(errfd[1]);
+        return -1;
+
+    } else if (!pidChild) {
+
+        /* Replace standard outs (dup2 also clears the close-on-exec flag) */
+        if ((dup2(outfd[1], 1) < 0) || (dup2(errfd[1], 2) < 0))
+            _exit(254);
+
+        /* Close any other debris from the parent, falling back to the
+           nasty way on kernels without close_range() */
+        if (syscall(__NR_close_range, 3, ~0U, 0) < 0) {
+            int maxFD = getdtablesize();
+            for (int cfd=3; cfd<maxFD; cfd++) {
+                close(cfd);
+            }
+        }
+
+        /* Launch given process */
+        execv( app.c_str(), &argv[0] );
+
+        /* We reach this point if execv fails */
+        _exit(254);
+
+    }
+
+    /* Close unused write end and switch the read ends to non-blocking */
+    close(outfd[1]); close(errfd[1]);
+    fcntl(outfd[0], F_SETFL, O_NONBLOCK);
+    fcntl(errfd[0], F_SETFL, O_NONBLOCK);
+
+    *outRd = outfd[0];
+    *errRd = errfd[0];
+    return pidChild;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Linux exec and return function (called by __sysExec())
+ *
+ * The parent sleeps on epoll until there is output, the child exits (through a pidfd),
+ * abortSysExec() is called, or the monotonic deadline expires.
+ */
+static int __sysExecSpawn( const string& app, const vector<string>& args, const callbackLine& onLine, string * rawStderr, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+    int ret = 0;
+    string rawStdout = "";
+    *rawStderr = "";
+
+    /* Spawn child instance */
+    int outfd[2], errfd[2];
+    pid_t pidChild = __sysExecFork( app, args, &outfd[0], &errfd[0] );
+    if (pidChild == -1) {
+
+        /* Return error code if something went wrong */
+        return 254;
+
+    }
+
+    /* Get a descriptor that becomes readable when the child exits (Linux 5.3+) */
+    int pidfd = syscall(__NR_pidfd_open, pidChild, 0);
+    int abortFd = __sysExecAbortFd();
+
+    /* Register everything we are waiting for */
+    struct epoll_event ev;
+    int epfd = epoll_create1( EPOLL_CLOEXEC );
+    int watchFds[4] = { outfd[0], errfd[0], pidfd, abortFd };
+    for (int i=0; i<4; i++) {
+        if (watchFds[i] < 0) continue;
+        ev.events = EPOLLIN; ev.data.fd = watchFds[i];
+        if ((epfd >= 0) && (epoll_ctl(epfd, EPOLL_CTL_ADD, watchFds[i], &ev) < 0)) {
+            close(epfd); epfd = -1;
+        }
+    }
+
+    /* Start reading stdout/err until both pipes hang-up, or the child exits */
+    bool pipeOpen[2] = { true, true };
+    bool childExited = false;
+    struct epoll_event events[4];
+    struct pollfd pollFds[4];
+    int readyFds[4];
+    long deadline = getMonotonicMillis() + config.timeout;
+    int waitMs, numReady;
+    while ((pipeOpen[0] || pipeOpen[1]) && !childExited) {
+
+        /* Abort if it takes way too long */
+        waitMs = (int)(deadline - getMonotonicMillis());
+        if ( sysExecAborted || (waitMs <= 0) ) {
+
+            // Close descriptors
+            close(outfd[0]); close(errfd[0]);
+            if (epfd >= 0) close(epfd);
+            if (pidfd >= 0) close(pidfd);
+
+            // Kill process
+            kill( pidChild, SIGKILL );
+
+            // Reap process
+            waitpid(pidChild, &ret, 0);
+
+            // Set stderror (just for the heck of it)
+            if (sysExecAborted) {
+                CVMWA_LOG("Debug", "Aborting execution");
+                *rawStderr = "ERROR: Aborted";
+                return 254;
+            } else {
+                CVMWA_LOG("Debug", "Timed out while waiting for response");
+                *rawStderr = "ERROR: Timed out";
+                return 255;
+            }
+
+        }
+
+        /* Without abort notifications, wake up once in a while to check the flag */
+        if (((abortFd < 0) || (epfd < 0)) && (waitMs > SYSEXEC_SLEEP_DELAY))
+            waitMs = SYSEXEC_SLEEP_DELAY;
+
+        /* Sleep until something happens */
+        numReady = 0;
+        if (epfd >= 0) {
+            int numEvents = epoll_wait( epfd, events, 4, waitMs );
+            if ((numEvents < 0) && (errno != EINTR)) break;
+            for (int i=0; i<numEvents; i++)
+                readyFds[numReady++] = events[i].data.fd;
+
+        } else {
+            /* No epoll instance: fall back to the timed poll loop over the same descriptors */
+            for (int i=0; i<4; i++) {
+                pollFds[i].fd = watchFds[i]; pollFds[i].events = POLLIN; pollFds[i].revents = 0;
+            }
+            if (!pipeOpen[0]) pollFds[0].fd = -1;
+            if (!pipeOpen[1]) pollFds[1].fd = -1;
+            int numEvents = poll( pollFds, 4, waitMs );
+            if ((numEvents < 0) && (errno != EINTR)) break;
+            for (int i=0; (i<4) && (numEvents > 0); i++)
+                if ((pollFds[i].fd >= 0) && pollFds[i].revents)
+                    readyFds[numReady++] = pollFds[i].fd;
+
+        }
+
+        for (int i=0; i<numReady; i++) {
+            int fd = readyFds[i];
+            if (fd == outfd[0]) {
+                pipeOpen[0] = __sysExecDrain( fd, &rawStdout );
+                if (!pipeOpen[0] && (epfd >= 0)) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                __sysExecFeedLines( &rawStdout, onLine, false );
+
+            } else if (fd == errfd[0]) {
+#if defined(DEBUG) || defined(LOGGING) || defined(CRASH_REPORTING)
+                size_t errOffset = rawStderr->length();
+#endif
+                pipeOpen[1] = __sysExecDrain( fd, rawStderr );
+                if (!pipeOpen[1] && (epfd >= 0)) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+#if defined(DEBUG) || defined(LOGGING) || defined(CRASH_REPORTING)
+                /* Debug log stderror */
+                if (rawStderr->length() > errOffset)
+                    CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
+#endif
+
+            } else if (fd == pidfd) {
+                /* The child has exited. Whatever it wrote is already in the pipes,
+                   so don't wait for grandchildren that might still hold them open. */
+                childExited = true;
+
+            } else if ((fd == abortFd) && !sysExecAborted) {
+                /* Stale notification from a previous abort */
+                eventfd_t value;
+                eventfd_read( abortFd, &value );
+
+            }
+        }
+
+    }
+
+    /* Collect what's left in the pipes and close them */
+    if (pipeOpen[0]) __sysExecDrain( outfd[0], &rawStdout );
+    if (pipeOpen[1]) __sysExecDrain( errfd[0], rawStderr );
+    close(outfd[0]); close(errfd[0]);
+    if (epfd >= 0) close(epfd);
+    if (pidfd >= 0) close(pidfd);
+
+    /* Pass the last line to the consumer */
+    __sysExecFeedLines( &rawStdout, onLine, true );
+
+    /* Wait spawned pid to exit */
+    waitpid(pidChild, &ret, 0);
+
+    /* Return the exit status */
+    return ret;
+    CRASH_REPORT_END;
+}
+
+#endif
+
 /**
  * Cross-platform exec and return function (called by sysExec())
  */
-int __sysExec( string app, string cmdline, vector<string> * stdoutList, string * rawStderr, const SysExecConfig& config ) {
+int __sysExec( const string& app, const vector<string>& args, const callbackLine& onLine, string * rawStderr, const SysExecConfig& config ) {
     CRASH_REPORT_BEGIN;
     try {
-#ifndef _WIN32
+#if defined(__linux__)
+
+    /* Use the event-driven spawn backend */
+    return __sysExecSpawn( app, args, onLine, rawStderr, config );
+
+#elif !defined(_WIN32)
     
     int ret = 0;
     pid_t pidChild;
@@ -886,6 +1337,14 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
     *rawStderr = "";
     bool pipeHUP[2];
 
+    /* Prepare the argument buffer before forking */
+    char *parts[512];
+    int iPart = 0;
+    parts[iPart++] = (char *)app.c_str();
+    for (vector<string>::const_iterator it = args.begin(); (it != args.end()) && (iPart < 511); ++it)
+        parts[iPart++] = (char *)(*it).c_str();
+    parts[iPart] = (char *)NULL;
+
     /* Prepare the two pipes */
     int outfd[2]; if (pipe(outfd) < 0) return HVE_IO_ERROR;
     int errfd[2]; if (pipe(errfd) < 0) return HVE_IO_ERROR;
@@ -928,11 +1387,6 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
             close(cfd);
         }
 
-        /* Split cmdline into string components */
-        char *parts[512];
-        parts[0] = (char *)app.c_str();
-        splitArguments( cmdline, parts, 512, 1 );
-        
         /* Launch given process */
         execv(app.c_str(), parts);
 
@@ -968,6 +1422,7 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
                         if (dataLen > 0) {
                             if (i == 0) {
                                 rawStdout.append(data, dataLen);
+                                __sysExecFeedLines( &rawStdout, onLine, false );
                             } else {
                                 rawStderr->append(data, dataLen);
 
@@ -1027,8 +1482,8 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
 
         }
 
-        /* Split stdout lines */
-        splitLines( rawStdout, stdoutList );
+        /* Pass the last line to the consumer */
+        __sysExecFeedLines( &rawStdout, onLine, true );
 
         /* Close pipes */
         close(outfd[0]); close(errfd[0]);
@@ -1092,6 +1547,7 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
     }
 
     /* Build cmdline */
+    string cmdline = joinArguments( args );
     string execpath = "\"" + app + "\" " + cmdline;
 
     /* Create process */
@@ -1131,8 +1587,10 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
         if (dwAvailable > 0) {
     		bSuccess = ReadFile( g_hChildStdOut_Rd, chBuf, 4096, &dwRead, NULL);
     		if ( !bSuccess || dwRead == 0 ) break;
-        	if ( stdoutList != NULL )
+        	if ( onLine ) {
     	    	rawStdout.append( chBuf, dwRead );
+                __sysExecFeedLines( &rawStdout, onLine, false );
+            }
         }
         
         /* Check for timeout */
@@ -1170,8 +1628,8 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
             CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
 #endif
 
-    	/* Split lines into stdout */
-        splitLines( rawStdout, stdoutList );
+    	/* Pass the last line to the consumer */
+        __sysExecFeedLines( &rawStdout, onLine, true );
         
         /* Wait for completion */
         DWORD ans;
@@ -1252,13 +1710,141 @@ int sysExecAsync( string app, string cmdline ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Post-process the exit code of a single __sysExec() attempt according to the given
+ * configuration, and return true if the command should not be retried.
+ */
+bool __sysExecCheckResult( int * res, const std::string& stdError, std::string * rawStderrAns, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+    int matchedRes = 0;
+
+    // Check for known error codes
+    matchedRes = checkMatchingErrorCode( stdError, config );
+    if (matchedRes != 0) {
+        *res = matchedRes;
+        return true;
+    }
+
+    // Check for "Error" in the stderr
+    // (Caused by a weird bug on VirtualBox)
+    if ((*res != 255) && ((stdError.find("error") != string::npos) || (stdError.find("ERROR") != string::npos) || (stdError.find("Error") != string::npos)) ) {
+        CVMWA_LOG("Debug", "Found error keyword. Set exit_code = 253");
+        if (rawStderrAns != NULL) *rawStderrAns = stdError;
+        *res = 253;
+    }
+
+    // If it was successful, or we were aborted, no retries.
+    return (*res == 0) || (*res == 255);
+    CRASH_REPORT_END;
+}
+
+/**
+ * The metric series of a command and verb
+ */
+typedef struct {
+    int     commands;
+    int     processes;
+    int     failures;
+    int     duration;
+} SYSEXEC_METRIC_IDS;
+
+/**
+ * Update the metrics of the given command, once all it's attempts are completed
+ */
+void __sysExecRecordMetrics( const std::string& app, const std::vector<std::string>& args, int attempts, int res, unsigned long long startedUs ) {
+    CRASH_REPORT_BEGIN;
+    static boost::mutex mutex;
+    static std::map< std::string, SYSEXEC_METRIC_IDS > cache;
+    Metrics & m = Metrics::Default();
+    std::string command = boost::filesystem::path(app).filename().string();
+    std::string verb = args.empty() ? "" : args[0];
+
+    // Register the series of every command and verb only once
+    SYSEXEC_METRIC_IDS ids;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::string key = command + " " + verb;
+        std::map< std::string, SYSEXEC_METRIC_IDS >::iterator it = cache.find( key );
+        if (it != cache.end()) {
+            ids = (*it).second;
+        } else {
+            std::string labels = Metrics::label( "command", command ) + "," + Metrics::label( "verb", verb );
+            ids.commands = m.counter( "cvmwa_exec_commands_total", "Commands executed, including all their retries", labels );
+            ids.processes = m.counter( "cvmwa_exec_processes_total", "Processes spawned by the commands", labels );
+            ids.failures = m.counter( "cvmwa_exec_failures_total", "Commands that completed with a non-zero exit code", labels );
+            ids.duration = m.histogram( "cvmwa_exec_duration_seconds", "Time from the start of a command until it's last attempt exits", labels );
+            cache[ key ] = ids;
+        }
+    }
+
+    m.add( ids.commands );
+    m.add( ids.processes, attempts );
+    if (res != 0)
+        m.add( ids.failures );
+    m.observe( ids.duration, (traceNowUs() - startedUs) / 1000000.0 );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Helper functions to collect the streamed lines into a vector
+ */
+static void __sysExecCollectLine( vector<string> * stdoutList, const string& line ) {
+    stdoutList->push_back( line );
+}
+static void __sysExecClearLines( vector<string> * stdoutList ) {
+    stdoutList->clear();
+}
+
 /**
  * Cross-platform exec function with retry functionality
  */
 int sysExec( const string& app, const string& cmdline, vector<string> * stdoutList, string * rawStderrAns, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> args;
+    splitArguments( cmdline, &args );
+    return sysExec( app, args, stdoutList, rawStderrAns, config );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cross-platform exec function with retry functionality, streaming the output lines
+ */
+int sysExec( const string& app, const string& cmdline, const callbackLine& onLine, string * rawStderrAns, const SysExecConfig& config, const callbackVoid& onRetry ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> args;
+    splitArguments( cmdline, &args );
+    return sysExec( app, args, onLine, rawStderrAns, config, onRetry );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cross-platform exec function with retry functionality, using an argument vector
+ */
+int sysExec( const string& app, const vector<string>& args, vector<string> * stdoutList, string * rawStderrAns, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+
+    // Without a buffer, just discard the output
+    if (stdoutList == NULL)
+        return sysExec( app, args, callbackLine(), rawStderrAns, config );
+
+    // Otherwise collect the lines of the last attempt
+    stdoutList->clear();
+    return sysExec( app, args, 
+                    boost::bind( &__sysExecCollectLine, stdoutList, _1 ), 
+                    rawStderrAns, config, 
+                    boost::bind( &__sysExecClearLines, stdoutList ) );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cross-platform exec function with retry functionality, using an argument vector
+ * and streaming the output lines
+ */
+int sysExec( const string& app, const vector<string>& args, const callbackLine& onLine, string * rawStderrAns, const SysExecConfig& config, const callbackVoid& onRetry ) {
     CRASH_REPORT_BEGIN;
     string stdError;
-    int res = 252, matchedRes = 0;
+    int res = 252;
     
     // Check if app does not exist
     if (!file_exists(app))
@@ -1266,32 +1852,25 @@ int sysExec( const string& app, const string& cmdline, vector<string> * stdoutLi
 
     // If we have already aborted, return
     if (sysExecAborted) {
-        CVMWA_LOG("Debug", "Aborted request to run: " << app << " " << cmdline);
+        CVMWA_LOG("Debug", "Aborted request to run: " << app << " " << joinArguments(args));
         return 255;
     }
 
     // Start the retry loop
-    for (int tries = 0; tries < config.retries; tries++ ) {
+    unsigned long long started = traceNowUs();
+    int tries;
+    for (tries = 0; tries < config.retries; tries++ ) {
         
+        // Let the consumer discard the output of the previous attempt
+        if ((tries > 0) && onRetry) onRetry();
+
         // Call the wrapper function
-        CVMWA_LOG("Debug", "Executing: " << app << " " << cmdline);
-        res = __sysExec( app, cmdline, stdoutList, &stdError, config );
+        CVMWA_LOG("Debug", "Executing: " << app << " " << joinArguments(args));
+        res = __sysExec( app, args, onLine, &stdError, config );
         CVMWA_LOG("Debug", "Exec EXIT_CODE: " << res);
 
-        // Check for known error codes
-        matchedRes = checkMatchingErrorCode( stdError, config );
-        if (matchedRes != 0) return matchedRes;
-
-        // Check for "Error" in the stderr
-        // (Caused by a weird bug on VirtualBox)
-        if ((res != 255) && ((stdError.find("error") != string::npos) || (stdError.find("ERROR") != string::npos) || (stdError.find("Error") != string::npos)) ) {
-            CVMWA_LOG("Debug", "Found error keyword. Set exit_code = 253");
-            if (rawStderrAns != NULL) *rawStderrAns = stdError;
-            res = 253;
-        }
-
         // If it was successful, or we were aborted, return now. No retries.
-        if ((res == 0) || (res == 255)) {
+        if (__sysExecCheckResult( &res, stdError, rawStderrAns, config )) {
             break;
         } else {
             // Wait and retry
@@ -1300,6 +1879,8 @@ int sysExec( const string& app, const string& cmdline, vector<string> * stdoutLi
         }
     }
 
+    // Account the command with all it's attempts
+    __sysExecRecordMetrics( app, args, std::min( tries + 1, config.retries ), res, started );
     return res;
     CRASH_REPORT_END;
 }
@@ -1375,6 +1956,8 @@ int digest_buffer( const std::string& buffer, const EVP_MD * md, string * dst, b
  */
 int digest_file( const std::string& path, const EVP_MD * md, string * dst, bool hex ) {
     CRASH_REPORT_BEGIN;
+    TRACE_SPAN("hash", "digest_file");
+    TRACE_SPAN_ARG("path", path);
     const int FREAD_CHUNK = 4096; // Filesystems have 4k or 8k chunks
     unsigned int md_len;
     unsigned char md_value[EVP_MAX_MD_SIZE];
@@ -1820,14 +2403,80 @@ bool isPortOpen( const char * host, int port, unsigned char handshake, int timeo
 }
 
 /**
- * Return a free port
+ * Local helper to bind a TCP socket on the given host and port
+ */
+static SOCKET __bindSocket( const char * host, int port ) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = inet_addr( host );
+
+    SOCKET sock = (SOCKET) socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return sock;
+
+    // Connections lingering in TIME_WAIT do not make the port busy for a
+    // listener that sets SO_REUSEADDR (as the hypervisor's do). On Windows
+    // the same option would allow stealing a port that is in use.
+    #ifndef _WIN32
+        int reuse = 1;
+        setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse) );
+    #endif
+
+    if (::bind( sock, (struct sockaddr *) &addr, sizeof(addr) ) < 0) {
+        #ifdef _WIN32
+            closesocket(sock);
+        #else
+            ::close(sock);
+        #endif
+        return (SOCKET) -1;
+    }
+    return sock;
+}
+
+/**
+ * Return a free port, by binding to port 0 and letting the kernel pick one
  */
 int getFreePort( const char * host ) {
-    int port = (rand() % 0xFBFF) + 1024;
-    while (isPortOpen( host, port ))
-        port = (rand() % 0xFBFF) + 1024;
+    CRASH_REPORT_BEGIN;
+    SOCKET sock = __bindSocket( host, 0 );
+    if (sock < 0) return 0;
 
+    // Get the port the kernel has assigned to us
+    struct sockaddr_in addr;
+    #ifdef _WIN32
+        int len = sizeof(addr);
+    #else
+        socklen_t len = sizeof(addr);
+    #endif
+    int port = 0;
+    if (getsockname( sock, (struct sockaddr *) &addr, &len ) == 0)
+        port = ntohs( addr.sin_port );
+
+    #ifdef _WIN32
+        closesocket(sock);
+    #else
+        ::close(sock);
+    #endif
     return port;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the specified port can be bound
+ */
+bool isPortBindable( const char * host, int port ) {
+    CRASH_REPORT_BEGIN;
+    SOCKET sock = __bindSocket( host, port );
+    if (sock < 0) return false;
+
+    #ifdef _WIN32
+        closesocket(sock);
+    #else
+        ::close(sock);
+    #endif
+    return true;
+    CRASH_REPORT_END;
 }
 
 /**
@@ -2129,6 +2778,8 @@ bool isSanitized( std::string * check, const char * chars ) {
  */
 int decompressFile( const std::string& src, const std::string& dst ) {
     CRASH_REPORT_BEGIN;
+    TRACE_SPAN("decompress", "decompressFile");
+    TRACE_SPAN_ARG("path", src);
     
     // Try to open gzfile
     gzFile file;
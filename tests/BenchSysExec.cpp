@@ -0,0 +1,70 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <CernVM/Utilities.h>
+#include <CernVM/TraceEvent.h>
+
+/**
+ * Measure the per-call latency of sysExec() on a short-lived command.
+ *
+ * Usage: BenchSysExec [iterations] [application]
+ * (defaults to 200 runs of /bin/echo)
+ */
+int main( int argc, char ** argv ) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+    std::string app = (argc > 2) ? argv[2] : "/bin/echo";
+    if (iterations <= 0) iterations = 200;
+
+    std::vector<std::string> args, lines;
+    args.push_back( "hello" );
+    std::string errors;
+    SysExecConfig config;
+
+    /* Warm up (page cache, first-time initialization) */
+    sysExec( app, args, &lines, &errors, config );
+
+    std::vector<double> samples;
+    samples.reserve( iterations );
+    for (int i=0; i<iterations; i++) {
+        unsigned long long started = traceNowUs();
+        int ret = sysExec( app, args, &lines, &errors, config );
+        samples.push_back( (traceNowUs() - started) / 1000.0 );
+        if (ret != 0) {
+            std::cerr << app << " exited with " << ret << std::endl;
+            return 1;
+        }
+    }
+
+    double total = 0;
+    for (size_t i=0; i<samples.size(); i++) total += samples[i];
+    std::sort( samples.begin(), samples.end() );
+
+    std::cout << "sysExec " << app << " x" << iterations << std::endl;
+    std::cout << "  mean " << (total / samples.size()) << " ms" << std::endl;
+    std::cout << "  p50  " << samples[ samples.size() / 2 ] << " ms" << std::endl;
+    std::cout << "  p99  " << samples[ (samples.size() * 99) / 100 ] << " ms" << std::endl;
+    std::cout << "  max  " << samples.back() << " ms" << std::endl;
+    return 0;
+}
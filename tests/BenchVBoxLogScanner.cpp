@@ -0,0 +1,93 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include <CernVM/Hypervisor.h>
+#include <CernVM/TraceEvent.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxProbes.h>
+#include "VBoxSamples.h"
+
+/**
+ * Print the time and the throughput of a scan over the given number of bytes
+ * (and the number of matches, unless negative)
+ */
+void report( const char * what, unsigned long long us, size_t bytes, int matches ) {
+    std::cout << "  " << what << " " << (us / 1000.0) << " ms, " << (bytes / (double)us) << " MB/s";
+    if (matches >= 0) std::cout << " (" << matches << " matches)";
+    std::cout << std::endl;
+}
+
+/**
+ * Compare the per-line std::string::find scan (what VBoxLogProbe used to do)
+ * against the VBoxLogScanner and the full VBoxLogProbe::analyze().
+ *
+ * Usage: BenchVBoxLogScanner [megabytes]
+ */
+int main( int argc, char ** argv ) {
+    int megabytes = (argc > 1) ? atoi(argv[1]) : 16;
+    if (megabytes <= 0) megabytes = 16;
+    std::string log = vboxSampleLog( (size_t)megabytes * 1024 * 1024 );
+    std::cout << "VBox.log of " << log.length() << " bytes" << std::endl;
+
+    // Per-line copies with three finds each
+    unsigned long long started = traceNowUs();
+    std::istringstream iss( log );
+    std::string line;
+    int matches = 0;
+    while (std::getline( iss, line )) {
+        if ((line.find("Changing the VM state from") != std::string::npos) ||
+            (line.find("Display::handleDisplayResize") != std::string::npos) ||
+            (line.find("WARNING! ") != std::string::npos))
+            matches++;
+    }
+    report( "per-line find ", traceNowUs() - started, log.length(), matches );
+
+    // The scanner alone
+    const VBoxLogScanner& scanner = VBoxLogScanner::Default();
+    started = traceNowUs();
+    const char * ptr = log.data(), * end = ptr + log.length(), * match;
+    matches = 0;
+    while ((match = scanner.find( ptr, end )) != NULL) {
+        matches++;
+        ptr = match + 1;
+    }
+    report( "VBoxLogScanner", traceNowUs() - started, log.length(), matches );
+
+    // The complete analysis, reading from a file
+    std::string folder = "vboxlog-bench";
+    boost::filesystem::create_directories( folder );
+    {
+        std::ofstream f( (folder + "/VBox.log").c_str(), std::ios::binary );
+        f << log;
+    }
+    VBoxLogProbe probe( folder, 0 );
+    started = traceNowUs();
+    probe.analyze();
+    report( "analyze()     ", traceNowUs() - started, log.length(), -1 );
+    boost::filesystem::remove_all( folder );
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <CernVM/Utilities.h>
+#include <CernVM/TraceEvent.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxMachineInfo.h>
+#include "VBoxSamples.h"
+
+/**
+ * Compare MachineInfo::parse() against the generic tokenize() on the output
+ * of 'showvminfo --machinereadable'.
+ *
+ * Usage: BenchVBoxMachineInfo [iterations]
+ */
+int main( int argc, char ** argv ) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 20000;
+    if (iterations <= 0) iterations = 20000;
+    std::vector<std::string> lines = vboxSampleShowVMInfo();
+    size_t checksum = 0;
+
+    unsigned long long started = traceNowUs();
+    for (int i=0; i<iterations; i++) {
+        MachineInfo info;
+        info.parse( lines );
+        checksum += info.memory;
+    }
+    double parseUs = (double)(traceNowUs() - started) / iterations;
+
+    started = traceNowUs();
+    for (int i=0; i<iterations; i++) {
+        std::map<const std::string, const std::string> kv = tokenize( &lines, '=' );
+        checksum += kv.size();
+    }
+    double tokenizeUs = (double)(traceNowUs() - started) / iterations;
+
+    std::cout << lines.size() << " lines x" << iterations << " (checksum " << checksum << ")" << std::endl;
+    std::cout << "  MachineInfo::parse " << parseUs << " us" << std::endl;
+    std::cout << "  tokenize           " << tokenizeUs << " us" << std::endl;
+    return 0;
+}
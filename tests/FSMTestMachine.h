@@ -0,0 +1,189 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef TESTS_FSMTESTMACHINE_H
+#define TESTS_FSMTESTMACHINE_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <CernVM/SimpleFSM.h>
+
+// The branch of the media download in the FSMTestMachine
+#define TEST_BRANCH         1
+
+// What the branch does when it's gate opens
+#define TEST_BRANCH_OK      0
+#define TEST_BRANCH_FAIL    1       // Calls FSMBranchFail
+#define TEST_BRANCH_THROW   2       // Throws an exception
+
+/**
+ * A latch the tests and the handlers wait on, with a timeout so that
+ * a broken test fails instead of hanging.
+ */
+class TestGate {
+public:
+    TestGate( bool open = false ) : isOpen(open), mutex(), cond() { };
+
+    void                open    () {
+        { boost::unique_lock<boost::mutex> lock(mutex); isOpen = true; }
+        cond.notify_all();
+    };
+
+    /**
+     * Wait for the gate to open. This is a boost::thread interruption point.
+     */
+    bool                wait    ( int timeout = 5000 ) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds( timeout );
+        while (!isOpen) {
+            if (!cond.timed_wait( lock, deadline )) return isOpen;
+        }
+        return true;
+    };
+
+private:
+    bool                        isOpen;
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+};
+
+/**
+ * An FSM that forks a download branch, does some work meanwhile and then
+ * joins it, logging the handlers it runs:
+ *
+ *  1 (idle) -> 2 fork Download -> 3 Work -> 4 Join -> 6 Check -> 5 (ready) -> 1
+ */
+class FSMTestMachine : public SimpleFSM {
+public:
+
+    FSMTestMachine( int mode = TEST_BRANCH_OK, bool open = true ) : SimpleFSM(), gate(open), started(),
+        branchMode(mode), downloads(0), interrupted(0), overlaps(0), joined(false), joinMessage(),
+        joinCode(0), log(), busy(false), mutex() {
+        FSM_REGISTRY(1,
+        {
+            FSM_STATE(1, 2);
+            FSM_FORK(2, TEST_BRANCH,
+                        &FSMTestMachine::Download,  3);
+            FSM_HANDLER(3, &FSMTestMachine::Work,   4);
+            FSM_HANDLER(4, &FSMTestMachine::Join,   6);
+            FSM_HANDLER(6, &FSMTestMachine::Check,  5);
+            FSM_STATE(5, 1);
+        });
+    };
+
+    /**
+     * Join the branch from outside the FSM
+     */
+    bool                join            ( std::string * message, int * code ) {
+        return FSMJoin( TEST_BRANCH, message, code );
+    };
+
+    /**
+     * Return a copy of the handler log
+     */
+    std::vector<std::string> getLog     ( ) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return log;
+    };
+
+    /**
+     * Wait until the FSM is no longer active, giving up after the timeout
+     */
+    bool                waitInactive    ( int timeout = 5000 ) {
+        boost::thread waiter( boost::bind( &SimpleFSM::FSMWaitInactive, this, 0 ) );
+        if (waiter.try_join_for( boost::chrono::milliseconds( timeout ) )) return true;
+        waiter.interrupt();
+        waiter.join();
+        return false;
+    };
+
+    // Opened by the test to let the branch complete
+    TestGate            gate;
+
+    // Opened by the branch when it starts
+    TestGate            started;
+
+    int                 branchMode;
+    int                 downloads;
+    int                 interrupted;
+    int                 overlaps;       // Steps of this FSM that ran in parallel
+    bool                joined;
+    std::string         joinMessage;
+    int                 joinCode;
+
+    // Handlers
+    void                Download        ( ) {
+        { boost::unique_lock<boost::mutex> lock(mutex); downloads++; }
+        started.open();
+        try {
+            gate.wait( 60000 );
+        } catch (boost::thread_interrupted &e) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            interrupted++;
+            throw;
+        }
+        if (branchMode == TEST_BRANCH_FAIL) FSMBranchFail( "Disk full", -6 );
+        if (branchMode == TEST_BRANCH_THROW) throw std::runtime_error( "Checksum mismatch" );
+    };
+    void                Work            ( ) { step( "work" ); };
+    void                Join            ( ) {
+        std::string message;
+        int code = 0;
+        bool ok = FSMJoin( TEST_BRANCH, &message, &code );
+        boost::unique_lock<boost::mutex> lock(mutex);
+        joined = ok;
+        joinMessage = message;
+        joinCode = code;
+        log.push_back( "join" );
+    };
+    void                Check           ( ) { step( "check" ); };
+
+private:
+
+    /**
+     * Log a step, counting the steps of this FSM that overlap
+     */
+    void                step            ( const std::string & name ) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (busy) overlaps++;
+            busy = true;
+        }
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+        boost::unique_lock<boost::mutex> lock(mutex);
+        busy = false;
+        log.push_back( name );
+    };
+
+    std::vector<std::string>    log;
+    bool                        busy;
+    boost::mutex                mutex;
+
+};
+
+#endif /* end of include guard: TESTS_FSMTESTMACHINE_H */
@@ -0,0 +1,256 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef TESTS_HTTPTESTSERVER_H
+#define TESTS_HTTPTESTSERVER_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/**
+ * A request received by the HttpTestServer
+ */
+typedef struct {
+
+    std::string     method;
+    std::string     range;          // The value of the Range header, if any
+    std::string     ifRange;        // The value of the If-Range header, if any
+
+} HTTP_TEST_REQUEST;
+
+/**
+ * A minimal HTTP/1.0 server on the loopback interface, serving a single file
+ * from memory with byte ranges, so the download tests do not need the network.
+ *
+ * Every connection is served by it's own thread and closed after the response.
+ */
+class HttpTestServer {
+public:
+
+    /**
+     * Start serving the given contents
+     */
+    HttpTestServer( const std::string& body )
+        : body(body), etag("\"v1\""), ranges(true), dropAfter(-1), requests(), mutex(),
+          listenFd(-1), port(0), acceptThread(NULL), workers() {
+        listenFd = socket( AF_INET, SOCK_STREAM, 0 );
+        int reuse = 1;
+        setsockopt( listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse) );
+        struct sockaddr_in addr;
+        memset( &addr, 0, sizeof(addr) );
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr( "127.0.0.1" );
+        socklen_t len = sizeof(addr);
+        if ((bind( listenFd, (struct sockaddr *) &addr, sizeof(addr) ) == 0) && (listen( listenFd, 16 ) == 0) &&
+            (getsockname( listenFd, (struct sockaddr *) &addr, &len ) == 0)) {
+            port = ntohs( addr.sin_port );
+            acceptThread = new boost::thread( boost::bind( &HttpTestServer::acceptLoop, this ) );
+        }
+    };
+
+    /**
+     * Stop serving and wait for the connections to complete
+     */
+    ~HttpTestServer() {
+        shutdown( listenFd, SHUT_RDWR );
+        close( listenFd );
+        if (acceptThread != NULL) {
+            acceptThread->join();
+            delete acceptThread;
+        }
+        for (std::list< boost::thread * >::iterator it = workers.begin(); it != workers.end(); ++it) {
+            (*it)->join();
+            delete *it;
+        }
+    };
+
+    /**
+     * The URL of the served file
+     */
+    std::string url( ) {
+        std::ostringstream oss;
+        oss << "http://127.0.0.1:" << port << "/file.bin";
+        return oss.str();
+    };
+
+    /**
+     * Return a copy of the requests received so far
+     */
+    std::vector< HTTP_TEST_REQUEST > getRequests( ) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return requests;
+    };
+
+    /**
+     * Set how the server behaves. If dropAfter is not negative, the next
+     * GET response is cut after that many bytes of it's body.
+     */
+    void configure( const std::string& etag, bool ranges, long dropAfter ) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        this->etag = etag;
+        this->ranges = ranges;
+        this->dropAfter = dropAfter;
+    };
+
+private:
+
+    /**
+     * Accept connections until the listening socket is closed
+     */
+    void acceptLoop( ) {
+        while (true) {
+            int fd = accept( listenFd, NULL, NULL );
+            if (fd < 0) break;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            workers.push_back( new boost::thread( boost::bind( &HttpTestServer::serve, this, fd ) ) );
+        }
+    };
+
+    /**
+     * Send the whole buffer, returning false if the peer went away
+     */
+    static bool sendAll( int fd, const char * data, size_t len ) {
+        while (len > 0) {
+            ssize_t n = send( fd, data, len, MSG_NOSIGNAL );
+            if (n <= 0) return false;
+            data += n;
+            len -= n;
+        }
+        return true;
+    };
+
+    /**
+     * Serve a single request
+     */
+    void serve( int fd ) {
+
+        // Read the request headers
+        std::string head;
+        char buf[1024];
+        while (head.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = recv( fd, buf, sizeof(buf), 0 );
+            if (n <= 0) {
+                close( fd );
+                return;
+            }
+            head.append( buf, n );
+        }
+
+        // Parse what we need
+        HTTP_TEST_REQUEST req;
+        req.method = head.substr( 0, head.find(' ') );
+        std::istringstream iss( head );
+        std::string line;
+        while (std::getline( iss, line )) {
+            if (!line.empty() && (line[line.length()-1] == '\r')) line.erase( line.length()-1 );
+            size_t sep = line.find(": ");
+            if (sep == std::string::npos) continue;
+            std::string name = line.substr( 0, sep );
+            for (std::string::iterator it = name.begin(); it != name.end(); ++it) *it = tolower(*it);
+            if (name == "range") req.range = line.substr( sep + 2 );
+            if (name == "if-range") req.ifRange = line.substr( sep + 2 );
+        }
+
+        // Pick the behaviour of this response
+        std::string tag;
+        bool useRanges;
+        long drop = -1;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            requests.push_back( req );
+            tag = etag;
+            useRanges = ranges;
+            if (req.method == "GET") {
+                drop = dropAfter;
+                dropAfter = -1;
+            }
+        }
+
+        // Serve a range only if it's still the same file
+        long begin = 0, end = (long) body.length() - 1;
+        bool partial = false;
+        if (useRanges && (req.range.compare(0, 6, "bytes=") == 0) && (req.ifRange.empty() || (req.ifRange == tag))) {
+            std::string spec = req.range.substr( 6 );
+            size_t dash = spec.find('-');
+            begin = atol( spec.substr( 0, dash ).c_str() );
+            if (dash + 1 < spec.length()) end = atol( spec.substr( dash + 1 ).c_str() );
+            partial = true;
+        }
+
+        std::ostringstream oss;
+        oss << "HTTP/1.0 " << (partial ? "206 Partial Content" : "200 OK") << "\r\n"
+            << "Content-Length: " << (end - begin + 1) << "\r\n"
+            << "ETag: " << tag << "\r\n";
+        if (useRanges) oss << "Accept-Ranges: bytes\r\n";
+        if (partial) oss << "Content-Range: bytes " << begin << "-" << end << "/" << body.length() << "\r\n";
+        oss << "Connection: close\r\n\r\n";
+        std::string hdr = oss.str();
+
+        if (sendAll( fd, hdr.data(), hdr.length() ) && (req.method == "GET")) {
+            size_t len = end - begin + 1;
+            if ((drop >= 0) && ((size_t) drop < len)) len = drop;
+            sendAll( fd, body.data() + begin, len );
+        }
+        close( fd );
+    };
+
+    std::string                     body;
+    std::string                     etag;
+    bool                            ranges;
+    long                            dropAfter;
+    std::vector< HTTP_TEST_REQUEST > requests;
+    boost::mutex                    mutex;
+
+    int                             listenFd;
+    int                             port;
+    boost::thread *                 acceptThread;
+    std::list< boost::thread * >    workers;
+
+};
+
+/**
+ * Contents for the download tests, different at every offset
+ */
+inline std::string httpTestBody( size_t size ) {
+    std::string body( size, '\0' );
+    unsigned int x = 12345;
+    for (size_t i=0; i<size; i++) {
+        x = x * 1103515245 + 12345;
+        body[i] = (char)(x >> 16);
+    }
+    return body;
+}
+
+#endif /* end of include guard: TESTS_HTTPTESTSERVER_H */
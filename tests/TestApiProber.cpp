@@ -0,0 +1,68 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#include <CernVM/ApiProber.h>
+#include <CernVM/Utilities.h>
+#include "TestCommon.h"
+
+/**
+ * Re-probe from within a batch callback, which runs on the prober thread
+ */
+void probeAgain( ApiProber * prober, int port, bool * result, const std::vector<API_PROBE>& /* results */ ) {
+    *result = prober->probe( "127.0.0.1", port, HSK_NONE, 1000 );
+}
+
+/**
+ * Probing from a callback of the prober does not dead-lock
+ */
+void testReentry() {
+    ApiProber prober;
+
+    // A port that is surely closed
+    int port = getFreePort( "127.0.0.1" );
+    TEST_CHECK( port != 0 );
+
+    std::vector<API_PROBE> probes(1);
+    probes[0].host = "127.0.0.1";
+    probes[0].port = port;
+    probes[0].handshake = HSK_NONE;
+    probes[0].alive = true;
+    probes[0].latency = 0;
+
+    bool again = true;
+    ApiProbeBatchPtr batch = prober.probeAsync( probes, 1000, boost::bind( &probeAgain, &prober, port, &again, _1 ) );
+    batch->wait();
+    TEST_CHECK( !batch->probes[0].alive );
+
+    // The callback runs after the batch is marked as done
+    for (int i=0; (i<100) && again; i++)
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 20 ) );
+    TEST_CHECK( !again );
+}
+
+int main() {
+    TEST_RUN( testReentry );
+    return TEST_RESULT();
+}
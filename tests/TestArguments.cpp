@@ -0,0 +1,79 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <CernVM/Utilities.h>
+#include "TestCommon.h"
+
+/**
+ * Shorthand to join a list of arguments
+ */
+std::string join( const char * a, const char * b = NULL ) {
+    std::vector<std::string> args;
+    args.push_back( a );
+    if (b != NULL) args.push_back( b );
+    return joinArguments( args );
+}
+
+/**
+ * Simple arguments are passed through, the rest is quoted
+ */
+void testQuoting() {
+    TEST_EQUAL( join("modifyvm", "--memory"), "modifyvm --memory" );
+    TEST_EQUAL( join("two words"), "\"two words\"" );
+    TEST_EQUAL( join(""), "\"\"" );
+    TEST_EQUAL( join("say \"hi\""), "\"say \\\"hi\\\"\"" );
+}
+
+/**
+ * Backslashes follow the Windows command-line rules
+ */
+void testBackslashes() {
+    // Literal when they don't precede a quote
+    TEST_EQUAL( join("C:\\Program Files\\VirtualBox"), "\"C:\\Program Files\\VirtualBox\"" );
+    TEST_EQUAL( join("C:\\path\\"), "C:\\path\\" );
+    // Doubled before the closing quote
+    TEST_EQUAL( join("C:\\My Disks\\"), "\"C:\\My Disks\\\\\"" );
+    TEST_EQUAL( join("a b\\\\"), "\"a b\\\\\\\\\"" );
+    // Doubled before an escaped quote
+    TEST_EQUAL( join("a\\\"b c"), "\"a\\\\\\\"b c\"" );
+}
+
+/**
+ * The command-line form of controlVM and friends is split on white space
+ */
+void testSplit() {
+    std::vector<std::string> args;
+    splitArguments( "setlinkstate1 on", &args );
+    TEST_EQUAL( args.size(), 2u );
+    if (args.size() == 2) {
+        TEST_EQUAL( args[0], "setlinkstate1" );
+        TEST_EQUAL( args[1], "on" );
+    }
+}
+
+int main() {
+    TEST_RUN( testQuoting );
+    TEST_RUN( testBackslashes );
+    TEST_RUN( testSplit );
+    return TEST_RESULT();
+}
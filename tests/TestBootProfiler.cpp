@@ -0,0 +1,189 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <CernVM/BootProfiler.h>
+#include <CernVM/LocalConfig.h>
+#include "TestCommon.h"
+
+// A runtime config of our own, so the samples of the user are not touched
+#define TEST_TABLE      "profile-test"
+
+/**
+ * Let some time pass inside a span
+ */
+void spend( int ms ) {
+    boost::this_thread::sleep( boost::posix_time::milliseconds( ms ) );
+}
+
+/**
+ * A span of another thread
+ */
+void otherThread( ProfileTrace * trace ) {
+    ProfileScope span( *trace, "download" );
+    spend( 2 );
+}
+
+/**
+ * The spans of a thread nest in the span that thread has open
+ */
+void testNesting() {
+    ProfileTrace trace;
+
+    // Nothing is recorded before begin()
+    TEST_EQUAL( trace.enter( "early" ), -1 );
+    trace.begin( "start" );
+    TEST_CHECK( trace.isActive() );
+    TEST_CHECK( !trace.inSpan() );
+    {
+        // Waits are recorded only inside a handler
+        ProfileScope orphan( trace, "wait", true );
+    }
+    {
+        ProfileScope handler( trace, "ConfigureVM" );
+        TEST_CHECK( trace.inSpan() );
+        { ProfileScope exec( trace, "exec:modifyvm" ); spend( 2 ); }
+        { ProfileScope exec( trace, "exec:modifyvm" ); spend( 2 ); }
+        { ProfileScope wait( trace, "wait", true ); spend( 1 ); }
+        boost::thread other( boost::bind( &otherThread, &trace ) );
+        other.join();
+    }
+    TEST_CHECK( !trace.inSpan() );
+    TEST_CHECK( trace.end() );
+    TEST_CHECK( !trace.end() );
+
+    std::vector< PROFILE_SPAN > spans = trace.getSpans();
+    TEST_EQUAL( spans.size(), 5u );
+    if (spans.size() != 5) return;
+    const char * names[] = { "ConfigureVM", "exec:modifyvm", "exec:modifyvm", "wait", "download" };
+    const int parents[] = { -1, 0, 0, 0, -1 };
+    for (size_t i=0; i<5; i++) {
+        TEST_EQUAL( spans[i].name, std::string(names[i]) );
+        TEST_EQUAL( spans[i].parent, parents[i] );
+        TEST_CHECK( spans[i].duration >= 0 );
+    }
+    TEST_CHECK( spans[1].duration >= 2 );
+    TEST_CHECK( spans[1].start >= spans[0].start );
+    TEST_CHECK( spans[2].start >= spans[1].start + spans[1].duration );
+}
+
+/**
+ * The breakdown sums the spans of the same path, and end() closes the open spans
+ */
+void testBreakdown() {
+    ProfileTrace trace;
+    trace.begin( "start" );
+    int handler = trace.enter( "ConfigureVM" );
+    { ProfileScope exec( trace, "exec:modifyvm" ); spend( 3 ); }
+    { ProfileScope exec( trace, "exec:modifyvm" ); spend( 2 ); }
+    { ProfileScope exec( trace, "exec:storageattach" ); spend( 1 ); }
+    trace.leave( handler );
+    int open = trace.enter( "StartVM" );
+    spend( 2 );
+    trace.end();
+
+    std::vector< PROFILE_SPAN > spans = trace.getSpans();
+    std::map< std::string, long > breakdown = trace.getBreakdown();
+    TEST_EQUAL( spans.size(), 5u );
+    TEST_EQUAL( breakdown.size(), 5u );
+    if (spans.size() != 5) return;
+
+    TEST_EQUAL( breakdown["ConfigureVM"], spans[0].duration );
+    TEST_EQUAL( breakdown["ConfigureVM.exec:modifyvm"], spans[1].duration + spans[2].duration );
+    TEST_EQUAL( breakdown["ConfigureVM.exec:storageattach"], spans[3].duration );
+    TEST_CHECK( breakdown["ConfigureVM.exec:modifyvm"] >= 5 );
+    TEST_CHECK( breakdown["ConfigureVM.exec:modifyvm"] + breakdown["ConfigureVM.exec:storageattach"] <= breakdown["ConfigureVM"] );
+
+    // The open span lasts until the end of the trace
+    TEST_EQUAL( spans[open].duration, breakdown["total"] - spans[open].start );
+    TEST_CHECK( breakdown["StartVM"] >= 2 );
+    TEST_CHECK( breakdown["ConfigureVM"] + breakdown["StartVM"] <= breakdown["total"] );
+}
+
+/**
+ * Nearest-rank percentiles of fixed samples
+ */
+void testStats() {
+    BootProfiler profiler( TEST_TABLE );
+    profiler.reset();
+
+    // The samples 1..20, not in order
+    LocalConfigPtr table = LocalConfig::forRuntime( TEST_TABLE );
+    table->set( "ConfigureVM", "20,3,17,1,9,12,5,14,7,19,2,16,11,4,18,6,13,8,15,10" );
+    table->set( "StartVM", "7" );
+    table->save();
+
+    std::map< std::string, PROFILE_STATS > stats = profiler.getStats();
+    TEST_EQUAL( stats.size(), 2u );
+    PROFILE_STATS st = stats["ConfigureVM"];
+    TEST_EQUAL( st.count, 20 );
+    TEST_EQUAL( st.p50, 10 );
+    TEST_EQUAL( st.p90, 18 );
+    TEST_EQUAL( st.p95, 19 );
+    TEST_EQUAL( st.p99, 20 );
+    TEST_EQUAL( st.max, 20 );
+    st = stats["StartVM"];
+    TEST_EQUAL( st.count, 1 );
+    TEST_EQUAL( st.p50, 7 );
+    TEST_EQUAL( st.p95, 7 );
+
+    profiler.reset();
+    TEST_EQUAL( profiler.getStats().size(), 0u );
+}
+
+/**
+ * Every recorded trace adds a sample per path, keeping only the latest ones
+ */
+void testRecord() {
+    BootProfiler profiler( TEST_TABLE );
+    profiler.reset();
+
+    ProfileTrace trace;
+    trace.begin( "start" );
+    { ProfileScope handler( trace, "StartVM" ); }
+    trace.end();
+
+    for (int i=0; i<BOOT_PROFILER_SAMPLES + 6; i++)
+        profiler.record( trace );
+    std::map< std::string, PROFILE_STATS > stats = profiler.getStats();
+    TEST_EQUAL( stats.size(), 2u );
+    TEST_EQUAL( stats["StartVM"].count, BOOT_PROFILER_SAMPLES );
+    TEST_EQUAL( stats["total"].count, BOOT_PROFILER_SAMPLES );
+    TEST_EQUAL( stats["total"].max, trace.getBreakdown()["total"] );
+
+    // The samples are shared through the disk
+    BootProfiler other( TEST_TABLE );
+    TEST_EQUAL( other.getStats()["StartVM"].count, BOOT_PROFILER_SAMPLES );
+    profiler.reset();
+}
+
+int main() {
+    TEST_RUN( testNesting );
+    TEST_RUN( testBreakdown );
+    TEST_RUN( testStats );
+    TEST_RUN( testRecord );
+    return TEST_RESULT();
+}
@@ -0,0 +1,56 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef TESTS_TESTCOMMON_H
+#define TESTS_TESTCOMMON_H
+
+#include <iostream>
+#include <string>
+
+/**
+ * Minimal assertion helpers shared by the unit tests in this folder.
+ *
+ * Every test is a stand-alone executable that returns non-zero if any
+ * of it's checks failed, which is what ctest expects.
+ */
+
+static int testFailures = 0;
+
+#define TEST_CHECK(expr) \
+    do { if (!(expr)) { \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #expr << std::endl; \
+        testFailures++; \
+    } } while (0)
+
+#define TEST_EQUAL(a, b) \
+    do { if (!((a) == (b))) { \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #a " == " #b \
+                  << " (" << (a) << " != " << (b) << ")" << std::endl; \
+        testFailures++; \
+    } } while (0)
+
+#define TEST_RUN(fn) \
+    do { std::cout << "- " #fn << std::endl; fn(); } while (0)
+
+#define TEST_RESULT() \
+    ((testFailures == 0) ? 0 : (std::cerr << testFailures << " check(s) failed" << std::endl, 1))
+
+#endif /* end of include guard: TESTS_TESTCOMMON_H */
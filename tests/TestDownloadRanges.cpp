@@ -0,0 +1,146 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+#include <boost/make_shared.hpp>
+
+#include <CernVM/Hypervisor.h>
+#include <CernVM/DownloadProvider.h>
+#include <CernVM/Utilities.h>
+#include "HttpTestServer.h"
+#include "TestCommon.h"
+
+/**
+ * Read back a downloaded file
+ */
+std::string readFile( const std::string& file ) {
+    std::ifstream ifs( file.c_str(), std::ios::binary );
+    std::ostringstream oss;
+    oss << ifs.rdbuf();
+    return oss.str();
+}
+
+/**
+ * Return the SHA256 checksum of the served file
+ */
+std::string bodyDigest( const std::string& body ) {
+    std::string hex;
+    TEST_EQUAL( sha256_buffer( body, &hex ), HVE_OK );
+    TEST_EQUAL( hex.length(), 64u );
+    return hex;
+}
+
+/**
+ * Count the GET requests that asked for a range
+ */
+int rangedGets( HttpTestServer& server ) {
+    std::vector< HTTP_TEST_REQUEST > reqs = server.getRequests();
+    int count = 0;
+    for (size_t i=0; i<reqs.size(); i++)
+        if ((reqs[i].method == "GET") && !reqs[i].range.empty()) count++;
+    return count;
+}
+
+/**
+ * A large file is fetched in segments and re-assembled in order
+ */
+void testSegmented() {
+    std::string body = httpTestBody( 4 * DP_SEGMENT_MIN_SIZE + 12345 );
+    HttpTestServer server( body );
+    std::string file = getTmpFile( ".bin" );
+
+    CURLProvider provider;
+    DigestSinkPtr digest = boost::make_shared<DigestSink>();
+    TEST_EQUAL( provider.downloadFile( server.url(), file, VariableTaskPtr(), digest ), HVE_OK );
+    TEST_CHECK( readFile( file ) == body );
+    TEST_EQUAL( rangedGets( server ), DP_SEGMENTS );
+
+    // The ranges that arrived out of order are hashed in order
+    TEST_EQUAL( digest->hex, bodyDigest( body ) );
+
+    remove( file.c_str() );
+}
+
+/**
+ * A single connection hashes the file as it arrives
+ */
+void testSingleConnection() {
+    std::string body = httpTestBody( 4 * DP_SEGMENT_MIN_SIZE + 12345 );
+    HttpTestServer server( body );
+    std::string file = getTmpFile( ".bin" );
+
+    CURLProvider provider;
+    provider.segments = 1;
+    DigestSinkPtr digest = boost::make_shared<DigestSink>();
+    TEST_EQUAL( provider.downloadFile( server.url(), file, VariableTaskPtr(), digest ), HVE_OK );
+    TEST_CHECK( readFile( file ) == body );
+    TEST_EQUAL( rangedGets( server ), 0 );
+    TEST_EQUAL( digest->hex, bodyDigest( body ) );
+
+    remove( file.c_str() );
+}
+
+/**
+ * A server without range support still gets the whole file in one request
+ */
+void testNoRanges() {
+    std::string body = httpTestBody( 4 * DP_SEGMENT_MIN_SIZE + 12345 );
+    HttpTestServer server( body );
+    server.configure( "\"v1\"", false, -1 );
+    std::string file = getTmpFile( ".bin" );
+
+    CURLProvider provider;
+    DigestSinkPtr digest = boost::make_shared<DigestSink>();
+    TEST_EQUAL( provider.downloadFile( server.url(), file, VariableTaskPtr(), digest ), HVE_OK );
+    TEST_CHECK( readFile( file ) == body );
+    TEST_EQUAL( rangedGets( server ), 0 );
+    TEST_EQUAL( digest->hex, bodyDigest( body ) );
+
+    remove( file.c_str() );
+}
+
+/**
+ * Small files are not worth splitting
+ */
+void testSmall() {
+    std::string body = httpTestBody( 100000 );
+    HttpTestServer server( body );
+    std::string file = getTmpFile( ".bin" );
+
+    CURLProvider provider;
+    TEST_EQUAL( provider.downloadFile( server.url(), file ), HVE_OK );
+    TEST_CHECK( readFile( file ) == body );
+    TEST_EQUAL( rangedGets( server ), 0 );
+
+    remove( file.c_str() );
+}
+
+int main() {
+    TEST_RUN( testSegmented );
+    TEST_RUN( testSingleConnection );
+    TEST_RUN( testNoRanges );
+    TEST_RUN( testSmall );
+    return TEST_RESULT();
+}
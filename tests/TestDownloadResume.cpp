@@ -0,0 +1,136 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+#include <boost/make_shared.hpp>
+
+#include <CernVM/Hypervisor.h>
+#include <CernVM/DownloadProvider.h>
+#include <CernVM/Utilities.h>
+#include "HttpTestServer.h"
+#include "TestCommon.h"
+
+/**
+ * Read back a downloaded file
+ */
+std::string readFile( const std::string& file ) {
+    std::ifstream ifs( file.c_str(), std::ios::binary );
+    std::ostringstream oss;
+    oss << ifs.rdbuf();
+    return oss.str();
+}
+
+/**
+ * Return the SHA256 checksum of the served file
+ */
+std::string bodyDigest( const std::string& body ) {
+    std::string hex;
+    TEST_EQUAL( sha256_buffer( body, &hex ), HVE_OK );
+    TEST_EQUAL( hex.length(), 64u );
+    return hex;
+}
+
+/**
+ * Return the last GET request the server received
+ */
+HTTP_TEST_REQUEST lastGet( HttpTestServer& server ) {
+    std::vector< HTTP_TEST_REQUEST > reqs = server.getRequests();
+    HTTP_TEST_REQUEST req;
+    for (size_t i=0; i<reqs.size(); i++)
+        if (reqs[i].method == "GET") req = reqs[i];
+    return req;
+}
+
+/**
+ * Return where the requested range starts, or 0 if there was no range
+ */
+long rangeStart( const HTTP_TEST_REQUEST& req ) {
+    if (req.range.compare( 0, 6, "bytes=" ) != 0) return 0;
+    return atol( req.range.substr( 6 ).c_str() );
+}
+
+/**
+ * An interrupted download continues from where it stopped
+ */
+void testResume() {
+    std::string body = httpTestBody( 300000 );
+    HttpTestServer server( body );
+    std::string file = getTmpFile( ".bin" );
+
+    // Cut the first transfer short, which must keep the partial file
+    server.configure( "\"v1\"", true, 100000 );
+    CURLProvider provider;
+    provider.segments = 1;
+    TEST_CHECK( provider.resumeFile( server.url(), file ) != HVE_OK );
+    TEST_CHECK( file_exists( file + ".part" ) );
+    TEST_CHECK( file_exists( file + ".part.info" ) );
+    TEST_CHECK( !file_exists( file ) );
+
+    // Continue it, asking only for what is missing of the same version.
+    // The checksum covers the part that was downloaded before too.
+    DigestSinkPtr digest = boost::make_shared<DigestSink>();
+    TEST_EQUAL( provider.resumeFile( server.url(), file, VariableTaskPtr(), digest ), HVE_OK );
+    HTTP_TEST_REQUEST req = lastGet( server );
+    TEST_CHECK( rangeStart( req ) > 0 );
+    TEST_CHECK( req.ifRange == "\"v1\"" );
+    TEST_CHECK( readFile( file ) == body );
+    TEST_EQUAL( digest->hex, bodyDigest( body ) );
+    TEST_CHECK( !file_exists( file + ".part" ) );
+    TEST_CHECK( !file_exists( file + ".part.info" ) );
+
+    remove( file.c_str() );
+}
+
+/**
+ * A partial download of a file that changed since is started over
+ */
+void testChanged() {
+    std::string body = httpTestBody( 300000 );
+    HttpTestServer server( body );
+    std::string file = getTmpFile( ".bin" );
+
+    server.configure( "\"v1\"", true, 100000 );
+    CURLProvider provider;
+    provider.segments = 1;
+    TEST_CHECK( provider.resumeFile( server.url(), file ) != HVE_OK );
+    TEST_CHECK( file_exists( file + ".part.info" ) );
+
+    // The server now has a different version
+    server.configure( "\"v2\"", true, -1 );
+    DigestSinkPtr digest = boost::make_shared<DigestSink>();
+    TEST_EQUAL( provider.resumeFile( server.url(), file, VariableTaskPtr(), digest ), HVE_OK );
+    TEST_EQUAL( rangeStart( lastGet( server ) ), 0 );
+    TEST_CHECK( readFile( file ) == body );
+    TEST_EQUAL( digest->hex, bodyDigest( body ) );
+
+    remove( file.c_str() );
+}
+
+int main() {
+    TEST_RUN( testResume );
+    TEST_RUN( testChanged );
+    return TEST_RESULT();
+}
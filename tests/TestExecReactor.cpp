@@ -0,0 +1,215 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+
+#include <CernVM/ExecReactor.h>
+#include <CernVM/ExecScheduler.h>
+#include "TestCommon.h"
+
+/**
+ * Line consumer and retry callback that keep only the lines of the last attempt
+ */
+struct LineSink {
+    LineSink() : lines(), retries(0) { };
+    void line( const std::string& l )   { lines.push_back( l ); };
+    void retry()                        { lines.clear(); retries++; };
+    std::vector<std::string>    lines;
+    int                         retries;
+};
+
+/**
+ * Completion callback counting the completed handles
+ */
+void countDone( boost::atomic<int> * counter, const ExecHandlePtr& ) {
+    (*counter)++;
+}
+
+/**
+ * A command that fails once: onRetry is called before the second attempt,
+ * so the consumer does not see the lines of the first attempt twice
+ */
+void testRetryCallsOnRetry() {
+    std::string flag = "exec-reactor-retry.flag";
+    ::remove( flag.c_str() );
+
+    std::vector<std::string> args;
+    args.push_back( "-c" );
+    args.push_back( "echo attempt; if [ -f " + flag + " ]; then echo second; exit 0; fi; touch " + flag + "; exit 1" );
+
+    LineSink sink;
+    ExecReactor reactor;
+    ExecHandlePtr h = reactor.exec( "/bin/sh", args, SysExecConfig(2, 10000), callbackExecDone(),
+                                    boost::bind( &LineSink::line, &sink, _1 ),
+                                    boost::bind( &LineSink::retry, &sink ) );
+    TEST_EQUAL( h->wait(), 0 );
+    TEST_EQUAL( sink.retries, 1 );
+    TEST_EQUAL( sink.lines.size(), 2u );
+    if (sink.lines.size() == 2) TEST_EQUAL( sink.lines[1], "second" );
+    ::remove( flag.c_str() );
+}
+
+/**
+ * Without a custom consumer, the collected lines are those of the last attempt
+ */
+void testRetryCollectedLines() {
+    std::string flag = "exec-reactor-collect.flag";
+    ::remove( flag.c_str() );
+
+    std::vector<std::string> args;
+    args.push_back( "-c" );
+    args.push_back( "echo attempt; [ -f " + flag + " ] && exit 0; touch " + flag + "; exit 1" );
+
+    ExecReactor reactor;
+    ExecHandlePtr h = reactor.exec( "/bin/sh", args, SysExecConfig(2, 10000) );
+    TEST_EQUAL( h->wait(), 0 );
+    TEST_EQUAL( h->stdoutList.size(), 1u );
+    ::remove( flag.c_str() );
+}
+
+/**
+ * Cancelling a command kills only that one
+ */
+void testCancel() {
+    std::vector<std::string> longArgs, shortArgs;
+    longArgs.push_back( "30" );
+    shortArgs.push_back( "ok" );
+
+    ExecReactor reactor;
+    ExecHandlePtr slow = reactor.exec( "/bin/sleep", longArgs, SysExecConfig(1, 60000) );
+    ExecHandlePtr fast = reactor.exec( "/bin/echo", shortArgs, SysExecConfig() );
+    TEST_EQUAL( fast->wait(), 0 );
+    TEST_CHECK( !slow->isDone() );
+    slow->cancel();
+    TEST_CHECK( slow->waitFor( 5000 ) );
+    TEST_EQUAL( slow->exitCode, 254 );
+}
+
+/**
+ * Destroying the reactor cancels the running commands and fires their
+ * completion callbacks, so the callers can release what they hold
+ */
+void testShutdownFiresDone() {
+    std::vector<std::string> args;
+    args.push_back( "30" );
+    boost::atomic<int> done(0);
+    ExecHandlePtr a, b;
+    {
+        ExecReactor reactor;
+        a = reactor.exec( "/bin/sleep", args, SysExecConfig(1, 60000), boost::bind( &countDone, &done, _1 ) );
+        b = reactor.exec( "/bin/sleep", args, SysExecConfig(1, 60000), boost::bind( &countDone, &done, _1 ) );
+        a->waitFor( 200 );
+    }
+    TEST_CHECK( a->isDone() );
+    TEST_CHECK( b->isDone() );
+    TEST_EQUAL( a->exitCode, 254 );
+    TEST_EQUAL( done.load(), 2 );
+}
+
+/**
+ * cancelAll() completes every active command
+ */
+void testCancelAll() {
+    std::vector<std::string> args;
+    args.push_back( "30" );
+    ExecReactor reactor;
+    ExecHandlePtr a = reactor.exec( "/bin/sleep", args, SysExecConfig(1, 60000) );
+    ExecHandlePtr b = reactor.exec( "/bin/sleep", args, SysExecConfig(1, 60000) );
+    a->waitFor( 200 );
+    reactor.cancelAll();
+    TEST_CHECK( a->waitFor( 5000 ) );
+    TEST_CHECK( b->waitFor( 5000 ) );
+    TEST_EQUAL( b->exitCode, 254 );
+}
+
+/**
+ * A command waiting for a scheduler slot is queued in the reactor: exec() does not
+ * block, cancelling it gives up it's place, and the slot goes to the next one
+ */
+void testSchedulerQueue() {
+    std::vector<std::string> longArgs, shortArgs;
+    longArgs.push_back( "30" );
+    shortArgs.push_back( "ok" );
+
+    ExecScheduler scheduler( 1 );
+    ExecReactor reactor;
+    ExecHandlePtr slow = reactor.exec( "/bin/sleep", longArgs, SysExecConfig(1, 60000), callbackExecDone(),
+                                       callbackLine(), callbackVoid(), &scheduler );
+
+    // These have to wait for the first one, but exec() returns right away
+    long started = getMonotonicMillis();
+    ExecHandlePtr queued = reactor.exec( "/bin/echo", shortArgs, SysExecConfig(), callbackExecDone(),
+                                         callbackLine(), callbackVoid(), &scheduler );
+    ExecHandlePtr next = reactor.exec( "/bin/echo", shortArgs, SysExecConfig(), callbackExecDone(),
+                                       callbackLine(), callbackVoid(), &scheduler );
+    TEST_CHECK( getMonotonicMillis() - started < 1000 );
+    TEST_CHECK( !queued->waitFor( 200 ) );
+    TEST_EQUAL( scheduler.getStats( SYSEXEC_PRIORITY_LIFECYCLE ).queued, 2 );
+
+    // Cancelling the queued command completes it without ever running it
+    queued->cancel();
+    TEST_CHECK( queued->waitFor( 5000 ) );
+    TEST_EQUAL( queued->exitCode, 254 );
+    TEST_EQUAL( scheduler.getStats( SYSEXEC_PRIORITY_LIFECYCLE ).queued, 1 );
+    TEST_EQUAL( scheduler.getRunning(), 1 );
+    TEST_CHECK( !next->isDone() );
+
+    // Once the slot is free, the remaining one runs
+    slow->cancel();
+    TEST_CHECK( slow->waitFor( 5000 ) );
+    TEST_CHECK( next->waitFor( 5000 ) );
+    TEST_EQUAL( next->exitCode, 0 );
+    TEST_EQUAL( scheduler.getRunning(), 0 );
+}
+
+/**
+ * cancelAll() also completes the commands still waiting for a slot
+ */
+void testCancelAllQueued() {
+    std::vector<std::string> args;
+    args.push_back( "30" );
+    ExecScheduler scheduler( 1 );
+    ExecReactor reactor;
+    ExecHandlePtr a = reactor.exec( "/bin/sleep", args, SysExecConfig(1, 60000), callbackExecDone(),
+                                    callbackLine(), callbackVoid(), &scheduler );
+    ExecHandlePtr b = reactor.exec( "/bin/sleep", args, SysExecConfig(1, 60000), callbackExecDone(),
+                                    callbackLine(), callbackVoid(), &scheduler );
+    a->waitFor( 200 );
+    reactor.cancelAll();
+    TEST_CHECK( a->waitFor( 5000 ) );
+    TEST_CHECK( b->waitFor( 5000 ) );
+    TEST_EQUAL( b->exitCode, 254 );
+    TEST_EQUAL( scheduler.getRunning(), 0 );
+}
+
+int main() {
+    TEST_RUN( testRetryCallsOnRetry );
+    TEST_RUN( testRetryCollectedLines );
+    TEST_RUN( testCancel );
+    TEST_RUN( testShutdownFiresDone );
+    TEST_RUN( testCancelAll );
+    TEST_RUN( testSchedulerQueue );
+    TEST_RUN( testCancelAllQueued );
+    return TEST_RESULT();
+}
@@ -0,0 +1,164 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <CernVM/ExecScheduler.h>
+#include "TestCommon.h"
+
+/**
+ * Records the order in which the queued commands are granted a slot
+ */
+struct GrantLog {
+    GrantLog() : order(), mutex() { };
+    void granted( const std::string& name ) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        order.push_back( name );
+    };
+    std::vector<std::string>    order;
+    boost::mutex                mutex;
+};
+
+/**
+ * Queue a command, returning it's ticket
+ */
+unsigned long enqueue( ExecScheduler& scheduler, GrantLog& log, int priority, const std::string& owner, const std::string& name ) {
+    unsigned long ticket = 0;
+    TEST_CHECK( !scheduler.acquireAsync( priority, owner, boost::bind( &GrantLog::granted, &log, name ), &ticket ) );
+    return ticket;
+}
+
+/**
+ * Free the slots one by one, so the queued commands are granted in order
+ */
+void drain( ExecScheduler& scheduler, GrantLog& log, size_t count ) {
+    for (size_t i=0; i<count; i++) {
+        scheduler.release();
+        TEST_EQUAL( log.order.size(), i + 1 );
+    }
+}
+
+/**
+ * The high-priority command goes first, then the owners take turns
+ */
+void testPriorityAndFairness() {
+    ExecScheduler scheduler( 2 );
+    GrantLog log;
+
+    // Fill the slots
+    scheduler.acquire( SYSEXEC_PRIORITY_LIFECYCLE, "busy" );
+    scheduler.acquire( SYSEXEC_PRIORITY_LIFECYCLE, "busy" );
+
+    // A backlog of one owner, then one command of another and one urgent
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "a", "a1" );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "a", "a2" );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "a", "a3" );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "b", "b1" );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_INTERACTIVE, "c", "c1" );
+    TEST_EQUAL( scheduler.getStats( SYSEXEC_PRIORITY_LIFECYCLE ).queued, 4 );
+    TEST_EQUAL( scheduler.getStats( SYSEXEC_PRIORITY_INTERACTIVE ).queued, 1 );
+    TEST_EQUAL( log.order.size(), 0u );
+
+    drain( scheduler, log, 5 );
+    const char * expected[] = { "c1", "a1", "b1", "a2", "a3" };
+    for (size_t i=0; (i<5) && (i<log.order.size()); i++)
+        TEST_EQUAL( log.order[i], std::string(expected[i]) );
+
+    TEST_EQUAL( scheduler.getRunning(), 2 );
+    TEST_EQUAL( scheduler.getStats( SYSEXEC_PRIORITY_LIFECYCLE ).queued, 0 );
+    TEST_EQUAL( scheduler.getStats( SYSEXEC_PRIORITY_LIFECYCLE ).maxQueued, 4 );
+}
+
+/**
+ * Polling never overtakes the lifecycle commands
+ */
+void testPriorityClasses() {
+    ExecScheduler scheduler( 1 );
+    GrantLog log;
+    scheduler.acquire( SYSEXEC_PRIORITY_LIFECYCLE, "busy" );
+
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_POLLING, "a", "poll" );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "a", "life" );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_INTERACTIVE, "b", "user" );
+
+    drain( scheduler, log, 3 );
+    if (log.order.size() == 3) {
+        TEST_EQUAL( log.order[0], "user" );
+        TEST_EQUAL( log.order[1], "life" );
+        TEST_EQUAL( log.order[2], "poll" );
+    }
+}
+
+/**
+ * A cancelled command gives up it's place without being granted
+ */
+void testCancel() {
+    ExecScheduler scheduler( 1 );
+    GrantLog log;
+    scheduler.acquire( SYSEXEC_PRIORITY_LIFECYCLE, "busy" );
+
+    unsigned long first = enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "a", "a1" );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "a", "a2" );
+    TEST_CHECK( scheduler.cancelAsync( first ) );
+    TEST_CHECK( !scheduler.cancelAsync( first ) );
+
+    drain( scheduler, log, 1 );
+    if (!log.order.empty()) TEST_EQUAL( log.order[0], "a2" );
+    TEST_EQUAL( scheduler.getStats( SYSEXEC_PRIORITY_LIFECYCLE ).queued, 0 );
+}
+
+/**
+ * Blocking waiters share the same queues
+ */
+void blockingWaiter( ExecScheduler * scheduler, GrantLog * log, const std::string& owner ) {
+    scheduler->acquire( SYSEXEC_PRIORITY_LIFECYCLE, owner );
+    log->granted( owner );
+}
+void testBlocking() {
+    ExecScheduler scheduler( 1 );
+    GrantLog log;
+    scheduler.acquire( SYSEXEC_PRIORITY_LIFECYCLE, "busy" );
+
+    boost::thread waiter( boost::bind( &blockingWaiter, &scheduler, &log, "blocked" ) );
+    for (int i=0; (i<100) && (scheduler.getStats( SYSEXEC_PRIORITY_LIFECYCLE ).queued == 0); i++)
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 10 ) );
+    enqueue( scheduler, log, SYSEXEC_PRIORITY_LIFECYCLE, "async", "async" );
+
+    scheduler.release();
+    waiter.join();
+    TEST_EQUAL( log.order.size(), 1u );
+    if (!log.order.empty()) TEST_EQUAL( log.order[0], "blocked" );
+    scheduler.release();
+    TEST_EQUAL( log.order.size(), 2u );
+    TEST_EQUAL( scheduler.getRunning(), 1 );
+}
+
+int main() {
+    TEST_RUN( testPriorityAndFairness );
+    TEST_RUN( testPriorityClasses );
+    TEST_RUN( testCancel );
+    TEST_RUN( testBlocking );
+    return TEST_RESULT();
+}
@@ -0,0 +1,182 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <CernVM/FSMExecutor.h>
+#include "FSMTestMachine.h"
+#include "TestCommon.h"
+
+// The number of FSMs sharing the executor in testStrands
+#define TEST_MACHINES       12
+
+/**
+ * Occupy a worker until the gate opens
+ */
+void blockWorker( TestGate * gate, TestGate * busy ) {
+    busy->open();
+    gate->wait();
+}
+
+/**
+ * Many FSMs on a few workers: the steps of every FSM run in order and never
+ * in parallel with each other
+ */
+void testStrands() {
+    FSMExecutorPtr executor = boost::make_shared<FSMExecutor>( 3 );
+    std::vector< boost::shared_ptr<FSMTestMachine> > machines;
+    for (int i=0; i<TEST_MACHINES; i++) {
+        boost::shared_ptr<FSMTestMachine> fsm = boost::make_shared<FSMTestMachine>();
+        fsm->FSMUseExecutor( executor );
+        TEST_CHECK( fsm->FSMThreadStart() == NULL );
+        machines.push_back( fsm );
+    }
+    for (int i=0; i<TEST_MACHINES; i++)
+        machines[i]->FSMGoto( 5 );
+
+    for (int i=0; i<TEST_MACHINES; i++) {
+        FSMTestMachine * fsm = machines[i].get();
+        TEST_CHECK( fsm->waitInactive() );
+        std::vector<std::string> log = fsm->getLog();
+        TEST_EQUAL( log.size(), 3u );
+        if (log.size() == 3) {
+            TEST_EQUAL( log[0], "work" );
+            TEST_EQUAL( log[1], "join" );
+            TEST_EQUAL( log[2], "check" );
+        }
+        TEST_EQUAL( fsm->overlaps, 0 );
+        TEST_CHECK( fsm->joined );
+        fsm->FSMThreadStop();
+    }
+}
+
+/**
+ * FSMWaitInactive returns when the executor completes the path
+ */
+void testWaitInactive() {
+    FSMExecutorPtr executor = boost::make_shared<FSMExecutor>( 2 );
+    FSMTestMachine fsm( TEST_BRANCH_OK, false );
+    fsm.FSMUseExecutor( executor );
+    fsm.FSMThreadStart();
+    fsm.FSMGoto( 5 );
+
+    // Still waiting for the branch
+    TEST_CHECK( fsm.started.wait() );
+    TEST_CHECK( !fsm.waitInactive( 100 ) );
+    TEST_CHECK( fsm.FSMActive() );
+
+    fsm.gate.open();
+    TEST_CHECK( fsm.waitInactive() );
+    TEST_EQUAL( fsm.getLog().size(), 3u );
+    fsm.FSMThreadStop();
+}
+
+/**
+ * Stopping an FSM whose step is still queued discards the step
+ */
+void stopFSM( FSMTestMachine * fsm ) {
+    fsm->FSMThreadStop();
+}
+void testStopQueued() {
+    FSMExecutorPtr executor = boost::make_shared<FSMExecutor>( 1 );
+    TestGate gate, busy;
+    executor->post( boost::bind( &blockWorker, &gate, &busy ) );
+    TEST_CHECK( busy.wait() );
+
+    FSMTestMachine fsm;
+    fsm.FSMUseExecutor( executor );
+    fsm.FSMThreadStart();
+    fsm.FSMGoto( 5 );
+    TEST_EQUAL( executor->getQueued(), 1 );
+
+    // The stop waits for the queued step to be discarded
+    boost::thread stopper( boost::bind( &stopFSM, &fsm ) );
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+    gate.open();
+    TEST_CHECK( stopper.try_join_for( boost::chrono::seconds( 5 ) ) );
+
+    TEST_EQUAL( fsm.getLog().size(), 0u );
+    TEST_EQUAL( fsm.downloads, 0 );
+    TEST_EQUAL( executor->getQueued(), 0 );
+}
+
+/**
+ * An FSM waiting for it's branch does not hold the only worker
+ */
+void testJoinDoesNotBlock() {
+    FSMExecutorPtr executor = boost::make_shared<FSMExecutor>( 1 );
+    FSMTestMachine slow( TEST_BRANCH_OK, false ), fast;
+    slow.FSMUseExecutor( executor );
+    fast.FSMUseExecutor( executor );
+    slow.FSMThreadStart();
+    fast.FSMThreadStart();
+
+    slow.FSMGoto( 5 );
+    TEST_CHECK( slow.started.wait() );
+    fast.FSMGoto( 5 );
+    TEST_CHECK( fast.waitInactive() );
+    TEST_EQUAL( fast.getLog().size(), 3u );
+    TEST_EQUAL( slow.getLog().size(), 1u );
+
+    // The join completes when the branch does
+    slow.gate.open();
+    TEST_CHECK( slow.waitInactive() );
+    std::vector<std::string> log = slow.getLog();
+    TEST_EQUAL( log.size(), 3u );
+    if (log.size() == 3) TEST_EQUAL( log[1], "join" );
+    TEST_CHECK( slow.joined );
+    TEST_EQUAL( slow.downloads, 1 );
+
+    slow.FSMThreadStop();
+    fast.FSMThreadStop();
+}
+
+/**
+ * Stopping an FSM that waits for it's branch interrupts the branch
+ */
+void testStopWhileJoining() {
+    FSMExecutorPtr executor = boost::make_shared<FSMExecutor>( 1 );
+    FSMTestMachine fsm( TEST_BRANCH_OK, false );
+    fsm.FSMUseExecutor( executor );
+    fsm.FSMThreadStart();
+    fsm.FSMGoto( 5 );
+    TEST_CHECK( fsm.started.wait() );
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+
+    fsm.FSMThreadStop();
+    TEST_EQUAL( fsm.interrupted, 1 );
+    std::vector<std::string> log = fsm.getLog();
+    TEST_EQUAL( log.size(), 1u );
+}
+
+int main() {
+    TEST_RUN( testStrands );
+    TEST_RUN( testWaitInactive );
+    TEST_RUN( testStopQueued );
+    TEST_RUN( testJoinDoesNotBlock );
+    TEST_RUN( testStopWhileJoining );
+    return TEST_RESULT();
+}
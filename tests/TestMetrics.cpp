@@ -0,0 +1,151 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <CernVM/Metrics.h>
+#include "TestCommon.h"
+
+// The number of threads updating the counter in testThreads
+#define TEST_THREADS    4
+
+/**
+ * Return the lines of the given family from the Prometheus text
+ */
+std::string family( const std::string& name ) {
+    std::string text = Metrics::Default().toPrometheus();
+    size_t begin = text.find( "# HELP " + name + " " );
+    if (begin == std::string::npos) return "";
+    size_t end = text.find( "# HELP ", begin + 1 );
+    return text.substr( begin, (end == std::string::npos) ? std::string::npos : end - begin );
+}
+
+/**
+ * Increment the counter, optionally staying alive until the gate is released
+ */
+void addMany( int id, int count, boost::mutex * gate ) {
+    for (int i=0; i<count; i++)
+        Metrics::Default().add( id );
+    if (gate != NULL) boost::unique_lock<boost::mutex> lock(*gate);
+}
+
+/**
+ * The totals include the live threads and the ones that exited
+ */
+void testThreads() {
+    Metrics& m = Metrics::Default();
+    int id = m.counter( "test_threads_total", "Updates from many threads" );
+    TEST_CHECK( id >= 0 );
+
+    // One thread stays alive
+    boost::mutex gate;
+    boost::unique_lock<boost::mutex> hold(gate);
+    boost::thread live( boost::bind( &addMany, id, 7, &gate ) );
+
+    // The others exit, so their values are retired
+    std::vector< boost::thread* > threads;
+    for (int i=0; i<TEST_THREADS; i++)
+        threads.push_back( new boost::thread( boost::bind( &addMany, id, 1000, (boost::mutex*)NULL ) ) );
+    for (int i=0; i<TEST_THREADS; i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    m.add( id, 5 );
+
+    // Wait for the live thread to complete it's updates
+    for (int i=0; (i<100) && (m.value( id ) != TEST_THREADS * 1000 + 12); i++)
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 10 ) );
+    TEST_EQUAL( m.value( id ), TEST_THREADS * 1000 + 12ULL );
+
+    // Nothing is lost when it exits too
+    hold.unlock();
+    live.join();
+    TEST_EQUAL( m.value( id ), TEST_THREADS * 1000 + 12ULL );
+    TEST_EQUAL( family( "test_threads_total" ),
+        "# HELP test_threads_total Updates from many threads\n"
+        "# TYPE test_threads_total counter\n"
+        "test_threads_total 4012\n" );
+}
+
+/**
+ * The same name and labels return the same series, and a name has a single type
+ */
+void testRegistry() {
+    Metrics& m = Metrics::Default();
+    int get = m.counter( "test_requests_total", "Requests by verb", Metrics::label( "verb", "get" ) );
+    int put = m.counter( "test_requests_total", "Ignored", Metrics::label( "verb", "put" ) );
+    TEST_CHECK( (get >= 0) && (put >= 0) && (get != put) );
+    TEST_EQUAL( m.counter( "test_requests_total", "", Metrics::label( "verb", "get" ) ), get );
+    TEST_EQUAL( m.histogram( "test_requests_total", "", Metrics::label( "verb", "get" ) ), -1 );
+    TEST_EQUAL( m.histogram( "test_requests_total", "", Metrics::label( "verb", "post" ) ), -1 );
+
+    m.add( get, 3 );
+    m.add( put );
+    m.add( -1 );
+    TEST_EQUAL( family( "test_requests_total" ),
+        "# HELP test_requests_total Requests by verb\n"
+        "# TYPE test_requests_total counter\n"
+        "test_requests_total{verb=\"get\"} 3\n"
+        "test_requests_total{verb=\"put\"} 1\n" );
+
+    // Escaping of the label values
+    TEST_EQUAL( Metrics::label( "path", "a\"b\\c\nd" ), "path=\"a\\\"b\\\\c\\nd\"" );
+}
+
+/**
+ * The buckets are cumulative and inclusive of their upper bound
+ */
+void testHistogram() {
+    Metrics& m = Metrics::Default();
+    int id = m.histogram( "test_latency_seconds", "Latency of the test", Metrics::label( "verb", "x" ) );
+    TEST_CHECK( id >= 0 );
+    m.observe( id, 0.002 );
+    m.observe( id, 0.004 );
+    m.observe( id, 1.5 );
+    m.observe( id, 3 );
+    m.observe( id, 6000 );
+    m.observe( id, -1 );
+    TEST_EQUAL( m.value( id ), 6u );
+
+    const char * bounds[] = { "0.001", "0.002", "0.005", "0.01", "0.02", "0.05", "0.1", "0.2", "0.5",
+                              "1", "2", "5", "10", "20", "50", "100", "200", "500", "1000", "2000", "5000", "+Inf" };
+    const int counts[] =    { 1, 2, 3, 3, 3, 3, 3, 3, 3,
+                              3, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6 };
+    std::ostringstream expected;
+    expected << "# HELP test_latency_seconds Latency of the test\n";
+    expected << "# TYPE test_latency_seconds histogram\n";
+    for (int i=0; i<METRICS_BUCKETS+1; i++)
+        expected << "test_latency_seconds_bucket{verb=\"x\",le=\"" << bounds[i] << "\"} " << counts[i] << "\n";
+    expected << "test_latency_seconds_sum{verb=\"x\"} 6004.51\n";
+    expected << "test_latency_seconds_count{verb=\"x\"} 6\n";
+    TEST_EQUAL( family( "test_latency_seconds" ), expected.str() );
+}
+
+int main() {
+    TEST_RUN( testThreads );
+    TEST_RUN( testRegistry );
+    TEST_RUN( testHistogram );
+    return TEST_RESULT();
+}
@@ -0,0 +1,177 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+#include <sstream>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include <CernVM/PortAllocator.h>
+#include <CernVM/LocalConfig.h>
+#include <CernVM/Utilities.h>
+#include "TestCommon.h"
+
+/**
+ * Reserve a port for every owner in the range on the given allocator
+ */
+void reserveMany( PortAllocator * alloc, const std::string& prefix, int count, std::vector<int> * ports ) {
+    for (int i=0; i<count; i++) {
+        std::ostringstream oss; oss << prefix << i;
+        ports->push_back( alloc->reserve( oss.str(), "rdp" ) );
+    }
+}
+
+/**
+ * Two allocators on the same table never hand out the same port,
+ * and each one sees the reservations of the other.
+ */
+void testSharedTable() {
+    PortAllocator a, b;
+    std::vector<int> portsA, portsB;
+
+    // Reserve concurrently from both allocators
+    boost::thread tA( boost::bind( &reserveMany, &a, "a-", 32, &portsA ) );
+    boost::thread tB( boost::bind( &reserveMany, &b, "b-", 32, &portsB ) );
+    tA.join();
+    tB.join();
+
+    std::set<int> all;
+    for (size_t i=0; i<portsA.size(); i++) {
+        TEST_CHECK( portsA[i] != 0 );
+        all.insert( portsA[i] );
+    }
+    for (size_t i=0; i<portsB.size(); i++) {
+        TEST_CHECK( portsB[i] != 0 );
+        all.insert( portsB[i] );
+    }
+    TEST_EQUAL( all.size(), (size_t) 64 );
+
+    // Every reservation survived the other allocator's saves
+    TEST_EQUAL( b.reserved("a-0", "rdp"), portsA[0] );
+    TEST_EQUAL( a.reserved("b-31", "rdp"), portsB[31] );
+    TEST_EQUAL( a.reserve("b-5", "rdp"), portsB[5] );
+
+    // Releasing from one allocator is seen by the other
+    a.release( "b-5" );
+    TEST_EQUAL( b.reserved("b-5", "rdp"), 0 );
+    TEST_EQUAL( b.reserved("b-6", "rdp"), portsB[6] );
+}
+
+/**
+ * A port reserved by somebody else cannot be claimed
+ */
+void testClaim() {
+    PortAllocator a, b;
+    int port = a.reserve( "owner-1", "api" );
+    TEST_CHECK( port != 0 );
+    TEST_CHECK( !b.claim( "owner-2", "api", port ) );
+    TEST_EQUAL( a.reserved("owner-1", "api"), port );
+    TEST_EQUAL( a.reserved("owner-2", "api"), 0 );
+
+    // Claiming a free port moves the reservation of the same purpose
+    TEST_CHECK( b.claim( "owner-1", "api", 1 ) );
+    TEST_EQUAL( a.reserved("owner-1", "api"), 1 );
+    TEST_CHECK( b.claim( "owner-2", "api", port ) );
+    TEST_EQUAL( a.reserved("owner-2", "api"), port );
+}
+
+/**
+ * Two processes reserving at the same time do not lose each other's reservations
+ */
+void testTwoProcesses() {
+    const int count = 48;
+    pid_t child = fork();
+    if (child == 0) {
+        PortAllocator alloc;
+        std::vector<int> ports;
+        reserveMany( &alloc, "child-", count, &ports );
+        _exit( 0 );
+    }
+    TEST_CHECK( child > 0 );
+
+    PortAllocator alloc;
+    std::vector<int> ports;
+    reserveMany( &alloc, "parent-", count, &ports );
+    int status = -1;
+    waitpid( child, &status, 0 );
+    TEST_EQUAL( status, 0 );
+
+    // Everything is in the table, on different ports
+    PortAllocator check;
+    std::set<int> all;
+    for (int i=0; i<count; i++) {
+        std::ostringstream pss; pss << "parent-" << i;
+        std::ostringstream css; css << "child-" << i;
+        int parentPort = check.reserved( pss.str(), "rdp" );
+        int childPort = check.reserved( css.str(), "rdp" );
+        TEST_CHECK( parentPort != 0 );
+        TEST_CHECK( childPort != 0 );
+        all.insert( parentPort );
+        all.insert( childPort );
+    }
+    TEST_EQUAL( all.size(), (size_t) (2 * count) );
+}
+
+/**
+ * Merging local changes keeps the keys that others have removed removed
+ */
+void testConfigMerge() {
+    LocalConfigPtr a = LocalConfig::forRuntime( "merge-test" );
+    a->set( "kept", "1" );
+    a->set( "released", "2" );
+
+    LocalConfigPtr b = LocalConfig::forRuntime( "merge-test" );
+    TEST_EQUAL( b->get("released"), "2" );
+
+    // 'a' releases a key while 'b' has an unsaved change of it's own
+    a->erase( "released" );
+    a->save();
+    b->lock();
+    b->set( "added", "3" );
+    b->sync();
+
+    TEST_CHECK( !b->contains("released") );
+    TEST_EQUAL( b->get("kept"), "1" );
+    TEST_EQUAL( b->get("added"), "3" );
+
+    LocalConfigPtr c = LocalConfig::forRuntime( "merge-test" );
+    TEST_CHECK( !c->contains("released") );
+    TEST_EQUAL( c->get("added"), "3" );
+    c->clearAll();
+}
+
+int main() {
+    char tpl[] = "/tmp/portallocXXXXXX";
+    char * dir = mkdtemp( tpl );
+    if (dir == NULL) return 2;
+    setAppDataBasePath( dir );
+
+    TEST_RUN( testSharedTable );
+    TEST_RUN( testClaim );
+    TEST_RUN( testTwoProcesses );
+    TEST_RUN( testConfigMerge );
+    return TEST_RESULT();
+}
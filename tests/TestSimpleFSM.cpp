@@ -0,0 +1,136 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "FSMTestMachine.h"
+#include "TestCommon.h"
+
+/**
+ * The join waits for the branch and the FSM continues after it
+ */
+void testJoin() {
+    FSMTestMachine fsm( TEST_BRANCH_OK, false );
+    fsm.FSMThreadStart();
+    fsm.FSMGoto( 5 );
+
+    // The work overlaps the download
+    TEST_CHECK( fsm.started.wait() );
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+    std::vector<std::string> log = fsm.getLog();
+    TEST_EQUAL( log.size(), 1u );
+    if (!log.empty()) TEST_EQUAL( log[0], "work" );
+
+    fsm.gate.open();
+    TEST_CHECK( fsm.waitInactive() );
+    log = fsm.getLog();
+    TEST_EQUAL( log.size(), 3u );
+    if (log.size() == 3) {
+        TEST_EQUAL( log[1], "join" );
+        TEST_EQUAL( log[2], "check" );
+    }
+    TEST_CHECK( fsm.joined );
+    TEST_EQUAL( fsm.downloads, 1 );
+    fsm.FSMThreadStop();
+}
+
+/**
+ * The failure of the branch is raised by the join
+ */
+void testJoinFailure( int mode, const std::string & message, int code ) {
+    FSMTestMachine fsm( mode );
+    fsm.FSMThreadStart();
+    fsm.FSMGoto( 5 );
+    TEST_CHECK( fsm.waitInactive() );
+    TEST_CHECK( !fsm.joined );
+    TEST_EQUAL( fsm.joinMessage, message );
+    TEST_EQUAL( fsm.joinCode, code );
+    fsm.FSMThreadStop();
+}
+void testBranchFail() {
+    testJoinFailure( TEST_BRANCH_FAIL, "Disk full", -6 );
+}
+void testBranchThrow() {
+    testJoinFailure( TEST_BRANCH_THROW, "Checksum mismatch", -1 );
+}
+
+/**
+ * Stopping the FSM interrupts the running branch, and a pending join
+ * fails with an empty message, so the caller can name the abort
+ */
+void joinFrom( FSMTestMachine * fsm, bool * ok, std::string * message, int * code ) {
+    *ok = fsm->join( message, code );
+}
+void testStop() {
+    FSMTestMachine fsm( TEST_BRANCH_OK, false );
+    fsm.FSMThreadStart();
+
+    // Fork only, so the join is ours
+    fsm.FSMGoto( 2 );
+    TEST_CHECK( fsm.started.wait() );
+
+    bool ok = true;
+    std::string message = "untouched";
+    int code = 0;
+    boost::thread joiner( boost::bind( &joinFrom, &fsm, &ok, &message, &code ) );
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+
+    fsm.FSMThreadStop();
+    TEST_CHECK( joiner.try_join_for( boost::chrono::seconds( 5 ) ) );
+    TEST_EQUAL( fsm.interrupted, 1 );
+    TEST_CHECK( !ok );
+    TEST_EQUAL( message, "" );
+    TEST_EQUAL( code, -1 );
+
+    // Nothing left to join
+    TEST_CHECK( fsm.join( NULL, NULL ) );
+}
+
+/**
+ * A joined branch is started again the next time the fork node is reached
+ */
+void testRefork() {
+    FSMTestMachine fsm;
+    fsm.FSMThreadStart();
+    fsm.FSMGoto( 5 );
+    TEST_CHECK( fsm.waitInactive() );
+    TEST_CHECK( fsm.joined );
+
+    fsm.FSMGoto( 1 );
+    TEST_CHECK( fsm.waitInactive() );
+    fsm.FSMGoto( 5 );
+    TEST_CHECK( fsm.waitInactive() );
+    TEST_CHECK( fsm.joined );
+    TEST_EQUAL( fsm.downloads, 2 );
+    TEST_EQUAL( fsm.getLog().size(), 6u );
+    fsm.FSMThreadStop();
+}
+
+int main() {
+    TEST_RUN( testJoin );
+    TEST_RUN( testBranchFail );
+    TEST_RUN( testBranchThrow );
+    TEST_RUN( testStop );
+    TEST_RUN( testRefork );
+    return TEST_RESULT();
+}
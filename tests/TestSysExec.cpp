@@ -0,0 +1,106 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <CernVM/Utilities.h>
+#include "TestCommon.h"
+
+/**
+ * The STDOUT lines reach the caller in order, including a last line without a newline
+ */
+void testOutputLines() {
+    std::vector<std::string> args, lines;
+    std::string errors;
+    args.push_back( "-c" );
+    args.push_back( "echo first; echo second; printf third" );
+    TEST_EQUAL( sysExec( "/bin/sh", args, &lines, &errors, SysExecConfig() ), 0 );
+    TEST_EQUAL( lines.size(), 3u );
+    if (lines.size() == 3) {
+        TEST_EQUAL( lines[0], "first" );
+        TEST_EQUAL( lines[1], "second" );
+        TEST_EQUAL( lines[2], "third" );
+    }
+}
+
+/**
+ * The arguments are passed as-is, without any shell splitting
+ */
+void testArgumentVector() {
+    std::vector<std::string> args, lines;
+    std::string errors;
+    args.push_back( "two words" );
+    args.push_back( "\"quoted\"" );
+    TEST_EQUAL( sysExec( "/bin/echo", args, &lines, &errors, SysExecConfig() ), 0 );
+    TEST_EQUAL( lines.size(), 1u );
+    if (!lines.empty()) TEST_EQUAL( lines[0], "two words \"quoted\"" );
+}
+
+/**
+ * A failing command returns it's exit status, and the STDERR text is collected
+ */
+void testExitCodeAndStderr() {
+    std::vector<std::string> args, lines;
+    std::string errors;
+    args.push_back( "-c" );
+    args.push_back( "echo oops >&2; exit 3" );
+    int ret = sysExec( "/bin/sh", args, &lines, &errors, SysExecConfig() );
+    TEST_CHECK( WIFEXITED(ret) );
+    TEST_EQUAL( WEXITSTATUS(ret), 3 );
+}
+
+/**
+ * A command that outlives it's timeout is killed and reported with 255
+ */
+void testTimeout() {
+    std::vector<std::string> args, lines;
+    std::string errors;
+    args.push_back( "10" );
+    long started = getMonotonicMillis();
+    TEST_EQUAL( sysExec( "/bin/sleep", args, &lines, &errors, SysExecConfig(1, 300) ), 255 );
+    TEST_CHECK( getMonotonicMillis() - started < 5000 );
+}
+
+#ifdef __linux__
+/**
+ * A background grandchild holding the pipes open does not delay the return
+ */
+void testGrandchildKeepsPipes() {
+    std::vector<std::string> args, lines;
+    std::string errors;
+    args.push_back( "-c" );
+    args.push_back( "sleep 5 & echo done" );
+    long started = getMonotonicMillis();
+    TEST_EQUAL( sysExec( "/bin/sh", args, &lines, &errors, SysExecConfig(1, 10000) ), 0 );
+    TEST_CHECK( getMonotonicMillis() - started < 4000 );
+}
+#endif
+
+int main() {
+    TEST_RUN( testOutputLines );
+    TEST_RUN( testArgumentVector );
+    TEST_RUN( testExitCodeAndStderr );
+    TEST_RUN( testTimeout );
+#ifdef __linux__
+    TEST_RUN( testGrandchildKeepsPipes );
+#endif
+    return TEST_RESULT();
+}
@@ -0,0 +1,146 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <json/json.h>
+
+#include <CernVM/TraceEvent.h>
+#include "TestCommon.h"
+
+// The trace file, in the working directory of the test
+#define TEST_TRACE      "TestTraceEvent.json"
+
+/**
+ * Read the whole trace file
+ */
+std::string readTrace() {
+    std::ifstream in( TEST_TRACE );
+    std::ostringstream oss;
+    oss << in.rdbuf();
+    return oss.str();
+}
+
+/**
+ * Record a span that lasts a few milliseconds
+ */
+void span( const std::string& name, int ms ) {
+    TraceSpan s( "test" );
+    s.begin( name );
+    s.arg( "ms", ms );
+    boost::this_thread::sleep( boost::posix_time::milliseconds( ms ) );
+}
+
+/**
+ * Two spans on a thread that exits before the process does
+ */
+void worker() {
+    span( "worker-1", 2 );
+    span( "worker-2", 2 );
+}
+
+/**
+ * Write the trace in a child process, which completes the file when it exits
+ */
+void writeTrace() {
+    setenv( TRACE_FILE_ENV, TEST_TRACE, 1 );
+    TEST_CHECK( traceEnabled() );
+
+    // The events are buffered until they are flushed
+    span( "configure \"vm\"", 5 );
+    TEST_CHECK( readTrace().find( "configure" ) == std::string::npos );
+    traceFlush();
+    TEST_CHECK( readTrace().find( "configure" ) != std::string::npos );
+
+    // The buffer of a thread is written when it exits
+    boost::thread t( &worker );
+    t.join();
+    TEST_CHECK( readTrace().find( "worker-2" ) != std::string::npos );
+
+    // The last one is written at shutdown
+    span( "shutdown", 1 );
+}
+
+/**
+ * The spans make a well-formed Chrome trace
+ */
+void testChromeTrace() {
+    remove( TEST_TRACE );
+    pid_t child = fork();
+    if (child == 0) {
+        writeTrace();
+        exit( TEST_RESULT() );
+    }
+    int status = 0;
+    waitpid( child, &status, 0 );
+    TEST_CHECK( WIFEXITED(status) && (WEXITSTATUS(status) == 0) );
+
+    Json::Value root;
+    Json::Reader reader;
+    TEST_CHECK( reader.parse( readTrace(), root ) );
+    TEST_CHECK( root.isArray() );
+    if (!root.isArray()) return;
+    TEST_EQUAL( root.size(), 5u );
+
+    int mainTid = 0, workerTid = 0, complete = 0;
+    for (Json::ArrayIndex i=0; i<root.size(); i++) {
+        const Json::Value& ev = root[i];
+        TEST_CHECK( ev.isObject() );
+        TEST_EQUAL( ev["pid"].asInt(), (int)child );
+        if (ev["ph"].asString() == "M") {
+            TEST_EQUAL( ev["name"].asString(), "process_name" );
+            continue;
+        }
+
+        // A complete event
+        complete++;
+        TEST_EQUAL( ev["ph"].asString(), "X" );
+        TEST_EQUAL( ev["cat"].asString(), "test" );
+        TEST_CHECK( ev["ts"].isIntegral() && (ev["ts"].asUInt64() > 0) );
+        TEST_CHECK( ev["dur"].isIntegral() );
+        TEST_CHECK( ev["dur"].asUInt64() >= (Json::UInt64)atoi( ev["args"]["ms"].asString().c_str() ) * 1000 );
+        TEST_CHECK( ev["tid"].isIntegral() && (ev["tid"].asInt() > 0) );
+        std::string name = ev["name"].asString();
+        if (name.compare( 0, 6, "worker" ) == 0) {
+            workerTid = ev["tid"].asInt();
+        } else {
+            if (mainTid != 0) TEST_EQUAL( ev["tid"].asInt(), mainTid );
+            mainTid = ev["tid"].asInt();
+        }
+    }
+    TEST_EQUAL( complete, 4 );
+    TEST_EQUAL( root[0]["name"].asString(), "configure \"vm\"" );
+    TEST_CHECK( (mainTid != 0) && (workerTid != 0) && (mainTid != workerTid) );
+    remove( TEST_TRACE );
+}
+
+int main() {
+    TEST_RUN( testChromeTrace );
+    return TEST_RESULT();
+}
@@ -0,0 +1,141 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <CernVM/ParameterMap.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxConfigPlan.h>
+#include "TestCommon.h"
+#include "VBoxSamples.h"
+
+#define SAMPLE_VM   "5e7a8c1e-9d5b-4bfa-a0d6-2b5b1d4e8a3c"
+
+/**
+ * The configuration of the VM in the sample, as the session would ask for it
+ */
+VBoxMachineSpec sampleSpec() {
+    VBoxMachineSpec spec;
+    spec.set("cpus",                2)
+        .set("memory",              2048)
+        .set("vram",                32)
+        .set("acpi",                "on")
+        .set("ioapic",              "on")
+        .set("boot1",               "dvd")
+        .set("nic1",                "nat")
+        .set("nictype1",            "virtio")
+        .set("nic2",                "hostonly")
+        .set("hostonlyadapter2",    "vboxnet0")
+        .set("nictype2",            "82540EM");
+    spec.natRule("guestapi", "guestapi,tcp,127.0.0.1,41522,,80");
+    spec.sharedFolder("data", "/home/user/data");
+    spec.extra("VBoxInternal2/SharedFoldersEnableSymlinksCreate/data", "1");
+    spec.controller("IDE", "ide")
+        .controller("SATA", "sata", 4);
+    return spec;
+}
+
+/**
+ * The values recorded after the VM was configured with the sample spec
+ */
+ParameterMapPtr sampleApplied() {
+    ParameterMapPtr applied = ParameterMap::instance();
+    applied->set( VBoxConfigPlan::appliedKey("extra", "VBoxInternal2/SharedFoldersEnableSymlinksCreate/data"), "1" );
+    return applied;
+}
+
+/**
+ * Return the arguments of a step as a single string
+ */
+std::string stepArgs( const VBoxConfigPlan& plan, size_t i ) {
+    if (i >= plan.steps.size()) return "<missing>";
+    return plan.steps[i].command.str();
+}
+
+/**
+ * A VM that is already configured needs no commands
+ */
+void testUpToDate() {
+    MachineInfo current;
+    TEST_CHECK( current.parse( vboxSampleShowVMInfo() ) );
+    VBoxConfigPlan plan( SAMPLE_VM, sampleSpec(), current, sampleApplied() );
+    TEST_CHECK( plan.empty() );
+    TEST_EQUAL( plan.steps.size(), 0u );
+    for (size_t i=0; i<plan.steps.size(); i++)
+        CVMWA_LOG("Info", "Unexpected step: " << stepArgs(plan, i));
+}
+
+/**
+ * A changed NIC and port-forwarding rule are applied in a single modifyvm
+ */
+void testModifyMerged() {
+    MachineInfo current;
+    TEST_CHECK( current.parse( vboxSampleShowVMInfo() ) );
+
+    VBoxMachineSpec spec = sampleSpec();
+    spec.set("nictype2", "virtio");
+    spec.natRules[0].second = "guestapi,tcp,127.0.0.1,41600,,80";
+
+    VBoxConfigPlan plan( SAMPLE_VM, spec, current, sampleApplied() );
+    TEST_EQUAL( plan.steps.size(), 1u );
+    TEST_EQUAL( stepArgs(plan, 0), "modifyvm " SAMPLE_VM " --nictype2 virtio "
+                                   "--natpf1 delete guestapi --natpf1 guestapi,tcp,127.0.0.1,41600,,80" );
+}
+
+/**
+ * A shared folder pointing to another host folder is removed and added again
+ */
+void testSharedFolderPath() {
+    MachineInfo current;
+    TEST_CHECK( current.parse( vboxSampleShowVMInfo() ) );
+
+    VBoxMachineSpec spec = sampleSpec();
+    spec.sharedFolders[0].hostPath = "/home/user/other data";
+
+    VBoxConfigPlan plan( SAMPLE_VM, spec, current, sampleApplied() );
+    TEST_EQUAL( plan.steps.size(), 2u );
+    TEST_EQUAL( stepArgs(plan, 0), "sharedfolder remove " SAMPLE_VM " --name data" );
+    TEST_EQUAL( stepArgs(plan, 1), "sharedfolder add " SAMPLE_VM " --name data --hostpath \"/home/user/other data\" --automount" );
+    if (plan.steps.size() == 2)
+        TEST_EQUAL( plan.steps[1].command.args[6], "/home/user/other data" );
+}
+
+/**
+ * A new VM gets everything, with all the options in one command
+ */
+void testNewVM() {
+    MachineInfo current;
+    VBoxConfigPlan plan( SAMPLE_VM, sampleSpec(), current, ParameterMapPtr() );
+
+    // modifyvm, sharedfolder, setextradata and two storagectl
+    TEST_EQUAL( plan.steps.size(), 5u );
+    TEST_EQUAL( plan.steps[0].command.args[0], "modifyvm" );
+    TEST_EQUAL( plan.steps[0].command.size(), 2u + 2 * 11 + 2 );
+    TEST_EQUAL( plan.naive, 1 + 1 + 1 + 1 + 2 );
+    TEST_EQUAL( plan.saved(), 1 );
+}
+
+int main() {
+    TEST_RUN( testUpToDate );
+    TEST_RUN( testModifyMerged );
+    TEST_RUN( testSharedFolderPath );
+    TEST_RUN( testNewVM );
+    return TEST_RESULT();
+}
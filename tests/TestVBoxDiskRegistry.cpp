@@ -0,0 +1,131 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <CernVM/Hypervisor/Virtualbox/VBoxDiskRegistry.h>
+#include "TestCommon.h"
+
+typedef std::map<const std::string, const std::string> DiskEntry;
+
+/**
+ * Build a 'list hdds' entry
+ */
+DiskEntry entry( const std::string& uuid, const std::string& parent, const std::string& location, const std::string& type ) {
+    DiskEntry e;
+    e.insert( std::make_pair("UUID", uuid) );
+    e.insert( std::make_pair("Parent UUID", parent) );
+    e.insert( std::make_pair("Location", location) );
+    e.insert( std::make_pair("Type", type) );
+    e.insert( std::make_pair("State", "created") );
+    return e;
+}
+
+/**
+ * Registry loaded with a base disk and one multi-attach child
+ */
+void loadSample( VBoxDiskRegistry * reg ) {
+    std::vector<DiskEntry> list;
+    list.push_back( entry("base-1", "base", "C:\\cache\\cernvm.vdi", "multiattach") );
+    list.push_back( entry("child-1", "base-1", "/vms/a/Snapshots/{child-1}.vdi", "normal") );
+    list.push_back( entry("other", "base", "/vms/b/scratch.vdi", "normal") );
+    reg->load( list );
+}
+
+/**
+ * Look-ups by UUID, by location (with either separator) and by parent
+ */
+void testLookups() {
+    VBoxDiskRegistry reg;
+    TEST_CHECK( !reg.isLoaded() );
+    loadSample( &reg );
+    TEST_CHECK( reg.isLoaded() );
+
+    VBOX_DISK_RECORD disk;
+    TEST_CHECK( reg.findByUUID( "child-1", &disk ) );
+    TEST_EQUAL( disk.parentUUID, "base-1" );
+    TEST_CHECK( reg.findByLocation( "C:/cache/cernvm.vdi", &disk ) );
+    TEST_EQUAL( disk.uuid, "base-1" );
+    TEST_EQUAL( reg.findChildren( "base-1" ).size(), 1u );
+    TEST_CHECK( !reg.findByUUID( "missing", &disk ) );
+}
+
+/**
+ * A multi-attach mount records it's differencing disk under the base
+ */
+void testAddDifferencing() {
+    VBoxDiskRegistry reg;
+    loadSample( &reg );
+
+    // Known base: recorded directly
+    TEST_CHECK( reg.addDifferencing( "/vms/b/scratch.vdi", "child-2" ) );
+    VBOX_DISK_RECORD disk;
+    TEST_CHECK( reg.findByUUID( "child-2", &disk ) );
+    TEST_EQUAL( disk.parentUUID, "other" );
+    TEST_CHECK( reg.findByUUID( "other", &disk ) );
+    TEST_EQUAL( disk.type, "multiattach" );
+    TEST_EQUAL( reg.findChildren( "other" ).size(), 1u );
+
+    // Another mount of the same base adds a sibling
+    TEST_CHECK( reg.addDifferencing( "C:\\cache\\cernvm.vdi", "child-3" ) );
+    TEST_EQUAL( reg.findChildren( "base-1" ).size(), 2u );
+
+    // Unknown base: nothing changes
+    TEST_CHECK( !reg.addDifferencing( "/unknown.vdi", "child-4" ) );
+    TEST_CHECK( !reg.findByUUID( "child-4", &disk ) );
+    TEST_CHECK( reg.isLoaded() );
+}
+
+/**
+ * Updates replace the owner of a location, removals clear all the indexes
+ */
+void testUpdateAndRemove() {
+    VBoxDiskRegistry reg;
+    loadSample( &reg );
+
+    VBOX_DISK_RECORD disk;
+    disk.uuid = "new-scratch";
+    disk.parentUUID = "base";
+    disk.location = "/vms/b/scratch.vdi";
+    disk.type = "normal";
+    disk.state = "created";
+    reg.update( disk );
+    TEST_CHECK( !reg.findByUUID( "other", NULL ) );
+    TEST_CHECK( reg.findByLocation( "/vms/b/scratch.vdi", &disk ) );
+    TEST_EQUAL( disk.uuid, "new-scratch" );
+
+    reg.remove( "child-1" );
+    TEST_EQUAL( reg.findChildren( "base-1" ).size(), 0u );
+    reg.remove( "C:/cache/cernvm.vdi" );
+    TEST_CHECK( !reg.findByUUID( "base-1", NULL ) );
+
+    reg.invalidate();
+    TEST_CHECK( !reg.isLoaded() );
+    TEST_CHECK( !reg.findByUUID( "new-scratch", NULL ) );
+}
+
+int main() {
+    TEST_RUN( testLookups );
+    TEST_RUN( testAddDifferencing );
+    TEST_RUN( testUpdateAndRemove );
+    return TEST_RESULT();
+}
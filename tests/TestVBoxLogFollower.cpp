@@ -0,0 +1,165 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+#include <CernVM/Hypervisor/Virtualbox/VBoxProbes.h>
+#include <CernVM/Hypervisor.h>
+#include "TestCommon.h"
+
+/**
+ * Create a scratch log folder
+ */
+std::string makeFolder() {
+    char tpl[] = "/tmp/vboxlogXXXXXX";
+    char * dir = mkdtemp( tpl );
+    return dir ? std::string(dir) : std::string();
+}
+
+/**
+ * Append the given text to VBox.log in the given folder
+ */
+void appendLog( const std::string& folder, const std::string& text ) {
+    std::ofstream f( (folder + "/VBox.log").c_str(), std::ios::out | std::ios::app | std::ios::binary );
+    f << text;
+}
+
+/**
+ * Remove a scratch log folder
+ */
+void removeFolder( const std::string& folder ) {
+    ::remove( (folder + "/VBox.log").c_str() );
+    ::remove( (folder + "/VBox.log.1").c_str() );
+    ::rmdir( folder.c_str() );
+}
+
+/**
+ * Only the complete lines appended since the last poll are analyzed
+ */
+void testIncremental() {
+    std::string dir = makeFolder();
+    appendLog( dir, "00:00:01.000000 Changing the VM state from 'CREATING' to 'CREATED'\n" );
+
+    VBoxLogFollower f( dir );
+    TEST_CHECK( f.hasChanges() );
+    TEST_CHECK( f.poll() );
+    TEST_CHECK( f.hasState );
+    TEST_EQUAL( f.state, SS_POWEROFF );
+    TEST_CHECK( !f.hasChanges() );
+    TEST_CHECK( !f.poll() );
+    TEST_CHECK( !f.hasState );
+
+    // An incomplete line is kept until it's terminated
+    appendLog( dir, "00:00:02.000000 Changing the VM state from 'POWERING_ON' to 'RUN" );
+    TEST_CHECK( f.hasChanges() );
+    f.poll();
+    TEST_CHECK( !f.hasState );
+    appendLog( dir, "NING'\n" );
+    TEST_CHECK( f.hasChanges() );
+    TEST_CHECK( f.poll() );
+    TEST_CHECK( f.hasState );
+    TEST_EQUAL( f.state, SS_RUNNING );
+
+    // Resuming from a saved position continues from there
+    VBoxLogFollower g( dir );
+    g.setPosition( f.getOffset(), f.getFileId() );
+    appendLog( dir, "00:00:03.000000 Changing the VM state from 'RUNNING' to 'SUSPENDED'\n" );
+    TEST_CHECK( g.poll() );
+    TEST_CHECK( g.hasState );
+    TEST_EQUAL( g.state, SS_PAUSED );
+
+    removeFolder( dir );
+}
+
+/**
+ * A rotated log is finished before continuing with the new one
+ */
+void testRotation() {
+    std::string dir = makeFolder();
+    appendLog( dir, "00:00:01.000000 Changing the VM state from 'CREATING' to 'CREATED'\n" );
+
+    VBoxLogFollower f( dir );
+    f.poll();
+    appendLog( dir, "00:00:02.000000 Changing the VM state from 'POWERING_ON' to 'RUNNING'\n" );
+    ::rename( (dir + "/VBox.log").c_str(), (dir + "/VBox.log.1").c_str() );
+    appendLog( dir, "00:00:00.000000 Log opened\n" );
+
+    TEST_CHECK( f.hasChanges() );
+    TEST_CHECK( f.poll() );
+    TEST_CHECK( f.hasState );
+    TEST_EQUAL( f.state, SS_RUNNING );
+
+    removeFolder( dir );
+}
+
+/**
+ * All the followers share one wake descriptor, and the events drained
+ * by one follower are still reported to the others.
+ */
+void testSharedWatch() {
+#ifdef __linux__
+    std::string dirA = makeFolder(), dirB = makeFolder();
+    appendLog( dirA, "00:00:01.000000 Log opened\n" );
+    appendLog( dirB, "00:00:01.000000 Log opened\n" );
+
+    VBoxLogFollower a1( dirA ), a2( dirA ), b( dirB );
+    TEST_CHECK( a1.getWakeFd() >= 0 );
+    TEST_EQUAL( a1.getWakeFd(), a2.getWakeFd() );
+    TEST_EQUAL( a1.getWakeFd(), b.getWakeFd() );
+    a1.poll(); a2.poll(); b.poll();
+    TEST_CHECK( !a1.hasChanges() );
+    TEST_CHECK( !a2.hasChanges() );
+    TEST_CHECK( !b.hasChanges() );
+
+    // A change in A is seen by both A followers, no matter who drains
+    appendLog( dirA, "00:00:02.000000 Something\n" );
+    TEST_CHECK( !b.hasChanges() );
+    TEST_CHECK( a2.hasChanges() );
+    TEST_CHECK( a1.hasChanges() );
+    TEST_CHECK( !a1.hasChanges() );
+
+    // Releasing one follower keeps the watch of the other
+    {
+        VBoxLogFollower a3( dirA );
+    }
+    appendLog( dirA, "00:00:03.000000 Something else\n" );
+    TEST_CHECK( a1.hasChanges() );
+
+    // A removed folder falls back to polling
+    removeFolder( dirB );
+    TEST_CHECK( b.hasChanges() );
+    TEST_EQUAL( b.getWakeFd(), -1 );
+    TEST_CHECK( a1.getWakeFd() >= 0 );
+
+    removeFolder( dirA );
+#endif
+}
+
+int main() {
+    TEST_RUN( testIncremental );
+    TEST_RUN( testRotation );
+    TEST_RUN( testSharedWatch );
+    return TEST_RESULT();
+}
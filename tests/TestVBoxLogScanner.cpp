@@ -0,0 +1,148 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+
+#include <CernVM/Hypervisor.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxProbes.h>
+#include "TestCommon.h"
+#include "VBoxSamples.h"
+
+static const char * PATTERNS[] = { "Changing the VM state from", "Display::handleDisplayResize", "WARNING! " };
+
+/**
+ * Reference implementation: the earliest occurence of any pattern
+ */
+const char * naiveFind( const char * begin, const char * end ) {
+    const char * best = NULL;
+    for (int i=0; i<3; i++) {
+        size_t len = strlen( PATTERNS[i] );
+        for (const char * p = begin; p + len <= end; p++) {
+            if (memcmp( p, PATTERNS[i], len ) == 0) {
+                if ((best == NULL) || (p < best)) best = p;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/**
+ * Deterministic pseudo-random generator
+ */
+static unsigned int seed = 12345;
+unsigned int nextRandom() {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+/**
+ * The scanner finds the same matches as the reference, for patterns (and
+ * partial patterns) planted at every alignment, including the buffer's end
+ */
+void testAgainstReference() {
+    const VBoxLogScanner& scanner = VBoxLogScanner::Default();
+    for (int round=0; round<2000; round++) {
+
+        // Random log-like noise with characters that appear in the patterns
+        size_t size = 1 + nextRandom() % 300;
+        std::string buf( size, ' ' );
+        static const char alphabet[] = "Changing the VM state from Display::handleDisplayResize WARNING! \n";
+        for (size_t i=0; i<size; i++)
+            buf[i] = alphabet[ nextRandom() % (sizeof(alphabet) - 1) ];
+
+        // Plant a few complete or truncated patterns
+        int plants = nextRandom() % 4;
+        for (int k=0; k<plants; k++) {
+            const char * pat = PATTERNS[ nextRandom() % 3 ];
+            size_t len = strlen( pat );
+            if (nextRandom() % 3 == 0) len = 1 + nextRandom() % len;
+            size_t at = nextRandom() % size;
+            for (size_t i=0; (i<len) && (at+i < size); i++)
+                buf[at+i] = pat[i];
+        }
+
+        // Compare every match
+        const char * begin = buf.data(), * end = begin + buf.size();
+        const char * ptr = begin;
+        for (;;) {
+            const char * expected = naiveFind( ptr, end );
+            const char * found = scanner.find( ptr, end );
+            TEST_CHECK( found == expected );
+            if ((found != expected) || (found == NULL)) break;
+            ptr = found + 1;
+        }
+    }
+}
+
+/**
+ * Buffers shorter than the patterns never match
+ */
+void testShortBuffers() {
+    const VBoxLogScanner& scanner = VBoxLogScanner::Default();
+    const char * text = "WARNING!";
+    TEST_CHECK( scanner.find( text, text ) == NULL );
+    TEST_CHECK( scanner.find( text, text + strlen(text) ) == NULL );
+    const char * exact = "WARNING! ";
+    TEST_CHECK( scanner.find( exact, exact + strlen(exact) ) == exact );
+}
+
+/**
+ * The probe reports the state, resolution and failures found in a log
+ */
+void testProbeAnalyze() {
+    std::string folder = "vboxlog-probe";
+    boost::filesystem::create_directories( folder );
+    {
+        std::ofstream f( (folder + "/VBox.log").c_str(), std::ios::binary );
+        f << vboxSampleLog( 200000 );
+    }
+
+    VBoxLogProbe probe( folder, 0 );
+    probe.analyze();
+    TEST_CHECK( probe.hasState );
+    TEST_EQUAL( probe.state, SS_RUNNING );
+    TEST_CHECK( probe.hasResolutionChange );
+    TEST_EQUAL( probe.resWidth, 1024 );
+    TEST_EQUAL( probe.resHeight, 768 );
+    TEST_EQUAL( probe.resBpp, 32 );
+    TEST_CHECK( probe.hasFailures );
+    TEST_EQUAL( probe.failures & HFL_NO_VIRTUALIZATION, HFL_NO_VIRTUALIZATION );
+
+    // Only the tail is analyzed when a tail size is given
+    VBoxLogProbe tail( folder, 120 );
+    tail.analyze();
+    TEST_CHECK( !tail.hasState );
+    TEST_CHECK( tail.hasFailures );
+
+    boost::filesystem::remove_all( folder );
+}
+
+int main() {
+    TEST_RUN( testAgainstReference );
+    TEST_RUN( testShortBuffers );
+    TEST_RUN( testProbeAnalyze );
+    return TEST_RESULT();
+}
@@ -0,0 +1,170 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <CernVM/Hypervisor.h>
+#include <CernVM/Hypervisor/Virtualbox/VBoxMachineInfo.h>
+#include "TestCommon.h"
+#include "VBoxSamples.h"
+
+typedef std::map<const std::string, const std::string> InfoMap;
+
+/**
+ * Return the value of the given key, or "<missing>"
+ */
+std::string valueOf( const InfoMap& map, const std::string& key ) {
+    InfoMap::const_iterator it = map.find( key );
+    if (it == map.end()) return "<missing>";
+    return it->second;
+}
+
+/**
+ * The typed fields are populated from the machine-readable output
+ */
+void testParseFields() {
+    MachineInfo info;
+    TEST_CHECK( info.parse( vboxSampleShowVMInfo() ) );
+    TEST_EQUAL( info.uuid, "5e7a8c1e-9d5b-4bfa-a0d6-2b5b1d4e8a3c" );
+    TEST_EQUAL( info.name, "CernVM-8a3c" );
+    TEST_EQUAL( info.state, SS_RUNNING );
+    TEST_EQUAL( info.cpus, 2 );
+    TEST_EQUAL( info.memory, 2048 );
+    TEST_EQUAL( info.vram, 32 );
+    TEST_EQUAL( info.executionCap, 80 );
+    TEST_CHECK( info.acpi && info.ioapic );
+    TEST_EQUAL( info.boot[0], "dvd" );
+    TEST_EQUAL( info.nics[0], "nat" );
+    TEST_EQUAL( info.nics[1], "hostonly" );
+    TEST_EQUAL( info.nics[2], "none" );
+    TEST_EQUAL( info.videoWidth, 1024 );
+    TEST_EQUAL( info.videoHeight, 768 );
+    TEST_EQUAL( info.videoBpp, 32 );
+    TEST_EQUAL( info.controllers.size(), 2u );
+    TEST_EQUAL( info.natRules.size(), 1u );
+    TEST_EQUAL( info.sharedFolders.size(), 1u );
+    TEST_EQUAL( info.settings["chipset"], "piix3" );
+
+    const VBOX_STORAGE_SLOT * slot = info.slot( "SATA", 0, 0 );
+    TEST_CHECK( slot != NULL );
+    if (slot != NULL) {
+        TEST_EQUAL( slot->medium, "/home/user/VirtualBox VMs/CernVM-8a3c/scratch disk.vdi" );
+        TEST_EQUAL( slot->uuid, "b1d2e3f4-1111-2222-3333-444455556666" );
+    }
+    TEST_CHECK( info.slot( "IDE", 0, 1 ) == NULL );
+}
+
+/**
+ * The exported map carries the human-readable keys the session code reads
+ */
+void testExportedMap() {
+    MachineInfo info;
+    info.parse( vboxSampleShowVMInfo() );
+    InfoMap map;
+    info.toMap( &map );
+
+    TEST_EQUAL( valueOf(map, "UUID"), "5e7a8c1e-9d5b-4bfa-a0d6-2b5b1d4e8a3c" );
+    TEST_EQUAL( valueOf(map, "State"), "running" );
+    TEST_EQUAL( valueOf(map, "Memory size"), "2048MB" );
+    TEST_EQUAL( valueOf(map, "VRAM size"), "32MB" );
+    TEST_EQUAL( valueOf(map, "CPU exec cap"), "80%" );
+    TEST_EQUAL( valueOf(map, "Boot Device (1)"), "dvd" );
+    TEST_EQUAL( valueOf(map, "NIC 1"), "Attachment: nat" );
+    TEST_EQUAL( valueOf(map, "NIC 3"), "disabled" );
+    TEST_EQUAL( valueOf(map, "Video mode"), "1024x768x32" );
+    TEST_EQUAL( valueOf(map, "Storage Controller Name (1)"), "SATA" );
+    TEST_EQUAL( valueOf(map, "SATA (1, 0)"), "/home/user/.cernvm/run/context-8a3c.iso (UUID: c2d3e4f5-aaaa-bbbb-cccc-ddddeeeeffff)" );
+}
+
+/**
+ * Parsing the lines rebuilt from the exported values gives the same record
+ */
+void testRoundTrip() {
+    MachineInfo first, second;
+    first.parse( vboxSampleShowVMInfo() );
+
+    // Rebuild the machine-readable lines from the typed record
+    std::vector<std::string> lines;
+    lines.push_back( "name=\"" + first.name + "\"" );
+    lines.push_back( "UUID=\"" + first.uuid + "\"" );
+    lines.push_back( "CfgFile=\"" + first.configFile + "\"" );
+    lines.push_back( "LogFldr=\"" + first.logFolder + "\"" );
+    lines.push_back( "VMState=\"" + first.stateName + "\"" );
+    for (std::map<std::string, std::string>::iterator it = first.settings.begin(); it != first.settings.end(); ++it)
+        lines.push_back( it->first + "=\"" + it->second + "\"" );
+    std::ostringstream video;
+    video << "VideoMode=\"" << first.videoWidth << "," << first.videoHeight << "," << first.videoBpp << "\"@0,0 1";
+    lines.push_back( video.str() );
+    for (std::vector<VBOX_STORAGE_SLOT>::iterator it = first.slots.begin(); it != first.slots.end(); ++it) {
+        std::ostringstream slot;
+        slot << it->port << "-" << it->device;
+        lines.push_back( "\"" + it->controller + "-" + slot.str() + "\"=\"" + it->medium + "\"" );
+        lines.push_back( "\"" + it->controller + "-ImageUUID-" + slot.str() + "\"=\"" + it->uuid + "\"" );
+    }
+
+    TEST_CHECK( second.parse( lines ) );
+    InfoMap a, b;
+    first.toMap( &a );
+    second.toMap( &b );
+    TEST_EQUAL( a.size(), b.size() );
+    for (InfoMap::iterator it = a.begin(); it != a.end(); ++it)
+        TEST_EQUAL( valueOf(b, it->first), it->second );
+}
+
+/**
+ * A powered-off machine has no video mode
+ */
+void testPoweredOff() {
+    std::vector<std::string> lines;
+    lines.push_back( "name=\"vm\"" );
+    lines.push_back( "UUID=\"1234\"" );
+    lines.push_back( "VMState=\"poweroff\"" );
+    MachineInfo info;
+    TEST_CHECK( info.parse( lines ) );
+    TEST_EQUAL( info.state, SS_POWEROFF );
+    InfoMap map;
+    info.toMap( &map );
+    TEST_EQUAL( valueOf(map, "State"), "powered off" );
+    TEST_EQUAL( valueOf(map, "Video mode"), "<missing>" );
+}
+
+/**
+ * Output without a UUID does not describe a machine
+ */
+void testInvalid() {
+    std::vector<std::string> lines;
+    lines.push_back( "VBoxManage: error: Could not find a registered machine named 'vm'" );
+    MachineInfo info;
+    TEST_CHECK( !info.parse( lines ) );
+    InfoMap map;
+    info.toMap( &map );
+    TEST_CHECK( map.empty() );
+}
+
+int main() {
+    TEST_RUN( testParseFields );
+    TEST_RUN( testExportedMap );
+    TEST_RUN( testRoundTrip );
+    TEST_RUN( testPoweredOff );
+    TEST_RUN( testInvalid );
+    return TEST_RESULT();
+}
@@ -0,0 +1,108 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <string>
+#include <vector>
+
+#include <CernVM/Hypervisor/Virtualbox/VBoxQueryCache.h>
+#include "TestCommon.h"
+
+/**
+ * Shorthand to build an argument vector
+ */
+std::vector<std::string> cmd( const char * a, const char * b = NULL ) {
+    std::vector<std::string> args;
+    args.push_back( a );
+    if (b != NULL) args.push_back( b );
+    return args;
+}
+
+/**
+ * A stored query is returned until a mutating command invalidates it's class
+ */
+void testHitAndInvalidate() {
+    VBoxQueryCache cache;
+    std::vector<std::string> lines, out;
+    lines.push_back( "disk" );
+    unsigned long gen = 0;
+
+    TEST_CHECK( !cache.lookup( cmd("list", "hdds"), &out, &gen ) );
+    cache.store( cmd("list", "hdds"), lines, gen );
+    TEST_CHECK( cache.lookup( cmd("list", "hdds"), &out ) );
+    TEST_EQUAL( out.size(), 1u );
+
+    // Other classes are not affected
+    cache.invalidateBy( cmd("setproperty", "machinefolder") );
+    TEST_CHECK( cache.lookup( cmd("list", "hdds"), &out ) );
+
+    cache.invalidateBy( cmd("storageattach", "vm") );
+    TEST_CHECK( !cache.lookup( cmd("list", "hdds"), &out ) );
+    TEST_EQUAL( cache.hits( VBQ_HDDS ), 2u );
+    TEST_EQUAL( cache.misses( VBQ_HDDS ), 2u );
+}
+
+/**
+ * A result whose class was invalidated while the query was running is not stored
+ */
+void testStoreAfterInvalidation() {
+    VBoxQueryCache cache;
+    std::vector<std::string> lines, out;
+    unsigned long gen = 0;
+
+    TEST_CHECK( !cache.lookup( cmd("list", "vms"), &out, &gen ) );
+    cache.invalidateBy( cmd("createvm") );
+    cache.store( cmd("list", "vms"), lines, gen );
+    TEST_CHECK( !cache.lookup( cmd("list", "vms"), &out, &gen ) );
+
+    // A query that started after the invalidation is kept
+    cache.store( cmd("list", "vms"), lines, gen );
+    TEST_CHECK( cache.lookup( cmd("list", "vms"), &out ) );
+}
+
+/**
+ * Snapshot operations change the registered media
+ */
+void testSnapshotInvalidates() {
+    TEST_EQUAL( VBoxQueryCache::affectedBy( cmd("snapshot", "vm") ) & VBQ_HDDS, VBQ_HDDS );
+    TEST_EQUAL( VBoxQueryCache::affectedBy( cmd("snapshot", "vm") ) & VBQ_HDINFO, VBQ_HDINFO );
+}
+
+/**
+ * Expired entries are misses
+ */
+void testExpiry() {
+    VBoxQueryCache cache( 50 );
+    std::vector<std::string> lines, out;
+    unsigned long gen = 0;
+
+    cache.lookup( cmd("list", "dhcpservers"), &out, &gen );
+    cache.store( cmd("list", "dhcpservers"), lines, gen );
+    TEST_CHECK( cache.lookup( cmd("list", "dhcpservers"), &out ) );
+    sleepMs( 100 );
+    TEST_CHECK( !cache.lookup( cmd("list", "dhcpservers"), &out ) );
+}
+
+int main() {
+    TEST_RUN( testHitAndInvalidate );
+    TEST_RUN( testStoreAfterInvalidation );
+    TEST_RUN( testSnapshotInvalidates );
+    TEST_RUN( testExpiry );
+    return TEST_RESULT();
+}
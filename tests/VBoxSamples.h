@@ -0,0 +1,180 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef TESTS_VBOXSAMPLES_H
+#define TESTS_VBOXSAMPLES_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Output of 'VBoxManage showvminfo <vm> --machinereadable' for a running
+ * CernVM session, as printed by VirtualBox 5.x
+ */
+static const char * VBOX_SAMPLE_SHOWVMINFO[] = {
+    "name=\"CernVM-8a3c\"",
+    "groups=\"/\"",
+    "ostype=\"Linux 2.6 / 3.x / 4.x (64-bit)\"",
+    "UUID=\"5e7a8c1e-9d5b-4bfa-a0d6-2b5b1d4e8a3c\"",
+    "CfgFile=\"/home/user/VirtualBox VMs/CernVM-8a3c/CernVM-8a3c.vbox\"",
+    "SnapFldr=\"/home/user/VirtualBox VMs/CernVM-8a3c/Snapshots\"",
+    "LogFldr=\"/home/user/VirtualBox VMs/CernVM-8a3c/Logs\"",
+    "hardwareuuid=\"5e7a8c1e-9d5b-4bfa-a0d6-2b5b1d4e8a3c\"",
+    "memory=2048",
+    "pagefusion=\"off\"",
+    "vram=32",
+    "cpuexecutioncap=80",
+    "hpet=\"off\"",
+    "chipset=\"piix3\"",
+    "firmware=\"BIOS\"",
+    "cpus=2",
+    "pae=\"on\"",
+    "longmode=\"on\"",
+    "triplefaultreset=\"off\"",
+    "apic=\"on\"",
+    "x2apic=\"on\"",
+    "cpuid-portability-level=0",
+    "bootmenu=\"messageandmenu\"",
+    "boot1=\"dvd\"",
+    "boot2=\"disk\"",
+    "boot3=\"none\"",
+    "boot4=\"none\"",
+    "acpi=\"on\"",
+    "ioapic=\"on\"",
+    "biosapic=\"apic\"",
+    "biossystemtimeoffset=0",
+    "rtcuseutc=\"off\"",
+    "hwvirtex=\"on\"",
+    "nestedpaging=\"on\"",
+    "largepages=\"on\"",
+    "vtxvpid=\"on\"",
+    "vtxux=\"on\"",
+    "paravirtprovider=\"default\"",
+    "VMState=\"running\"",
+    "VMStateChangeTime=\"2016-03-14T10:22:41.000000000\"",
+    "monitorcount=1",
+    "accelerate3d=\"off\"",
+    "accelerate2dvideo=\"off\"",
+    "teleporterenabled=\"off\"",
+    "teleporterport=0",
+    "teleporteraddress=\"\"",
+    "teleporterpassword=\"\"",
+    "tracing-enabled=\"off\"",
+    "tracing-allow-vm-access=\"off\"",
+    "tracing-config=\"\"",
+    "autostart-enabled=\"off\"",
+    "autostart-delay=0",
+    "defaultfrontend=\"\"",
+    "storagecontrollername0=\"IDE\"",
+    "storagecontrollertype0=\"PIIX4\"",
+    "storagecontrollerinstance0=\"0\"",
+    "storagecontrollermaxportcount0=\"2\"",
+    "storagecontrollerportcount0=\"2\"",
+    "storagecontrollerbootable0=\"on\"",
+    "storagecontrollername1=\"SATA\"",
+    "storagecontrollertype1=\"IntelAhci\"",
+    "storagecontrollerinstance1=\"0\"",
+    "storagecontrollermaxportcount1=\"30\"",
+    "storagecontrollerportcount1=\"2\"",
+    "storagecontrollerbootable1=\"on\"",
+    "\"IDE-0-0\"=\"/home/user/.cernvm/cache/ucernvm-prod.1.18-2.cernvm.x86_64.iso\"",
+    "\"IDE-ImageUUID-0-0\"=\"0c0f5c5e-3a1e-4d44-9d67-0b3f8c0c2b7a\"",
+    "\"IDE-IsEjected\"=\"off\"",
+    "\"IDE-0-1\"=\"none\"",
+    "\"IDE-1-0\"=\"none\"",
+    "\"IDE-1-1\"=\"none\"",
+    "\"SATA-0-0\"=\"/home/user/VirtualBox VMs/CernVM-8a3c/scratch disk.vdi\"",
+    "\"SATA-ImageUUID-0-0\"=\"b1d2e3f4-1111-2222-3333-444455556666\"",
+    "\"SATA-1-0\"=\"/home/user/.cernvm/run/context-8a3c.iso\"",
+    "\"SATA-ImageUUID-1-0\"=\"c2d3e4f5-aaaa-bbbb-cccc-ddddeeeeffff\"",
+    "natnet1=\"nat\"",
+    "macaddress1=\"080027A1B2C3\"",
+    "cableconnected1=\"on\"",
+    "nic1=\"nat\"",
+    "nictype1=\"virtio\"",
+    "nicspeed1=\"0\"",
+    "mtu=\"0\"",
+    "sockSnd=\"64\"",
+    "sockRcv=\"64\"",
+    "tcpWndSnd=\"64\"",
+    "tcpWndRcv=\"64\"",
+    "Forwarding(0)=\"guestapi,tcp,127.0.0.1,41522,,80\"",
+    "hostonlyadapter2=\"vboxnet0\"",
+    "macaddress2=\"080027D4E5F6\"",
+    "cableconnected2=\"on\"",
+    "nic2=\"hostonly\"",
+    "nictype2=\"82540EM\"",
+    "nicspeed2=\"0\"",
+    "nic3=\"none\"",
+    "nic4=\"none\"",
+    "hidpointing=\"ps2mouse\"",
+    "hidkeyboard=\"ps2kbd\"",
+    "uart1=\"off\"",
+    "uart2=\"off\"",
+    "audio=\"none\"",
+    "clipboard=\"disabled\"",
+    "draganddrop=\"disabled\"",
+    "SessionName=\"headless\"",
+    "VideoMode=\"1024,768,32\"@0,0 1",
+    "vrde=\"on\"",
+    "vrdeport=41523",
+    "vrdeports=\"41523\"",
+    "vrdeaddress=\"127.0.0.1\"",
+    "SharedFolderNameMachineMapping1=\"data\"",
+    "SharedFolderPathMachineMapping1=\"/home/user/data\"",
+    "GuestMemoryBalloon=0",
+};
+
+/**
+ * Return the sample as output lines
+ */
+inline std::vector<std::string> vboxSampleShowVMInfo() {
+    return std::vector<std::string>( VBOX_SAMPLE_SHOWVMINFO,
+        VBOX_SAMPLE_SHOWVMINFO + sizeof(VBOX_SAMPLE_SHOWVMINFO) / sizeof(VBOX_SAMPLE_SHOWVMINFO[0]) );
+}
+
+/**
+ * Build a synthetic VBox.log of about the given size. It contains ordinary
+ * lines, with a state change to RUNNING, a display resize and a warning
+ * near it's end.
+ */
+inline std::string vboxSampleLog( size_t size ) {
+    static const char * filler[] = {
+        "00:00:02.318204 VMMDev: Guest Additions information report: Version 4.3.12 r93733 '4.3.12'\n",
+        "00:00:02.318990 PIIX3 ATA: Ctl#0: RESET, DevSel=0 AIOIf=0 CmdIf0=0x00 (-1 usec ago) CmdIf1=0x00 (-1 usec ago)\n",
+        "00:00:02.401774 NAT: IPv6 not supported\n",
+        "00:00:02.512345 AHCI#0: Port 0 reset\n",
+        "00:00:03.104512 VMMDev: Guest Log: vboxguest: misc device minor 55, IRQ 20, I/O port d020, MMIO at f0400000 (size 0x400000)\n",
+        "00:00:03.220001 Display::handleDisplayUpdate: uScreenId=0 x=0 y=0 w=1024 h=768\n",
+    };
+    const size_t fillerCount = sizeof(filler) / sizeof(filler[0]);
+    std::string log;
+    log.reserve( size + 512 );
+    log += "00:00:00.618312 Changing the VM state from 'CREATING' to 'CREATED'\n";
+    for (size_t i=0; log.length() + 512 < size; i++)
+        log += filler[ (i * 7) % fillerCount ];
+    log += "00:00:01.100000 Changing the VM state from 'POWERING_ON' to 'RUNNING'\n";
+    log += "00:00:04.733014 Display::handleDisplayResize(): uScreenId = 0, pvVRAM=00007f3c w=1024 h=768 bpp=32 cbLine=0x1000, flags=0x1\n";
+    log += "00:00:04.900000 WARNING! 64-bit guest type selected but the host CPU does NOT support HW virtualization.\n";
+    return log;
+}
+
+#endif /* end of include guard: TESTS_VBOXSAMPLES_H */